@@ -66,6 +66,8 @@ Logger::Target::Target(const LoggerTarget& target, const esologs::Config& log_co
 {}
 
 void Logger::Log(Connection* conn, const irc::Message& msg, bool sent) {
+  std::int64_t received_ns = esologs::MonotonicNs();
+
   for (auto& target : targets_) {
     if (conn->net() != target->net)
       continue;
@@ -86,6 +88,8 @@ void Logger::Log(Connection* conn, const irc::Message& msg, bool sent) {
 
     esologs::LogEvent log_event;
     FillEvent(&log_event, msg, sent);
+    if (pipe_)
+      log_event.mutable_timing()->set_received_ns(received_ns);
     target->log.Write(&log_event, pipe_.get());
   }
 
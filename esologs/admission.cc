@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+
+#include <prometheus/counter.h>
+#include <prometheus/gauge.h>
+#include <prometheus/histogram.h>
+
+#include "esologs/admission.h"
+
+namespace esologs {
+
+Admission::Ticket& Admission::Ticket::operator=(Ticket&& other) noexcept {
+  if (this != &other) {
+    Release();
+    admission_ = other.admission_;
+    class_ = other.class_;
+    other.admission_ = nullptr;
+  }
+  return *this;
+}
+
+bool Admission::Ticket::Escalate() {
+  if (!admission_)
+    return false;
+  if (class_ == Class::kExpensive)
+    return true;
+
+  // The cheap slot is given up first, so that waiting for an expensive one doesn't block cheap requests.
+  Admission* admission = admission_;
+  Release();
+  if (!admission->Acquire(Class::kExpensive))
+    return false;
+  admission_ = admission;
+  class_ = Class::kExpensive;
+  return true;
+}
+
+void Admission::Ticket::Release() {
+  if (admission_) {
+    admission_->Release(class_);
+    admission_ = nullptr;
+  }
+}
+
+Admission::Admission(const Limits& cheap, const Limits& expensive, std::chrono::milliseconds timeout, prometheus::Registry* metric_registry)
+    : timeout_(timeout),
+      retry_after_(std::max(std::chrono::ceil<std::chrono::seconds>(timeout), std::chrono::seconds(1)))
+{
+  queue(Class::kCheap).limits = cheap;
+  queue(Class::kExpensive).limits = expensive;
+
+  if (metric_registry) {
+    auto& running = prometheus::BuildGauge()
+        .Name("esologs_admission_running_requests")
+        .Help("Number of requests being handled, by admission class.")
+        .Register(*metric_registry);
+    auto& queued = prometheus::BuildGauge()
+        .Name("esologs_admission_queued_requests")
+        .Help("Number of requests waiting to be admitted, by admission class.")
+        .Register(*metric_registry);
+    auto& shed = prometheus::BuildCounter()
+        .Name("esologs_admission_shed_total")
+        .Help("How many requests have been refused with a 503, by admission class and reason?")
+        .Register(*metric_registry);
+    auto& wait = prometheus::BuildHistogram()
+        .Name("esologs_admission_wait_seconds")
+        .Help("Time admitted requests spent waiting in the queue, by admission class.")
+        .Register(*metric_registry);
+    static const prometheus::Histogram::BucketBoundaries kWaitBuckets = {
+      0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5,
+    };
+
+    for (Class c : {Class::kCheap, Class::kExpensive}) {
+      const char* name = c == Class::kCheap ? "cheap" : "expensive";
+      Queue& q = queue(c);
+      q.metric_running = &running.Add({{"class", name}});
+      q.metric_queued = &queued.Add({{"class", name}});
+      q.metric_shed_full = &shed.Add({{"class", name}, {"reason", "queue_full"}});
+      q.metric_shed_timeout = &shed.Add({{"class", name}, {"reason", "timeout"}});
+      q.metric_wait = &wait.Add({{"class", name}}, kWaitBuckets);
+    }
+  }
+}
+
+Admission::Ticket Admission::Admit(Class c) {
+  if (!Acquire(c))
+    return Ticket();
+  return Ticket(this, c);
+}
+
+bool Admission::Acquire(Class c) {
+  Queue& q = queue(c);
+  std::unique_lock<std::mutex> lock(lock_);
+
+  if (q.running < q.limits.running) {
+    ++q.running;
+    if (q.metric_running)
+      q.metric_running->Set(q.running);
+    return true;
+  }
+
+  if (q.queued >= q.limits.queued) {
+    if (q.metric_shed_full)
+      q.metric_shed_full->Increment();
+    return false;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  ++q.queued;
+  if (q.metric_queued)
+    q.metric_queued->Set(q.queued);
+  bool admitted = q.slot_free.wait_until(lock, start + timeout_, [&q]() { return q.running < q.limits.running; });
+  --q.queued;
+  if (q.metric_queued)
+    q.metric_queued->Set(q.queued);
+
+  if (!admitted) {
+    if (q.metric_shed_timeout)
+      q.metric_shed_timeout->Increment();
+    return false;
+  }
+
+  ++q.running;
+  if (q.metric_running)
+    q.metric_running->Set(q.running);
+  if (q.metric_wait)
+    q.metric_wait->Observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  return true;
+}
+
+void Admission::Release(Class c) {
+  Queue& q = queue(c);
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    --q.running;
+    if (q.metric_running)
+      q.metric_running->Set(q.running);
+  }
+  q.slot_free.notify_one();
+}
+
+} // namespace esologs
@@ -0,0 +1,115 @@
+#ifndef ESOLOGS_ADMISSION_H_
+#define ESOLOGS_ADMISSION_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include <prometheus/counter.h>
+#include <prometheus/gauge.h>
+#include <prometheus/histogram.h>
+#include <prometheus/registry.h>
+
+#include "base/common.h"
+
+namespace esologs {
+
+/**
+ * Admission control for request handlers.
+ *
+ * Requests come in two classes: cheap ones, served from memory (index pages, cached renderings,
+ * 304s, static files), and expensive ones, which need to decode and render logfiles. Each class has
+ * its own limit on how many requests may be handled at once, and on how many may wait for a slot.
+ * A request that finds the queue full, or doesn't get a slot before a deadline, is shed, so that a
+ * burst of expensive requests fails fast instead of tying up every handler thread.
+ *
+ * Whether a request is expensive usually isn't known until it's been looked up, so every request
+ * is admitted as cheap, and escalated (giving up its cheap slot) once it turns out it needs to
+ * render something.
+ */
+class Admission {
+ public:
+  enum class Class { kCheap, kExpensive };
+
+  struct Limits {
+    /** Maximum number of requests being handled at once. */
+    unsigned running;
+    /** Maximum number of requests waiting for a slot. Further requests are shed immediately. */
+    unsigned queued;
+  };
+
+  /** Permission to handle a request. Releases its slot when destroyed. */
+  class Ticket {
+   public:
+    Ticket() = default;
+    ~Ticket() { Release(); }
+    Ticket(Ticket&& other) noexcept : admission_(other.admission_), class_(other.class_) { other.admission_ = nullptr; }
+    Ticket& operator=(Ticket&& other) noexcept;
+    DISALLOW_COPY(Ticket);
+
+    /** Returns `true` if the request was admitted (and hasn't since been shed). */
+    explicit operator bool() const noexcept { return admission_ != nullptr; }
+
+    /**
+     * Moves the request to the expensive class, waiting for a slot if necessary.
+     *
+     * Returns `false` if the request was shed, in which case the ticket is left empty. Does nothing
+     * (and returns `true`) if the request is already expensive.
+     */
+    bool Escalate();
+
+    /**
+     * Gives up the slot early, once the request no longer needs it: typically when all that's left
+     * is writing out a response that's already been rendered.
+     */
+    void Release();
+
+   private:
+    Admission* admission_ = nullptr;
+    Class class_ = Class::kCheap;
+
+    Ticket(Admission* admission, Class c) : admission_(admission), class_(c) {}
+
+    friend class Admission;
+  };
+
+  Admission(const Limits& cheap, const Limits& expensive, std::chrono::milliseconds timeout, prometheus::Registry* metric_registry = nullptr);
+  DISALLOW_COPY(Admission);
+
+  /** Admits a request in the given class. The returned ticket is empty if the request was shed. */
+  Ticket Admit(Class c);
+
+  /** How long a shed client should wait before trying again, for the `Retry-After` header. */
+  std::chrono::seconds retry_after() const noexcept { return retry_after_; }
+
+ private:
+  struct Queue {
+    Limits limits;
+    unsigned running = 0;
+    unsigned queued = 0;
+    std::condition_variable slot_free;
+
+    prometheus::Gauge* metric_running = nullptr;
+    prometheus::Gauge* metric_queued = nullptr;
+    prometheus::Counter* metric_shed_full = nullptr;
+    prometheus::Counter* metric_shed_timeout = nullptr;
+    prometheus::Histogram* metric_wait = nullptr;
+  };
+
+  const std::chrono::milliseconds timeout_;
+  const std::chrono::seconds retry_after_;
+  Queue queues_[2]; // by Class
+  std::mutex lock_;
+
+  bool Acquire(Class c);
+  void Release(Class c);
+  Queue& queue(Class c) { return queues_[static_cast<int>(c)]; }
+};
+
+} // namespace esologs
+
+#endif // ESOLOGS_ADMISSION_H_
+
+// Local Variables:
+// mode: c++
+// End:
@@ -0,0 +1,142 @@
+#include <chrono>
+#include <future>
+#include <thread>
+#include <utility>
+
+#include "gtest/gtest.h"
+
+#include "esologs/admission.h"
+
+namespace esologs {
+
+using namespace std::chrono_literals;
+
+using Class = Admission::Class;
+
+TEST(AdmissionTest, ShedsWhenQueueIsFull) {
+  Admission admission({2, 0}, {1, 0}, 1000ms);
+
+  auto t1 = admission.Admit(Class::kCheap);
+  auto t2 = admission.Admit(Class::kCheap);
+  EXPECT_TRUE(t1);
+  EXPECT_TRUE(t2);
+
+  auto start = std::chrono::steady_clock::now();
+  auto t3 = admission.Admit(Class::kCheap);
+  EXPECT_FALSE(t3);
+  EXPECT_LT(std::chrono::steady_clock::now() - start, 500ms); // shed without waiting
+
+  // the classes are independent
+  auto e1 = admission.Admit(Class::kExpensive);
+  EXPECT_TRUE(e1);
+  EXPECT_FALSE(admission.Admit(Class::kExpensive));
+
+  // and a released slot can be taken again
+  t1 = Admission::Ticket();
+  EXPECT_TRUE(admission.Admit(Class::kCheap));
+}
+
+TEST(AdmissionTest, ReleaseGivesUpSlotEarly) {
+  Admission admission({1, 0}, {1, 0}, 1000ms);
+  auto t1 = admission.Admit(Class::kCheap);
+  ASSERT_TRUE(t1);
+  ASSERT_TRUE(t1.Escalate());
+  EXPECT_FALSE(admission.Admit(Class::kExpensive));
+
+  t1.Release();
+  EXPECT_FALSE(t1);
+  EXPECT_FALSE(t1.Escalate());
+  EXPECT_TRUE(admission.Admit(Class::kExpensive));
+}
+
+TEST(AdmissionTest, ShedsOnTimeout) {
+  Admission admission({1, 1}, {1, 0}, 50ms);
+  auto t1 = admission.Admit(Class::kCheap);
+  ASSERT_TRUE(t1);
+
+  auto start = std::chrono::steady_clock::now();
+  auto t2 = admission.Admit(Class::kCheap);
+  EXPECT_FALSE(t2);
+  EXPECT_GE(std::chrono::steady_clock::now() - start, 50ms);
+}
+
+TEST(AdmissionTest, QueuedRequestGetsReleasedSlot) {
+  Admission admission({1, 1}, {1, 0}, 10s);
+  auto t1 = admission.Admit(Class::kCheap);
+  ASSERT_TRUE(t1);
+
+  auto waiter = std::async(std::launch::async, [&admission]() { return bool(admission.Admit(Class::kCheap)); });
+  EXPECT_EQ(std::future_status::timeout, waiter.wait_for(50ms));
+
+  // the one queue slot is taken, so a third request is shed at once
+  EXPECT_FALSE(admission.Admit(Class::kCheap));
+
+  t1 = Admission::Ticket();
+  EXPECT_TRUE(waiter.get());
+}
+
+TEST(AdmissionTest, Escalate) {
+  Admission admission({1, 0}, {1, 0}, 1000ms);
+
+  auto t1 = admission.Admit(Class::kCheap);
+  ASSERT_TRUE(t1);
+  EXPECT_TRUE(t1.Escalate());
+  EXPECT_TRUE(t1);
+  EXPECT_TRUE(t1.Escalate()); // already expensive
+
+  // the cheap slot was given up, but the expensive one is taken
+  auto t2 = admission.Admit(Class::kCheap);
+  ASSERT_TRUE(t2);
+  EXPECT_FALSE(t2.Escalate());
+  EXPECT_FALSE(t2);
+  EXPECT_FALSE(t2.Escalate());
+
+  // which also gave up t2's cheap slot
+  auto t3 = admission.Admit(Class::kCheap);
+  EXPECT_TRUE(t3);
+
+  t1 = Admission::Ticket();
+  EXPECT_TRUE(t3.Escalate());
+}
+
+TEST(AdmissionTest, EscalateWaitsForSlot) {
+  Admission admission({2, 0}, {1, 1}, 10s);
+  auto t1 = admission.Admit(Class::kCheap);
+  ASSERT_TRUE(t1.Escalate());
+
+  auto t2 = admission.Admit(Class::kCheap);
+  ASSERT_TRUE(t2);
+  auto waiter = std::async(std::launch::async, [&t2]() { return t2.Escalate(); });
+  EXPECT_EQ(std::future_status::timeout, waiter.wait_for(50ms));
+
+  // while waiting, t2 doesn't hold on to its cheap slot
+  auto t3 = admission.Admit(Class::kCheap);
+  auto t4 = admission.Admit(Class::kCheap);
+  EXPECT_TRUE(t3);
+  EXPECT_TRUE(t4);
+
+  t1 = Admission::Ticket();
+  EXPECT_TRUE(waiter.get());
+}
+
+TEST(AdmissionTest, MovedTicketReleasesOnce) {
+  Admission admission({1, 0}, {1, 0}, 1000ms);
+  {
+    auto t1 = admission.Admit(Class::kCheap);
+    ASSERT_TRUE(t1);
+    Admission::Ticket t2(std::move(t1));
+    EXPECT_FALSE(t1);
+    EXPECT_TRUE(t2);
+    EXPECT_FALSE(admission.Admit(Class::kCheap));
+  }
+  auto t3 = admission.Admit(Class::kCheap);
+  EXPECT_TRUE(t3);
+  EXPECT_FALSE(admission.Admit(Class::kCheap));
+}
+
+TEST(AdmissionTest, RetryAfter) {
+  EXPECT_EQ(1s, Admission({1, 0}, {1, 0}, 200ms).retry_after());
+  EXPECT_EQ(3s, Admission({1, 0}, {1, 0}, 2500ms).retry_after());
+}
+
+} // namespace esologs
@@ -0,0 +1,19 @@
+#ifndef ESOLOGS_ASSETS_H_
+#define ESOLOGS_ASSETS_H_
+
+#include <span>
+
+#include "web/asset.h"
+
+namespace esologs {
+
+/** Returns the static files (stylesheets, scripts, the favicon) of the log server. */
+std::span<const web::Asset> Assets();
+
+} // namespace esologs
+
+#endif // ESOLOGS_ASSETS_H_
+
+// Local Variables:
+// mode: c++
+// End:
@@ -0,0 +1,287 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <prometheus/counter.h>
+#include <prometheus/gauge.h>
+
+#include "base/log.h"
+#include "esologs/cache.h"
+
+namespace esologs {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+void AppendDate(const YMD& date, std::string* out) {
+  char buf[16];
+  if (date.day == 0)
+    std::snprintf(buf, sizeof buf, "%04d-%02d", date.year, date.month);
+  else
+    std::snprintf(buf, sizeof buf, "%04d-%02d-%02d", date.year, date.month, date.day);
+  out->append(buf);
+}
+
+} // unnamed namespace
+
+RenderCache::RenderCache(
+    std::size_t max_bytes,
+    const std::string& disk_dir, std::size_t max_disk_bytes,
+    prometheus::Registry* metric_registry)
+    : max_bytes_(max_bytes), disk_dir_(disk_dir), max_disk_bytes_(max_disk_bytes)
+{
+  if (metric_registry) {
+    auto& hits = prometheus::BuildCounter()
+        .Name("esologs_cache_hits_total")
+        .Help("How many requests were served from the render cache?")
+        .Register(*metric_registry);
+    metric_hits_memory_ = &hits.Add({{"tier", "memory"}});
+    metric_hits_disk_ = &hits.Add({{"tier", "disk"}});
+    metric_misses_ = &prometheus::BuildCounter()
+        .Name("esologs_cache_misses_total")
+        .Help("How many cacheable requests had to be rendered?")
+        .Register(*metric_registry)
+        .Add({});
+    metric_evictions_ = &prometheus::BuildCounter()
+        .Name("esologs_cache_evictions_total")
+        .Help("How many entries have been evicted from the in-memory render cache?")
+        .Register(*metric_registry)
+        .Add({});
+    metric_bytes_ = &prometheus::BuildGauge()
+        .Name("esologs_cache_bytes")
+        .Help("Total size of the bodies in the in-memory render cache.")
+        .Register(*metric_registry)
+        .Add({});
+    if (!disk_dir_.empty()) {
+      metric_disk_evictions_ = &prometheus::BuildCounter()
+          .Name("esologs_cache_disk_evictions_total")
+          .Help("How many files have been evicted from the on-disk render cache?")
+          .Register(*metric_registry)
+          .Add({});
+      metric_disk_bytes_ = &prometheus::BuildGauge()
+          .Name("esologs_cache_disk_bytes")
+          .Help("Total size of the files in the on-disk render cache.")
+          .Register(*metric_registry)
+          .Add({});
+    }
+  }
+
+  if (!disk_dir_.empty())
+    ScanDisk();
+}
+
+std::string RenderCache::Key(const YMD& date, const std::optional<YMD>& prev, const std::optional<YMD>& next, std::string_view format) {
+  std::string key;
+  AppendDate(date, &key);
+  key += format;
+  key += '@';
+  if (prev)
+    AppendDate(*prev, &key);
+  key += ',';
+  if (next)
+    AppendDate(*next, &key);
+  return key;
+}
+
+RenderCache::Body RenderCache::Get(std::string_view target, const std::string& key) {
+  std::string full_key{target};
+  full_key += '/';
+  full_key += key;
+
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = entries_.find(full_key);
+    if (it != entries_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      if (metric_hits_memory_)
+        metric_hits_memory_->Increment();
+      return it->second->body;
+    }
+  }
+
+  if (!disk_dir_.empty()) {
+    if (Body body = ReadDisk(full_key); body) {
+      if (metric_hits_disk_)
+        metric_hits_disk_->Increment();
+      std::lock_guard<std::mutex> lock(lock_);
+      Insert(std::move(full_key), body);
+      return body;
+    }
+  }
+
+  if (metric_misses_)
+    metric_misses_->Increment();
+  return nullptr;
+}
+
+void RenderCache::Put(std::string_view target, const std::string& key, Body body) {
+  std::string full_key{target};
+  full_key += '/';
+  full_key += key;
+
+  if (!disk_dir_.empty())
+    WriteDisk(full_key, *body);
+
+  std::lock_guard<std::mutex> lock(lock_);
+  Insert(std::move(full_key), std::move(body));
+}
+
+void RenderCache::Insert(std::string full_key, Body body) {
+  // called with lock_ held
+
+  if (body->size() > max_bytes_)
+    return;
+  if (entries_.find(full_key) != entries_.end())
+    return; // rendered concurrently by someone else
+
+  while (!lru_.empty() && bytes_ + body->size() > max_bytes_) {
+    Entry& victim = lru_.back();
+    bytes_ -= victim.body->size();
+    entries_.erase(victim.key);
+    lru_.pop_back();
+    if (metric_evictions_)
+      metric_evictions_->Increment();
+  }
+
+  bytes_ += body->size();
+  lru_.push_front(Entry{std::move(full_key), std::move(body)});
+  entries_.emplace(lru_.front().key, lru_.begin());
+
+  if (metric_bytes_)
+    metric_bytes_->Set(bytes_);
+}
+
+RenderCache::Body RenderCache::ReadDisk(const std::string& full_key) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = disk_entries_.find(full_key);
+    if (it == disk_entries_.end())
+      return nullptr;
+    disk_lru_.splice(disk_lru_.begin(), disk_lru_, it->second);
+  }
+
+  std::ifstream in(disk_dir_ / full_key, std::ios::binary);
+  auto body = in ? std::make_shared<std::string>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()) : nullptr;
+  if (!body || in.bad()) {
+    // deleted (or broken) from under us: forget about it
+    std::lock_guard<std::mutex> lock(lock_);
+    if (auto it = disk_entries_.find(full_key); it != disk_entries_.end())
+      RemoveDisk(it->second);
+    return nullptr;
+  }
+  return body;
+}
+
+void RenderCache::WriteDisk(const std::string& full_key, const std::string& body) {
+  if (body.size() > max_disk_bytes_)
+    return;
+
+  fs::path path = disk_dir_ / full_key;
+  static std::atomic<unsigned> tmp_counter = 0;
+  fs::path tmp = path;
+  tmp += ".tmp" + std::to_string(tmp_counter++);
+
+  std::error_code ec;
+  fs::create_directories(path.parent_path(), ec);
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(body.data(), body.size());
+    if (!out) {
+      LOG(WARNING) << "render cache: failed to write: " << tmp;
+      fs::remove(tmp, ec);
+      return;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(lock_);
+  fs::rename(tmp, path, ec);
+  if (ec) {
+    LOG(WARNING) << "render cache: failed to rename: " << tmp << ": " << ec.message();
+    fs::remove(tmp, ec);
+    return;
+  }
+  InsertDisk(full_key, body.size());
+}
+
+void RenderCache::ScanDisk() {
+  struct Found {
+    fs::file_time_type mtime;
+    std::string key;
+    std::size_t size;
+  };
+  std::vector<Found> found;
+
+  std::error_code ec;
+  for (auto it = fs::recursive_directory_iterator(disk_dir_, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+    std::error_code entry_ec;
+    if (!it->is_regular_file(entry_ec))
+      continue;
+    const fs::path& path = it->path();
+    if (path.extension().string().starts_with(".tmp")) {
+      fs::remove(path, entry_ec); // left over from a write that never finished
+      continue;
+    }
+    auto mtime = it->last_write_time(entry_ec);
+    if (entry_ec)
+      continue;
+    auto size = it->file_size(entry_ec);
+    if (entry_ec)
+      continue;
+    found.push_back(Found{mtime, path.lexically_relative(disk_dir_).string(), static_cast<std::size_t>(size)});
+  }
+  if (ec && ec != std::errc::no_such_file_or_directory)
+    LOG(WARNING) << "render cache: failed to scan " << disk_dir_ << ": " << ec.message();
+
+  std::sort(found.begin(), found.end(), [](const Found& a, const Found& b) { return a.mtime < b.mtime; });
+  std::lock_guard<std::mutex> lock(lock_);
+  for (const Found& f : found)
+    InsertDisk(f.key, f.size);
+}
+
+void RenderCache::InsertDisk(const std::string& full_key, std::size_t size) {
+  // called with lock_ held
+
+  if (auto it = disk_entries_.find(full_key); it != disk_entries_.end()) {
+    // written concurrently by someone else, with the same contents
+    disk_lru_.splice(disk_lru_.begin(), disk_lru_, it->second);
+  } else {
+    disk_bytes_ += size;
+    disk_lru_.push_front(DiskEntry{full_key, size});
+    disk_entries_.emplace(disk_lru_.front().key, disk_lru_.begin());
+  }
+
+  while (disk_bytes_ > max_disk_bytes_ && !disk_lru_.empty()) {
+    RemoveDisk(std::prev(disk_lru_.end()));
+    if (metric_disk_evictions_)
+      metric_disk_evictions_->Increment();
+  }
+
+  if (metric_disk_bytes_)
+    metric_disk_bytes_->Set(disk_bytes_);
+}
+
+void RenderCache::RemoveDisk(std::list<DiskEntry>::iterator it) {
+  // called with lock_ held
+
+  std::error_code ec;
+  fs::remove(disk_dir_ / it->key, ec);
+  if (ec)
+    LOG(WARNING) << "render cache: failed to remove: " << it->key << ": " << ec.message();
+  disk_bytes_ -= it->size;
+  disk_entries_.erase(it->key);
+  disk_lru_.erase(it);
+
+  if (metric_disk_bytes_)
+    metric_disk_bytes_->Set(disk_bytes_);
+}
+
+} // namespace esologs
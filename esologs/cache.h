@@ -0,0 +1,106 @@
+#ifndef ESOLOGS_CACHE_H_
+#define ESOLOGS_CACHE_H_
+
+#include <cstddef>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <prometheus/counter.h>
+#include <prometheus/gauge.h>
+#include <prometheus/registry.h>
+
+#include "esologs/index.h"
+
+namespace esologs {
+
+/**
+ * Byte-budgeted LRU cache of rendered response bodies.
+ *
+ * Only content that can never change (i.e., frozen logs) should be stored here. Cached bodies are
+ * handed out as shared pointers, so an entry being evicted doesn't affect responses in progress.
+ *
+ * If a directory is given, entries are also written there as files, and consulted on a miss of the
+ * in-memory cache. The disk tier is an LRU of its own, with a separate byte budget; files already
+ * in the directory on startup are taken in, oldest first by modification time. Pages whose key has
+ * changed (e.g., by getting a new navigation link) are never asked for again, so they eventually
+ * fall out of it.
+ */
+class RenderCache {
+ public:
+  using Body = std::shared_ptr<const std::string>;
+
+  RenderCache(
+      std::size_t max_bytes,
+      const std::string& disk_dir = "", std::size_t max_disk_bytes = 0,
+      prometheus::Registry* metric_registry = nullptr);
+
+  /**
+   * Builds the cache key of a log page.
+   *
+   * The navigation links of a page are part of the key, so a page is effectively invalidated if
+   * a neighbouring day (or month) appears in the index later.
+   */
+  static std::string Key(const YMD& date, const std::optional<YMD>& prev, const std::optional<YMD>& next, std::string_view format);
+
+  /** Returns the cached body for (target, key), or `nullptr` on a miss. */
+  Body Get(std::string_view target, const std::string& key);
+  /** Stores a body in the cache. */
+  void Put(std::string_view target, const std::string& key, Body body);
+
+ private:
+  struct Entry {
+    std::string key;
+    Body body;
+  };
+
+  const std::size_t max_bytes_;
+  const std::filesystem::path disk_dir_;
+
+  std::list<Entry> lru_; // most recently used first
+  std::unordered_map<std::string_view, std::list<Entry>::iterator> entries_; // keys point to lru_ entries
+  std::size_t bytes_ = 0;
+
+  /** Files of the disk tier, by their path relative to disk_dir_ (i.e., the full key). */
+  struct DiskEntry {
+    std::string key;
+    std::size_t size;
+  };
+  const std::size_t max_disk_bytes_;
+  std::list<DiskEntry> disk_lru_; // most recently used first
+  std::unordered_map<std::string_view, std::list<DiskEntry>::iterator> disk_entries_;
+  std::size_t disk_bytes_ = 0;
+
+  std::mutex lock_;
+
+  prometheus::Counter* metric_hits_memory_ = nullptr;
+  prometheus::Counter* metric_hits_disk_ = nullptr;
+  prometheus::Counter* metric_misses_ = nullptr;
+  prometheus::Counter* metric_evictions_ = nullptr;
+  prometheus::Gauge* metric_bytes_ = nullptr;
+  prometheus::Counter* metric_disk_evictions_ = nullptr;
+  prometheus::Gauge* metric_disk_bytes_ = nullptr;
+
+  void Insert(std::string full_key, Body body);
+  Body ReadDisk(const std::string& full_key);
+  void WriteDisk(const std::string& full_key, const std::string& body);
+  /** Takes in the files already in the disk tier, and removes any temporary files left over. */
+  void ScanDisk();
+  /** Records a file of \p size bytes in the disk tier as the most recently used. Needs the lock. */
+  void InsertDisk(const std::string& full_key, std::size_t size);
+  /** Removes a file from the disk tier (and disk_lru_). Needs the lock. */
+  void RemoveDisk(std::list<DiskEntry>::iterator it);
+};
+
+} // namespace esologs
+
+#endif // ESOLOGS_CACHE_H_
+
+// Local Variables:
+// mode: c++
+// End:
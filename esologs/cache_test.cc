@@ -0,0 +1,138 @@
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "esologs/cache.h"
+
+namespace esologs {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+RenderCache::Body MakeBody(std::size_t size, char c) {
+  return std::make_shared<const std::string>(size, c);
+}
+
+} // unnamed namespace
+
+struct RenderCacheTest : public ::testing::Test {
+  RenderCacheTest() {
+    const char* tmp = std::getenv("TEST_TMPDIR");
+    dir = fs::path(tmp ? tmp : "/tmp") / "render_cache_test";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+  }
+
+  ~RenderCacheTest() {
+    fs::remove_all(dir);
+  }
+
+  fs::path dir;
+};
+
+TEST_F(RenderCacheTest, Key) {
+  EXPECT_EQ("2021-01-01.html@2020-12-31,2021-01-02", RenderCache::Key(YMD(2021, 1, 1), YMD(2020, 12, 31), YMD(2021, 1, 2), ".html"));
+  EXPECT_EQ("2021-01.txt@2020-12,", RenderCache::Key(YMD(2021, 1, 0), YMD(2020, 12, 0), std::nullopt, ".txt"));
+}
+
+TEST_F(RenderCacheTest, EvictsLeastRecentlyUsed) {
+  RenderCache cache(30);
+
+  cache.Put("t", "a", MakeBody(10, 'a'));
+  cache.Put("t", "b", MakeBody(10, 'b'));
+  cache.Put("t", "c", MakeBody(10, 'c'));
+  ASSERT_TRUE(cache.Get("t", "a")); // now b is the least recently used
+
+  cache.Put("t", "d", MakeBody(10, 'd'));
+  EXPECT_TRUE(cache.Get("t", "a"));
+  EXPECT_FALSE(cache.Get("t", "b"));
+  EXPECT_TRUE(cache.Get("t", "c"));
+  EXPECT_TRUE(cache.Get("t", "d"));
+
+  // a body larger than the whole budget isn't cached, and doesn't evict anything
+  cache.Put("t", "e", MakeBody(31, 'e'));
+  EXPECT_FALSE(cache.Get("t", "e"));
+  EXPECT_TRUE(cache.Get("t", "a"));
+  EXPECT_TRUE(cache.Get("t", "c"));
+  EXPECT_TRUE(cache.Get("t", "d"));
+}
+
+TEST_F(RenderCacheTest, KeysAreScopedByTarget) {
+  RenderCache cache(100);
+  cache.Put("t1", "a", MakeBody(1, '1'));
+  cache.Put("t2", "a", MakeBody(1, '2'));
+
+  auto body = cache.Get("t1", "a");
+  ASSERT_TRUE(body);
+  EXPECT_EQ("1", *body);
+  body = cache.Get("t2", "a");
+  ASSERT_TRUE(body);
+  EXPECT_EQ("2", *body);
+}
+
+TEST_F(RenderCacheTest, EvictedBodiesStayValid) {
+  RenderCache cache(10);
+  cache.Put("t", "a", MakeBody(10, 'a'));
+  auto body = cache.Get("t", "a");
+  ASSERT_TRUE(body);
+
+  cache.Put("t", "b", MakeBody(10, 'b'));
+  EXPECT_FALSE(cache.Get("t", "a"));
+  EXPECT_EQ(std::string(10, 'a'), *body);
+}
+
+TEST_F(RenderCacheTest, DiskTier) {
+  {
+    RenderCache cache(10, dir.string(), 100);
+    cache.Put("t", "a", MakeBody(10, 'a'));
+    cache.Put("t", "b", MakeBody(10, 'b')); // evicts a from memory, but not from disk
+    EXPECT_TRUE(fs::exists(dir / "t" / "a"));
+
+    auto body = cache.Get("t", "a");
+    ASSERT_TRUE(body);
+    EXPECT_EQ(std::string(10, 'a'), *body);
+  }
+
+  // the files are picked up again by a new cache
+  RenderCache cache(10, dir.string(), 100);
+  auto body = cache.Get("t", "b");
+  ASSERT_TRUE(body);
+  EXPECT_EQ(std::string(10, 'b'), *body);
+  EXPECT_FALSE(cache.Get("t", "c"));
+}
+
+TEST_F(RenderCacheTest, DiskTierIsBounded) {
+  fs::create_directories(dir / "t");
+  std::ofstream(dir / "t" / "old") << std::string(10, 'o');
+  std::ofstream(dir / "t" / "new.tmp3") << "partial";
+
+  RenderCache cache(10, dir.string(), 25);
+  EXPECT_FALSE(fs::exists(dir / "t" / "new.tmp3"));
+
+  cache.Put("t", "a", MakeBody(10, 'a'));
+  ASSERT_TRUE(cache.Get("t", "old")); // from disk: now a is the least recently used
+  cache.Put("t", "b", MakeBody(10, 'b'));
+  EXPECT_FALSE(fs::exists(dir / "t" / "a"));
+  EXPECT_TRUE(fs::exists(dir / "t" / "old"));
+  EXPECT_TRUE(fs::exists(dir / "t" / "b"));
+
+  // too large for the disk budget: not written at all
+  RenderCache big(100, dir.string(), 25);
+  big.Put("t", "c", MakeBody(30, 'c'));
+  EXPECT_FALSE(fs::exists(dir / "t" / "c"));
+}
+
+TEST_F(RenderCacheTest, DiskTierForgetsDeletedFiles) {
+  RenderCache cache(10, dir.string(), 100);
+  cache.Put("t", "a", MakeBody(10, 'a'));
+  cache.Put("t", "b", MakeBody(10, 'b'));
+  fs::remove(dir / "t" / "a");
+  EXPECT_FALSE(cache.Get("t", "a"));
+}
+
+} // namespace esologs
@@ -0,0 +1,251 @@
+// Renders the frozen parts of the log archive into a directory tree of static files.
+//
+// Usage: esologs_export [--threads=N] [--force] <esologs.config> <output-dir>
+//
+// The tree mirrors the server's URLs: the static assets go at the top, and each target's pages in
+// a subdirectory of its own (`<target>/2020-01-02.html`, `<target>/2020-01.txt`, `<target>/2020.html`
+// and so on). Every file also gets `.gz` and `.br` siblings. The server can be pointed at the same
+// directory (the `export_dir` setting) to send the exported pages instead of rendering them.
+//
+// Only log pages that can no longer change are exported: those that are frozen, and aren't the
+// last ones of the archive (whose navigation still changes once the next day is logged). Such
+// pages are skipped if they've already been exported, so re-running the tool only renders what's
+// new; use --force to render everything again (e.g. after changing the formatters). Index pages
+// are cheap to render, and rewritten whenever they've changed.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "base/exc.h"
+#include "base/log.h"
+#include "esologs/assets.h"
+#include "esologs/config.pb.h"
+#include "esologs/format.h"
+#include "esologs/index.h"
+#include "esologs/workers.h"
+#include "proto/util.h"
+#include "web/asset.h"
+#include "web/encoding.h"
+
+extern "C" {
+#include <stdlib.h>
+}
+
+namespace {
+
+namespace fs = std::filesystem;
+
+constexpr const char* kFormats[] = {".html", ".txt", "-raw.txt", ".json"};
+
+struct Stats {
+  std::atomic<unsigned> written = 0;
+  std::atomic<unsigned> skipped = 0;
+  std::atomic<unsigned> failed = 0;
+};
+
+fs::path Sibling(const fs::path& path, const char* suffix) {
+  fs::path sibling = path;
+  sibling += suffix;
+  return sibling;
+}
+
+/** Returns `true` if the file and both of its compressed siblings exist. */
+bool Exported(const fs::path& path) {
+  return fs::exists(path) && fs::exists(Sibling(path, ".gz")) && fs::exists(Sibling(path, ".br"));
+}
+
+/** Writes a file through a temporary one, so that a reader never sees it half-written. */
+void WriteFile(const fs::path& path, std::string_view data) {
+  fs::path tmp = Sibling(path, ".tmp");
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    if (!out)
+      throw base::Exception("write failed: " + tmp.string());
+  }
+  std::error_code ec;
+  fs::rename(tmp, path, ec);
+  if (ec)
+    throw base::Exception("rename failed: " + path.string() + ": " + ec.message());
+}
+
+/** Writes a file along with its `.gz` and `.br` siblings. The plain file is written last. */
+void WriteWithSiblings(const fs::path& path, std::string_view data) {
+  WriteFile(Sibling(path, ".gz"), web::Compress(web::Encoding::kGzip, data));
+  WriteFile(Sibling(path, ".br"), web::Compress(web::Encoding::kBrotli, data));
+  WriteFile(path, data);
+}
+
+/** Returns `true` if the file exists and has exactly the given contents. */
+bool Unchanged(const fs::path& path, std::string_view data) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    return false;
+  std::string old{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+  return old == data;
+}
+
+std::string PageName(const esologs::YMD& date, const char* format) {
+  char buf[16];
+  if (date.day != 0)
+    std::snprintf(buf, sizeof buf, "%04d-%02d-%02d", date.year, date.month, date.day);
+  else
+    std::snprintf(buf, sizeof buf, "%04d-%02d", date.year, date.month);
+  return std::string(buf) + format;
+}
+
+class Exporter {
+ public:
+  Exporter(const esologs::TargetConfig& cfg, const fs::path& out, bool force, esologs::WorkerPool* workers, Stats* stats)
+      : cfg_(cfg), index_(cfg.log_path()), dir_(out / cfg.name()), force_(force), workers_(workers), stats_(stats)
+  {}
+
+  /** Queues the log pages that need exporting, and writes the index pages. */
+  void Run();
+
+ private:
+  const esologs::TargetConfig& cfg_;
+  esologs::LogIndex index_;
+  const fs::path dir_;
+  const bool force_;
+  esologs::WorkerPool* const workers_;
+  Stats* const stats_;
+
+  void Queue(const esologs::YMD& date);
+  void WriteIndex(int y, const char* name);
+};
+
+void Exporter::Run() {
+  fs::create_directories(dir_);
+
+  auto [y_min, y_max] = index_.bounds();
+  std::vector<esologs::YMD> days;
+  index_.ForRange(esologs::YMD(y_min, 1, 1), esologs::YMD(y_max, 12, 31), [&days](int y, int m, int d) {
+      days.emplace_back(y, m, d);
+    });
+
+  std::set<std::pair<int, int>> months;
+  for (const esologs::YMD& date : days) {
+    Queue(date);
+    months.emplace(date.year, date.month);
+  }
+  for (auto [y, m] : months)
+    Queue(esologs::YMD(y, m));
+
+  for (int y = y_min; y <= y_max; ++y)
+    WriteIndex(y, nullptr);
+  WriteIndex(-1, "all.html");
+  WriteIndex(index_.default_year(), "index.html");
+}
+
+void Exporter::Queue(const esologs::YMD& date) {
+  std::optional<esologs::YMD> prev, next;
+  esologs::FileInfo info;
+  if (!index_.Lookup(date, &prev, &next) || !next || !index_.Stat(date, &info) || !info.frozen)
+    return; // still subject to change
+
+  for (const char* format : kFormats) {
+    fs::path path = dir_ / PageName(date, format);
+    if (!force_ && Exported(path)) {
+      ++stats_->skipped;
+      continue;
+    }
+    workers_->Post([this, date, prev, next, format, path]() {
+        try {
+          std::string text;
+          esologs::FormatLog(esologs::LogFormatter::Create(format, &text).get(), &index_, cfg_, date, prev, next);
+          WriteWithSiblings(path, text);
+          ++stats_->written;
+        } catch (const std::exception& e) {
+          LOG(ERROR) << "export failed: " << path.string() << ": " << e.what();
+          ++stats_->failed;
+        }
+      });
+  }
+}
+
+void Exporter::WriteIndex(int y, const char* name) {
+  std::string text;
+  esologs::FormatIndex(&text, cfg_, index_, y);
+  fs::path path = dir_ / (name ? std::string(name) : std::to_string(y) + ".html");
+  if (Unchanged(path, text) && Exported(path)) {
+    ++stats_->skipped;
+    return;
+  }
+  WriteWithSiblings(path, text);
+  ++stats_->written;
+}
+
+void ExportAssets(const fs::path& out, Stats* stats) {
+  for (const web::Asset& asset : esologs::Assets()) {
+    fs::path path = out / asset.path.substr(1);
+    if (Unchanged(path, asset.identity) && Exported(path)) {
+      ++stats->skipped;
+      continue;
+    }
+    // The embedded compressed forms are left out when they're no smaller; files are always written.
+    WriteFile(Sibling(path, ".gz"), asset.gzip.empty() ? web::Compress(web::Encoding::kGzip, asset.identity) : std::string(asset.gzip));
+    WriteFile(Sibling(path, ".br"), asset.brotli.empty() ? web::Compress(web::Encoding::kBrotli, asset.identity) : std::string(asset.brotli));
+    WriteFile(path, asset.identity);
+    ++stats->written;
+  }
+}
+
+} // unnamed namespace
+
+int main(int argc, char* argv[]) {
+  unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+  bool force = false;
+  std::vector<const char*> args;
+  for (int arg = 1; arg < argc; ++arg) {
+    std::string_view opt(argv[arg]);
+    if (opt.starts_with("--threads="))
+      threads = std::max(std::atoi(argv[arg] + 10), 1);
+    else if (opt == "--force")
+      force = true;
+    else
+      args.push_back(argv[arg]);
+  }
+  if (args.size() != 2) {
+    LOG(ERROR) << "usage: " << argv[0] << " [--threads=N] [--force] <esologs.config> <output-dir>";
+    return 1;
+  }
+
+  setenv("TZ", "UTC", 1);  // no-op, for safety
+  esologs::Config config;
+  proto::ReadText(args[0], &config);
+  fs::path out = args[1];
+
+  Stats stats;
+  try {
+    fs::create_directories(out);
+    ExportAssets(out, &stats);
+
+    std::vector<std::unique_ptr<Exporter>> exporters;
+    {
+      esologs::WorkerPool workers(threads);
+      for (const auto& target : config.target()) {
+        auto& exporter = exporters.emplace_back(std::make_unique<Exporter>(target, out, force, &workers, &stats));
+        exporter->Run();
+      }
+    } // waits for the queued pages to be written
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "export failed: " << e.what();
+    return 1;
+  }
+
+  LOG(INFO) << "exported " << stats.written << " pages (" << stats.skipped << " up to date, " << stats.failed << " failed)";
+  return stats.failed > 0 ? 1 : 0;
+}
@@ -1,13 +1,18 @@
+#include <array>
+#include <charconv>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
 #include <functional>
+#include <limits>
 
 #include <date/date.h>
 
 #include "base/log.h"
 #include "esologs/format.h"
+#include "esologs/scan.h"
+#include "esologs/search.h"
 #include "web/writer.h"
 
 namespace esologs {
@@ -37,10 +42,10 @@ void WriteHtmlHeader(web::Writer* web, const char* css, const char* js, TitleArg
   if (js)
     web->Write("<script defer=\"true\" type=\"text/javascript\" src=\"", js, "\"></script>");
 
-  web->Write(
+  web->Write(web::Ref(
       "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">"
       "</head>\n"
-      "<body>\n");
+      "<body>\n"));
 }
 
 void WriteHtmlFooter(web::Writer* web) {
@@ -49,16 +54,20 @@ void WriteHtmlFooter(web::Writer* web) {
 
 constexpr char kContentTypeText[] = "text/plain; charset=utf-8";
 constexpr char kContentTypeHtml[] = "text/html; charset=utf-8";
+constexpr char kContentTypeJson[] = "application/x-ndjson";
+constexpr char kContentTypeJsonObject[] = "application/json";
 
 constexpr char kCssIndex[] = "../index.css";
 constexpr char kCssLog[] = "../log.css";
 
 } // unnamed namespace
 
-void FormatIndex(const web::Request& req, web::Response* resp, const TargetConfig& cfg, const LogIndex& index, int y) {
-  web::Writer web(resp, kContentTypeHtml);
-  if (req.is_head())
-    return;
+void FormatIndex(std::string* buffer, const TargetConfig& cfg, const LogIndex& index, int y) {
+  FormatIndex(buffer, cfg, index.dates(), y);
+}
+
+void FormatIndex(std::string* buffer, const TargetConfig& cfg, const std::vector<YMD>& dates, int y) {
+  web::Writer web(buffer);
 
   bool all = y < 0;
   if (all)
@@ -69,7 +78,7 @@ void FormatIndex(const web::Request& req, web::Response* resp, const TargetConfi
   if (!cfg.announce().empty())
     web.Write(cfg.announce());
 
-  auto [y_min, y_max] = index.bounds();
+  auto [y_min, y_max] = LogIndex::bounds(dates);
   int y_last = y_max;
 
   if (!all) {
@@ -100,7 +109,7 @@ void FormatIndex(const web::Request& req, web::Response* resp, const TargetConfi
     web.Write("<div class=\"b\">\n");
 
     int mh = 0;
-    index.For(y, [&web, &mh](int y, int m, int d) {
+    LogIndex::For(dates, y, [&web, &mh](int y, int m, int d) {
         if (m != mh) {
           YMD ym(y, m);
           web.Write(
@@ -134,6 +143,36 @@ void FormatIndex(const web::Request& req, web::Response* resp, const TargetConfi
   WriteHtmlFooter(&web);
 }
 
+void FormatLog(LogFormatter* fmt, LogIndex* index, const TargetConfig& cfg, const YMD& date, const std::optional<YMD>& prev, const std::optional<YMD>& next) {
+  fmt->FormatHeader(date, prev, next, cfg.title());
+  int d_min = date.day ? date.day : 1;
+  int d_max = date.day ? date.day : 31;
+  for (int d = d_min; d <= d_max; ++d) {
+    auto reader = index->Open(date.year, date.month, d);
+    if (!reader)
+      continue;
+    fmt->FormatDay(d_min != d_max, date.year, date.month, d);
+    fmt->FormatEvents(reader.get(), cfg);
+  }
+  fmt->FormatFooter(date, prev, next);
+}
+
+/** Escapes text without formatting codes for HTML, including attribute values. Drops control codes. */
+static void HtmlEscapePlain(std::string_view raw, std::string* cooked) {
+  for (char c : raw) {
+    if (c == '<')
+      *cooked += "&lt;";
+    else if (c == '>')
+      *cooked += "&gt;";
+    else if (c == '&')
+      *cooked += "&amp;";
+    else if (c == '"')
+      *cooked += "&quot;";
+    else if (static_cast<unsigned char>(c) >= 0x20)
+      cooked->push_back(c);
+  }
+}
+
 static void DoFormatError(web::Response* resp, int code, std::string_view extra_headers, const char* fmt, va_list args) {
   char text[512];
   std::vsnprintf(text, sizeof text, fmt, args);
@@ -175,10 +214,11 @@ struct LogLine {
   Type type;
   std::int64_t day;
   std::uint64_t line;
-  std::string tstamp;
-  std::string nick;
-  std::string uhost;
-  std::string body;
+  // These point into the event, the config or the formatter, and are only valid during FormatLine.
+  std::string_view tstamp;
+  std::string_view nick;
+  std::string_view uhost;
+  std::string_view body;
 };
 
 constexpr const char* kLineDescriptions[] = {
@@ -196,57 +236,131 @@ constexpr const char* kLineDescriptions[] = {
   /* IGNORED: */ "",
 };
 
-class LogLineFormatter : public LogFormatter {
+struct LineCommand {
+  std::string_view cmd;
+  LogLine::Type type;
+};
+
+/** IRC commands that are logged as lines. Anything else is LogLine::ERROR. */
+constexpr LineCommand kLineCommands[] = {
+  {"PRIVMSG", LogLine::MESSAGE},
+  {"NOTICE", LogLine::MESSAGE},
+  {"JOIN", LogLine::JOIN},
+  {"PART", LogLine::PART},
+  {"QUIT", LogLine::QUIT},
+  {"NICK", LogLine::NICK},
+  {"CHGHOST", LogLine::CHGHOST},
+  {"KICK", LogLine::KICK},
+  {"MODE", LogLine::MODE},
+  {"TOPIC", LogLine::TOPIC},
+  {"NAMES", LogLine::IGNORED},
+};
+
+// Commands are classified with a perfect hash: kCommandSeed is picked (at compile time) so that
+// every command in kLineCommands lands in a different slot of kCommandTable, and then any command
+// only needs to be compared against whatever is in its slot.
+
+constexpr std::size_t kCommandSlots = 16;
+
+constexpr std::size_t CommandSlot(std::string_view cmd, std::uint32_t seed) {
+  std::uint32_t h = seed;
+  for (char c : cmd)
+    h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+  return (h >> 16) % kCommandSlots;
+}
+
+constexpr std::uint32_t FindCommandSeed() {
+  for (std::uint32_t seed = 1;; ++seed) {
+    bool used[kCommandSlots] = {};
+    bool collision = false;
+    for (const auto& c : kLineCommands) {
+      std::size_t slot = CommandSlot(c.cmd, seed);
+      collision = collision || used[slot];
+      used[slot] = true;
+    }
+    if (!collision)
+      return seed;
+  }
+}
+
+constexpr std::uint32_t kCommandSeed = FindCommandSeed();
+
+constexpr std::array<LineCommand, kCommandSlots> kCommandTable = []() {
+  std::array<LineCommand, kCommandSlots> table{};
+  for (auto& entry : table)
+    entry = {"", LogLine::ERROR};
+  for (const auto& c : kLineCommands)
+    table[CommandSlot(c.cmd, kCommandSeed)] = c;
+  return table;
+}();
+
+inline LogLine::Type ClassifyCommand(std::string_view cmd) {
+  const LineCommand& entry = kCommandTable[CommandSlot(cmd, kCommandSeed)];
+  return entry.cmd == cmd ? entry.type : LogLine::ERROR;
+}
+
+/** Two-digit renderings of 00 to 59, for timestamps. */
+constexpr std::array<char, 120> kTwoDigits = []() {
+  std::array<char, 120> digits{};
+  for (int i = 0; i < 60; ++i) {
+    digits[2*i] = '0' + i / 10;
+    digits[2*i + 1] = '0' + i % 10;
+  }
+  return digits;
+}();
+
+/**
+ * Base of the concrete formatters, which implements FormatEvents with a loop specialized for each.
+ *
+ * The formatters are `final`, and the loop calls the formatter's own FormatEvent without going
+ * through the vtable, so each instantiation can inline everything from decoding an event to writing
+ * out its rendering.
+ */
+template <typename Formatter>
+class StaticFormatter : public LogFormatter {
+ public:
+  void FormatEvents(proto::DelimReader* reader, const TargetConfig& cfg) override {
+    Formatter* fmt = static_cast<Formatter*>(this);
+    LogEvent event;
+    while (reader->Read(&event))
+      fmt->Formatter::FormatEvent(event, cfg);
+  }
+
+  std::unique_ptr<LogFormatter> CreateSibling(std::string* buffer) const override {
+    return std::make_unique<Formatter>(buffer);
+  }
+};
+
+/** Formatters that turn each event into a LogLine first. The subclass provides `FormatLine`. */
+template <typename Formatter>
+class LogLineFormatter : public StaticFormatter<Formatter> {
  public:
   void FormatEvent(const LogEvent& event, const TargetConfig& cfg) override;
-  virtual void FormatLine(const LogLine& line) = 0;
+  void SetLineNumber(std::uint64_t line) override { line_counter_ = line; }
  private:
   std::uint64_t line_counter_ = 0;
+  // storage for the parts of a LogLine that aren't in the event as is, reused across events
+  char line_tstamp_[8];
+  std::string line_body_;
 };
 
-void LogLineFormatter::FormatEvent(const LogEvent& event, const TargetConfig& cfg) {
-  static constexpr struct {
-    const char* cmd;
-    LogLine::Type type;
-  } kLineTypes[] = {
-    {"PRIVMSG", LogLine::MESSAGE},
-    {"NOTICE", LogLine::MESSAGE},
-    {"JOIN", LogLine::JOIN},
-    {"PART", LogLine::PART},
-    {"QUIT", LogLine::QUIT},
-    {"NICK", LogLine::NICK},
-    {"CHGHOST", LogLine::CHGHOST},
-    {"KICK", LogLine::KICK},
-    {"MODE", LogLine::MODE},
-    {"TOPIC", LogLine::TOPIC},
-    {"NAMES", LogLine::IGNORED},
-  };
-  static constexpr std::size_t kLineTypeCount = sizeof kLineTypes / sizeof *kLineTypes;
-
+template <typename Formatter>
+void LogLineFormatter<Formatter>::FormatEvent(const LogEvent& event, const TargetConfig& cfg) {
   LogLine line;
 
-  const std::string& cmd = event.command();
-  std::size_t line_type = 0;
-  for (; line_type < kLineTypeCount; ++line_type) {
-    if (cmd == kLineTypes[line_type].cmd) {
-      line.type = kLineTypes[line_type].type;
-      break;
-    }
-  }
-  if (line_type == kLineTypeCount)
-    line.type = LogLine::ERROR;
-  else if (line.type == LogLine::IGNORED)
+  line.type = ClassifyCommand(event.command());
+  if (line.type == LogLine::IGNORED)
     return;
 
   auto time_us = event.time_us() % 86400000000u;
 
-  line.tstamp.resize(8);
-  std::snprintf(
-      line.tstamp.data(), 9,
-      "%02d:%02d:%02d",
-      (int)(time_us / 3600000000u),
-      (int)(time_us / 60000000u % 60u),
-      (int)(time_us / 1000000u % 60u));
+  unsigned secs = time_us / 1000000u;
+  std::memcpy(line_tstamp_, &kTwoDigits[2 * (secs / 3600u)], 2);
+  line_tstamp_[2] = ':';
+  std::memcpy(line_tstamp_ + 3, &kTwoDigits[2 * (secs / 60u % 60u)], 2);
+  line_tstamp_[5] = ':';
+  std::memcpy(line_tstamp_ + 6, &kTwoDigits[2 * (secs % 60u)], 2);
+  line.tstamp = std::string_view(line_tstamp_, 8);
 
   if (event.has_event_id()) {
     line.day = event.event_id().day();
@@ -259,7 +373,7 @@ void LogLineFormatter::FormatEvent(const LogEvent& event, const TargetConfig& cf
   if (event.direction() == LogEvent::SENT) {
     line.nick = cfg.nick();
   } else {
-    const std::string& prefix = event.prefix();
+    std::string_view prefix = event.prefix();
     std::size_t sep = prefix.find('!');
     if (sep > 0 && sep != std::string::npos)
       line.nick = prefix.substr(0, sep), line.uhost = prefix.substr(sep + 1);
@@ -267,44 +381,60 @@ void LogLineFormatter::FormatEvent(const LogEvent& event, const TargetConfig& cf
       line.nick = "?unknown?", line.uhost = "?unknown?";
   }
 
+  line_body_.clear();
   int body_arg = (line.type == LogLine::QUIT || line.type == LogLine::NICK || line.type == LogLine::CHGHOST) ? 0 : 1;
   for (int i = body_arg; i < event.args_size(); ++i) {
     if (i > body_arg)
-      line.body.push_back(line.type == LogLine::CHGHOST ? '@' : ' ');
+      line_body_.push_back(line.type == LogLine::CHGHOST ? '@' : ' ');
     for (const auto& c : event.args(i)) {
       unsigned char v = c;
       if (v < 1 || (v > 3 && v < 15) || (v > 15 && v < 29))
         continue;
-      line.body.push_back(c);
+      line_body_.push_back(c);
     }
   }
+  line.body = line_body_;
 
   if (line.type == LogLine::MESSAGE) {
     std::string_view body = line.body;
     if (body.size() >= 9 && body.substr(0, 8) == "\x01""ACTION " && body[body.size()-1] == '\x01') {
       line.type = LogLine::ACTION;
-      line.body = line.body.substr(8, line.body.size()-9);
+      line.body = body.substr(8, body.size()-9);
     }
   }
 
-  FormatLine(line);
+  static_cast<Formatter*>(this)->FormatLine(line);
 }
 
-class HtmlLineFormatter : public LogLineFormatter {
+class HtmlLineFormatter final : public LogLineFormatter<HtmlLineFormatter> {
  public:
-  HtmlLineFormatter(web::Response* resp, std::string_view extra_headers) : web_(resp, kContentTypeHtml, 200, extra_headers) {}
+  HtmlLineFormatter(web::Response* resp, std::string_view extra_headers, web::Encoding encoding) : web_(resp, kContentTypeHtml, 200, extra_headers, encoding) {}
   HtmlLineFormatter(std::string* buffer) : web_(buffer) {}
   void FormatHeader(const YMD& date, const std::optional<YMD>& prev, const std::optional<YMD>& next, const std::string& title) override;
   void FormatFooter(const YMD& date, const std::optional<YMD>& prev, const std::optional<YMD>& next) override;
   void FormatStalkerHeader(int year, const std::string& title) override;
   void FormatStalkerFooter() override;
+  void FormatListHeader(std::string_view heading, const std::string& title) override;
+  void FormatListFooter() override;
   void FormatDay(bool multiday, int year, int month, int day) override;
   void FormatElision() override;
-  void FormatLine(const LogLine& line) override;
+  void WriteRendered(std::string_view text) override { web_.Write(text); }
+  void FormatLine(const LogLine& line);
  private:
   web::Writer web_;
+  // scratch space for the escaped body, row id and link of a line
+  std::string body_;
+  std::string id_;
+  std::string link_;
   std::int64_t last_day_ = 0;
   std::uint64_t last_line_ = 0;
+  // NickHash of recently seen nicks, in slots picked by a cheaper function of the nick
+  struct NickMemo {
+    std::string nick;
+    unsigned hash = 0;
+  };
+  std::array<NickMemo, 64> nick_memo_;
+  unsigned NickClass(std::string_view nick);
   void FormatNav(const YMD& date, const std::optional<YMD>& prev, const std::optional<YMD>& next);
 };
 
@@ -353,14 +483,30 @@ void HtmlLineFormatter::FormatStalkerHeader(int year, const std::string& title)
 
 void HtmlLineFormatter::FormatStalkerFooter() {
   web_.Write(
-      "<div id=\"s\" data-stalker-day=\"", last_day_, "\" data-stalker-line=\"", last_line_, "\"></div>\n"
-      "<div id=\"eof\" class=\"n\">"
-      "<span id=\"smsg\">"
-      "To update automatically, stalker mode requires a reasonably modern browser with scripts enabled. "
-      "If this message does not disappear, it's either because of that or a bug. Feel free to get in "
-      "touch on channel for debugging. Or just work around the issue by manually reloading."
-      "</span>"
+      "<div id=\"s\" data-stalker-day=\"", last_day_, "\" data-stalker-line=\"", last_line_, "\"></div>\n",
+      web::Ref(
+          "<div id=\"eof\" class=\"n\">"
+          "<span id=\"smsg\">"
+          "To update automatically, stalker mode requires a reasonably modern browser with scripts enabled. "
+          "If this message does not disappear, it's either because of that or a bug. Feel free to get in "
+          "touch on channel for debugging. Or just work around the issue by manually reloading."
+          "</span>"
+          "</div>\n"));
+  WriteHtmlFooter(&web_);
+}
+
+void HtmlLineFormatter::FormatListHeader(std::string_view heading, const std::string& title) {
+  std::string escaped;
+  HtmlEscapePlain(heading, &escaped);
+  WriteHtmlHeader(&web_, kCssLog, nullptr, escaped, " - ", title);
+  web_.Write(
+      "<div class=\"n\">"
+      "<span class=\"nc\">", escaped, "</span>"
+      "  <a href=\"all.html\">↑all</a>"
       "</div>\n");
+}
+
+void HtmlLineFormatter::FormatListFooter() {
   WriteHtmlFooter(&web_);
 }
 
@@ -375,14 +521,14 @@ void HtmlLineFormatter::FormatDay(bool multiday, int year, int month, int day) {
 }
 
 void HtmlLineFormatter::FormatElision() {
-  web_.Write(
+  web_.Write(web::Ref(
       "<div class=\"r\">"
       "<span class=\"t\">        </span>"
       "<span class=\"s\"> </span>"
       "<span class=\"x\">   </span>"
       "<span class=\"s\"> </span>"
       "<span class=\"ed\">[...]</span>"
-      "</div>\n");
+      "</div>\n"));
 }
 
 void RowId(std::uint64_t id, std::string* str) {
@@ -395,7 +541,7 @@ void RowId(std::uint64_t id, std::string* str) {
   }
 }
 
-unsigned NickHash(const std::string& nick) {
+unsigned NickHash(std::string_view nick) {
   unsigned nick_hash = 0;
   for (const auto& c : nick)
     nick_hash = 31 * nick_hash + (unsigned char)c;
@@ -422,7 +568,7 @@ struct IrcFormat {
       *out += sep; *out += "fg"; *out += std::to_string(bg); sep = " ";
     }
   }
-  std::size_t ParseColor(const std::string& raw, std::size_t i) {
+  std::size_t ParseColor(std::string_view raw, std::size_t i) {
     std::size_t len = raw.size();
 
     if (i+1 >= len || (raw[i+1] < '0' || raw[i+1] > '9')) {
@@ -458,23 +604,30 @@ struct IrcFormat {
   }
 };
 
-std::string HtmlEscape(const std::string& raw) {
-  std::string cooked;
-
+void HtmlEscape(std::string_view raw, std::string* cooked) {
   IrcFormat format;
 
-  for (std::size_t i = 0; i < raw.size(); ++i) {
-    char c = raw[i];
+  const char* begin = raw.data();
+  const char* end = begin + raw.size();
+  for (const char* p = begin; p < end; ++p) {
+    // copy the run of ordinary characters up to the next one that needs escaping or formatting
+    const char* special = FindHtmlSpecial(p, end);
+    cooked->append(p, special);
+    if (special == end)
+      break;
+    p = special;
+
+    char c = *p;
     if (c == 1) {
-      cooked += "&lt;CTCP&gt;";
+      *cooked += "&lt;CTCP&gt;";
     } else if ((unsigned char)c < 32) {
       if (!format.is_default())
-        cooked += "</span>";
+        *cooked += "</span>";
 
       if (c == 2)
         format.bold = !format.bold;
       else if (c == 3)
-        i = format.ParseColor(raw, i);
+        p = begin + format.ParseColor(raw, p - begin);
       else if (c == 15)
         format.Reset();
       else if (c == 29)
@@ -485,72 +638,79 @@ std::string HtmlEscape(const std::string& raw) {
         format.underline = !format.underline;
 
       if (!format.is_default()) {
-        cooked += "<span class=\"";
-        format.AppendClass(&cooked);
-        cooked += "\">";
+        *cooked += "<span class=\"";
+        format.AppendClass(cooked);
+        *cooked += "\">";
       }
     } else if (c == '<') {
-      cooked += "&lt;";
+      *cooked += "&lt;";
     } else if (c == '>') {
-      cooked += "&gt;";
-    } else if (c == '&') {
-      cooked += "&amp;";
+      *cooked += "&gt;";
     } else {
-      cooked += c;
+      *cooked += "&amp;";
     }
   }
   if (!format.is_default())
-    cooked += "</span>";
+    *cooked += "</span>";
+}
 
-  return cooked;
+unsigned HtmlLineFormatter::NickClass(std::string_view nick) {
+  if (nick.empty())
+    return NickHash(nick);
+  NickMemo& memo = nick_memo_[(nick.size() * 31 + (unsigned char)nick.front() * 7 + (unsigned char)nick.back()) % nick_memo_.size()];
+  if (memo.nick != nick) {
+    memo.nick.assign(nick);
+    memo.hash = NickHash(nick);
+  }
+  return memo.hash;
 }
 
 void HtmlLineFormatter::FormatLine(const LogLine& line) {
-  std::string id;
-  std::string link;
-
   if (line.day) {
     YMD ymd{date::sys_days{date::days{line.day}}};
-    id = "";
+    id_.clear();
     // TODO: wrap this sort of thing
-    link.resize(10);
-    std::snprintf(link.data(), 11, "%04u-%02u-%02u", (unsigned) ymd.year % 10000, (unsigned) ymd.month % 100, (unsigned) ymd.day % 100);
-    link += ".html#l"; RowId(line.line, &link);
+    char ymd_text[11];
+    std::snprintf(ymd_text, sizeof ymd_text, "%04u-%02u-%02u", (unsigned) ymd.year % 10000, (unsigned) ymd.month % 100, (unsigned) ymd.day % 100);
+    link_.assign(ymd_text, 10);
+    link_ += ".html#l"; RowId(line.line, &link_);
 
     last_day_ = line.day;
     last_line_ = line.line;
   } else {
-    id = " id=\"l"; RowId(line.line, &id); id += '"';
-    link = "#l"; RowId(line.line, &link);
+    id_ = " id=\"l"; RowId(line.line, &id_); id_ += '"';
+    link_ = "#l"; RowId(line.line, &link_);
   }
 
   web_.Write(
-      "<div", id, " class=\"r\">"
+      "<div", id_, " class=\"r\">"
       "<span class=\"t\">", line.tstamp, "</span>"
       "<span class=\"s\"> </span>");
 
-  std::string body = HtmlEscape(line.body);
+  body_.clear();
+  HtmlEscape(line.body, &body_);
+  const std::string& body = body_;
 
   if (line.type == LogLine::MESSAGE || line.type == LogLine::ACTION) {
     bool act = line.type == LogLine::ACTION;
     web_.Write(
-        "<span class=\"ma h", NickHash(line.nick), "\">"
-        "<a href=\"", link, "\">", act ? "* " : "&lt;", line.nick, act ? "" : "&gt;", "</a>"
+        "<span class=\"ma h", NickClass(line.nick), "\">"
+        "<a href=\"", link_, "\">", act ? "* " : "&lt;", line.nick, act ? "" : "&gt;", "</a>"
         "</span>"
         "<span class=\"s\"> </span>"
         "<span class=\"mb\">", body, "</span>");
   } else if (line.type != LogLine::ERROR) {
     web_.Write(
-        "<span class=\"x\"><a href=\"", link, "\">-!-</a></span>"
+        "<span class=\"x\"><a href=\"", link_, "\">-!-</a></span>"
         "<span class=\"s\"> </span>"
         "<span class=\"ed\">"
-        "<span class=\"ea h", NickHash(line.nick), "\">", line.nick, "</span>"
+        "<span class=\"ea h", NickClass(line.nick), "\">", line.nick, "</span>"
         " has ", kLineDescriptions[line.type]);
     if (!body.empty()) {
       if (line.type == LogLine::PART || line.type == LogLine::QUIT)
         web_.Write(" (<span class=\"eb\">", body, "</span>)");
       else if (line.type == LogLine::NICK || line.type == LogLine::KICK)
-        web_.Write(" <span class=\"ea h", NickHash(body), "\">", body, "</span>");
+        web_.Write(" <span class=\"ea h", NickClass(body), "\">", body, "</span>");
       else if (line.type == LogLine::CHGHOST)
         web_.Write(" <span class=\"eb\">", body, "</span>");
       else if (line.type == LogLine::MODE || line.type == LogLine::TOPIC)
@@ -564,18 +724,23 @@ void HtmlLineFormatter::FormatLine(const LogLine& line) {
   web_.Write("</div>\n");
 }
 
-class TextLineFormatter : public LogLineFormatter {
+class TextLineFormatter final : public LogLineFormatter<TextLineFormatter> {
  public:
-  TextLineFormatter(web::Response* resp, std::string_view extra_headers) : web_(resp, kContentTypeText, 200, extra_headers) {}
+  TextLineFormatter(web::Response* resp, std::string_view extra_headers, web::Encoding encoding) : web_(resp, kContentTypeText, 200, extra_headers, encoding) {}
+  TextLineFormatter(std::string* buffer) : web_(buffer) {}
   void FormatHeader(const YMD&, const std::optional<YMD>&, const std::optional<YMD>&, const std::string&) override {}
   void FormatFooter(const YMD&, const std::optional<YMD>&, const std::optional<YMD>&) override {}
   void FormatStalkerHeader(int, const std::string&) override {}
   void FormatStalkerFooter() override {}
+  void FormatListHeader(std::string_view, const std::string&) override {}
+  void FormatListFooter() override {}
   void FormatDay(bool multiday, int year, int month, int day) override;
   void FormatElision() override;
-  void FormatLine(const LogLine& line) override;
+  void WriteRendered(std::string_view text) override { web_.Write(text); }
+  void FormatLine(const LogLine& line);
  private:
   web::Writer web_;
+  std::string body_; // scratch space for the unformatted body of a line
 };
 
 void TextLineFormatter::FormatDay(bool multiday, int year, int month, int day) {
@@ -587,30 +752,31 @@ void TextLineFormatter::FormatElision() {
   web_.Write("[...]\n");
 }
 
-std::string UnFormat(const std::string& raw) {
-  std::string cooked;
-
+void UnFormat(std::string_view raw, std::string* cooked) {
   IrcFormat format;
 
-  for (std::size_t i = 0; i < raw.size(); ++i) {
-    char c = raw[i];
-    if ((unsigned char)c < 32) {
-      if (c == 1)
-        cooked += "<CTCP>";
-      else if (c == 3)
-        i = format.ParseColor(raw, i);
-    } else {
-      cooked += c;
-    }
-  }
+  const char* begin = raw.data();
+  const char* end = begin + raw.size();
+  for (const char* p = begin; p < end; ++p) {
+    const char* control = FindControl(p, end);
+    cooked->append(p, control);
+    if (control == end)
+      break;
+    p = control;
 
-  return cooked;
+    if (*p == 1)
+      *cooked += "<CTCP>";
+    else if (*p == 3)
+      p = begin + format.ParseColor(raw, p - begin);
+  }
 }
 
 void TextLineFormatter::FormatLine(const LogLine& line) {
   web_.Write(line.tstamp, " ");
 
-  std::string body = UnFormat(line.body);
+  body_.clear();
+  UnFormat(line.body, &body_);
+  const std::string& body = body_;
   if (line.type == LogLine::MESSAGE) {
     web_.Write("<", line.nick, "> ", body, "\n");
   } else if (line.type == LogLine::ACTION) {
@@ -631,16 +797,20 @@ void TextLineFormatter::FormatLine(const LogLine& line) {
   }
 }
 
-class RawFormatter : public LogFormatter {
+class RawFormatter final : public StaticFormatter<RawFormatter> {
  public:
-  RawFormatter(web::Response* resp, std::string_view extra_headers) : web_(resp, kContentTypeText, 200, extra_headers), offset_s_(0) {}
+  RawFormatter(web::Response* resp, std::string_view extra_headers, web::Encoding encoding) : web_(resp, kContentTypeText, 200, extra_headers, encoding), offset_s_(0) {}
+  RawFormatter(std::string* buffer) : web_(buffer), offset_s_(0) {}
   void FormatHeader(const YMD&, const std::optional<YMD>&, const std::optional<YMD>&, const std::string&) override {}
   void FormatFooter(const YMD&, const std::optional<YMD>&, const std::optional<YMD>&) override {}
   void FormatStalkerHeader(int, const std::string&) override {}
   void FormatStalkerFooter() override {}
+  void FormatListHeader(std::string_view, const std::string&) override {}
+  void FormatListFooter() override {}
   void FormatDay(bool, int year, int month, int day) override;
   void FormatElision() override {}
   void FormatEvent(const LogEvent& event, const TargetConfig&) override;
+  void WriteRendered(std::string_view text) override { web_.Write(text); }
  private:
   web::Writer web_;
   unsigned long offset_s_;
@@ -668,22 +838,427 @@ void RawFormatter::FormatEvent(const LogEvent& event, const TargetConfig&) {
   web_.Write("\n");
 }
 
+/** Returns the length of the valid UTF-8 sequence at \p p, or 0 if it isn't one. */
+std::size_t Utf8Length(const unsigned char* p, const unsigned char* end) {
+  unsigned char c = p[0];
+  std::size_t len;
+  unsigned char lo = 0x80, hi = 0xbf; // range of the second byte
+  if (c < 0x80)
+    return 1;
+  else if (c >= 0xc2 && c <= 0xdf)
+    len = 2;
+  else if (c >= 0xe0 && c <= 0xef)
+    len = 3, lo = c == 0xe0 ? 0xa0 : 0x80, hi = c == 0xed ? 0x9f : 0xbf; // no overlongs or surrogates
+  else if (c >= 0xf0 && c <= 0xf4)
+    len = 4, lo = c == 0xf0 ? 0x90 : 0x80, hi = c == 0xf4 ? 0x8f : 0xbf; // no overlongs, nothing past U+10FFFF
+  else
+    return 0;
+
+  if (end - p < static_cast<std::ptrdiff_t>(len) || p[1] < lo || p[1] > hi)
+    return 0;
+  for (std::size_t i = 2; i < len; ++i) {
+    if (p[i] < 0x80 || p[i] > 0xbf)
+      return 0;
+  }
+  return len;
+}
+
+/**
+ * Appends \p raw to \p cooked as the contents of a JSON string.
+ *
+ * IRC doesn't guarantee any particular encoding, so bytes that aren't part of valid UTF-8 are
+ * replaced with U+FFFD, to keep the output parseable by strict decoders.
+ */
+void JsonEscape(std::string_view raw, std::string* cooked) {
+  static constexpr char kHex[] = "0123456789abcdef";
+
+  const char* end = raw.data() + raw.size();
+  for (const char* p = raw.data(); p < end; ) {
+    const char* special = FindJsonSpecial(p, end);
+    cooked->append(p, special);
+    if (special == end)
+      break;
+    p = special;
+
+    unsigned char c = *p;
+    if (c == '"') {
+      *cooked += "\\\"";
+    } else if (c == '\\') {
+      *cooked += "\\\\";
+    } else if (c < 0x20) {
+      char esc[] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 15]};
+      cooked->append(esc, sizeof esc);
+    } else if (std::size_t len = Utf8Length(reinterpret_cast<const unsigned char*>(p), reinterpret_cast<const unsigned char*>(end)); len) {
+      cooked->append(p, len);
+      p += len;
+      continue;
+    } else {
+      *cooked += "\\ufffd";
+    }
+    ++p;
+  }
+}
+
+void AppendNumber(std::uint64_t n, std::string* out) {
+  char buf[20];
+  out->append(buf, std::to_chars(buf, buf + sizeof buf, n).ptr);
+}
+
+/**
+ * Formatter of the `.json` format: one JSON object per event (newline-delimited JSON).
+ *
+ * The objects carry the parsed parts of the IRC message as is, formatting codes and all, with the
+ * event's ID (the same day and line numbers the stalker uses) and its time as a Unix timestamp in
+ * microseconds (`ts`) and in ISO 8601 form (`time`). Optional fields are left out when empty.
+ */
+class JsonFormatter final : public StaticFormatter<JsonFormatter> {
+ public:
+  JsonFormatter(web::Response* resp, std::string_view extra_headers, web::Encoding encoding) : web_(resp, kContentTypeJson, 200, extra_headers, encoding) {}
+  JsonFormatter(std::string* buffer) : web_(buffer) {}
+  void FormatHeader(const YMD&, const std::optional<YMD>&, const std::optional<YMD>&, const std::string&) override {}
+  void FormatFooter(const YMD&, const std::optional<YMD>&, const std::optional<YMD>&) override {}
+  void FormatStalkerHeader(int, const std::string&) override {}
+  void FormatStalkerFooter() override {}
+  void FormatListHeader(std::string_view, const std::string&) override {}
+  void FormatListFooter() override {}
+  void FormatDay(bool, int year, int month, int day) override;
+  void FormatElision() override {}
+  void FormatEvent(const LogEvent& event, const TargetConfig& cfg) override;
+  void WriteRendered(std::string_view text) override { web_.Write(text); }
+ private:
+  web::Writer web_;
+  std::int64_t day_ = 0;
+  std::uint64_t line_counter_ = 0;
+  std::string line_; // scratch space for the object of an event
+  // "YYYY-MM-DDT" prefix of the time field, for day number date_day_
+  std::int64_t date_day_ = std::numeric_limits<std::int64_t>::min();
+  char date_[11];
+  void SetDay(std::int64_t day);
+};
+
+void JsonFormatter::FormatDay(bool, int year, int month, int day) {
+  date::sys_days d = date::year{year}/month/day;
+  day_ = d.time_since_epoch().count();
+  line_counter_ = 0;
+}
+
+void JsonFormatter::SetDay(std::int64_t day) {
+  if (day == date_day_)
+    return;
+  YMD ymd(YMD::day_number, day);
+  char buf[16];
+  std::snprintf(buf, sizeof buf, "%04u-%02u-%02uT", (unsigned) ymd.year % 10000, (unsigned) ymd.month % 100, (unsigned) ymd.day % 100);
+  std::memcpy(date_, buf, sizeof date_);
+  date_day_ = day;
+}
+
+void JsonFormatter::FormatEvent(const LogEvent& event, const TargetConfig& cfg) {
+  std::int64_t day;
+  std::uint64_t line;
+  if (event.has_event_id()) {
+    day = event.event_id().day();
+    line = event.event_id().line();
+  } else {
+    day = day_;
+    line = line_counter_++;
+  }
+  SetDay(day);
+
+  auto time_us = event.time_us();
+  unsigned secs = time_us / 1000000u % 86400u;
+  char time[16];
+  std::memcpy(time, &kTwoDigits[2 * (secs / 3600u)], 2);
+  time[2] = ':';
+  std::memcpy(time + 3, &kTwoDigits[2 * (secs / 60u % 60u)], 2);
+  time[5] = ':';
+  std::memcpy(time + 6, &kTwoDigits[2 * (secs % 60u)], 2);
+  time[8] = '.';
+  for (unsigned i = 0, us = time_us % 1000000u; i < 6; ++i, us /= 10)
+    time[14 - i] = '0' + us % 10;
+  time[15] = 'Z';
+
+  line_.assign("{\"day\":");
+  AppendNumber(day, &line_);
+  line_ += ",\"line\":";
+  AppendNumber(line, &line_);
+  line_ += ",\"ts\":";
+  AppendNumber(static_cast<std::uint64_t>(day) * 86400000000u + time_us, &line_);
+  line_ += ",\"time\":\"";
+  line_.append(date_, sizeof date_);
+  line_.append(time, sizeof time);
+  line_ += event.direction() == LogEvent::SENT ? "\",\"direction\":\"sent\"" : "\",\"direction\":\"received\"";
+
+  std::string_view nick;
+  if (event.direction() == LogEvent::SENT) {
+    nick = cfg.nick();
+  } else if (std::size_t sep = event.prefix().find('!'); sep > 0 && sep != std::string::npos) {
+    nick = std::string_view(event.prefix()).substr(0, sep);
+  }
+  if (!event.prefix().empty()) {
+    line_ += ",\"prefix\":\"";
+    JsonEscape(event.prefix(), &line_);
+    line_ += '"';
+  }
+  if (!nick.empty()) {
+    line_ += ",\"nick\":\"";
+    JsonEscape(nick, &line_);
+    line_ += '"';
+  }
+  if (!event.account().empty()) {
+    line_ += ",\"account\":\"";
+    JsonEscape(event.account(), &line_);
+    line_ += '"';
+  }
+
+  line_ += ",\"command\":\"";
+  JsonEscape(event.command(), &line_);
+  line_ += "\",\"args\":[";
+  for (int i = 0, n = event.args_size(); i < n; ++i) {
+    line_ += i ? ",\"" : "\"";
+    JsonEscape(event.args(i), &line_);
+    line_ += '"';
+  }
+  line_ += ']';
+
+  if (event.tags_size() > 0) {
+    line_ += ",\"tags\":{";
+    for (int i = 0, n = event.tags_size(); i < n; ++i) {
+      line_ += i ? ",\"" : "\"";
+      JsonEscape(event.tags(i).key(), &line_);
+      line_ += "\":\"";
+      JsonEscape(event.tags(i).value(), &line_);
+      line_ += '"';
+    }
+    line_ += '}';
+  }
+
+  line_ += "}\n";
+  web_.Write(line_);
+}
+
 } // namespace internal
 
-std::unique_ptr<LogFormatter> LogFormatter::CreateHTML(web::Response* resp, std::string_view extra_headers) {
-  return std::make_unique<internal::HtmlLineFormatter>(resp, extra_headers);
+bool IsNumberedLine(const LogEvent& event) {
+  return internal::ClassifyCommand(event.command()) != internal::LogLine::IGNORED;
+}
+
+bool MessageText(const LogEvent& event, std::string* text, bool* action) {
+  if (internal::ClassifyCommand(event.command()) != internal::LogLine::MESSAGE || event.args_size() < 2)
+    return false;
+
+  std::string joined;
+  std::string_view body;
+  if (event.args_size() == 2) {
+    body = event.args(1);
+  } else {
+    for (int i = 1; i < event.args_size(); ++i) {
+      if (i > 1)
+        joined.push_back(' ');
+      joined += event.args(i);
+    }
+    body = joined;
+  }
+
+  bool act = body.size() >= 9 && body.substr(0, 8) == "\x01""ACTION " && body.back() == '\x01';
+  if (act)
+    body = body.substr(8, body.size() - 9);
+  if (action)
+    *action = act;
+  text->clear();
+  internal::UnFormat(body, text);
+  return true;
+}
+
+/** Appends \p raw to \p cooked, encoded as a query string value. */
+static void QueryEscape(std::string_view raw, std::string* cooked) {
+  static constexpr char kHex[] = "0123456789ABCDEF";
+  for (char c : raw) {
+    unsigned char v = c;
+    if ((v >= 'a' && v <= 'z') || (v >= 'A' && v <= 'Z') || (v >= '0' && v <= '9') || c == '-' || c == '_' || c == '.' || c == '~') {
+      cooked->push_back(c);
+    } else if (c == ' ') {
+      cooked->push_back('+');
+    } else {
+      char esc[] = {'%', kHex[v >> 4], kHex[v & 15]};
+      cooked->append(esc, sizeof esc);
+    }
+  }
+}
+
+/** Writes the `HH:MM:SS` time of an offset from midnight, in microseconds. */
+static void AppendTime(std::uint64_t time_us, std::string* out) {
+  unsigned secs = time_us / 1000000u % 86400u;
+  out->append(&internal::kTwoDigits[2 * (secs / 3600u)], 2);
+  out->push_back(':');
+  out->append(&internal::kTwoDigits[2 * (secs / 60u % 60u)], 2);
+  out->push_back(':');
+  out->append(&internal::kTwoDigits[2 * (secs % 60u)], 2);
+}
+
+static void AppendDate(const YMD& date, std::string* out) {
+  char buf[11];
+  std::snprintf(buf, sizeof buf, "%04u-%02u-%02u", (unsigned) date.year % 10000, (unsigned) date.month % 100, (unsigned) date.day % 100);
+  out->append(buf, 10);
+}
+
+static void FormatSearchJson(web::Writer* web, const SearchResults& results) {
+  std::string out;
+  out += "{\"query\":\"";
+  internal::JsonEscape(results.query, &out);
+  out += "\",\"page\":";
+  internal::AppendNumber(results.page, &out);
+  out += ",\"pages\":";
+  internal::AppendNumber(results.pages, &out);
+  out += ",\"total\":";
+  internal::AppendNumber(results.total, &out);
+  out += results.truncated ? ",\"truncated\":true" : ",\"truncated\":false";
+  out += ",\"results\":[";
+  for (std::size_t i = 0; i < results.matches.size(); ++i) {
+    const SearchMatch& match = results.matches[i];
+    out += i ? ",{\"date\":\"" : "{\"date\":\"";
+    AppendDate(match.date, &out);
+    out += "\",\"line\":";
+    internal::AppendNumber(match.line, &out);
+    out += ",\"time\":\"";
+    AppendTime(match.time_us, &out);
+    out += "\",\"nick\":\"";
+    internal::JsonEscape(match.nick, &out);
+    out += match.action ? "\",\"action\":true" : "\",\"action\":false";
+    out += ",\"text\":\"";
+    internal::JsonEscape(match.text, &out);
+    out += "\",\"score\":";
+    internal::AppendNumber(match.score, &out);
+    out += ",\"url\":\"";
+    AppendDate(match.date, &out);
+    out += ".html#l";
+    internal::RowId(match.line, &out);
+    out += "\"}";
+  }
+  out += "]}\n";
+  web->Write(out);
+}
+
+static void FormatSearchHtml(web::Writer* web, const TargetConfig& cfg, const SearchResults& results) {
+  std::string query, query_url;
+  HtmlEscapePlain(results.query, &query);
+  QueryEscape(results.query, &query_url);
+
+  WriteHtmlHeader(web, kCssLog, nullptr, "search - ", cfg.title());
+  web->Write(
+      "<div class=\"n\">"
+      "<form action=\"search.html\">"
+      "<input type=\"search\" name=\"q\" size=\"40\" value=\"", query, "\"> "
+      "<input type=\"submit\" value=\"search\">"
+      "  <a href=\"all.html\">↑all</a>"
+      "</form>"
+      "</div>\n");
+
+  if (!results.query.empty()) {
+    web->Write("<div class=\"n\">");
+    if (results.total == 0)
+      web->Write("no matches");
+    else
+      web->Write(results.total, results.total == 1 ? " match" : " matches");
+    if (results.truncated)
+      web->Write(" (only the most recent ones were searched)");
+    web->Write("</div>\n");
+  }
+
+  std::string link, time, nick, text;
+  for (const SearchMatch& match : results.matches) {
+    link.clear();
+    AppendDate(match.date, &link);
+    link += ".html#l";
+    internal::RowId(match.line, &link);
+    time.clear();
+    AppendTime(match.time_us, &time);
+    nick.clear();
+    HtmlEscapePlain(match.nick, &nick);
+    text.clear();
+    HtmlEscapePlain(match.text, &text);
+    web->Write(
+        "<div class=\"r\">"
+        "<span class=\"t\"><a href=\"", link, "\">", match.date, " ", time, "</a></span>"
+        "<span class=\"s\"> </span>"
+        "<span class=\"ma h", internal::NickHash(match.nick), "\">", match.action ? "* " : "&lt;", nick, match.action ? "" : "&gt;", "</span>"
+        "<span class=\"s\"> </span>"
+        "<span class=\"mb\">", text, "</span>"
+        "</div>\n");
+  }
+
+  if (results.pages > 1) {
+    web->Write("<div class=\"n\">");
+    if (results.page > 1)
+      web->Write("<a href=\"search.html?q=", query_url, "&amp;page=", results.page - 1, "\">←previous</a>  ");
+    web->Write("<span class=\"nc\">page ", results.page, " of ", results.pages, "</span>");
+    if (results.page < results.pages)
+      web->Write("  <a href=\"search.html?q=", query_url, "&amp;page=", results.page + 1, "\">next→</a>");
+    web->Write("</div>\n");
+  }
+
+  WriteHtmlFooter(web);
+}
+
+void FormatSearch(web::Response* resp, std::string_view extra_headers, web::Encoding encoding, std::string_view format, const TargetConfig& cfg, const SearchResults& results) {
+  if (format == ".json") {
+    web::Writer web(resp, kContentTypeJsonObject, 200, extra_headers, encoding);
+    FormatSearchJson(&web, results);
+  } else {
+    web::Writer web(resp, kContentTypeHtml, 200, extra_headers, encoding);
+    FormatSearchHtml(&web, cfg, results);
+  }
+}
+
+std::unique_ptr<LogFormatter> LogFormatter::CreateHTML(web::Response* resp, std::string_view extra_headers, web::Encoding encoding) {
+  return std::make_unique<internal::HtmlLineFormatter>(resp, extra_headers, encoding);
 }
 
 std::unique_ptr<LogFormatter> LogFormatter::CreateHTML(std::string* buffer) {
   return std::make_unique<internal::HtmlLineFormatter>(buffer);
 }
 
-std::unique_ptr<LogFormatter> LogFormatter::CreateText(web::Response* resp, std::string_view extra_headers) {
-  return std::make_unique<internal::TextLineFormatter>(resp, extra_headers);
+std::unique_ptr<LogFormatter> LogFormatter::CreateText(web::Response* resp, std::string_view extra_headers, web::Encoding encoding) {
+  return std::make_unique<internal::TextLineFormatter>(resp, extra_headers, encoding);
+}
+
+std::unique_ptr<LogFormatter> LogFormatter::CreateText(std::string* buffer) {
+  return std::make_unique<internal::TextLineFormatter>(buffer);
+}
+
+std::unique_ptr<LogFormatter> LogFormatter::CreateRaw(web::Response* resp, std::string_view extra_headers, web::Encoding encoding) {
+  return std::make_unique<internal::RawFormatter>(resp, extra_headers, encoding);
 }
 
-std::unique_ptr<LogFormatter> LogFormatter::CreateRaw(web::Response* resp, std::string_view extra_headers) {
-  return std::make_unique<internal::RawFormatter>(resp, extra_headers);
+std::unique_ptr<LogFormatter> LogFormatter::CreateRaw(std::string* buffer) {
+  return std::make_unique<internal::RawFormatter>(buffer);
+}
+
+std::unique_ptr<LogFormatter> LogFormatter::CreateJson(web::Response* resp, std::string_view extra_headers, web::Encoding encoding) {
+  return std::make_unique<internal::JsonFormatter>(resp, extra_headers, encoding);
+}
+
+std::unique_ptr<LogFormatter> LogFormatter::CreateJson(std::string* buffer) {
+  return std::make_unique<internal::JsonFormatter>(buffer);
+}
+
+std::unique_ptr<LogFormatter> LogFormatter::Create(std::string_view format, std::string* buffer) {
+  if (format == ".html")
+    return CreateHTML(buffer);
+  else if (format == ".txt")
+    return CreateText(buffer);
+  else if (format == ".json")
+    return CreateJson(buffer);
+  else
+    return CreateRaw(buffer);
+}
+
+const char* LogContentType(std::string_view format) {
+  if (format == ".html")
+    return kContentTypeHtml;
+  else if (format == ".json")
+    return kContentTypeJson;
+  else
+    return kContentTypeText;
 }
 
 } // namespace esologs
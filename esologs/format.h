@@ -1,36 +1,112 @@
 #ifndef ESOLOGS_FORMAT_H_
 #define ESOLOGS_FORMAT_H_
 
+#include <cstdint>
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "esologs/config.pb.h"
 #include "esologs/index.h"
 #include "esologs/log.pb.h"
+#include "proto/delim.h"
+#include "web/encoding.h"
 #include "web/request.h"
 #include "web/response.h"
 
 namespace esologs {
 
-void FormatIndex(const web::Request& req, web::Response* resp, const TargetConfig& cfg, const LogIndex& index, int y);
+/** Renders the index page of year \p y (or of all years, if negative) into \p buffer. */
+void FormatIndex(std::string* buffer, const TargetConfig& cfg, const LogIndex& index, int y);
+/** Renders an index page from a copy of the dates of a LogIndex, which can be done without its lock. */
+void FormatIndex(std::string* buffer, const TargetConfig& cfg, const std::vector<YMD>& dates, int y);
+
+struct LogFormatter;
+
+/**
+ * Renders the logs of \p date (a day, or a month if `date.day` is 0) with \p fmt, header to footer.
+ *
+ * \p prev and \p next are the neighbouring pages, for navigation.
+ */
+void FormatLog(LogFormatter* fmt, LogIndex* index, const TargetConfig& cfg, const YMD& date, const std::optional<YMD>& prev, const std::optional<YMD>& next);
 
 void FormatError(web::Response* resp, int code, const char* fmt, ...);
 void FormatErrorWithHeaders(web::Response* resp, int code, std::string_view extra_headers, const char* fmt, ...);
 
+/**
+ * Returns `true` if the line formatters give \p event a line number.
+ *
+ * Most events do; the exceptions are commands (like NAMES) that aren't logged as lines at all.
+ */
+bool IsNumberedLine(const LogEvent& event);
+
+/**
+ * Sets \p text to the text of a message (a `PRIVMSG` or `NOTICE`) as the text format shows it,
+ * without any formatting codes, and \p action to whether it's a CTCP ACTION.
+ *
+ * Returns `false` (leaving \p text unspecified) if \p event isn't a message.
+ */
+bool MessageText(const LogEvent& event, std::string* text, bool* action = nullptr);
+
+struct SearchResults;
+
+/**
+ * Renders a page of search results in \p format (`.html` or `.json`) as the response.
+ *
+ * The HTML page has a search form on top, and is just the form if the query is empty.
+ */
+void FormatSearch(web::Response* resp, std::string_view extra_headers, web::Encoding encoding, std::string_view format, const TargetConfig& cfg, const SearchResults& results);
+
+/** Returns the content type of a log format (one of `.html`, `.txt`, `-raw.txt` or `.json`). */
+const char* LogContentType(std::string_view format);
+
 struct LogFormatter {
-  static std::unique_ptr<LogFormatter> CreateHTML(web::Response* resp, std::string_view extra_headers = std::string_view());
+  static std::unique_ptr<LogFormatter> CreateHTML(web::Response* resp, std::string_view extra_headers = std::string_view(), web::Encoding encoding = web::Encoding::kIdentity);
   static std::unique_ptr<LogFormatter> CreateHTML(std::string* buffer);
-  static std::unique_ptr<LogFormatter> CreateText(web::Response* resp, std::string_view extra_headers = std::string_view());
-  static std::unique_ptr<LogFormatter> CreateRaw(web::Response* resp, std::string_view extra_headers = std::string_view());
+  static std::unique_ptr<LogFormatter> CreateText(web::Response* resp, std::string_view extra_headers = std::string_view(), web::Encoding encoding = web::Encoding::kIdentity);
+  static std::unique_ptr<LogFormatter> CreateText(std::string* buffer);
+  static std::unique_ptr<LogFormatter> CreateRaw(web::Response* resp, std::string_view extra_headers = std::string_view(), web::Encoding encoding = web::Encoding::kIdentity);
+  static std::unique_ptr<LogFormatter> CreateRaw(std::string* buffer);
+  static std::unique_ptr<LogFormatter> CreateJson(web::Response* resp, std::string_view extra_headers = std::string_view(), web::Encoding encoding = web::Encoding::kIdentity);
+  static std::unique_ptr<LogFormatter> CreateJson(std::string* buffer);
+  /** Creates a formatter for a log format (see LogContentType), writing to an external buffer. */
+  static std::unique_ptr<LogFormatter> Create(std::string_view format, std::string* buffer);
 
   virtual void FormatHeader(const YMD& date, const std::optional<YMD>& prev, const std::optional<YMD>& next, const std::string& title) = 0;
   virtual void FormatFooter(const YMD& date, const std::optional<YMD>& prev, const std::optional<YMD>& next) = 0;
   virtual void FormatStalkerHeader(int year, const std::string& title) = 0;
   virtual void FormatStalkerFooter() = 0;
+  /**
+   * Writes the header of a page of lines picked from across the logs, like those of one nick.
+   *
+   * The lines follow as the days of a multi-day page, possibly with elisions between them.
+   */
+  virtual void FormatListHeader(std::string_view heading, const std::string& title) = 0;
+  virtual void FormatListFooter() = 0;
   virtual void FormatDay(bool multiday, int year, int month, int day) = 0;
   virtual void FormatElision() = 0;
   virtual void FormatEvent(const LogEvent& event, const TargetConfig& cfg) = 0;
+  /**
+   * Reads and formats all the remaining events of \p reader.
+   *
+   * Does the same as calling FormatEvent for each event, but the loop runs inside the formatter,
+   * so the whole decode-and-format pipeline of each format gets compiled without virtual calls.
+   */
+  virtual void FormatEvents(proto::DelimReader* reader, const TargetConfig& cfg) = 0;
+
+  /**
+   * Sets the number of the next line (of events without an event ID).
+   *
+   * Line numbers run on across the days of a multi-day page, so a day formatted on its own, to be
+   * stitched into one, must start where the earlier days' lines (see IsNumberedLine) end.
+   */
+  virtual void SetLineNumber(std::uint64_t line) {}
+  /** Writes out \p text, as rendered by another formatter of the same format. */
+  virtual void WriteRendered(std::string_view text) = 0;
+  /** Creates a formatter of the same format, writing to an external buffer. */
+  virtual std::unique_ptr<LogFormatter> CreateSibling(std::string* buffer) const = 0;
 
   virtual ~LogFormatter() = default;
 };
@@ -0,0 +1,194 @@
+// Renders log files through the web formatters, to measure throughput and heap allocations.
+//
+// By default, the events are decoded up front, and only formatting is measured. With
+// --pipeline=loop or --pipeline=fused, each repetition also decodes the files, either reading and
+// formatting one event at a time through the LogFormatter interface, or with FormatEvents.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "base/exc.h"
+#include "esologs/config.pb.h"
+#include "esologs/format.h"
+#include "esologs/log.pb.h"
+#include "proto/brotli.h"
+#include "proto/delim.h"
+#include "web/response.h"
+
+namespace {
+
+std::atomic<std::uint64_t> allocations = 0;
+
+struct NullResponse : public web::Response {
+  std::uint64_t bytes = 0;
+  std::uint64_t writes = 0;
+
+  void Write(const void*, std::size_t size) override {
+    bytes += size;
+    ++writes;
+  }
+
+  void WriteV(const std::string_view* parts, std::size_t count) override {
+    for (std::size_t i = 0; i < count; ++i)
+      bytes += parts[i].size();
+    ++writes;
+  }
+};
+
+std::unique_ptr<esologs::LogFormatter> CreateFormatter(std::string_view format, web::Response* resp) {
+  if (format == "html")
+    return esologs::LogFormatter::CreateHTML(resp);
+  else if (format == "txt")
+    return esologs::LogFormatter::CreateText(resp);
+  else if (format == "json")
+    return esologs::LogFormatter::CreateJson(resp);
+  else
+    return esologs::LogFormatter::CreateRaw(resp);
+}
+
+std::unique_ptr<proto::DelimReader> OpenLog(const char* path) {
+  if (std::string_view(path).ends_with(".pb.br"))
+    return std::make_unique<proto::DelimReader>(base::own(proto::BrotliInputStream::FromFile(path)));
+  else
+    return std::make_unique<proto::DelimReader>(path);
+}
+
+} // unnamed namespace
+
+// All the replaceable forms of new and delete go through malloc/free, so that none of them is
+// mismatched with the library's own.
+
+static void* CountedAlloc(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size) { return CountedAlloc(size); }
+void* operator new[](std::size_t size) { return CountedAlloc(size); }
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  try { return CountedAlloc(size); } catch (const std::bad_alloc&) { return nullptr; }
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  try { return CountedAlloc(size); } catch (const std::bad_alloc&) { return nullptr; }
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+
+int main(int argc, char *argv[]) {
+  std::string_view format = "html";
+  std::string_view pipeline = "format";
+  int reps = 10;
+
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    std::string_view opt(argv[arg]);
+    if (opt.starts_with("--format="))
+      format = opt.substr(9);
+    else if (opt.starts_with("--pipeline="))
+      pipeline = opt.substr(11);
+    else if (opt.starts_with("--reps="))
+      reps = std::atoi(argv[arg] + 7);
+    else
+      arg = argc; // force usage message
+  }
+  if (arg >= argc
+      || (format != "html" && format != "txt" && format != "raw" && format != "json")
+      || (pipeline != "format" && pipeline != "loop" && pipeline != "fused")
+      || reps < 1) {
+    std::fprintf(stderr, "usage: %s [--format=html|txt|raw|json] [--pipeline=format|loop|fused] [--reps=N] log.pb [log.pb ...]\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<const char*> paths(argv + arg, argv + argc);
+  std::vector<esologs::LogEvent> events;
+  for (; arg < argc; arg++) {
+    try {
+      auto reader = OpenLog(argv[arg]);
+      esologs::LogEvent event;
+      while (reader->Read(&event))
+        events.push_back(event);
+    } catch (base::Exception& e) {
+      std::fprintf(stderr, "error reading %s: %s\n", argv[arg], e.what());
+      return 1;
+    }
+  }
+
+  esologs::TargetConfig config;
+  config.set_nick("esolangs");
+  const esologs::YMD date(2021, 1, 1);
+
+  std::uint64_t bytes = 0, writes = 0;
+  std::uint64_t allocs_before = allocations.load();
+  auto start = std::chrono::steady_clock::now();
+
+  for (int rep = 0; rep < reps; rep++) {
+    NullResponse resp;
+    {
+      auto fmt = CreateFormatter(format, &resp);
+      fmt->FormatHeader(date, std::nullopt, std::nullopt, "bench");
+      if (pipeline == "format") {
+        for (const auto& event : events)
+          fmt->FormatEvent(event, config);
+      } else {
+        for (const char* path : paths) {
+          auto reader = OpenLog(path);
+          if (pipeline == "fused") {
+            fmt->FormatEvents(reader.get(), config);
+          } else {
+            esologs::LogEvent event;
+            while (reader->Read(&event))
+              fmt->FormatEvent(event, config);
+          }
+        }
+      }
+      fmt->FormatFooter(date, std::nullopt, std::nullopt);
+    }
+    bytes += resp.bytes;
+    writes += resp.writes;
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::uint64_t allocs = allocations.load() - allocs_before;
+  double lines = double(events.size()) * reps;
+
+  // Once a formatter's buffers have grown to fit, formatting events shouldn't allocate at all.
+  std::uint64_t steady_allocs;
+  {
+    NullResponse resp;
+    auto fmt = CreateFormatter(format, &resp);
+    fmt->FormatHeader(date, std::nullopt, std::nullopt, "bench");
+    for (const auto& event : events)
+      fmt->FormatEvent(event, config);
+    std::uint64_t before = allocations.load();
+    for (const auto& event : events)
+      fmt->FormatEvent(event, config);
+    steady_allocs = allocations.load() - before;
+    fmt->FormatFooter(date, std::nullopt, std::nullopt);
+  }
+
+  std::printf(
+      "%s (%s): %zu events x %d reps in %.3f s\n"
+      "  %.1f MB/s, %.0f events/s, %.1f bytes/write\n"
+      "  %.3f allocations/event (%llu total)\n"
+      "  %llu allocations in steady state\n",
+      std::string(format).c_str(), std::string(pipeline).c_str(), events.size(), reps, elapsed.count(),
+      bytes / elapsed.count() / 1e6, lines / elapsed.count(), writes ? double(bytes) / writes : 0.0,
+      lines ? allocs / lines : 0.0, static_cast<unsigned long long>(allocs),
+      static_cast<unsigned long long>(steady_allocs));
+  return 0;
+}
@@ -0,0 +1,126 @@
+#include <random>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "esologs/config.pb.h"
+#include "esologs/format.h"
+#include "esologs/log.pb.h"
+
+namespace esologs {
+
+namespace {
+
+/** The commands that are logged as lines (or, for NAMES, deliberately not logged). */
+const std::set<std::string> kKnownCommands = {
+  "PRIVMSG", "NOTICE", "JOIN", "PART", "QUIT", "NICK", "CHGHOST", "KICK", "MODE", "TOPIC", "NAMES",
+};
+
+LogEvent MakeEvent(std::string_view command, std::string_view nick = "nick") {
+  LogEvent event;
+  event.set_time_us(3723000000u); // 01:02:03
+  event.set_prefix(std::string(nick) + "!user@host");
+  event.set_command(std::string(command));
+  event.add_args("#channel");
+  event.add_args("text");
+  return event;
+}
+
+std::string FormatText(const LogEvent& event) {
+  TargetConfig cfg;
+  std::string out;
+  LogFormatter::CreateText(&out)->FormatEvent(event, cfg);
+  return out;
+}
+
+/** Returns the highlight class (`hN`) the HTML formatter gives to the nick of a message. */
+std::string NickClass(LogFormatter* fmt, std::string* out, std::string_view nick) {
+  TargetConfig cfg;
+  out->clear();
+  fmt->FormatEvent(MakeEvent("PRIVMSG", nick), cfg);
+  std::size_t start = out->find("class=\"ma ");
+  if (start == std::string::npos)
+    return "";
+  start += 10;
+  return out->substr(start, out->find('"', start) - start);
+}
+
+} // unnamed namespace
+
+TEST(FormatTest, ClassifiesKnownCommands) {
+  static const struct {
+    const char* command;
+    const char* text;
+  } tests[] = {
+    {"PRIVMSG", "01:02:03 <nick> text\n"},
+    {"NOTICE",  "01:02:03 <nick> text\n"},
+    {"JOIN",    "01:02:03 -!- nick has joined.\n"},
+    {"PART",    "01:02:03 -!- nick has left (text).\n"},
+    {"QUIT",    "01:02:03 -!- nick has quit (#channel text).\n"},
+    {"NICK",    "01:02:03 -!- nick has changed nick to #channel text.\n"},
+    {"CHGHOST", "01:02:03 -!- nick has changed hostmask to #channel@text.\n"},
+    {"KICK",    "01:02:03 -!- nick has kicked text.\n"},
+    {"MODE",    "01:02:03 -!- nick has set channel mode: text.\n"},
+    {"TOPIC",   "01:02:03 -!- nick has set topic: text.\n"},
+    {"NAMES",   ""},
+  };
+
+  for (const auto& test : tests) {
+    LogEvent event = MakeEvent(test.command);
+    EXPECT_EQ(test.text, FormatText(event)) << test.command;
+    EXPECT_EQ(*test.text != '\0', IsNumberedLine(event)) << test.command;
+    std::string text;
+    bool is_message = std::string_view(test.command) == "PRIVMSG" || std::string_view(test.command) == "NOTICE";
+    EXPECT_EQ(is_message, MessageText(event, &text)) << test.command;
+  }
+}
+
+// The commands are looked up with a perfect hash, so anything else that lands in the slot of a
+// known command must still be told apart from it.
+TEST(FormatTest, RejectsOtherCommands) {
+  std::vector<std::string> commands = {
+    "", "privmsg", "Privmsg", "PRIVMS", "PRIVMSGG", "NOTICE ", "JOINS", "PAR", "001", "353", "PING", "CAP", "AWAY",
+  };
+  std::mt19937 rng(4044);
+  for (int i = 0; i < 5000; ++i) {
+    std::string cmd(1 + rng() % 8, ' ');
+    for (char& c : cmd)
+      c = 'A' + rng() % 26;
+    commands.push_back(cmd);
+  }
+
+  for (const std::string& cmd : commands) {
+    if (kKnownCommands.count(cmd))
+      continue;
+    LogEvent event = MakeEvent(cmd);
+    EXPECT_EQ("01:02:03 [unexpected log event :(]\n", FormatText(event)) << cmd;
+    EXPECT_TRUE(IsNumberedLine(event)) << cmd;
+    std::string text;
+    EXPECT_FALSE(MessageText(event, &text)) << cmd;
+  }
+}
+
+// The HTML formatter memoizes the highlight classes of nicks in a small table, which must never
+// give a nick a class other than the one it gets in a fresh formatter.
+TEST(FormatTest, MemoizedNickClasses) {
+  std::vector<std::string> nicks;
+  for (int i = 0; i < 300; ++i)
+    nicks.push_back("nick" + std::to_string(i));
+
+  std::string out;
+  auto fmt = LogFormatter::CreateHTML(&out);
+  for (int round = 0; round < 3; ++round) {
+    for (const std::string& nick : nicks) {
+      std::string fresh_out;
+      auto fresh = LogFormatter::CreateHTML(&fresh_out);
+      std::string expected = NickClass(fresh.get(), &fresh_out, nick);
+      ASSERT_FALSE(expected.empty()) << nick;
+      EXPECT_EQ(expected, NickClass(fmt.get(), &out, nick)) << nick;
+    }
+  }
+}
+
+} // namespace esologs
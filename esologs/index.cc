@@ -11,20 +11,15 @@ namespace esologs {
 
 namespace fs = std::filesystem;
 
-namespace {
-
-constexpr std::chrono::steady_clock::duration kRescanInterval = std::chrono::seconds(30);
-
-} // unnamed namespace
-
 void LogIndex::Refresh() {
-  if (std::chrono::steady_clock::now() - last_scan_ >= kRescanInterval)
+  if (std::chrono::steady_clock::now() - last_scan_ >= rescan_interval_)
     Scan();
 }
 
 void LogIndex::Scan(bool full) {
   last_scan_ = std::chrono::steady_clock::now();
 
+  std::size_t old_size = dates_.size();
   if (full)
     dates_.clear();
 
@@ -87,6 +82,10 @@ void LogIndex::Scan(bool full) {
         dates_.emplace_back(year, month, day);
     }
   }
+
+  // Scans only ever add dates, so the size tells if anything changed.
+  if (dates_.size() != old_size)
+    ++generation_;
 }
 
 bool LogIndex::Lookup(const YMD& date, std::optional<YMD>* prev, std::optional<YMD>* next) const noexcept {
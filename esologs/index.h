@@ -1,7 +1,9 @@
 #ifndef ESOLOGS_INDEX_H_
 #define ESOLOGS_INDEX_H_
 
+#include <algorithm>
 #include <chrono>
+#include <cstdint>
 #include <filesystem>
 #include <mutex>
 #include <optional>
@@ -79,15 +81,24 @@ struct FileInfo {
 class LogIndex {
  public:
 
-  LogIndex(const std::string& root) : root_(root) {
+  /** How often Refresh looks for new days, unless told otherwise. */
+  static constexpr std::chrono::steady_clock::duration kDefaultRescanInterval = std::chrono::seconds(30);
+
+  LogIndex(const std::string& root, std::chrono::steady_clock::duration rescan_interval = kDefaultRescanInterval)
+      : root_(root), rescan_interval_(rescan_interval)
+  {
     Scan(/* full: */ true);
   }
 
   void Refresh();
 
   template <typename F>
-  void For(int y, F f) const {
-    for (auto it = dates_.rbegin(); it != dates_.rend(); ++it) {
+  void For(int y, F f) const { For(dates_, y, f); }
+
+  /** Calls `f(y, m, d)` for each date of year \p y in \p dates (a copy of dates()), newest first. */
+  template <typename F>
+  static void For(const std::vector<YMD>& dates, int y, F f) {
+    for (auto it = dates.rbegin(); it != dates.rend(); ++it) {
       if (it->year > y)
         continue;
       else if (it->year < y)
@@ -96,6 +107,13 @@ class LogIndex {
     }
   }
 
+  /** Calls `f(y, m, d)` for each date with logs from \p from to \p to (inclusive), oldest first. */
+  template <typename F>
+  void ForRange(const YMD& from, const YMD& to, F f) const {
+    for (auto it = std::lower_bound(dates_.begin(), dates_.end(), from); it != dates_.end() && *it <= to; ++it)
+      f(it->year, it->month, it->day);
+  }
+
   bool Lookup(const YMD& date, std::optional<YMD>* prev = nullptr, std::optional<YMD>* next = nullptr) const noexcept;
 
   bool Stat(const YMD& date, FileInfo* info);
@@ -104,6 +122,14 @@ class LogIndex {
 
   std::mutex* lock() { return &lock_; }
 
+  /**
+   * Returns a number that changes whenever the set of dates in the index does.
+   *
+   * Anything derived only from the dates (like the index pages) stays valid for as long as the
+   * generation stays the same. Generations are only meaningful within a single process.
+   */
+  std::uint64_t generation() const noexcept { return generation_; }
+
   int default_year() const noexcept {
     if (dates_.empty())
       return 2002;  // arbitrary
@@ -111,17 +137,28 @@ class LogIndex {
       return dates_.back().year;
   }
 
-  std::pair<int, int> bounds() const noexcept {
-    if (dates_.empty())
+  std::pair<int, int> bounds() const noexcept { return bounds(dates_); }
+
+  /** Returns the first and last year of \p dates (a copy of dates()). */
+  static std::pair<int, int> bounds(const std::vector<YMD>& dates) noexcept {
+    if (dates.empty())
       return std::pair(2002, 2002);
     else
-      return std::pair(dates_.front().year, dates_.back().year);
+      return std::pair(dates.front().year, dates.back().year);
   }
 
+  /**
+   * Returns all the dates with logs, oldest first. Needs the lock, but a copy can be used without
+   * it, e.g. to render an index page.
+   */
+  const std::vector<YMD>& dates() const noexcept { return dates_; }
+
  private:
   const std::string root_;
+  const std::chrono::steady_clock::duration rescan_interval_;
   std::vector<YMD> dates_;
   std::chrono::steady_clock::time_point last_scan_;
+  std::uint64_t generation_ = 0;
 
   std::mutex lock_;
 
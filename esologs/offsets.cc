@@ -0,0 +1,88 @@
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "esologs/format.h"
+#include "esologs/log.pb.h"
+#include "esologs/offsets.h"
+
+namespace esologs {
+
+std::size_t LineOffsets::Render(
+    LogIndex* index, const TargetConfig& cfg, const YMD& date, std::string_view format,
+    const web::RangeSpec& spec, std::optional<web::ByteRange>* range, std::string* body) {
+  std::lock_guard<std::mutex> lock(lock_);
+  Day* day = format == ".txt" ? &text_ : &raw_;
+
+  if (!Update(index, cfg, date, format, day))
+    return 0;
+  std::size_t size = day->ends.empty() ? 0 : day->ends.back();
+
+  *range = web::ResolveRange(spec, size);
+  if (!*range)
+    return size;
+
+  // events [first_event, last_event] overlap the range
+  const auto& ends = day->ends;
+  std::size_t first_event = std::upper_bound(ends.begin(), ends.end(), (*range)->first) - ends.begin();
+  std::size_t last_event = std::upper_bound(ends.begin(), ends.end(), (*range)->last) - ends.begin();
+  std::size_t start = first_event > 0 ? ends[first_event - 1] : 0;
+
+  auto reader = index->Open(date.year, date.month, date.day);
+  if (!reader) {
+    *range = std::nullopt;
+    return 0;
+  }
+
+  std::string rendered;
+  {
+    auto fmt = LogFormatter::Create(format, &rendered);
+    fmt->FormatDay(false, date.year, date.month, date.day);
+    // Events before the range are only skipped over, not parsed.
+    std::size_t i = 0;
+    for (; i < first_event && reader->Skip(); ++i) {}
+    LogEvent event;
+    for (; i <= last_event && reader->Read(&event); ++i)
+      fmt->FormatEvent(event, cfg);
+  }
+
+  body->assign(rendered, (*range)->first - start, (*range)->size());
+  return size;
+}
+
+bool LineOffsets::Update(LogIndex* index, const TargetConfig& cfg, const YMD& date, std::string_view format, Day* day) {
+  if (day->date != date) {
+    day->date = date;
+    day->ends.clear();
+  }
+
+  auto reader = index->Open(date.year, date.month, date.day);
+  if (!reader)
+    return false;
+
+  std::string rendered;
+  auto fmt = LogFormatter::Create(format, &rendered);
+  fmt->FormatDay(false, date.year, date.month, date.day);
+
+  // Events that already have offsets are only skipped over; just the new ones are parsed.
+  std::size_t count = 0;
+  while (count < day->ends.size() && reader->Skip())
+    ++count;
+
+  if (count < day->ends.size()) {
+    // The file got shorter, so it's not the one the offsets were computed for.
+    day->ends.clear();
+    return Update(index, cfg, date, format, day);
+  }
+
+  LogEvent event;
+  while (reader->Read(&event)) {
+    rendered.clear();
+    fmt->FormatEvent(event, cfg);
+    day->ends.push_back((day->ends.empty() ? 0 : day->ends.back()) + rendered.size());
+  }
+  return true;
+}
+
+} // namespace esologs
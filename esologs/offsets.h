@@ -0,0 +1,61 @@
+#ifndef ESOLOGS_OFFSETS_H_
+#define ESOLOGS_OFFSETS_H_
+
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "esologs/config.pb.h"
+#include "esologs/index.h"
+#include "web/range.h"
+
+namespace esologs {
+
+/**
+ * Byte offsets of the events in the text and raw renderings of a day that's still being logged.
+ *
+ * Both formats render each event on its own, without a header or a footer, so the rendering of a
+ * growing day only ever grows at the end. Knowing where each event's rendering ends lets a byte
+ * range be served by formatting just the events that overlap it: an incremental mirror asking for
+ * everything past the length it already has only costs the new lines.
+ *
+ * Offsets are kept for the most recently requested day in each format, and extended (formatting
+ * each new event once) whenever the day is requested again.
+ */
+class LineOffsets {
+ public:
+  /**
+   * Renders a byte range of a day in the `.txt` or `-raw.txt` format.
+   *
+   * Returns the full size of the rendering. If the range is satisfiable, its bytes are stored in
+   * \p body, and the resolved range in \p range; otherwise \p range is left empty.
+   */
+  std::size_t Render(
+      LogIndex* index, const TargetConfig& cfg, const YMD& date, std::string_view format,
+      const web::RangeSpec& spec, std::optional<web::ByteRange>* range, std::string* body);
+
+ private:
+  struct Day {
+    YMD date{0};
+    /** End offset of the rendering of each event so far. */
+    std::vector<std::size_t> ends;
+  };
+
+  Day text_;
+  Day raw_;
+  std::mutex lock_;
+
+  /** Brings the offsets of \p day up to date with the logfile. Returns false if there's no file. */
+  bool Update(LogIndex* index, const TargetConfig& cfg, const YMD& date, std::string_view format, Day* day);
+};
+
+} // namespace esologs
+
+#endif // ESOLOGS_OFFSETS_H_
+
+// Local Variables:
+// mode: c++
+// End:
@@ -0,0 +1,140 @@
+#include "esologs/scan.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define ESOLOGS_SCAN_X86 1
+#endif
+
+namespace esologs {
+
+namespace {
+
+using FindFunction = const char* (*)(const char*, const char*) noexcept;
+
+/** Which bytes a search is looking for, on top of the IRC control codes. */
+enum class Special { kControl, kHtml, kJson };
+
+template <Special kSet>
+inline bool IsSpecial(char c) noexcept {
+  unsigned char v = c;
+  if (kSet == Special::kHtml)
+    return v < 0x20 || v == '<' || v == '>' || v == '&';
+  if (kSet == Special::kJson)
+    return v < 0x20 || v == '"' || v == '\\' || v >= 0x80;
+  return v < 0x20;
+}
+
+template <Special kSet>
+const char* FindScalar(const char* p, const char* end) noexcept {
+  while (p < end && !IsSpecial<kSet>(*p))
+    ++p;
+  return p;
+}
+
+#if ESOLOGS_SCAN_X86
+
+// The vector versions check whole blocks, and finish off with one last block aligned to the end
+// of the input (overlapping already checked bytes, which are known not to match) instead of going
+// byte by byte. Inputs shorter than a block are left to the next narrower version.
+
+template <Special kSet>
+inline unsigned SpecialMask(__m128i v) noexcept {
+  // there's no unsigned compare, but v <= 0x1f exactly when min(v, 0x1f) == v
+  __m128i m = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v);
+  if (kSet == Special::kHtml) {
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+  } else if (kSet == Special::kJson) {
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    m = _mm_or_si128(m, v); // bytes from 0x80 up have their top bit set, which is all movemask looks at
+  }
+  return static_cast<unsigned>(_mm_movemask_epi8(m));
+}
+
+template <Special kSet>
+const char* FindSse2(const char* p, const char* end) noexcept {
+  constexpr int kBlock = 16;
+  if (end - p < kBlock)
+    return FindScalar<kSet>(p, end);
+
+  for (; end - p >= kBlock; p += kBlock) {
+    if (unsigned mask = SpecialMask<kSet>(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))); mask)
+      return p + __builtin_ctz(mask);
+  }
+  if (p == end)
+    return end;
+  const char* last = end - kBlock;
+  if (unsigned mask = SpecialMask<kSet>(_mm_loadu_si128(reinterpret_cast<const __m128i*>(last))); mask)
+    return last + __builtin_ctz(mask);
+  return end;
+}
+
+template <Special kSet>
+__attribute__((target("avx2")))
+inline unsigned SpecialMask(__m256i v) noexcept {
+  __m256i m = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v);
+  if (kSet == Special::kHtml) {
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+  } else if (kSet == Special::kJson) {
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+    m = _mm256_or_si256(m, v);
+  }
+  return static_cast<unsigned>(_mm256_movemask_epi8(m));
+}
+
+template <Special kSet>
+__attribute__((target("avx2")))
+const char* FindAvx2(const char* p, const char* end) noexcept {
+  constexpr int kBlock = 32;
+  if (end - p < kBlock)
+    return FindSse2<kSet>(p, end);
+
+  for (; end - p >= kBlock; p += kBlock) {
+    if (unsigned mask = SpecialMask<kSet>(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))); mask)
+      return p + __builtin_ctz(mask);
+  }
+  if (p == end)
+    return end;
+  const char* last = end - kBlock;
+  if (unsigned mask = SpecialMask<kSet>(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(last))); mask)
+    return last + __builtin_ctz(mask);
+  return end;
+}
+
+#endif // ESOLOGS_SCAN_X86
+
+template <Special kSet>
+FindFunction SelectFind() noexcept {
+#if ESOLOGS_SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return FindAvx2<kSet>;
+  return FindSse2<kSet>; // SSE2 is part of the x86-64 baseline
+#else
+  return FindScalar<kSet>;
+#endif
+}
+
+} // unnamed namespace
+
+const char* FindHtmlSpecial(const char* begin, const char* end) noexcept {
+  static const FindFunction find = SelectFind<Special::kHtml>();
+  return find(begin, end);
+}
+
+const char* FindControl(const char* begin, const char* end) noexcept {
+  static const FindFunction find = SelectFind<Special::kControl>();
+  return find(begin, end);
+}
+
+const char* FindJsonSpecial(const char* begin, const char* end) noexcept {
+  static const FindFunction find = SelectFind<Special::kJson>();
+  return find(begin, end);
+}
+
+} // namespace esologs
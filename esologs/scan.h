@@ -0,0 +1,30 @@
+#ifndef ESOLOGS_SCAN_H_
+#define ESOLOGS_SCAN_H_
+
+namespace esologs {
+
+/**
+ * Returns a pointer to the first byte in [\p begin, \p end) that's an IRC control code (below
+ * 0x20) or one of `<`, `>` and `&`, or \p end if there isn't one.
+ *
+ * These are the bytes HtmlEscape needs to do something about; everything in between can be copied
+ * as is. The search is vectorized (using AVX2 or SSE2, picked at runtime) where available.
+ */
+const char* FindHtmlSpecial(const char* begin, const char* end) noexcept;
+
+/** Like FindHtmlSpecial, but only looks for IRC control codes, for UnFormat. */
+const char* FindControl(const char* begin, const char* end) noexcept;
+
+/**
+ * Like FindHtmlSpecial, but for JsonEscape: looks for control codes, `"`, `\\` and any bytes
+ * outside ASCII (which need to be checked for being valid UTF-8).
+ */
+const char* FindJsonSpecial(const char* begin, const char* end) noexcept;
+
+} // namespace esologs
+
+#endif // ESOLOGS_SCAN_H_
+
+// Local Variables:
+// mode: c++
+// End:
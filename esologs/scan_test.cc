@@ -0,0 +1,62 @@
+#include <random>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "esologs/scan.h"
+
+namespace esologs {
+
+namespace {
+
+const char* FindReference(const char* p, const char* end, bool (*special)(unsigned char)) {
+  while (p < end && !special(static_cast<unsigned char>(*p)))
+    ++p;
+  return p;
+}
+
+bool IsHtmlSpecial(unsigned char c) { return c < 0x20 || c == '<' || c == '>' || c == '&'; }
+bool IsControl(unsigned char c) { return c < 0x20; }
+bool IsJsonSpecial(unsigned char c) { return c < 0x20 || c == '"' || c == '\\' || c >= 0x80; }
+
+} // unnamed namespace
+
+// The vectorized searches go by blocks of 16 or 32 bytes, with special cases for what's left over
+// at the end, so they're checked against a plain loop for all sorts of lengths and alignments.
+TEST(ScanTest, MatchesScalarSearch) {
+  // mostly ordinary text, with the occasional byte that each of the searches looks for
+  static const std::string kRare = std::string("<>&\"\\\x01\x02\x0f\x1f\x7f\x80\xc3\xff", 13);
+  std::mt19937 rng(12345);
+
+  std::string buffer(256 + 64, ' ');
+  for (int iter = 0; iter < 20000; ++iter) {
+    std::size_t offset = rng() % 64;
+    std::size_t size = rng() % 257;
+    unsigned rare_odds = 1 + rng() % 200;
+    for (std::size_t i = 0; i < size; ++i)
+      buffer[offset + i] = rng() % rare_odds == 0 ? kRare[rng() % kRare.size()] : static_cast<char>(' ' + rng() % 95);
+
+    const char* begin = buffer.data() + offset;
+    const char* end = begin + size;
+    ASSERT_EQ(FindReference(begin, end, IsHtmlSpecial) - begin, FindHtmlSpecial(begin, end) - begin) << "size " << size;
+    ASSERT_EQ(FindReference(begin, end, IsControl) - begin, FindControl(begin, end) - begin) << "size " << size;
+    ASSERT_EQ(FindReference(begin, end, IsJsonSpecial) - begin, FindJsonSpecial(begin, end) - begin) << "size " << size;
+  }
+}
+
+TEST(ScanTest, EveryPosition) {
+  // a single special byte at each position, in each of the sizes around the block boundaries
+  for (std::size_t size : {1, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65, 100}) {
+    for (std::size_t pos = 0; pos <= size; ++pos) {
+      std::string text(size, 'x');
+      if (pos < size)
+        text[pos] = '<';
+      const char* begin = text.data();
+      const char* end = begin + size;
+      EXPECT_EQ(begin + pos, FindHtmlSpecial(begin, end)) << "size " << size;
+      EXPECT_EQ(end, FindControl(begin, end)) << "size " << size;
+    }
+  }
+}
+
+} // namespace esologs
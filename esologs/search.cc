@@ -0,0 +1,829 @@
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+
+#include "base/log.h"
+#include "esologs/format.h"
+#include "esologs/search.h"
+#include "esologs/search.pb.h"
+#include "proto/delim.h"
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+}
+
+namespace esologs {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+/** Version of the indexing rules (what text is indexed, and how). Bump to rebuild all indices. */
+constexpr std::uint32_t kIndexVersion = 1;
+/** Version of the nick indexing rules (which lines are indexed, and how). */
+constexpr std::uint32_t kNickIndexVersion = 1;
+
+/**
+ * Most events to skip over when reading the lines of a nick from a logfile, before seeking instead.
+ *
+ * Skipping only needs the length prefixes, but a seek discards the read buffer.
+ */
+constexpr std::uint32_t kMaxSkip = 64;
+
+void Lowercase(std::string* text) {
+  for (char& c : *text) {
+    if (c >= 'A' && c <= 'Z')
+      c += 'a' - 'A';
+  }
+}
+
+/** Appends the distinct trigrams of \p text to \p trigrams, keeping them sorted. */
+void AddTrigrams(std::string_view text, std::vector<std::uint32_t>* trigrams) {
+  for (std::size_t i = 0; i + 3 <= text.size(); ++i) {
+    trigrams->push_back(
+        std::uint32_t{static_cast<unsigned char>(text[i])} << 16
+        | std::uint32_t{static_cast<unsigned char>(text[i+1])} << 8
+        | std::uint32_t{static_cast<unsigned char>(text[i+2])});
+  }
+  std::sort(trigrams->begin(), trigrams->end());
+  trigrams->erase(std::unique(trigrams->begin(), trigrams->end()), trigrams->end());
+}
+
+void AppendVarint(std::uint64_t v, std::string* out) {
+  while (v >= 0x80) {
+    out->push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  out->push_back(static_cast<char>(v));
+}
+
+/** Decodes a list of delta-coded varints (as written by AppendVarint) into the running sums. */
+std::vector<std::int64_t> DecodeDays(std::string_view deltas) {
+  std::vector<std::int64_t> days;
+  std::int64_t day = 0;
+  std::uint64_t v = 0;
+  int shift = 0;
+  for (char c : deltas) {
+    v |= std::uint64_t{static_cast<unsigned char>(c) & 0x7fu} << shift;
+    shift += 7;
+    if (!(c & 0x80)) {
+      day += v;
+      days.push_back(day);
+      v = 0;
+      shift = 0;
+    }
+  }
+  return days;
+}
+
+/** Intersects sorted lists into the first one, shortest first, to keep the intermediate ones small. */
+template <typename T>
+std::vector<T> Intersect(std::vector<std::vector<T>> lists) {
+  if (lists.empty())
+    return {};
+  std::sort(lists.begin(), lists.end(), [](const auto& a, const auto& b) { return a.size() < b.size(); });
+  std::vector<T> result = std::move(lists[0]);
+  std::vector<T> scratch;
+  for (std::size_t i = 1; i < lists.size() && !result.empty(); ++i) {
+    scratch.clear();
+    std::set_intersection(result.begin(), result.end(), lists[i].begin(), lists[i].end(), std::back_inserter(scratch));
+    result.swap(scratch);
+  }
+  return result;
+}
+
+bool IsWordByte(char c) {
+  unsigned char v = c;
+  return (v >= 'a' && v <= 'z') || (v >= '0' && v <= '9') || v == '_' || v >= 0x80;
+}
+
+/**
+ * Returns how well \p text (lowercased) matches \p terms, or 0 if it doesn't contain all of them.
+ *
+ * Each term scores 2 if it appears as a whole word (or phrase), and 1 if only as a part of one.
+ */
+int Score(std::string_view text, const std::vector<std::string>& terms) {
+  int score = 0;
+  for (const std::string& term : terms) {
+    int best = 0;
+    for (std::size_t pos = text.find(term); pos != std::string_view::npos && best < 2; pos = text.find(term, pos + 1)) {
+      std::size_t end = pos + term.size();
+      bool word = (pos == 0 || !IsWordByte(text[pos - 1])) && (end == text.size() || !IsWordByte(text[end]));
+      best = word ? 2 : 1;
+    }
+    if (!best)
+      return 0;
+    score += best;
+  }
+  return score;
+}
+
+/** Returns the nick that sent \p event, or an empty string if it didn't come from a user. */
+std::string_view Sender(const LogEvent& event, const TargetConfig& cfg) {
+  if (event.direction() == LogEvent::SENT)
+    return cfg.nick();
+  std::string_view prefix = event.prefix();
+  std::size_t sep = prefix.find('!');
+  if (sep > 0 && sep != std::string_view::npos)
+    return prefix.substr(0, sep);
+  return std::string_view();
+}
+
+std::string_view Nick(const LogEvent& event, const TargetConfig& cfg) {
+  std::string_view nick = Sender(event, cfg);
+  return nick.empty() ? "?unknown?" : nick;
+}
+
+std::int64_t DayNumber(const YMD& date) {
+  return std::chrono::duration_cast<date::days>(date.time().time_since_epoch()).count();
+}
+
+template <typename Index>
+bool WriteIndex(const fs::path& path, const Index& idx) {
+  fs::path tmp = path;
+  tmp += ".tmp";
+  std::error_code ec;
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if (!out || !idx.SerializeToOstream(&out) || !out.flush()) {
+      fs::remove(tmp, ec);
+      return false;
+    }
+  }
+  fs::rename(tmp, path, ec);
+  return !ec;
+}
+
+} // unnamed namespace
+
+std::vector<std::string> SearchTerms(std::string_view query) {
+  std::vector<std::string> terms;
+  std::size_t pos = 0;
+  while (pos < query.size()) {
+    if (query[pos] == ' ' || query[pos] == '\t') {
+      ++pos;
+      continue;
+    }
+    std::string_view term;
+    if (query[pos] == '"') {
+      std::size_t end = std::min(query.find('"', pos + 1), query.size());
+      term = query.substr(pos + 1, end - pos - 1);
+      pos = end + 1;
+    } else {
+      std::size_t end = std::min(query.find_first_of(" \t\"", pos), query.size());
+      term = query.substr(pos, end - pos);
+      pos = end;
+    }
+    if (term.empty())
+      continue;
+    std::string lower(term);
+    Lowercase(&lower);
+    if (std::find(terms.begin(), terms.end(), lower) == terms.end())
+      terms.push_back(std::move(lower));
+  }
+  return terms;
+}
+
+std::string NickKey(std::string_view nick) {
+  std::string key(nick);
+  for (char& c : key) {
+    if (c >= 'A' && c <= '^')
+      c += 'a' - 'A'; // also maps []\^ to {}|~
+  }
+  return key;
+}
+
+SearchIndex::SearchIndex(LogIndex* index, const TargetConfig& cfg)
+    : index_(index), config_(cfg), root_(cfg.log_path())
+{}
+
+SearchIndex::~SearchIndex() {
+  stopping_ = true;
+  if (builder_.joinable())
+    builder_.join();
+}
+
+void SearchIndex::Start() {
+  builder_ = std::thread([this]() {
+      auto start = std::chrono::steady_clock::now();
+      try {
+        Update();
+      } catch (const std::exception& e) {
+        LOG(ERROR) << "search: " << config_.name() << ": indexing failed: " << e.what();
+      }
+      if (stopping_)
+        return;
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      LOG(INFO) << "search: " << config_.name() << ": index ready in " << elapsed.count() << "s";
+      ready_ = true;
+    });
+}
+
+void SearchIndex::Add(const LogEvent& event) {
+  std::int64_t n = event.event_id().day();
+  std::uint64_t line = event.event_id().line();
+
+  std::lock_guard<std::mutex> lock(lock_);
+  if (n <= frozen_through_)
+    return;
+  LiveDay& day = live_[n];
+  day.piped = true;
+  if (line < day.events)
+    return; // already read from the logfile
+  if (line > day.events) {
+    day.pending.emplace(line, event);
+    return;
+  }
+  IndexLive(&day, event);
+  IndexPending(&day);
+}
+
+void SearchIndex::IndexLive(LiveDay* day, const LogEvent& event) {
+  std::uint32_t line = day->events++;
+  std::string text;
+  if (!MessageText(event, &text))
+    return;
+  Lowercase(&text);
+  std::vector<std::uint32_t> trigrams;
+  AddTrigrams(text, &trigrams);
+  for (std::uint32_t t : trigrams)
+    day->postings[t].push_back(line);
+}
+
+void SearchIndex::IndexPending(LiveDay* day) {
+  while (!day->pending.empty() && day->pending.begin()->first <= day->events) {
+    auto next = day->pending.begin();
+    if (next->first == day->events)
+      IndexLive(day, next->second);
+    day->pending.erase(next);
+  }
+}
+
+void SearchIndex::Update() {
+  std::lock_guard<std::mutex> update_lock(update_lock_);
+
+  std::int64_t from;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    from = frozen_through_ + 1;
+  }
+
+  std::vector<std::pair<YMD, bool>> days; // date, frozen
+  {
+    std::lock_guard<std::mutex> lock(*index_->lock());
+    index_->Refresh();
+    index_->ForRange(YMD(YMD::day_number, from), YMD(9999, 12, 31), [this, &days](int y, int m, int d) {
+        YMD date(y, m, d);
+        FileInfo info;
+        days.emplace_back(date, index_->Stat(date, &info) && info.frozen);
+      });
+  }
+
+  for (const auto& [date, frozen] : days) {
+    if (stopping_)
+      return;
+    if (!frozen) {
+      CatchUp(date);
+      continue;
+    }
+
+    DayIndex idx;
+    bool stored = LoadDay(date, &idx);
+    std::int64_t n = DayNumber(date);
+
+    std::lock_guard<std::mutex> lock(lock_);
+    std::uint32_t t = 0;
+    for (std::uint32_t delta : idx.trigram_deltas()) {
+      t += delta;
+      DayList& list = days_[t];
+      AppendVarint(n - list.last, &list.deltas);
+      list.last = n;
+    }
+    if (!stored)
+      unsaved_.emplace(n, idx.SerializeAsString());
+    frozen_through_ = n;
+    live_.erase(live_.begin(), live_.upper_bound(n));
+  }
+}
+
+bool SearchIndex::LoadDay(const YMD& date, DayIndex* idx) {
+  fs::path path = IndexFile(date);
+  {
+    std::ifstream in(path, std::ios::binary);
+    if (in && idx->ParseFromIstream(&in) && idx->version() == kIndexVersion)
+      return true;
+  }
+
+  idx->Clear();
+  try {
+    BuildDay(date, idx);
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "search: failed to index " << path << ": " << e.what();
+    idx->Clear();
+    return true; // nothing to store
+  }
+  if (!WriteIndex(path, *idx)) {
+    LOG(WARNING) << "search: failed to write " << path << ", keeping it in memory";
+    return false;
+  }
+  return true;
+}
+
+void SearchIndex::BuildDay(const YMD& date, DayIndex* idx) {
+  idx->set_version(kIndexVersion);
+  auto reader = index_->Open(date.year, date.month, date.day);
+  if (!reader)
+    return;
+
+  std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> postings;
+  LogEvent event;
+  std::string text;
+  std::vector<std::uint32_t> trigrams;
+  for (std::uint32_t i = 0; reader->Read(&event); ++i) {
+    if (!MessageText(event, &text))
+      continue;
+    Lowercase(&text);
+    trigrams.clear();
+    AddTrigrams(text, &trigrams);
+    for (std::uint32_t t : trigrams)
+      postings[t].push_back(i);
+  }
+
+  std::vector<std::uint32_t> keys;
+  keys.reserve(postings.size());
+  for (const auto& [t, events] : postings)
+    keys.push_back(t);
+  std::sort(keys.begin(), keys.end());
+
+  std::uint32_t prev_t = 0;
+  for (std::uint32_t t : keys) {
+    const std::vector<std::uint32_t>& events = postings[t];
+    idx->add_trigram_deltas(t - prev_t);
+    idx->add_counts(events.size());
+    std::uint32_t prev_e = 0;
+    for (std::uint32_t e : events) {
+      idx->add_event_deltas(e - prev_e);
+      prev_e = e;
+    }
+    prev_t = t;
+  }
+}
+
+void SearchIndex::CatchUp(const YMD& date) {
+  // Normally a live day is kept up to date by the pipe, and the logfile only needs reading when
+  // there's a gap: events logged before the server started, or missed while the pipe was down.
+  std::int64_t n = DayNumber(date);
+  std::uint64_t from;
+  std::uintmax_t known_size;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    LiveDay& day = live_[n];
+    if (day.piped && day.pending.empty())
+      return;
+    from = day.events;
+    known_size = day.file_size;
+  }
+
+  fs::path logfile = root_ / std::to_string(date.year) / std::to_string(date.month) / (std::to_string(date.day) + ".pb");
+  std::error_code ec;
+  std::uintmax_t size = fs::file_size(logfile, ec);
+  if (ec || size == known_size)
+    return;
+  auto reader = index_->Open(date.year, date.month, date.day);
+  if (!reader)
+    return;
+
+  std::vector<LogEvent> events;
+  LogEvent event;
+  for (std::uint64_t i = 0; reader->Read(&event); ++i) {
+    if (i >= from)
+      events.push_back(event);
+  }
+
+  std::lock_guard<std::mutex> lock(lock_);
+  LiveDay& day = live_[n];
+  for (std::size_t i = 0; i < events.size(); ++i) {
+    if (from + i == day.events)
+      IndexLive(&day, events[i]);
+  }
+  IndexPending(&day);
+  day.file_size = size;
+}
+
+void SearchIndex::Search(const std::vector<std::string>& terms, unsigned page, SearchResults* results) {
+  Update();
+
+  std::vector<std::uint32_t> trigrams;
+  for (const std::string& term : terms)
+    AddTrigrams(term, &trigrams);
+
+  std::vector<SearchMatch> matches;
+  for (Candidates& candidates : Lookup(trigrams)) {
+    if (matches.size() >= kMaxMatches) {
+      results->truncated = true;
+      break;
+    }
+    if (candidates.events.empty())
+      candidates.events = LookupDay(candidates.day, trigrams);
+    Verify(candidates, terms, &matches);
+  }
+
+  std::sort(matches.begin(), matches.end(), [](const SearchMatch& a, const SearchMatch& b) {
+      if (a.score != b.score)
+        return a.score > b.score;
+      if (a.date != b.date)
+        return a.date > b.date;
+      return a.line > b.line;
+    });
+
+  results->total = matches.size();
+  results->pages = (matches.size() + kPageSize - 1) / kPageSize;
+  results->page = std::clamp(page, 1u, std::max(results->pages, 1u));
+  std::size_t first = (results->page - 1) * kPageSize;
+  std::size_t last = std::min(first + kPageSize, matches.size());
+  results->matches.assign(std::make_move_iterator(matches.begin() + first), std::make_move_iterator(matches.begin() + last));
+}
+
+std::vector<SearchIndex::Candidates> SearchIndex::Lookup(const std::vector<std::uint32_t>& trigrams) {
+  std::vector<Candidates> candidates;
+  std::vector<std::int64_t> frozen;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+
+    for (auto day = live_.rbegin(); day != live_.rend(); ++day) {
+      std::vector<std::vector<std::uint32_t>> lists;
+      for (std::uint32_t t : trigrams) {
+        auto list = day->second.postings.find(t);
+        if (list == day->second.postings.end())
+          break;
+        lists.push_back(list->second);
+      }
+      if (lists.size() != trigrams.size())
+        continue;
+      std::vector<std::uint32_t> events = Intersect(std::move(lists));
+      if (!events.empty())
+        candidates.push_back(Candidates{day->first, std::move(events)});
+    }
+
+    std::vector<std::vector<std::int64_t>> lists;
+    for (std::uint32_t t : trigrams) {
+      auto list = days_.find(t);
+      if (list == days_.end())
+        break;
+      lists.push_back(DecodeDays(list->second.deltas));
+    }
+    if (lists.size() == trigrams.size())
+      frozen = Intersect(std::move(lists));
+  }
+
+  // The events of frozen days are looked up from their index files as they're needed.
+  for (auto day = frozen.rbegin(); day != frozen.rend(); ++day)
+    candidates.push_back(Candidates{*day, {}});
+  return candidates;
+}
+
+std::vector<std::uint32_t> SearchIndex::LookupDay(std::int64_t day, const std::vector<std::uint32_t>& trigrams) {
+  DayIndex idx;
+  bool parsed = false;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (auto unsaved = unsaved_.find(day); unsaved != unsaved_.end())
+      parsed = idx.ParseFromString(unsaved->second);
+  }
+  if (!parsed) {
+    std::ifstream in(IndexFile(YMD(YMD::day_number, day)), std::ios::binary);
+    if (!in || !idx.ParseFromIstream(&in))
+      return {};
+  }
+  if (idx.counts_size() != idx.trigram_deltas_size())
+    return {};
+
+  // Both the trigrams of the index and the looked up ones are sorted, so they can be merged.
+  std::vector<std::vector<std::uint32_t>> lists;
+  auto want = trigrams.begin();
+  std::uint32_t t = 0;
+  std::size_t offset = 0;
+  for (int i = 0; i < idx.trigram_deltas_size() && want != trigrams.end(); ++i) {
+    t += idx.trigram_deltas(i);
+    std::size_t count = idx.counts(i);
+    if (offset + count > static_cast<std::size_t>(idx.event_deltas_size()))
+      return {};
+    if (*want < t)
+      return {}; // a trigram that's not in the index
+    if (*want == t) {
+      std::vector<std::uint32_t>& events = lists.emplace_back();
+      std::uint32_t e = 0;
+      for (std::size_t j = offset; j < offset + count; ++j)
+        events.push_back(e += idx.event_deltas(j));
+      ++want;
+    }
+    offset += count;
+  }
+  if (want != trigrams.end())
+    return {};
+  return Intersect(std::move(lists));
+}
+
+void SearchIndex::Verify(const Candidates& candidates, const std::vector<std::string>& terms, std::vector<SearchMatch>* matches) {
+  YMD date(YMD::day_number, candidates.day);
+  auto reader = index_->Open(date.year, date.month, date.day);
+  if (!reader)
+    return;
+
+  LogEvent event;
+  std::string text, lower;
+  std::uint64_t line = 0;
+  auto next = candidates.events.begin();
+  for (std::uint32_t i = 0; next != candidates.events.end() && reader->Read(&event); ++i) {
+    bool action;
+    if (i == *next) {
+      ++next;
+      if (MessageText(event, &text, &action)) {
+        lower = text;
+        Lowercase(&lower);
+        if (int score = Score(lower, terms); score > 0) {
+          matches->push_back(SearchMatch{
+              date, line, event.time_us() % 86400000000u, std::string(Nick(event, config_)), text, action, score});
+        }
+      }
+    }
+    if (IsNumberedLine(event))
+      ++line;
+  }
+}
+
+fs::path SearchIndex::IndexFile(const YMD& date) const {
+  return root_ / std::to_string(date.year) / std::to_string(date.month) / (std::to_string(date.day) + ".trigrams");
+}
+
+NickIndex::NickIndex(LogIndex* index, const TargetConfig& cfg)
+    : index_(index), config_(cfg), root_(cfg.log_path())
+{}
+
+NickIndex::~NickIndex() {
+  stopping_ = true;
+  if (builder_.joinable())
+    builder_.join();
+}
+
+void NickIndex::Start() {
+  builder_ = std::thread([this]() {
+      auto start = std::chrono::steady_clock::now();
+      try {
+        Update();
+      } catch (const std::exception& e) {
+        LOG(ERROR) << "nicks: " << config_.name() << ": indexing failed: " << e.what();
+      }
+      if (stopping_)
+        return;
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      LOG(INFO) << "nicks: " << config_.name() << ": index ready in " << elapsed.count() << "s";
+      ready_ = true;
+    });
+}
+
+void NickIndex::Update() {
+  std::lock_guard<std::mutex> update_lock(update_lock_);
+
+  std::int64_t from;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    from = frozen_through_ + 1;
+  }
+
+  std::vector<std::pair<YMD, bool>> days; // date, frozen
+  {
+    std::lock_guard<std::mutex> lock(*index_->lock());
+    index_->Refresh();
+    index_->ForRange(YMD(YMD::day_number, from), YMD(9999, 12, 31), [this, &days](int y, int m, int d) {
+        YMD date(y, m, d);
+        FileInfo info;
+        days.emplace_back(date, index_->Stat(date, &info) && info.frozen);
+      });
+  }
+
+  for (const auto& [date, frozen] : days) {
+    if (stopping_ || !frozen)
+      return; // the days from here on are still being logged
+
+    DayNicks idx;
+    bool stored = LoadDay(date, &idx);
+    std::int64_t n = DayNumber(date);
+
+    std::lock_guard<std::mutex> lock(lock_);
+    for (const NickPostings& postings : idx.nicks()) {
+      DayList& list = nicks_[postings.key()];
+      AppendVarint(n - list.last, &list.deltas);
+      list.last = n;
+    }
+    for (const NickPostings& postings : idx.accounts()) {
+      DayList& list = accounts_[postings.key()];
+      AppendVarint(n - list.last, &list.deltas);
+      list.last = n;
+    }
+    if (!stored)
+      unsaved_.emplace(n, idx.SerializeAsString());
+    frozen_through_ = n;
+  }
+}
+
+bool NickIndex::LoadDay(const YMD& date, DayNicks* idx) {
+  fs::path path = IndexFile(date);
+  {
+    std::ifstream in(path, std::ios::binary);
+    if (in && idx->ParseFromIstream(&in) && idx->version() == kNickIndexVersion)
+      return true;
+  }
+
+  idx->Clear();
+  try {
+    BuildDay(date, idx);
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "nicks: failed to index " << path << ": " << e.what();
+    idx->Clear();
+    return true; // nothing to store
+  }
+  if (!WriteIndex(path, *idx)) {
+    LOG(WARNING) << "nicks: failed to write " << path << ", keeping it in memory";
+    return false;
+  }
+  return true;
+}
+
+void NickIndex::BuildDay(const YMD& date, DayNicks* idx) {
+  idx->set_version(kNickIndexVersion);
+  auto reader = index_->Open(date.year, date.month, date.day);
+  if (!reader)
+    return;
+
+  std::map<std::string, std::vector<Line>> nicks, accounts;
+  LogEvent event;
+  std::uint32_t line = 0;
+  for (std::uint32_t i = 0; ; ++i) {
+    std::uint64_t offset = reader->bytes();
+    if (!reader->Read(&event))
+      break;
+    if (!IsNumberedLine(event))
+      continue;
+    if (std::string_view nick = Sender(event, config_); !nick.empty())
+      nicks[NickKey(nick)].push_back(Line{i, line, offset});
+    if (!event.account().empty())
+      accounts[event.account()].push_back(Line{i, line, offset});
+    ++line;
+  }
+
+  auto add = [](const std::map<std::string, std::vector<Line>>& lines, auto* out) {
+    for (const auto& [key, key_lines] : lines) {
+      NickPostings* postings = out->Add();
+      postings->set_key(key);
+      Line prev{0, 0, 0};
+      for (const Line& l : key_lines) {
+        postings->add_event_deltas(l.event - prev.event);
+        postings->add_line_deltas(l.line - prev.line);
+        postings->add_offset_deltas(l.offset - prev.offset);
+        prev = l;
+      }
+    }
+  };
+  add(nicks, idx->mutable_nicks());
+  add(accounts, idx->mutable_accounts());
+}
+
+std::size_t NickIndex::Format(LogFormatter* fmt, bool account, std::string_view name, const YMD& from, const YMD& to) {
+  Update();
+
+  std::string key = account ? std::string(name) : NickKey(name);
+  std::int64_t first = DayNumber(from), last = DayNumber(to);
+
+  std::vector<std::int64_t> frozen;
+  std::int64_t frozen_through;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    auto& lists = account ? accounts_ : nicks_;
+    if (auto list = lists.find(key); list != lists.end())
+      frozen = DecodeDays(list->second.deltas);
+    frozen_through = frozen_through_;
+  }
+  frozen.erase(frozen.begin(), std::lower_bound(frozen.begin(), frozen.end(), first));
+  frozen.erase(std::upper_bound(frozen.begin(), frozen.end(), last), frozen.end());
+
+  // Days that aren't frozen yet have no index files, and are just indexed here and now.
+  std::vector<YMD> live;
+  if (frozen_through < last) {
+    std::lock_guard<std::mutex> lock(*index_->lock());
+    index_->ForRange(YMD(YMD::day_number, std::max(first, frozen_through + 1)), to, [&live](int y, int m, int d) {
+        live.emplace_back(y, m, d);
+      });
+  }
+
+  std::size_t count = 0;
+  for (std::int64_t day : frozen) {
+    std::vector<Line> lines = LookupDay(day, account, key);
+    FormatDay(fmt, YMD(YMD::day_number, day), lines);
+    count += lines.size();
+  }
+  for (const YMD& date : live) {
+    DayNicks idx;
+    BuildDay(date, &idx);
+    std::vector<Line> lines = Find(idx, account, key);
+    FormatDay(fmt, date, lines);
+    count += lines.size();
+  }
+  return count;
+}
+
+std::vector<NickIndex::Line> NickIndex::LookupDay(std::int64_t day, bool account, const std::string& key) {
+  DayNicks idx;
+  bool parsed = false;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (auto unsaved = unsaved_.find(day); unsaved != unsaved_.end())
+      parsed = idx.ParseFromString(unsaved->second);
+  }
+  if (!parsed) {
+    std::ifstream in(IndexFile(YMD(YMD::day_number, day)), std::ios::binary);
+    if (!in || !idx.ParseFromIstream(&in))
+      return {};
+  }
+
+  return Find(idx, account, key);
+}
+
+std::vector<NickIndex::Line> NickIndex::Find(const DayNicks& idx, bool account, const std::string& key) {
+  const auto& postings = account ? idx.accounts() : idx.nicks();
+  auto found = std::lower_bound(postings.begin(), postings.end(), key, [](const NickPostings& p, const std::string& k) { return p.key() < k; });
+  if (found == postings.end() || found->key() != key)
+    return {};
+  if (found->line_deltas_size() != found->event_deltas_size() || found->offset_deltas_size() != found->event_deltas_size())
+    return {};
+
+  std::vector<Line> lines;
+  Line l{0, 0, 0};
+  for (int i = 0; i < found->event_deltas_size(); ++i) {
+    l.event += found->event_deltas(i);
+    l.line += found->line_deltas(i);
+    l.offset += found->offset_deltas(i);
+    lines.push_back(l);
+  }
+  return lines;
+}
+
+void NickIndex::FormatDay(LogFormatter* fmt, const YMD& date, const std::vector<Line>& lines) {
+  if (lines.empty())
+    return;
+  std::int64_t day = DayNumber(date);
+
+  // Plain logfiles can be seeked in. Compressed ones are read from the start, skipping what's
+  // not needed, which is at least cheaper than parsing it.
+  struct File {
+    int fd = -1;
+    ~File() { if (fd != -1) close(fd); }
+  } file;
+  fs::path logfile = root_ / std::to_string(date.year) / std::to_string(date.month) / (std::to_string(date.day) + ".pb");
+  std::unique_ptr<proto::DelimReader> reader;
+  file.fd = open(logfile.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file.fd == -1) {
+    reader = index_->Open(date.year, date.month, date.day);
+    if (!reader)
+      return;
+  }
+
+  fmt->FormatDay(true, date.year, date.month, date.day);
+  LogEvent event;
+  std::uint32_t next = 0; // index of the event the reader is at
+  for (const Line& l : lines) {
+    if (file.fd != -1 && (!reader || l.event < next || l.event - next > kMaxSkip)) {
+      reader.reset();
+      if (lseek(file.fd, l.offset, SEEK_SET) == -1)
+        break;
+      reader = std::make_unique<proto::DelimReader>(base::own(std::make_unique<google::protobuf::io::FileInputStream>(file.fd)));
+      next = l.event;
+    }
+    while (next < l.event && reader->Skip())
+      ++next;
+    if (next != l.event || !reader->Read(&event))
+      break;
+    ++next;
+    event.mutable_event_id()->set_day(day);
+    event.mutable_event_id()->set_line(l.line);
+    fmt->FormatEvent(event, config_);
+  }
+}
+
+fs::path NickIndex::IndexFile(const YMD& date) const {
+  return root_ / std::to_string(date.year) / std::to_string(date.month) / (std::to_string(date.day) + ".nicks");
+}
+
+} // namespace esologs
@@ -0,0 +1,270 @@
+#ifndef ESOLOGS_SEARCH_H_
+#define ESOLOGS_SEARCH_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "base/common.h"
+#include "esologs/config.pb.h"
+#include "esologs/index.h"
+#include "esologs/log.pb.h"
+
+namespace esologs {
+
+class DayIndex;
+class DayNicks;
+struct LogFormatter;
+
+/**
+ * Splits a search query into its terms: words, or phrases in double quotes. All the terms are
+ * lowercased (ASCII only), as searches ignore case.
+ */
+std::vector<std::string> SearchTerms(std::string_view query);
+
+/**
+ * Normalizes a nick for looking it up. Nicks are compared case-insensitively, with the rfc1459
+ * casemapping: `[]\^` are the uppercase forms of `{}|~`.
+ */
+std::string NickKey(std::string_view nick);
+
+/** Days (by day number) something appears in, in increasing order, delta-coded as varints. */
+struct DayList {
+  std::string deltas;
+  std::int64_t last = 0;
+};
+
+/** A message matching a search. */
+struct SearchMatch {
+  YMD date{0};
+  /** Line number of the message, as in the `#l` anchors of the day's page. */
+  std::uint64_t line;
+  /** Time of the message, as an offset from midnight in microseconds. */
+  std::uint64_t time_us;
+  std::string nick;
+  /** Text of the message, without any formatting codes. */
+  std::string text;
+  /** Whether the message is a CTCP ACTION (`/me`). */
+  bool action;
+  /** How well the message matched. Words matching whole count for more than parts of words. */
+  int score;
+};
+
+/** One page of the results of a search. */
+struct SearchResults {
+  std::string query;
+  /** Number of the page (starting from 1), and how many pages there are in total. */
+  unsigned page = 1;
+  unsigned pages = 0;
+  /** Number of matching messages found. */
+  std::size_t total = 0;
+  /** If set, the search stopped early, and only the most recent matches were ranked. */
+  bool truncated = false;
+  /** The matches of the page, best first. */
+  std::vector<SearchMatch> matches;
+};
+
+/**
+ * Trigram index of the message bodies of a target's logs.
+ *
+ * Each day's messages are indexed on their own, into posting lists from each trigram (three bytes)
+ * of their text to the events containing it. For days that can no longer change, those are stored
+ * next to the logfile (as `D.trigrams` for `D.pb`), and built on startup for any days missing one.
+ * Only the set of days each trigram appears in is kept in memory. The day still being logged is
+ * indexed in memory, from the events coming through the pipe, and its logfile if any were missed.
+ *
+ * A search looks up the trigrams of its terms to find the candidate messages, then reads them from
+ * the logs to check that they really contain every term. Days are searched newest first, and the
+ * search stops once it has found kMaxMatches messages.
+ */
+class SearchIndex {
+ public:
+  /** Most matches a search looks for, before ranking them. */
+  static constexpr std::size_t kMaxMatches = 1000;
+  /** Matches per page of results. */
+  static constexpr std::size_t kPageSize = 50;
+
+  SearchIndex(LogIndex* index, const TargetConfig& cfg);
+  /** Stops building the index, if it's still in progress. */
+  ~SearchIndex();
+  DISALLOW_COPY(SearchIndex);
+
+  /** Starts indexing the logs, on a thread of its own. Searches can be made once it's ready. */
+  void Start();
+  bool ready() const noexcept { return ready_; }
+
+  /** Indexes an event of the day being logged, as it arrives through the pipe. */
+  void Add(const LogEvent& event);
+
+  /**
+   * Finds the messages containing all of \p terms (as returned by SearchTerms), and returns page
+   * \p page of them in \p results.
+   *
+   * At least one of the terms must be 3 bytes or longer; the shorter ones have no trigrams to look
+   * up, so they're only checked for in the messages matching the others.
+   */
+  void Search(const std::vector<std::string>& terms, unsigned page, SearchResults* results);
+
+ private:
+  /** In-memory index of a day that's still being logged. */
+  struct LiveDay {
+    /** Number of events indexed so far, from the start of the day. */
+    std::uint64_t events = 0;
+    /** Size of the logfile when last read, to tell if there's anything new in it. */
+    std::uintmax_t file_size = 0;
+    /** Whether any events of the day have come in from the pipe. */
+    bool piped = false;
+    std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> postings;
+    /** Events that came in from the pipe after a gap (by line), until the logfile fills it in. */
+    std::map<std::uint64_t, LogEvent> pending;
+  };
+
+  /** Candidate events of a day, for verifying against the logs. */
+  struct Candidates {
+    std::int64_t day;
+    std::vector<std::uint32_t> events;
+  };
+
+  LogIndex* const index_;
+  const TargetConfig& config_;
+  const std::filesystem::path root_;
+
+  /** Held for the duration of Update, so that only one thread brings the index up to date. */
+  std::mutex update_lock_;
+
+  /** Guards everything below. */
+  std::mutex lock_;
+  /** Days each trigram appears in. */
+  std::unordered_map<std::uint32_t, DayList> days_;
+  /** Day number of the newest day whose index is complete, or -1 if none. */
+  std::int64_t frozen_through_ = -1;
+  /** Serialized indices of days whose index file couldn't be written. */
+  std::unordered_map<std::int64_t, std::string> unsaved_;
+  std::map<std::int64_t, LiveDay> live_;
+
+  std::atomic<bool> ready_ = false;
+  std::atomic<bool> stopping_ = false;
+  std::thread builder_;
+
+  /** Indexes any days that have been frozen, and catches up with the logfiles of live days. */
+  void Update();
+  /**
+   * Loads the index of a frozen day from its file, building and storing it if necessary.
+   *
+   * Returns `false` if the index had to be built, but couldn't be stored.
+   */
+  bool LoadDay(const YMD& date, DayIndex* idx);
+  void BuildDay(const YMD& date, DayIndex* idx);
+  /** Indexes any events of a live day's logfile that haven't come in through the pipe. */
+  void CatchUp(const YMD& date);
+  /** Indexes \p event as the next event of a live day. Needs the lock. */
+  void IndexLive(LiveDay* day, const LogEvent& event);
+  /** Indexes any pending events of a live day that are next in line. Needs the lock. */
+  void IndexPending(LiveDay* day);
+
+  /** Finds the candidate events of the days with every one of \p trigrams, newest day first. */
+  std::vector<Candidates> Lookup(const std::vector<std::uint32_t>& trigrams);
+  std::vector<std::uint32_t> LookupDay(std::int64_t day, const std::vector<std::uint32_t>& trigrams);
+  /** Reads the candidate events of a day, and adds the ones that match \p terms to \p matches. */
+  void Verify(const Candidates& candidates, const std::vector<std::string>& terms, std::vector<SearchMatch>* matches);
+
+  std::filesystem::path IndexFile(const YMD& date) const;
+};
+
+/**
+ * Index of the lines of each nick (and account) across a target's logs.
+ *
+ * Kept like the trigram index of SearchIndex: the lines of each nick in a day that can no longer
+ * change are stored next to the logfile (as `D.nicks` for `D.pb`), along with their offsets in it,
+ * and only the set of days each nick appears in is kept in memory. Days still being logged are
+ * read in full when asked for, as there are only ever a couple of them.
+ */
+class NickIndex {
+ public:
+  NickIndex(LogIndex* index, const TargetConfig& cfg);
+  /** Stops building the index, if it's still in progress. */
+  ~NickIndex();
+  DISALLOW_COPY(NickIndex);
+
+  /** Starts indexing the logs, on a thread of its own. Lookups can be made once it's ready. */
+  void Start();
+  bool ready() const noexcept { return ready_; }
+
+  /**
+   * Formats the lines of nick \p name (or of account \p name, if \p account is set) from \p from
+   * to \p to (inclusive) with \p fmt, oldest first, as the days of a multi-day page.
+   *
+   * Only the lines themselves are read from the logfiles, by seeking to their offsets, so the cost
+   * is proportional to the number of lines rather than to the size of the logs. (Except for any
+   * logfiles that have been compressed, which are still read through up to the last line.)
+   *
+   * Returns the number of lines formatted.
+   */
+  std::size_t Format(LogFormatter* fmt, bool account, std::string_view name, const YMD& from, const YMD& to);
+
+ private:
+  /** A line of a day. */
+  struct Line {
+    /** Index of the event in the logfile. */
+    std::uint32_t event;
+    /** Line number, as in the `#l` anchors of the day's page. */
+    std::uint32_t line;
+    /** Byte offset of the event in the (uncompressed) logfile. */
+    std::uint64_t offset;
+  };
+
+  LogIndex* const index_;
+  const TargetConfig& config_;
+  const std::filesystem::path root_;
+
+  /** Held for the duration of Update, so that only one thread brings the index up to date. */
+  std::mutex update_lock_;
+
+  /** Guards everything below. */
+  std::mutex lock_;
+  /** Days each nick (by NickKey) and each account appears in. */
+  std::unordered_map<std::string, DayList> nicks_;
+  std::unordered_map<std::string, DayList> accounts_;
+  /** Day number of the newest day whose index is complete, or -1 if none. */
+  std::int64_t frozen_through_ = -1;
+  /** Serialized indices of days whose index file couldn't be written. */
+  std::unordered_map<std::int64_t, std::string> unsaved_;
+
+  std::atomic<bool> ready_ = false;
+  std::atomic<bool> stopping_ = false;
+  std::thread builder_;
+
+  /** Indexes any days that have been frozen. */
+  void Update();
+  /**
+   * Loads the index of a frozen day from its file, building and storing it if necessary.
+   *
+   * Returns `false` if the index had to be built, but couldn't be stored.
+   */
+  bool LoadDay(const YMD& date, DayNicks* idx);
+  void BuildDay(const YMD& date, DayNicks* idx);
+  /** Looks up the lines of \p key in the index of a frozen day. */
+  std::vector<Line> LookupDay(std::int64_t day, bool account, const std::string& key);
+  /** Finds the lines of \p key in the index of a day. */
+  static std::vector<Line> Find(const DayNicks& idx, bool account, const std::string& key);
+  /** Reads \p lines (in increasing order) from a day's logfile, and formats them with \p fmt. */
+  void FormatDay(LogFormatter* fmt, const YMD& date, const std::vector<Line>& lines);
+
+  std::filesystem::path IndexFile(const YMD& date) const;
+};
+
+} // namespace esologs
+
+#endif // ESOLOGS_SEARCH_H_
+
+// Local Variables:
+// mode: c++
+// End:
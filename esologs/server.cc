@@ -1,19 +1,28 @@
+#include <algorithm>
+#include <atomic>
 #include <charconv>
 #include <chrono>
-#include <cstdio>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <limits>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <thread>
+#include <vector>
 
+#include <prometheus/counter.h>
 #include <prometheus/exposer.h>
+#include <prometheus/histogram.h>
 #include <prometheus/registry.h>
 #include "re2/re2.h"
 
 #include "base/log.h"
+#include "esologs/assets.h"
 #include "esologs/config.pb.h"
 #include "esologs/format.h"
 #include "esologs/index.h"
@@ -22,11 +31,18 @@
 #include "event/loop.h"
 #include "proto/brotli.h"
 #include "proto/delim.h"
+#include "web/asset.h"
+#include "web/encoding.h"
+#include "web/etag.h"
+#include "web/range.h"
 #include "web/server.h"
 #include "web/writer.h"
 
 extern "C" {
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 }
 
 namespace esologs {
@@ -35,9 +51,258 @@ namespace {
 
 constexpr const char* kStalkerWebsocketProtocol = "v1.stalker.logs.esolangs.org";
 
+using Clock = std::chrono::steady_clock;
+
+/** Passes a response through, counting the bytes sent. */
+class CountingResponse : public web::Response {
+ public:
+  explicit CountingResponse(web::Response* resp) : resp_(resp) {}
+
+  void Write(const void* data, std::size_t size) override {
+    bytes_ += size;
+    resp_->Write(data, size);
+  }
+
+  void WriteV(const std::string_view* parts, std::size_t count) override {
+    for (std::size_t i = 0; i < count; ++i)
+      bytes_ += parts[i].size();
+    resp_->WriteV(parts, count);
+  }
+
+  void WriteFile(int fd, off_t offset, std::size_t size) override {
+    bytes_ += size;
+    resp_->WriteFile(fd, offset, size);
+  }
+
+  bool is_head() const override { return resp_->is_head(); }
+  bool chunked_ok() const override { return resp_->chunked_ok(); }
+
+  std::size_t bytes() const { return bytes_; }
+
+ private:
+  web::Response* resp_;
+  std::size_t bytes_ = 0;
+};
+
+/** Returns the `format` metric label of a log format. */
+const char* FormatLabel(const std::string& format) {
+  if (format == ".html")
+    return "html";
+  else if (format == ".txt")
+    return "txt";
+  else if (format == ".json")
+    return "json";
+  else
+    return "raw";
+}
+
+/** Returns the value (not decoded) of parameter \p name in \p query, if it's there. */
+std::optional<std::string_view> QueryParam(const char* query, std::string_view name) {
+  if (!query)
+    return std::nullopt;
+  std::string_view q(query);
+  while (!q.empty()) {
+    std::string_view param = q.substr(0, q.find('&'));
+    q.remove_prefix(std::min(param.size() + 1, q.size()));
+    if (param.size() > name.size() && param.starts_with(name) && param[name.size()] == '=')
+      return param.substr(name.size() + 1);
+  }
+  return std::nullopt;
+}
+
+/** Decodes a query string value: `+` is a space, and `%XX` the byte XX. */
+std::string DecodeQueryValue(std::string_view value) {
+  auto hex = [](char c) {
+    if (c >= '0' && c <= '9')
+      return c - '0';
+    if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+      return c - 'A' + 10;
+    return -1;
+  };
+  std::string decoded;
+  for (std::size_t i = 0; i < value.size(); ++i) {
+    int hi, lo;
+    if (value[i] == '+') {
+      decoded += ' ';
+    } else if (value[i] == '%' && i + 2 < value.size() && (hi = hex(value[i+1])) >= 0 && (lo = hex(value[i+2])) >= 0) {
+      decoded += static_cast<char>(hi << 4 | lo);
+      i += 2;
+    } else {
+      decoded += value[i];
+    }
+  }
+  return decoded;
+}
+
+/** Returns the date (`YYYY-MM-DD`, matched by \p re_date) of parameter \p name, if it's valid. */
+std::optional<YMD> DateParam(const web::Request& req, std::string_view name, const RE2& re_date) {
+  std::optional<std::string_view> text = QueryParam(req.query(), name);
+  int y, m, d;
+  if (!text || !RE2::FullMatch(std::string(*text), re_date, &y, &m, &d))
+    return std::nullopt;
+  if (!(date::year{y}/m/d).ok())
+    return std::nullopt;
+  return YMD(y, m, d);
+}
+
+/** Longest range of days `events.json` will serve in one response. */
+constexpr int kMaxEventsDays = 31;
+
+/**
+ * How many days (per worker thread) a multi-day render may have in flight ahead of the one being
+ * written out. Bounds the memory a render holds in decoded events and formatted days.
+ */
+constexpr std::size_t kRenderWindowPerThread = 2;
+
+/**
+ * A multi-day render in progress, shared between the request thread and the worker tasks.
+ *
+ * Each day is decoded by one task, and formatted by another, into a buffer of its own. Formatting
+ * a day needs to wait until all earlier days are decoded, because that's when it's known where its
+ * line numbers start. Whichever decoding task completes a prefix of decoded days queues the
+ * formatting of those days.
+ *
+ * The tasks only use what's in here (and the long-lived target), so that a request bailing out
+ * early, with tasks still queued, leaves nothing dangling.
+ */
+struct DayRenders {
+  struct Day {
+    int day;
+    bool exists = false;
+    std::vector<LogEvent> events;
+    std::uint64_t first_line = 0;
+    std::uint64_t lines = 0;
+    bool decoded = false;
+    bool done = false;
+    std::string text;
+  };
+
+  /** Formatter of the page's format, for creating the ones for each day. Never written to. */
+  std::string prototype_buffer;
+  std::unique_ptr<LogFormatter> prototype;
+  /** Whether to time the decode and render phases. */
+  bool tracing;
+
+  std::mutex lock;
+  std::condition_variable day_done;
+  std::vector<Day> days;
+  /** Days before this one have been given their first line number, and queued for formatting. */
+  std::size_t numbered = 0;
+  std::uint64_t next_line = 0;
+  std::exception_ptr error;
+  Clock::duration decode{0};
+  Clock::duration render{0};
+};
+
+/** Longest range of days `grep` will scan in one request. */
+constexpr int kMaxGrepDays = 366;
+/** Most matching lines `grep` returns, and how many it returns by default. */
+constexpr unsigned kMaxGrepMatches = 1000;
+constexpr unsigned kDefaultGrepMatches = 100;
+/** Most lines of context `grep` shows on either side of a match. */
+constexpr unsigned kMaxGrepContext = 10;
+/** Longest pattern `grep` accepts. */
+constexpr std::size_t kMaxGrepPattern = 256;
+
+/** A grep over a range of days in progress, shared between the request thread and the worker tasks. */
+struct DayGreps {
+  struct Line {
+    LogEvent event;
+    bool match;
+    /** Whether lines were left out between this line and the one before it. */
+    bool gap;
+  };
+  struct Day {
+    YMD date{0};
+    /** The matching lines and their context, with event IDs set to their day and line numbers. */
+    std::vector<Line> lines;
+    bool done = false;
+  };
+
+  std::unique_ptr<RE2> re;
+  unsigned context;
+  unsigned limit;
+  /** Whether to time the decode phase. */
+  bool tracing;
+  /** Set once the request no longer needs any more days, to skip the rest. */
+  std::atomic<bool> stop = false;
+
+  std::mutex lock;
+  std::condition_variable day_done;
+  std::vector<Day> days;
+  std::exception_ptr error;
+  Clock::duration decode{0};
+};
+
+/**
+ * Reads a day of logs for DayGreps, keeping the lines that match its pattern, and their context.
+ *
+ * Lines are matched as the `.txt` format shows them (without the newline), timestamp and all, as
+ * that's what people are used to grepping.
+ */
+void GrepDay(LogIndex* index, const TargetConfig& cfg, DayGreps* job, DayGreps::Day* day) {
+  auto reader = index->Open(day->date.year, day->date.month, day->date.day);
+  if (!reader)
+    return;
+  std::int64_t day_number = std::chrono::duration_cast<date::days>(day->date.time().time_since_epoch()).count();
+
+  std::string text;
+  auto text_fmt = LogFormatter::CreateText(&text);
+  auto keep = [day](LogEvent&& event, bool match) {
+    bool gap = !day->lines.empty() && day->lines.back().event.event_id().line() + 1 != event.event_id().line();
+    day->lines.push_back(DayGreps::Line{std::move(event), match, gap});
+  };
+
+  std::deque<LogEvent> before; // up to `context` lines since the last kept one
+  unsigned after = 0; // lines of context still to keep after the last match
+  unsigned matches = 0;
+  LogEvent event;
+  for (std::uint64_t line = 0; reader->Read(&event); ) {
+    if (!IsNumberedLine(event))
+      continue;
+    if (line % 256 == 0 && job->stop)
+      return;
+    event.mutable_event_id()->set_day(day_number);
+    event.mutable_event_id()->set_line(line++);
+
+    text.clear();
+    text_fmt->FormatEvent(event, cfg);
+    std::string_view shown(text);
+    if (!shown.empty() && shown.back() == '\n')
+      shown.remove_suffix(1);
+
+    if (RE2::PartialMatch(shown, *job->re)) {
+      for (LogEvent& b : before)
+        keep(std::move(b), false);
+      before.clear();
+      keep(std::move(event), true);
+      after = job->context;
+      if (++matches == job->limit && after == 0)
+        return;
+    } else if (after > 0) {
+      keep(std::move(event), false);
+      if (--after == 0 && matches == job->limit)
+        return;
+    } else if (job->context > 0) {
+      before.push_back(std::move(event));
+      if (before.size() > job->context)
+        before.pop_front();
+    }
+  }
+}
+
+double Seconds(Clock::duration d) {
+  return std::chrono::duration<double>(d).count();
+}
+
 } // unnamed namespace
 
-Server::Server(const Config& config, event::Loop* loop) : loop_(loop) {
+Server::Server(const Config& config, event::Loop* loop)
+    : loop_(loop),
+      started_(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count())
+{
   if (config.listen_port().empty())
     throw base::Exception("missing required setting: listen_port");
   if (config.target_size() == 0)
@@ -47,8 +312,37 @@ Server::Server(const Config& config, event::Loop* loop) : loop_(loop) {
     metric_exposer_ = std::make_unique<prometheus::Exposer>(config.metrics_addr());
     metric_registry_ = std::make_shared<prometheus::Registry>();
     metric_exposer_->RegisterCollectable(metric_registry_);
+
+    metric_request_seconds_ = &prometheus::BuildHistogram()
+        .Name("esologs_http_request_duration_seconds")
+        .Help("Time taken to handle a request, by target, route and format.")
+        .Register(*metric_registry_);
+    metric_response_bytes_ = &prometheus::BuildHistogram()
+        .Name("esologs_http_response_size_bytes")
+        .Help("Sizes of responses (including headers), by target, route and format.")
+        .Register(*metric_registry_);
+    metric_responses_ = &prometheus::BuildCounter()
+        .Name("esologs_http_responses_total")
+        .Help("How many responses have been sent, by target, route and status code?")
+        .Register(*metric_registry_);
+    metric_bytes_out_ = &prometheus::BuildCounter()
+        .Name("esologs_http_response_bytes_total")
+        .Help("How many bytes (including headers) have been sent in responses, by target and route?")
+        .Register(*metric_registry_);
+    metric_conditional_hits_ = &prometheus::BuildCounter()
+        .Name("esologs_http_conditional_hits_total")
+        .Help("How many conditional requests have been answered with a 304, by which validator matched?")
+        .Register(*metric_registry_);
+    metric_phase_seconds_ = &prometheus::BuildHistogram()
+        .Name("esologs_http_phase_duration_seconds")
+        .Help("Time spent in each phase (index lookup, logfile decoding, rendering) of handling a log request.")
+        .Register(*metric_registry_);
   }
 
+  unsigned render_threads = config.render_threads() ? config.render_threads() : std::max(std::thread::hardware_concurrency(), 1u);
+  if (render_threads > 1)
+    workers_ = std::make_unique<WorkerPool>(render_threads);
+
   for (const auto& target_config : config.target()) {
     if (target_config.log_path().empty())
       throw base::Exception("missing required setting: log_path");
@@ -56,14 +350,63 @@ Server::Server(const Config& config, event::Loop* loop) : loop_(loop) {
       throw base::Exception("missing required setting: nick");
 
     auto target = std::make_unique<Target>(target_config);
+    target->workers = workers_.get();
+    if (!config.export_dir().empty())
+      target->export_dir = config.export_dir() + '/' + target_config.name() + '/';
+    if (config.search())
+      target->search = std::make_unique<SearchIndex>(&target->index, target->config);
+    if (config.nick_index())
+      target->nicks = std::make_unique<NickIndex>(&target->index, target->config);
     if (!targets_.try_emplace(target->config.name(), std::move(target)).second)
       throw base::Exception("duplicate targets");
   }
 
+  for (auto& [name, target] : targets_) {
+    if (target->search)
+      target->search->Start();
+    if (target->nicks)
+      target->nicks->Start();
+  }
+
   if (!config.pipe_socket().empty())
     stalker_ = std::make_unique<Stalker>(config, loop_, this, metric_registry_.get());
 
-  web_server_ = std::make_unique<web::Server>(config.listen_port());
+  std::size_t cache_bytes = std::size_t{config.render_cache_mb() ? config.render_cache_mb() : 64} << 20;
+  std::size_t cache_disk_bytes = std::size_t{config.render_cache_disk_mb() ? config.render_cache_disk_mb() : 1024} << 20;
+  cache_ = std::make_unique<RenderCache>(cache_bytes, config.render_cache_dir(), cache_disk_bytes, metric_registry_.get());
+
+  unsigned num_threads = config.num_threads() ? config.num_threads() : 2;
+  Admission::Limits cheap_limits, expensive_limits;
+  cheap_limits.running = config.max_cheap_requests() ? config.max_cheap_requests() : num_threads;
+  cheap_limits.queued = config.max_queued_cheap_requests() ? config.max_queued_cheap_requests() : num_threads;
+  expensive_limits.running = config.max_expensive_requests() ? config.max_expensive_requests() : std::max(num_threads / 2, 1u);
+  if (config.max_queued_expensive_requests())
+    expensive_limits.queued = config.max_queued_expensive_requests();
+  else if (num_threads > expensive_limits.running + 1)
+    expensive_limits.queued = num_threads - expensive_limits.running - 1;
+  else
+    expensive_limits.queued = 0;
+  auto admission_timeout = std::chrono::milliseconds(config.admission_timeout_ms() ? config.admission_timeout_ms() : 2000);
+  admission_ = std::make_unique<Admission>(cheap_limits, expensive_limits, admission_timeout, metric_registry_.get());
+
+  web::Server::Options web_options;
+  web_options.port = config.listen_port();
+  web_options.num_threads = num_threads;
+  if (config.max_websocket_clients())
+    web_options.max_websocket_clients = config.max_websocket_clients();
+  if (config.websocket_ping_interval_s())
+    web_options.websocket_ping_interval = std::chrono::seconds(config.websocket_ping_interval_s());
+  if (config.websocket_idle_timeout_s())
+    web_options.websocket_idle_timeout = std::chrono::seconds(config.websocket_idle_timeout_s());
+  if (config.disable_keep_alive())
+    web_options.keep_alive_timeout = std::chrono::milliseconds(0);
+  else if (config.keep_alive_timeout_ms())
+    web_options.keep_alive_timeout = std::chrono::milliseconds(config.keep_alive_timeout_ms());
+  if (config.event_loop_server())
+    web_options.backend = web::Server::Backend::kLoop;
+  web_options.metric_registry = metric_registry_.get();
+
+  web_server_ = web::Server::Create(web_options, loop_);
   web_server_->AddHandler("/", this);
   if (stalker_)
     web_server_->AddWebsocketHandler("/", kStalkerWebsocketProtocol, this);
@@ -76,82 +419,200 @@ LogIndex* Server::index(const std::string& target) {
   return nullptr;
 }
 
+SearchIndex* Server::search(const std::string& target) {
+  auto t = targets_.find(target);
+  if (t != targets_.end())
+    return t->second->search.get();
+  return nullptr;
+}
+
 int Server::HandleGet(const web::Request& req, web::Response* resp) {
+  if (!metric_request_seconds_)
+    return HandleRequest(req, resp, nullptr);
+
+  auto start = Clock::now();
+  CountingResponse counted(resp);
+  RequestTrace trace;
+  int code = HandleRequest(req, &counted, &trace);
+  ObserveRequest(trace, code, counted.bytes(), Clock::now() - start);
+  return code;
+}
+
+void Server::ObserveRequest(const RequestTrace& trace, int code, std::size_t bytes, Clock::duration elapsed) {
+  static const prometheus::Histogram::BucketBoundaries kSecondsBuckets = {
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5,
+  };
+  static const prometheus::Histogram::BucketBoundaries kBytesBuckets = {
+    256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304, 16777216,
+  };
+
+  std::string target(trace.target);
+  metric_request_seconds_->Add({{"target", target}, {"route", trace.route}, {"format", trace.format}}, kSecondsBuckets)
+      .Observe(Seconds(elapsed));
+  metric_response_bytes_->Add({{"target", target}, {"route", trace.route}, {"format", trace.format}}, kBytesBuckets)
+      .Observe(bytes);
+  metric_responses_->Add({{"target", target}, {"route", trace.route}, {"code", std::to_string(code)}}).Increment();
+  metric_bytes_out_->Add({{"target", target}, {"route", trace.route}}).Increment(bytes);
+  if (trace.conditional)
+    metric_conditional_hits_->Add({{"target", target}, {"route", trace.route}, {"validator", trace.conditional}}).Increment();
+
+  const std::pair<const char*, Clock::duration> phases[] = {
+    {"lookup", trace.lookup}, {"decode", trace.decode}, {"render", trace.render},
+  };
+  for (const auto& [phase, duration] : phases) {
+    if (duration.count() > 0)
+      metric_phase_seconds_->Add({{"target", target}, {"route", trace.route}, {"phase", phase}}, kSecondsBuckets)
+          .Observe(Seconds(duration));
+  }
+}
+
+int Server::HandleRequest(const web::Request& req, web::Response* resp, RequestTrace* trace) {
   const char* uri = req.uri();
   if (!uri || *uri != '/') {
     FormatError(resp, 500, "missing request uri");
     return 500;
   }
 
+  // Every request starts out as cheap, and gets escalated if it turns out to need rendering.
+  Admission::Ticket ticket = admission_->Admit(Admission::Class::kCheap);
+  if (!ticket)
+    return Shed(resp);
+
   Target* tgt;
-  if (const char* target_uri = StripTarget(uri, &tgt); target_uri)
-    return tgt->HandleGet(this, target_uri, req, resp);
-
-#if !defined(NDEBUG)
-  std::string ext;
-  if (RE2::FullMatch(uri, "/(?:index|log|stalker)\\.(html|css|js)", &ext)) {
-    std::string path("esologs/web"); path += uri;
-    std::FILE* f = std::fopen(path.c_str(), "rb");
-    if (f) {
-      web::Writer w(resp, ext == "css" ? "text/css" : "text/javascript", 200);
-      std::string buffer;
-      constexpr std::size_t kBufferSize = 65536;
-      while (true) {
-        buffer.resize(kBufferSize);
-        std::size_t got = std::fread(buffer.data(), 1, kBufferSize, f);
-        if (got == 0)
-          break;
-        buffer.resize(got);
-        w.Write(buffer);
-      }
-      return 200;
-    }
+  if (const char* target_uri = StripTarget(uri, &tgt); target_uri) {
+    if (trace)
+      trace->target = tgt->config.name();
+    return tgt->HandleGet(this, target_uri, req, resp, &ticket, trace);
+  }
+
+  std::string_view path = std::strcmp(uri, "/") == 0 ? "/index.html" : uri;
+  if (const web::Asset* asset = web::FindAsset(Assets(), path); asset) {
+    if (trace)
+      trace->route = "asset";
+    return web::ServeAsset(*asset, req, resp);
   }
-#endif // !defined(NDEBUG)
 
   FormatError(resp, 404, "unknown path: %s", uri);
   return 404;
 }
 
-static std::pair<std::size_t, std::size_t> AppendETag(const FileInfo& info, std::string* headers);
-static bool CheckETag(std::string_view etag, std::string_view cond);
+int Server::Shed(web::Response* resp) {
+  std::string headers = "Retry-After: " + std::to_string(admission_->retry_after().count()) + "\r\n";
+  FormatErrorWithHeaders(resp, 503, headers, "server busy, try again later");
+  return 503;
+}
+
+static std::pair<std::size_t, std::size_t> AppendETag(const FileInfo& info, web::Encoding encoding, std::string* headers, std::string_view frozen_variant = std::string_view());
+static std::pair<std::size_t, std::size_t> AppendIndexETag(std::int64_t started, std::uint64_t generation, web::Encoding encoding, std::string* headers);
 
 static void AppendLastModified(FileInfo::time_type last_write, std::string* headers);
 static bool CheckLastModified(FileInfo::time_type last_write, const char* cond);
+static bool CheckIfRange(std::string_view etag, FileInfo::time_type last_write, const char* cond);
+static const char* CheckConditional(const web::Request& req, std::string_view etag, FileInfo::time_type last_write);
 
-int Server::Target::HandleGet(Server* srv, const char* uri, const web::Request& req, web::Response* resp) {
+static int SendRange(
+    const web::Request& req, web::Response* resp, const char* content_type, std::string extra_headers,
+    const std::optional<web::ByteRange>& range, std::size_t size, std::string_view part);
+static int SendRendered(
+    const web::Request& req, web::Response* resp, const char* content_type, std::string extra_headers,
+    web::Encoding encoding, std::string_view body, Admission::Ticket* ticket);
+
+int Server::Target::HandleGet(Server* srv, const char* uri, const web::Request& req, web::Response* resp, Admission::Ticket* ticket, RequestTrace* trace) {
   std::string ys, ms, ds, format;
 
   if (RE2::FullMatch(uri, srv->re_index_, &ys)) {
     int y;
+    if (trace) {
+      trace->route = "index";
+      trace->format = "html";
+    }
 
-    std::lock_guard<std::mutex> lock(*index.lock());
-    index.Refresh();
+    web::Encoding encoding = web::NegotiateEncoding(req.header("Accept-Encoding"));
+    std::string extra_headers{"Vary: Accept-Encoding\r\n"};
+    RenderCache::Body body;
+    {
+      std::unique_lock<std::mutex> lock(*index.lock());
+      Clock::time_point start;
+      if (trace)
+        start = Clock::now();
+      index.Refresh();
 
-    if (ys.empty())
-      y = index.default_year();
-    else if (ys == "all")
-      y = -1;
-    else
-      y = std::stoi(ys);
+      if (ys.empty())
+        y = index.default_year();
+      else if (ys == "all")
+        y = -1;
+      else
+        y = std::stoi(ys);
 
-    FormatIndex(req, resp, config, index, y);
+      // Index pages only change when the index does, so they can be validated by its generation.
+      auto etag_pos = AppendIndexETag(srv->started_, index.generation(), encoding, &extra_headers);
+      auto etag = std::string_view(extra_headers).substr(etag_pos.first, etag_pos.second);
+      if (const char* cond = req.header("If-None-Match"); cond && web::MatchesETag(cond, etag)) {
+        if (trace) {
+          trace->conditional = "etag";
+          trace->lookup = Clock::now() - start;
+        }
+        lock.unlock();
+        FormatErrorWithHeaders(resp, 304, extra_headers, "not modified");
+        return 304;
+      }
+
+      Clock::time_point lookup_done;
+      if (trace)
+        lookup_done = Clock::now();
+      body = IndexPage(y, encoding, &lock);
+      if (trace) {
+        trace->lookup = lookup_done - start;
+        trace->render = Clock::now() - lookup_done;
+      }
+    }
+
+    if (encoding != web::Encoding::kIdentity) {
+      extra_headers += "Content-Encoding: ";
+      extra_headers += web::EncodingName(encoding);
+      extra_headers += "\r\n";
+    }
+    web::Writer web(resp, LogContentType(".html"), 200, extra_headers);
+    web.BufferBody();
+    if (!req.is_head())
+      web.Write(web::Ref(*body));
     return 200;
   }
 
+  if (std::strcmp(uri, "events.json") == 0)
+    return HandleEvents(srv, req, resp, ticket, trace);
+
+  if (search && RE2::FullMatch(uri, srv->re_search_, &format))
+    return HandleSearch(srv, format, req, resp, ticket, trace);
+
+  if (nicks && RE2::FullMatch(uri, srv->re_said_, &format))
+    return HandleSaid(srv, format, req, resp, ticket, trace);
+
+  if (RE2::FullMatch(uri, srv->re_grep_, &format))
+    return HandleGrep(srv, format, req, resp, ticket, trace);
+
   if (RE2::FullMatch(uri, srv->re_logfile_, &ys, &ms, &ds, &format)) {
     const YMD date(std::stoi(ys), std::stoi(ms), ds.empty() ? 0 : std::stoi(ds));
+    if (trace) {
+      trace->route = date.day != 0 ? "day" : "month";
+      trace->format = FormatLabel(format);
+    }
 
     bool found;
     std::optional<YMD> prev, next;
-    bool stat_ok;
+    bool stat_ok = false;
     FileInfo info;
     {
+      Clock::time_point start;
+      if (trace)
+        start = Clock::now();
       std::lock_guard<std::mutex> lock(*index.lock());
       index.Refresh();
       found = index.Lookup(date, &prev, &next);
       if (found)
         stat_ok = index.Stat(date, &info);
+      if (trace)
+        trace->lookup = Clock::now() - start;
     }
 
     if (!found) {
@@ -162,55 +623,110 @@ int Server::Target::HandleGet(Server* srv, const char* uri, const web::Request&
       return 404;
     }
 
-    std::string extra_headers{};
+    // Byte ranges are supported for frozen pages (as exact slices of the cached rendering), and
+    // for the text formats of logs still being written, whose renderings only ever grow.
+    bool ranges = stat_ok && (info.frozen || format == ".txt" || format == "-raw.txt");
+    std::optional<web::RangeSpec> range_spec;
+    if (ranges)
+      range_spec = web::ParseRange(req.header("Range"));
+
+    web::Encoding encoding = web::NegotiateEncoding(req.header("Accept-Encoding"));
+    if (range_spec && !info.frozen)
+      encoding = web::Encoding::kIdentity; // a compressed stream has no stable byte offsets
+    std::string extra_headers{"Vary: Accept-Encoding\r\n"};
+    if (ranges)
+      extra_headers += "Accept-Ranges: bytes\r\n";
     if (stat_ok) {
-      auto etag_pos = AppendETag(info, &extra_headers);
+      // Frozen pages still change when their navigation does, so their tag names the rendering.
+      auto etag_pos = AppendETag(info, encoding, &extra_headers, RenderCache::Key(date, prev, next, format));
       AppendLastModified(info.last_write, &extra_headers);
-      if (const char* cond = req.header("If-None-Match")) {
-        auto etag = std::string_view(extra_headers).substr(etag_pos.first, etag_pos.second);
-        if (CheckETag(etag, cond)) {
-          FormatErrorWithHeaders(resp, 304, extra_headers, "not modified");
-          return 304;
-        }
-      } else if (const char* cond = req.header("If-Modified-Since")) {
-        if (CheckLastModified(info.last_write, cond)) {
-          FormatErrorWithHeaders(resp, 304, extra_headers, "not modified");
-          return 304;
-        }
+      auto etag = std::string_view(extra_headers).substr(etag_pos.first, etag_pos.second);
+      // For the same reason, the (synthesized) date of a frozen page isn't good enough for If-Range.
+      if (const char* cond = req.header("If-Range"); range_spec && cond && (!CheckIfRange(etag, info.last_write, cond) || (info.frozen && *cond != '"')))
+        range_spec = std::nullopt;
+      if (const char* validator = CheckConditional(req, etag, info.last_write)) {
+        if (trace)
+          trace->conditional = validator;
+        FormatErrorWithHeaders(resp, 304, extra_headers, "not modified");
+        return 304;
       }
     }
 
-    auto fmt = CreateFormatter(format, resp, extra_headers);
-    if (req.is_head())
-      return 200;
-
-    LogEvent event;
-    fmt->FormatHeader(date, prev, next, config.title());
+    if (stat_ok && info.frozen) {
+      if (!export_dir.empty() && !range_spec) {
+        if (int code = SendExported(uri, resp, format, encoding, extra_headers); code)
+          return code;
+      }
 
-    int d_min = date.day ? date.day : 1;
-    int d_max = date.day ? date.day : 31;
-    for (int d = d_min; d <= d_max; ++d) {
-      // TODO: force UTF-8 (with fallback) for non-raw formats
+      // Frozen logs never change, so their rendered form (in each encoding) can be cached.
+      std::string key = RenderCache::Key(date, prev, next, format);
+      RenderCache::Body body;
+      if (encoding != web::Encoding::kIdentity) {
+        std::string encoded_key = key + '.' + web::EncodingName(encoding);
+        body = srv->cache_->Get(config.name(), encoded_key);
+        if (!body) {
+          RenderCache::Body plain = RenderCached(srv, key, format, date, prev, next, ticket, trace);
+          if (!plain || !ticket->Escalate())
+            return srv->Shed(resp);
+          body = std::make_shared<std::string>(web::Compress(encoding, *plain));
+          srv->cache_->Put(config.name(), encoded_key, body);
+        }
+        extra_headers += "Content-Encoding: ";
+        extra_headers += web::EncodingName(encoding);
+        extra_headers += "\r\n";
+      } else {
+        body = RenderCached(srv, key, format, date, prev, next, ticket, trace);
+        if (!body)
+          return srv->Shed(resp);
+      }
+      if (range_spec) {
+        auto range = web::ResolveRange(*range_spec, body->size());
+        std::string_view part = range ? std::string_view(*body).substr(range->first, range->size()) : std::string_view();
+        ticket->Release();
+        return SendRange(req, resp, LogContentType(format), std::move(extra_headers), range, body->size(), part);
+      }
+      return SendRendered(req, resp, LogContentType(format), std::move(extra_headers), web::Encoding::kIdentity, *body, ticket);
+    }
 
-      auto reader = index.Open(date.year, date.month, d);
-      if (!reader)
-        continue; // shouldn't happen
+    // Anything past this point reads and renders the logfiles.
+    if (!ticket->Escalate())
+      return srv->Shed(resp);
 
-      fmt->FormatDay(d_min != d_max, date.year, date.month, d);
-      while (reader->Read(&event))
-        fmt->FormatEvent(event, config);
+    if (range_spec) {
+      std::optional<web::ByteRange> range;
+      std::string part;
+      std::size_t size;
+      if (date.day != 0) {
+        size = offsets.Render(&index, config, date, format, *range_spec, &range, &part);
+      } else {
+        // Months still being logged are rare enough targets to just render in full.
+        std::string rendered;
+        Render(LogFormatter::Create(format, &rendered).get(), date, prev, next, trace);
+        size = rendered.size();
+        if ((range = web::ResolveRange(*range_spec, size)))
+          part = rendered.substr(range->first, range->size());
+      }
+      ticket->Release();
+      return SendRange(req, resp, LogContentType(format), std::move(extra_headers), range, size, part);
     }
-    fmt->FormatFooter(date, prev, next);
 
-    return 200;
+    if (req.is_head()) {
+      CreateFormatter(format, resp, extra_headers, encoding);
+      return 200;
+    }
+    std::string rendered;
+    Render(LogFormatter::Create(format, &rendered).get(), date, prev, next, trace);
+    return SendRendered(req, resp, LogContentType(format), std::move(extra_headers), encoding, rendered, ticket);
   }
 
   if (srv->stalker_ && RE2::FullMatch(uri, srv->re_stalker_, &format)) {
+    if (trace) {
+      trace->route = "stalker";
+      trace->format = FormatLabel(format);
+    }
     // TODO consider checking for a connected pipe rather than events being loaded
     if (srv->stalker_->loaded()) {
-      auto fmt = CreateFormatter(format, resp, std::string_view());
-      srv->stalker_->Format(config, fmt.get());
-      return 200;
+      return srv->stalker_->Serve(config, format, req, resp);
     } else {
       FormatError(resp, 500, "stalker server temporarily unavailable, try again in a minute");
       return 500;
@@ -221,6 +737,579 @@ int Server::Target::HandleGet(Server* srv, const char* uri, const web::Request&
   return 404;
 }
 
+int Server::Target::HandleEvents(Server* srv, const web::Request& req, web::Response* resp, Admission::Ticket* ticket, RequestTrace* trace) {
+  if (trace) {
+    trace->route = "events";
+    trace->format = "json";
+  }
+
+  std::optional<YMD> from = DateParam(req, "from", srv->re_date_);
+  std::optional<YMD> to = DateParam(req, "to", srv->re_date_);
+  if (!from || !to) {
+    FormatError(resp, 400, "expected a date range: events.json?from=YYYY-MM-DD&to=YYYY-MM-DD");
+    return 400;
+  }
+  if (*to < *from || to->time() - from->time() >= std::chrono::days{kMaxEventsDays}) {
+    FormatError(resp, 400, "date range must be from 1 to %d days", kMaxEventsDays);
+    return 400;
+  }
+
+  struct Day {
+    YMD date;
+    std::optional<YMD> prev, next;
+    bool frozen;
+  };
+  std::vector<Day> days;
+  bool stat_ok;
+  FileInfo info;
+  {
+    Clock::time_point start;
+    if (trace)
+      start = Clock::now();
+    std::lock_guard<std::mutex> lock(*index.lock());
+    index.Refresh();
+    index.ForRange(*from, *to, [this, &days](int y, int m, int d) {
+        Day& day = days.emplace_back(Day{YMD(y, m, d), std::nullopt, std::nullopt, false});
+        FileInfo day_info;
+        index.Lookup(day.date, &day.prev, &day.next);
+        day.frozen = index.Stat(day.date, &day_info) && day_info.frozen;
+      });
+    // The range is frozen once its last day is, whether that day has any logs or not. Until then,
+    // it's validated by the last day, the only one still being written.
+    stat_ok = index.Stat(*to, &info);
+    if (trace)
+      trace->lookup = Clock::now() - start;
+  }
+
+  if (days.empty()) {
+    FormatError(resp, 404, "no logs from %04d-%02d-%02d to %04d-%02d-%02d", from->year, from->month, from->day, to->year, to->month, to->day);
+    return 404;
+  }
+
+  web::Encoding encoding = web::NegotiateEncoding(req.header("Accept-Encoding"));
+  std::string extra_headers{"Vary: Accept-Encoding\r\n"};
+  if (stat_ok) {
+    auto etag_pos = AppendETag(info, encoding, &extra_headers);
+    AppendLastModified(info.last_write, &extra_headers);
+    auto etag = std::string_view(extra_headers).substr(etag_pos.first, etag_pos.second);
+    if (const char* validator = CheckConditional(req, etag, info.last_write)) {
+      if (trace)
+        trace->conditional = validator;
+      FormatErrorWithHeaders(resp, 304, extra_headers, "not modified");
+      return 304;
+    }
+  }
+
+  // Each day is rendered (or taken from the cache) on its own, the same as for its `.json` page.
+  std::vector<RenderCache::Body> bodies;
+  for (const Day& day : days) {
+    RenderCache::Body body;
+    if (day.frozen) {
+      body = RenderCached(srv, RenderCache::Key(day.date, day.prev, day.next, ".json"), ".json", day.date, day.prev, day.next, ticket, trace);
+    } else if (ticket->Escalate()) {
+      auto buffer = std::make_shared<std::string>();
+      Render(LogFormatter::CreateJson(buffer.get()).get(), day.date, day.prev, day.next, trace);
+      body = std::move(buffer);
+    }
+    if (!body)
+      return srv->Shed(resp);
+    bodies.push_back(std::move(body));
+  }
+  if (encoding != web::Encoding::kIdentity && !ticket->Escalate())
+    return srv->Shed(resp);
+
+  std::string joined;
+  for (const RenderCache::Body& body : bodies)
+    joined += *body;
+  return SendRendered(req, resp, LogContentType(".json"), std::move(extra_headers), encoding, joined, ticket);
+}
+
+int Server::Target::HandleSearch(Server* srv, const std::string& format, const web::Request& req, web::Response* resp, Admission::Ticket* ticket, RequestTrace* trace) {
+  if (trace) {
+    trace->route = "search";
+    trace->format = FormatLabel(format);
+  }
+
+  SearchResults results;
+  if (auto q = QueryParam(req.query(), "q"))
+    results.query = DecodeQueryValue(*q);
+  unsigned page = 1;
+  if (auto p = QueryParam(req.query(), "page"))
+    std::from_chars(p->data(), p->data() + p->size(), page);
+
+  // The HTML page without a query is just the search form.
+  std::vector<std::string> terms = SearchTerms(results.query);
+  bool searchable = std::any_of(terms.begin(), terms.end(), [](const std::string& term) { return term.size() >= 3; });
+  if (!searchable && (format == ".json" || !terms.empty())) {
+    FormatError(resp, 400, "search query must have a word of at least 3 characters: search%s?q=...", format.c_str());
+    return 400;
+  }
+
+  if (searchable && !req.is_head()) {
+    if (!search->ready()) {
+      FormatErrorWithHeaders(resp, 503, "Retry-After: 60\r\n", "search index is still being built, try again later");
+      return 503;
+    }
+    if (!ticket->Escalate())
+      return srv->Shed(resp);
+    Clock::time_point start;
+    if (trace)
+      start = Clock::now();
+    search->Search(terms, page, &results);
+    if (trace)
+      trace->lookup = Clock::now() - start;
+  }
+
+  web::Encoding encoding = web::NegotiateEncoding(req.header("Accept-Encoding"));
+  if (encoding != web::Encoding::kIdentity && !ticket->Escalate())
+    return srv->Shed(resp);
+  Clock::time_point start;
+  if (trace)
+    start = Clock::now();
+  FormatSearch(resp, "Vary: Accept-Encoding\r\n", encoding, format, config, results);
+  if (trace)
+    trace->render = Clock::now() - start;
+  return 200;
+}
+
+int Server::Target::HandleSaid(Server* srv, const std::string& format, const web::Request& req, web::Response* resp, Admission::Ticket* ticket, RequestTrace* trace) {
+  if (trace) {
+    trace->route = "said";
+    trace->format = FormatLabel(format);
+  }
+
+  std::optional<std::string_view> nick = QueryParam(req.query(), "nick");
+  std::optional<std::string_view> account = QueryParam(req.query(), "account");
+  std::string name = DecodeQueryValue(nick ? *nick : account ? *account : std::string_view());
+  if (!nick == !account || !RE2::FullMatch(name, srv->re_nick_)) {
+    FormatError(resp, 400, "expected a nick or an account: said%s?nick=... or said%s?account=...", format.c_str(), format.c_str());
+    return 400;
+  }
+
+  std::optional<YMD> from = YMD(1, 1, 1), to = YMD(9999, 12, 31);
+  if (QueryParam(req.query(), "from"))
+    from = DateParam(req, "from", srv->re_date_);
+  if (QueryParam(req.query(), "to"))
+    to = DateParam(req, "to", srv->re_date_);
+  if (!from || !to) {
+    FormatError(resp, 400, "expected dates as YYYY-MM-DD: said%s?nick=...&from=...&to=...", format.c_str());
+    return 400;
+  }
+
+  if (!nicks->ready()) {
+    FormatErrorWithHeaders(resp, 503, "Retry-After: 60\r\n", "nick index is still being built, try again later");
+    return 503;
+  }
+  if (!ticket->Escalate())
+    return srv->Shed(resp);
+
+  web::Encoding encoding = web::NegotiateEncoding(req.header("Accept-Encoding"));
+  if (req.is_head()) {
+    CreateFormatter(format, resp, "Vary: Accept-Encoding\r\n", encoding);
+    return 200;
+  }
+
+  Clock::time_point start;
+  if (trace)
+    start = Clock::now();
+  std::string rendered;
+  auto fmt = LogFormatter::Create(format, &rendered);
+  std::string heading = (account ? "lines of account " : "lines of ") + name;
+  fmt->FormatListHeader(heading, config.title());
+  nicks->Format(fmt.get(), account.has_value(), name, *from, *to);
+  fmt->FormatListFooter();
+  fmt.reset();
+  if (trace)
+    trace->render = Clock::now() - start;
+  return SendRendered(req, resp, LogContentType(format), "Vary: Accept-Encoding\r\n", encoding, rendered, ticket);
+}
+
+int Server::Target::HandleGrep(Server* srv, const std::string& format, const web::Request& req, web::Response* resp, Admission::Ticket* ticket, RequestTrace* trace) {
+  if (trace) {
+    trace->route = "grep";
+    trace->format = FormatLabel(format);
+  }
+
+  std::string pattern;
+  if (auto q = QueryParam(req.query(), "re"))
+    pattern = DecodeQueryValue(*q);
+  std::optional<YMD> from = DateParam(req, "from", srv->re_date_);
+  std::optional<YMD> to = DateParam(req, "to", srv->re_date_);
+  if (pattern.empty() || pattern.size() > kMaxGrepPattern || !from || !to) {
+    FormatError(resp, 400, "expected a pattern and a date range: grep%s?re=...&from=YYYY-MM-DD&to=YYYY-MM-DD", format.c_str());
+    return 400;
+  }
+  if (*to < *from || to->time() - from->time() >= std::chrono::days{kMaxGrepDays}) {
+    FormatError(resp, 400, "date range must be from 1 to %d days", kMaxGrepDays);
+    return 400;
+  }
+  unsigned context = 0, limit = kDefaultGrepMatches;
+  if (auto c = QueryParam(req.query(), "context"))
+    std::from_chars(c->data(), c->data() + c->size(), context);
+  if (auto l = QueryParam(req.query(), "limit"))
+    std::from_chars(l->data(), l->data() + l->size(), limit);
+  context = std::min(context, kMaxGrepContext);
+  limit = std::clamp(limit, 1u, kMaxGrepMatches);
+
+  auto re = std::make_unique<RE2>(pattern, RE2::Quiet);
+  if (!re->ok()) {
+    FormatError(resp, 400, "invalid pattern: %s", re->error().c_str());
+    return 400;
+  }
+
+  std::vector<YMD> dates;
+  {
+    Clock::time_point start;
+    if (trace)
+      start = Clock::now();
+    std::lock_guard<std::mutex> lock(*index.lock());
+    index.Refresh();
+    index.ForRange(*from, *to, [&dates](int y, int m, int d) { dates.emplace_back(y, m, d); });
+    if (trace)
+      trace->lookup = Clock::now() - start;
+  }
+
+  if (!ticket->Escalate())
+    return srv->Shed(resp);
+
+  web::Encoding encoding = web::NegotiateEncoding(req.header("Accept-Encoding"));
+  if (req.is_head()) {
+    CreateFormatter(format, resp, "Vary: Accept-Encoding\r\n", encoding);
+    return 200;
+  }
+
+  std::string rendered;
+  auto fmt = LogFormatter::Create(format, &rendered);
+  fmt->FormatListHeader("grep " + pattern, config.title());
+  Grep(fmt.get(), std::move(re), dates, context, limit, trace);
+  fmt->FormatListFooter();
+  fmt.reset();
+  return SendRendered(req, resp, LogContentType(format), "Vary: Accept-Encoding\r\n", encoding, rendered, ticket);
+}
+
+void Server::Target::Grep(LogFormatter* fmt, std::unique_ptr<RE2> re, const std::vector<YMD>& dates, unsigned context, unsigned limit, RequestTrace* trace) {
+  auto job = std::make_shared<DayGreps>();
+  job->re = std::move(re);
+  job->context = context;
+  job->limit = limit;
+  job->tracing = trace != nullptr;
+  for (const YMD& date : dates)
+    job->days.emplace_back().date = date;
+
+  auto scan = [this, job](std::size_t i) {
+    DayGreps::Day& day = job->days[i];
+    Clock::time_point start;
+    if (job->tracing)
+      start = Clock::now();
+    std::exception_ptr error;
+    if (!job->stop) {
+      try {
+        GrepDay(&index, config, job.get(), &day);
+      } catch (...) {
+        error = std::current_exception();
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(job->lock);
+    if (job->tracing)
+      job->decode += Clock::now() - start;
+    if (error && !job->error)
+      job->error = error;
+    day.done = true;
+    job->day_done.notify_all();
+  };
+
+  // The days are written out in order as they're done, until enough lines have matched. Any days
+  // still queued or being scanned by then are skipped through the stop flag.
+  struct Stop {
+    DayGreps* job;
+    ~Stop() { job->stop = true; }
+  } stop{job.get()};
+
+  std::size_t window = workers ? kRenderWindowPerThread * workers->size() : 0;
+  std::size_t queued = 0;
+  unsigned matches = 0;
+  Clock::duration render{0};
+  for (std::size_t i = 0; i < job->days.size() && matches < limit; ++i) {
+    if (workers) {
+      for (; queued < job->days.size() && queued <= i + window; ++queued)
+        workers->Post([scan, queued]() { scan(queued); });
+    } else {
+      scan(i);
+    }
+
+    std::vector<DayGreps::Line> lines;
+    {
+      std::unique_lock<std::mutex> lock(job->lock);
+      job->day_done.wait(lock, [&job, i]() { return job->error || job->days[i].done; });
+      if (job->error)
+        std::rethrow_exception(job->error);
+      lines.swap(job->days[i].lines);
+    }
+    if (lines.empty())
+      continue;
+
+    Clock::time_point start;
+    if (trace)
+      start = Clock::now();
+    const YMD& date = job->days[i].date;
+    fmt->FormatDay(true, date.year, date.month, date.day);
+    for (const DayGreps::Line& line : lines) {
+      if (matches == limit && (line.match || line.gap))
+        break; // only the context after the last match is still wanted
+      if (line.gap)
+        fmt->FormatElision();
+      fmt->FormatEvent(line.event, config);
+      if (line.match)
+        ++matches;
+    }
+    if (trace)
+      render += Clock::now() - start;
+  }
+
+  if (trace) {
+    std::lock_guard<std::mutex> lock(job->lock);
+    trace->decode += job->decode;
+    trace->render += render;
+  }
+}
+
+RenderCache::Body Server::Target::RenderCached(Server* srv, const std::string& key, std::string_view format, const YMD& date, const std::optional<YMD>& prev, const std::optional<YMD>& next, Admission::Ticket* ticket, RequestTrace* trace) {
+  if (RenderCache::Body body = srv->cache_->Get(config.name(), key); body)
+    return body;
+  if (!ticket->Escalate())
+    return nullptr;
+  auto buffer = std::make_shared<std::string>();
+  Render(LogFormatter::Create(format, buffer.get()).get(), date, prev, next, trace);
+  srv->cache_->Put(config.name(), key, buffer);
+  return buffer;
+}
+
+int Server::Target::SendExported(const char* uri, web::Response* resp, std::string_view format, web::Encoding encoding, std::string extra_headers) {
+  std::string path = export_dir + uri;
+  if (encoding == web::Encoding::kGzip)
+    path += ".gz";
+  else if (encoding == web::Encoding::kBrotli)
+    path += ".br";
+
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return 0;
+  }
+
+  if (encoding != web::Encoding::kIdentity) {
+    extra_headers += "Content-Encoding: ";
+    extra_headers += web::EncodingName(encoding);
+    extra_headers += "\r\n";
+  }
+  {
+    web::Writer web(resp, LogContentType(format), 200, extra_headers);
+    web.SendFile(fd, st.st_size);
+  }
+  close(fd);
+  return 200;
+}
+
+RenderCache::Body Server::Target::IndexPage(int y, web::Encoding encoding, std::unique_lock<std::mutex>* lock) {
+  // Only pages of years that have logs are kept, so requests for arbitrary years can't grow the map.
+  auto [y_min, y_max] = index.bounds();
+  bool keep = y < 0 || (y >= y_min && y <= y_max);
+
+  std::uint64_t generation = index.generation();
+  RenderCache::Body plain, body;
+  if (auto page = index_pages.find(y); keep && page != index_pages.end() && page->second.generation == generation) {
+    plain = page->second.bodies[static_cast<int>(web::Encoding::kIdentity)];
+    body = page->second.bodies[static_cast<int>(encoding)];
+  }
+  if (body) {
+    lock->unlock();
+    return body;
+  }
+  std::vector<YMD> dates;
+  if (!plain)
+    dates = index.dates();
+  lock->unlock();
+
+  if (!plain) {
+    auto buffer = std::make_shared<std::string>();
+    FormatIndex(buffer.get(), config, dates, y);
+    plain = std::move(buffer);
+  }
+  body = encoding == web::Encoding::kIdentity ? plain : std::make_shared<std::string>(web::Compress(encoding, *plain));
+
+  // A page rendered from dates that have changed meanwhile is still served (its ETag matches), but not kept.
+  if (keep) {
+    lock->lock();
+    if (index.generation() == generation) {
+      CachedIndex& page = index_pages[y];
+      if (page.generation != generation)
+        page = CachedIndex{generation};
+      page.bodies[static_cast<int>(web::Encoding::kIdentity)] = plain;
+      page.bodies[static_cast<int>(encoding)] = body;
+    }
+    lock->unlock();
+  }
+  return body;
+}
+
+void Server::Target::Render(LogFormatter* fmt, const YMD& date, const std::optional<YMD>& prev, const std::optional<YMD>& next, RequestTrace* trace) {
+  if (workers && date.day == 0) {
+    fmt->FormatHeader(date, prev, next, config.title());
+    RenderDays(fmt, date, trace);
+    fmt->FormatFooter(date, prev, next);
+    return;
+  }
+  if (!trace) {
+    FormatLog(fmt, &index, config, date, prev, next);
+    return;
+  }
+
+  // When tracing, time spent opening and reading the logfiles is counted as decoding, and the
+  // rest (including writing out the formatted response) as rendering.
+  Clock::time_point start = Clock::now();
+  Clock::duration decode{0};
+
+  LogEvent event;
+  fmt->FormatHeader(date, prev, next, config.title());
+
+  int d_min = date.day ? date.day : 1;
+  int d_max = date.day ? date.day : 31;
+  for (int d = d_min; d <= d_max; ++d) {
+    // TODO: force UTF-8 (with fallback) for non-raw formats
+
+    Clock::time_point t = Clock::now();
+    auto reader = index.Open(date.year, date.month, d);
+    decode += Clock::now() - t;
+    if (!reader)
+      continue; // shouldn't happen
+
+    fmt->FormatDay(d_min != d_max, date.year, date.month, d);
+    while (true) {
+      t = Clock::now();
+      bool more = reader->Read(&event);
+      decode += Clock::now() - t;
+      if (!more)
+        break;
+      fmt->FormatEvent(event, config);
+    }
+  }
+  fmt->FormatFooter(date, prev, next);
+
+  trace->decode += decode;
+  trace->render += Clock::now() - start - decode;
+}
+
+void Server::Target::RenderDays(LogFormatter* fmt, const YMD& date, RequestTrace* trace) {
+  // With tracing, the decode and render phases are summed over the workers, so they measure the
+  // work done rather than how long the request took.
+  auto job = std::make_shared<DayRenders>();
+  job->prototype = fmt->CreateSibling(&job->prototype_buffer);
+  job->tracing = trace != nullptr;
+  for (int d = 1; d <= 31; ++d)
+    job->days.emplace_back().day = d;
+
+  auto format = [this, job, date](std::size_t i) {
+    DayRenders::Day& day = job->days[i];
+    Clock::time_point start;
+    if (job->tracing)
+      start = Clock::now();
+    std::string text;
+    auto day_fmt = job->prototype->CreateSibling(&text);
+    day_fmt->SetLineNumber(day.first_line);
+    day_fmt->FormatDay(true, date.year, date.month, day.day);
+    for (const LogEvent& event : day.events)
+      day_fmt->FormatEvent(event, config);
+    day_fmt.reset();
+    std::vector<LogEvent>().swap(day.events);
+
+    std::lock_guard<std::mutex> lock(job->lock);
+    day.text = std::move(text);
+    day.done = true;
+    if (job->tracing)
+      job->render += Clock::now() - start;
+    job->day_done.notify_all();
+  };
+
+  auto decode = [this, job, date, format](std::size_t i) {
+    DayRenders::Day& day = job->days[i];
+    {
+      std::lock_guard<std::mutex> lock(job->lock);
+      if (job->error)
+        return; // the request has already failed
+    }
+    Clock::time_point start;
+    if (job->tracing)
+      start = Clock::now();
+    std::exception_ptr error;
+    try {
+      if (auto reader = index.Open(date.year, date.month, day.day); reader) {
+        day.exists = true;
+        while (reader->Read(&day.events.emplace_back())) {
+          if (IsNumberedLine(day.events.back()))
+            ++day.lines;
+        }
+        day.events.pop_back();
+      }
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(job->lock);
+    if (job->tracing)
+      job->decode += Clock::now() - start;
+    if (error) {
+      if (!job->error)
+        job->error = error;
+      job->day_done.notify_all();
+      return;
+    }
+    day.decoded = true;
+    while (job->numbered < job->days.size() && job->days[job->numbered].decoded) {
+      DayRenders::Day& next = job->days[job->numbered];
+      next.first_line = job->next_line;
+      job->next_line += next.lines;
+      if (next.exists) {
+        workers->Post([format, n = job->numbered]() { format(n); });
+      } else {
+        next.done = true;
+        job->day_done.notify_all();
+      }
+      ++job->numbered;
+    }
+  };
+
+  // Days are queued for decoding only as far ahead of the one being written as the window allows.
+  std::size_t window = kRenderWindowPerThread * workers->size();
+  std::size_t queued = 0;
+  for (std::size_t i = 0; i < job->days.size(); ++i) {
+    for (; queued < job->days.size() && queued <= i + window; ++queued)
+      workers->Post([decode, queued]() { decode(queued); });
+
+    std::string text;
+    bool exists;
+    {
+      std::unique_lock<std::mutex> lock(job->lock);
+      job->day_done.wait(lock, [&job, i]() { return job->error || job->days[i].done; });
+      if (job->error)
+        std::rethrow_exception(job->error);
+      text = std::move(job->days[i].text);
+      exists = job->days[i].exists;
+    }
+    if (exists)
+      fmt->WriteRendered(text);
+  }
+
+  if (trace) {
+    std::lock_guard<std::mutex> lock(job->lock);
+    trace->decode += job->decode;
+    trace->render += job->render;
+  }
+}
+
 web::WebsocketClientHandler* Server::HandleWebsocketClient(const char* uri, const char* protocol) {
   CHECK(stalker_);
 
@@ -264,20 +1353,32 @@ const char* Server::StripTarget(const char* uri, Target** target) {
   return sep + 1;
 }
 
-std::unique_ptr<LogFormatter> Server::CreateFormatter(const std::string& format, web::Response* resp, std::string_view extra_headers) {
+std::unique_ptr<LogFormatter> Server::CreateFormatter(const std::string& format, web::Response* resp, std::string_view extra_headers, web::Encoding encoding) {
   if (format == ".html")
-    return LogFormatter::CreateHTML(resp, extra_headers);
+    return LogFormatter::CreateHTML(resp, extra_headers, encoding);
   else if (format == ".txt")
-    return LogFormatter::CreateText(resp, extra_headers);
+    return LogFormatter::CreateText(resp, extra_headers, encoding);
+  else if (format == ".json")
+    return LogFormatter::CreateJson(resp, extra_headers, encoding);
   else
-    return LogFormatter::CreateRaw(resp, extra_headers);
+    return LogFormatter::CreateRaw(resp, extra_headers, encoding);
 }
 
-static std::pair<std::size_t, std::size_t> AppendETag(const FileInfo& info, std::string* headers) {
+/**
+ * Appends the ETag header of a logfile's rendering. Returns the position and length of the tag.
+ *
+ * Frozen logs never change, but \p frozen_variant can tell apart renderings that do, like pages
+ * whose navigation changes when a later day is added.
+ */
+static std::pair<std::size_t, std::size_t> AppendETag(const FileInfo& info, web::Encoding encoding, std::string* headers, std::string_view frozen_variant) {
   headers->append("ETag: ");
   std::size_t start = headers->size();
   if (info.frozen) {
-    headers->append("\"frozen\"");
+    headers->append("\"frozen");
+    if (!frozen_variant.empty()) {
+      headers->push_back('-');
+      headers->append(frozen_variant);
+    }
   } else {
     // TODO: consider adding a to_chars convenience append utility to bracket
     char buf[std::numeric_limits<decltype(info.size)>::digits10+1];
@@ -287,32 +1388,33 @@ static std::pair<std::size_t, std::size_t> AppendETag(const FileInfo& info, std:
     headers->push_back('-');
     *std::to_chars(buf, buf + sizeof buf, info.size).ptr = 0;
     headers->append(buf);
-    headers->push_back('"');
   }
+  // the same content in different encodings must not share an entity tag
+  if (encoding != web::Encoding::kIdentity) {
+    headers->push_back('-');
+    headers->append(web::EncodingName(encoding));
+  }
+  headers->push_back('"');
   std::size_t end = headers->size();
   headers->append("\r\n");
   return {start, end - start};
 }
 
-static bool CheckETag(std::string_view etag, std::string_view cond) {
-  while (!cond.empty()) {
-    if (cond.starts_with("W/"))
-      cond.remove_prefix(2);
-    if (!cond.starts_with('"'))
-      return false;
-    std::size_t end = cond.find('"', 1);
-    if (end == cond.npos)
-      return false;
-    if (cond.substr(0, end+1) == etag)
-      return true;
-    cond.remove_prefix(end+1);
-    if (!cond.starts_with(','))
-      return false;
-    cond.remove_prefix(1);
-    while (cond.starts_with(' '))
-      cond.remove_prefix(1);
+static std::pair<std::size_t, std::size_t> AppendIndexETag(std::int64_t started, std::uint64_t generation, web::Encoding encoding, std::string* headers) {
+  headers->append("ETag: ");
+  std::size_t start = headers->size();
+  headers->append("\"index-");
+  headers->append(std::to_string(started));
+  headers->push_back('-');
+  headers->append(std::to_string(generation));
+  if (encoding != web::Encoding::kIdentity) {
+    headers->push_back('-');
+    headers->append(web::EncodingName(encoding));
   }
-  return false;
+  headers->push_back('"');
+  std::size_t end = headers->size();
+  headers->append("\r\n");
+  return {start, end - start};
 }
 
 static void AppendLastModified(FileInfo::time_type last_write, std::string* headers) {
@@ -336,4 +1438,75 @@ static bool CheckLastModified(FileInfo::time_type last_write, const char* cond)
   return is.good() && last_write <= cond_time;
 }
 
+static bool CheckIfRange(std::string_view etag, FileInfo::time_type last_write, const char* cond) {
+  std::string_view c(cond);
+  if (c.starts_with('"'))
+    return c == etag; // If-Range uses the strong comparison, so weak tags never match
+  if (c.starts_with("W/"))
+    return false;
+
+  std::string input{cond};
+  std::istringstream is{input};
+  FileInfo::time_type cond_time;
+  is >> date::parse("%a, %d %b %Y %T GMT", cond_time);
+  return is.good() && std::chrono::floor<std::chrono::seconds>(last_write) == cond_time;
+}
+
+/**
+ * Checks the validators of a conditional request against a resource's current ones.
+ *
+ * Returns which validator (`etag` or `date`) matched, if the resource is unchanged and should get
+ * a 304, or `nullptr` if it should be sent. As per RFC 9110, `If-Modified-Since` is only looked at
+ * when there's no `If-None-Match`.
+ */
+static const char* CheckConditional(const web::Request& req, std::string_view etag, FileInfo::time_type last_write) {
+  if (const char* cond = req.header("If-None-Match"))
+    return web::MatchesETag(cond, etag) ? "etag" : nullptr;
+  if (const char* cond = req.header("If-Modified-Since"))
+    return CheckLastModified(last_write, cond) ? "date" : nullptr;
+  return nullptr;
+}
+
+static int SendRange(
+    const web::Request& req, web::Response* resp, const char* content_type, std::string extra_headers,
+    const std::optional<web::ByteRange>& range, std::size_t size, std::string_view part) {
+  if (!range) {
+    web::AppendUnsatisfiedRange(size, &extra_headers);
+    FormatErrorWithHeaders(resp, 416, extra_headers, "range not satisfiable: %zu bytes available", size);
+    return 416;
+  }
+
+  web::AppendContentRange(*range, size, &extra_headers);
+  web::Writer web(resp, content_type, 206, extra_headers);
+  web.BufferBody();
+  if (!req.is_head())
+    web.Write(web::Ref(part));
+  return 206;
+}
+
+/**
+ * Sends a response whose body has already been rendered, compressing it first if needed. The
+ * request's admission slot is given up before anything is written, so that a slow client only
+ * holds on to a handler thread, and not to the right to render.
+ */
+static int SendRendered(
+    const web::Request& req, web::Response* resp, const char* content_type, std::string extra_headers,
+    web::Encoding encoding, std::string_view body, Admission::Ticket* ticket) {
+  std::string compressed;
+  if (encoding != web::Encoding::kIdentity) {
+    compressed = web::Compress(encoding, body);
+    body = compressed;
+    extra_headers += "Content-Encoding: ";
+    extra_headers += web::EncodingName(encoding);
+    extra_headers += "\r\n";
+  }
+  ticket->Release();
+
+  web::Writer web(resp, content_type, 200, extra_headers);
+  web.BufferBody();
+  if (!req.is_head())
+    web.Write(web::Ref(body));
+  return 200;
+}
+
 } // namespace esologs
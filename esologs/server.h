@@ -1,17 +1,30 @@
 #ifndef ESOLOGS_SERVER_H_
 #define ESOLOGS_SERVER_H_
 
+#include <chrono>
+#include <cstdint>
+#include <mutex>
 #include <string_view>
 #include <unordered_map>
 
+#include <prometheus/counter.h>
 #include <prometheus/exposer.h>
+#include <prometheus/family.h>
+#include <prometheus/histogram.h>
 #include <prometheus/registry.h>
 #include "re2/re2.h"
 
 #include "event/loop.h"
+#include "esologs/admission.h"
+#include "esologs/cache.h"
 #include "esologs/config.pb.h"
+#include "esologs/format.h"
 #include "esologs/index.h"
+#include "esologs/offsets.h"
+#include "esologs/search.h"
 #include "esologs/stalker.h"
+#include "esologs/workers.h"
+#include "web/encoding.h"
 #include "web/server.h"
 
 namespace esologs {
@@ -22,36 +35,137 @@ class Server : public web::RequestHandler, public web::WebsocketHandler, public
 
   int port() const { return web_server_->port(); }
   LogIndex* index(const std::string& target) override;
+  SearchIndex* search(const std::string& target) override;
 
   int HandleGet(const web::Request& req, web::Response* resp) override;
   web::WebsocketClientHandler* HandleWebsocketClient(const char* uri, const char* protocol) override;
 
  private:
+  /** What a request turned out to be, and where its time went, for the request metrics. */
+  struct RequestTrace {
+    std::string_view target;
+    const char* route = "other";
+    const char* format = "";
+    /** For 304 responses, which validator (`etag` or `date`) matched. */
+    const char* conditional = nullptr;
+    std::chrono::steady_clock::duration lookup{0};
+    std::chrono::steady_clock::duration decode{0};
+    std::chrono::steady_clock::duration render{0};
+  };
+
   struct Target {
-    Target(const TargetConfig& c) : config(c), index(c.log_path()) {}
-    int HandleGet(Server* srv, const char* uri, const web::Request& req, web::Response* resp);
+    Target(const TargetConfig& c)
+        : config(c),
+          index(c.log_path(), c.rescan_interval_ms() ? std::chrono::milliseconds(c.rescan_interval_ms()) : LogIndex::kDefaultRescanInterval)
+    {}
+    /**
+     * Handles a request for the target, escalating \p ticket if it needs rendering.
+     *
+     * If \p trace is set, fills it in for the metrics.
+     */
+    int HandleGet(Server* srv, const char* uri, const web::Request& req, web::Response* resp, Admission::Ticket* ticket, RequestTrace* trace);
+    /** Handles `events.json`, the events of a range of days (given in the query string) as NDJSON. */
+    int HandleEvents(Server* srv, const web::Request& req, web::Response* resp, Admission::Ticket* ticket, RequestTrace* trace);
+    /** Handles `search.html` and `search.json`, with the query (and page) in the query string. */
+    int HandleSearch(Server* srv, const std::string& format, const web::Request& req, web::Response* resp, Admission::Ticket* ticket, RequestTrace* trace);
+    /**
+     * Handles `said.*`, the lines of a nick (or an account) in any log format, optionally limited
+     * to a range of days, all given in the query string.
+     */
+    int HandleSaid(Server* srv, const std::string& format, const web::Request& req, web::Response* resp, Admission::Ticket* ticket, RequestTrace* trace);
+    /**
+     * Handles `grep.*`, the lines matching a regular expression in a range of days, in any log
+     * format. The pattern, the range, and how many matches and lines of context to show, are all
+     * given in the query string.
+     */
+    int HandleGrep(Server* srv, const std::string& format, const web::Request& req, web::Response* resp, Admission::Ticket* ticket, RequestTrace* trace);
     web::WebsocketClientHandler* HandleWebsocketClient(Server* srv, const char* uri, const char* protocol);
+    void Render(LogFormatter* fmt, const YMD& date, const std::optional<YMD>& prev, const std::optional<YMD>& next, RequestTrace* trace);
+    /** Renders the days of a month on the worker pool, for Render. */
+    void RenderDays(LogFormatter* fmt, const YMD& date, RequestTrace* trace);
+    /**
+     * Formats the lines of \p dates matching \p re with \p fmt, scanning the days on the worker
+     * pool, and stopping once \p limit lines have matched.
+     */
+    void Grep(LogFormatter* fmt, std::unique_ptr<RE2> re, const std::vector<YMD>& dates, unsigned context, unsigned limit, RequestTrace* trace);
+    /**
+     * Returns the uncompressed rendering of a frozen page, from the cache if possible.
+     *
+     * Returns `nullptr` if the page needed rendering, but \p ticket couldn't be escalated.
+     */
+    RenderCache::Body RenderCached(Server* srv, const std::string& key, std::string_view format, const YMD& date, const std::optional<YMD>& prev, const std::optional<YMD>& next, Admission::Ticket* ticket, RequestTrace* trace);
+    /**
+     * Sends the exported file of a frozen page, if there is one in \p encoding.
+     *
+     * Returns the response code, or 0 if nothing was sent.
+     */
+    int SendExported(const char* uri, web::Response* resp, std::string_view format, web::Encoding encoding, std::string extra_headers);
+    /**
+     * Returns the index page of year \p y (-1 for all years) in \p encoding.
+     *
+     * Called with the index lock held in \p lock. Only the cached pages (or a copy of the dates) are
+     * looked up under it: it's released for rendering and compressing, and returned released.
+     */
+    RenderCache::Body IndexPage(int y, web::Encoding encoding, std::unique_lock<std::mutex>* lock);
+
+    /** Rendered index page, valid for as long as the index stays at the same generation. */
+    struct CachedIndex {
+      std::uint64_t generation = 0;
+      RenderCache::Body bodies[3]; // by web::Encoding
+    };
+
     TargetConfig config;
     LogIndex index;
+    LineOffsets offsets;
+    /** Pool for rendering multi-day pages, or `nullptr` to render them on the calling thread. */
+    WorkerPool* workers = nullptr;
+    /** Directory (with a trailing `/`) of the target's exported pages, or empty if not set. */
+    std::string export_dir;
+    /** Index pages by year (-1 for `all.html`), guarded by the index lock. */
+    std::unordered_map<int, CachedIndex> index_pages;
+    /** Search index, or `nullptr` if search isn't enabled. */
+    std::unique_ptr<SearchIndex> search;
+    /** Nick index, or `nullptr` if it isn't enabled. */
+    std::unique_ptr<NickIndex> nicks;
   };
 
   const char* StripTarget(const char* uri, Target** target);
+  int HandleRequest(const web::Request& req, web::Response* resp, RequestTrace* trace);
+  /** Refuses a request that wasn't admitted, with a 503. */
+  int Shed(web::Response* resp);
+  void ObserveRequest(const RequestTrace& trace, int code, std::size_t bytes, std::chrono::steady_clock::duration elapsed);
 
   event::Loop* loop_;
+  /** Server start time (in seconds), to keep index page ETags from different runs apart. */
+  const std::int64_t started_;
 
   std::unordered_map<std::string_view, std::unique_ptr<Target>> targets_;
   std::unique_ptr<Stalker> stalker_;
+  std::unique_ptr<RenderCache> cache_;
+  std::unique_ptr<Admission> admission_;
+  std::unique_ptr<WorkerPool> workers_;
 
   std::unique_ptr<prometheus::Exposer> metric_exposer_;
   std::shared_ptr<prometheus::Registry> metric_registry_;
+  prometheus::Family<prometheus::Histogram>* metric_request_seconds_ = nullptr;
+  prometheus::Family<prometheus::Histogram>* metric_response_bytes_ = nullptr;
+  prometheus::Family<prometheus::Counter>* metric_responses_ = nullptr;
+  prometheus::Family<prometheus::Counter>* metric_bytes_out_ = nullptr;
+  prometheus::Family<prometheus::Counter>* metric_conditional_hits_ = nullptr;
+  prometheus::Family<prometheus::Histogram>* metric_phase_seconds_ = nullptr;
 
   const RE2 re_index_ = RE2("(?:(\\d+|all)\\.html)?");
-  const RE2 re_logfile_ = RE2("(\\d+)-(\\d+)(?:-(\\d+))?(\\.html|\\.txt|-raw\\.txt)");
+  const RE2 re_logfile_ = RE2("(\\d+)-(\\d+)(?:-(\\d+))?(\\.html|\\.txt|-raw\\.txt|\\.json)");
+  const RE2 re_date_ = RE2("(\\d{4})-(\\d{2})-(\\d{2})");
   const RE2 re_stalker_ = RE2("stalker(\\.html|\\.txt|-raw\\.txt)");
+  const RE2 re_search_ = RE2("search(\\.html|\\.json)");
+  const RE2 re_said_ = RE2("said(\\.html|\\.txt|-raw\\.txt|\\.json)");
+  const RE2 re_grep_ = RE2("grep(\\.html|\\.txt|-raw\\.txt|\\.json)");
+  const RE2 re_nick_ = RE2("[A-Za-z0-9\\[\\]\\\\`_^{|}~-]{1,64}");
 
   std::unique_ptr<web::Server> web_server_;
 
-  static std::unique_ptr<LogFormatter> CreateFormatter(const std::string& format, web::Response* resp, std::string_view extra_headers);
+  static std::unique_ptr<LogFormatter> CreateFormatter(const std::string& format, web::Response* resp, std::string_view extra_headers, web::Encoding encoding);
 };
 
 } // namespace esologs
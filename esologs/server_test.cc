@@ -1,15 +1,68 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
 #include <fstream>
+#include <future>
 #include <memory>
+#include <optional>
+#include <regex>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "httplib/httplib.h"
 
 #include "esologs/config.pb.h"
+#include "esologs/format.h"
+#include "esologs/index.h"
 #include "esologs/server.h"
 
+extern "C" {
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
 namespace esologs {
 
+namespace {
+
+/** Days of the test logs. */
+const char* const kTestDays[] = {"2020-12-29", "2020-12-30", "2020-12-31", "2021-01-01", "2021-01-02", "2021-01-03"};
+
+/** Returns the lines of the `.txt` pages of all the test days. */
+std::vector<std::string> TextLines(httplib::Client* client) {
+  std::vector<std::string> lines;
+  for (const char* day : kTestDays) {
+    auto resp = client->Get((std::string("/test/") + day + ".txt").c_str());
+    EXPECT_EQ(200, resp->status) << day;
+    std::istringstream in(resp->body);
+    for (std::string line; std::getline(in, line); )
+      lines.push_back(line);
+  }
+  return lines;
+}
+
+/** Returns the lines of a multi-day page, other than the empty ones and the headings of days. */
+std::vector<std::string> ListedLines(const std::string& body) {
+  std::vector<std::string> lines;
+  std::istringstream in(body);
+  std::regex heading_re("^\\d{4}-\\d\\d-\\d\\d:$");
+  for (std::string line; std::getline(in, line); ) {
+    if (!line.empty() && !std::regex_match(line, heading_re))
+      lines.push_back(line);
+  }
+  return lines;
+}
+
+} // unnamed namespace
+
 struct ServerTest : public ::testing::Test {
   ServerTest() {
     Config config;
@@ -40,6 +93,7 @@ TEST_F(ServerTest, DiffGoldenFiles) {
     {"/test/2021-01-01.html",    "testdata/golden/esologs.2021-01-01.html"},
     {"/test/2021-01-01.txt",     "testdata/golden/esologs.2021-01-01.txt"},
     {"/test/2021-01-01-raw.txt", "testdata/golden/esologs.2021-01-01-raw.txt"},
+    {"/test/2021-01-01.json",    "testdata/golden/esologs.2021-01-01.json"},
     {"/test/2021-01.html",       "testdata/golden/esologs.2021-01.html"},
   };
   static const size_t ntests = sizeof tests / sizeof tests[0];
@@ -57,4 +111,587 @@ TEST_F(ServerTest, DiffGoldenFiles) {
   }
 }
 
+TEST_F(ServerTest, Assets) {
+  auto index = client->Get("/index.html");
+  ASSERT_EQ(200, index->status);
+  EXPECT_FALSE(index->body.empty());
+  std::string etag = index->get_header_value("ETag");
+  EXPECT_FALSE(etag.empty());
+
+  // the root is the front page
+  auto root = client->Get("/");
+  ASSERT_EQ(200, root->status);
+  EXPECT_EQ(index->body, root->body);
+  EXPECT_EQ(etag, root->get_header_value("ETag"));
+
+  EXPECT_EQ(304, client->Get("/", httplib::Headers{{"If-None-Match", etag}})->status);
+  EXPECT_EQ(200, client->Get("/log.css")->status);
+  EXPECT_EQ(404, client->Get("/nonexistent.css")->status);
+}
+
+// The same page in different content codings must not share an entity tag, or a cache could
+// revalidate one with the other.
+TEST_F(ServerTest, EncodedETags) {
+  for (const char* url : {"/test/", "/test/2021-01-01.txt", "/test/2021-01.html"}) {
+    SCOPED_TRACE(url);
+    auto identity = client->Head(url);
+    ASSERT_EQ(200, identity->status);
+    std::string etag = identity->get_header_value("ETag");
+    ASSERT_TRUE(etag.size() > 2 && etag.back() == '"') << etag;
+    EXPECT_EQ("", identity->get_header_value("Content-Encoding"));
+    EXPECT_EQ("Accept-Encoding", identity->get_header_value("Vary"));
+
+    for (const char* coding : {"gzip", "br"}) {
+      auto encoded = client->Head(url, httplib::Headers{{"Accept-Encoding", coding}});
+      ASSERT_EQ(200, encoded->status);
+      EXPECT_EQ(coding, encoded->get_header_value("Content-Encoding"));
+      std::string encoded_etag = encoded->get_header_value("ETag");
+      EXPECT_EQ(etag.substr(0, etag.size() - 1) + "-" + coding + "\"", encoded_etag);
+
+      EXPECT_EQ(304, client->Get(url, httplib::Headers{{"Accept-Encoding", coding}, {"If-None-Match", encoded_etag}})->status);
+      EXPECT_EQ(200, client->Head(url, httplib::Headers{{"Accept-Encoding", coding}, {"If-None-Match", etag}})->status);
+    }
+    EXPECT_EQ(304, client->Get(url, httplib::Headers{{"If-None-Match", etag}})->status);
+  }
+}
+
+TEST_F(ServerTest, IndexETag) {
+  auto index = client->Get("/test/");
+  ASSERT_EQ(200, index->status);
+  std::string etag = index->get_header_value("ETag");
+  ASSERT_FALSE(etag.empty());
+  EXPECT_EQ(etag, client->Get("/test/")->get_header_value("ETag"));
+
+  auto cached = client->Get("/test/", httplib::Headers{{"If-None-Match", etag}});
+  EXPECT_EQ(304, cached->status);
+  EXPECT_EQ(etag, cached->get_header_value("ETag"));
+  EXPECT_EQ(304, client->Get("/test/", httplib::Headers{{"If-None-Match", "\"other\", W/" + etag}})->status);
+  EXPECT_EQ(200, client->Get("/test/", httplib::Headers{{"If-None-Match", "\"other\""}})->status);
+}
+
+TEST_F(ServerTest, RangeRequests) {
+  std::string golden;
+  std::getline(std::ifstream("testdata/golden/esologs.2021-01-01-raw.txt"), golden, '\0');
+  ASSERT_GT(golden.size(), 200);
+
+  auto resp = client->Get("/test/2021-01-01-raw.txt", httplib::Headers{{"Range", "bytes=100-199"}});
+  ASSERT_EQ(206, resp->status);
+  EXPECT_EQ(golden.substr(100, 100), resp->body);
+  EXPECT_EQ("bytes 100-199/" + std::to_string(golden.size()), resp->get_header_value("Content-Range"));
+
+  resp = client->Get("/test/2021-01-01-raw.txt", httplib::Headers{{"Range", "bytes=-10"}});
+  ASSERT_EQ(206, resp->status);
+  EXPECT_EQ(golden.substr(golden.size() - 10), resp->body);
+
+  resp = client->Get("/test/2021-01-01-raw.txt", httplib::Headers{{"Range", "bytes=" + std::to_string(golden.size()) + "-"}});
+  EXPECT_EQ(416, resp->status);
+
+  resp = client->Get("/test/2021-01-01-raw.txt", httplib::Headers{{"Range", "bytes=0-9"}, {"If-Range", "\"stale\""}});
+  ASSERT_EQ(200, resp->status);
+  EXPECT_EQ(golden, resp->body);
+}
+
+TEST_F(ServerTest, EventsJson) {
+  std::string golden;
+  std::getline(std::ifstream("testdata/golden/esologs.2021-01-01.json"), golden, '\0');
+  ASSERT_GT(golden.size(), 0);
+
+  auto resp = client->Get("/test/events.json?from=2021-01-01&to=2021-01-01");
+  ASSERT_EQ(200, resp->status);
+  EXPECT_EQ(golden, resp->body);
+
+  // a range is the `.json` pages of its days, one after another, skipping days without logs
+  auto prev = client->Get("/test/2020-12-31.json");
+  ASSERT_EQ(200, prev->status);
+  resp = client->Get("/test/events.json?from=2020-12-31&to=2021-01-01");
+  ASSERT_EQ(200, resp->status);
+  EXPECT_EQ(prev->body + golden, resp->body);
+  resp = client->Get("/test/events.json?from=2020-12-31&to=2021-01-20");
+  ASSERT_EQ(200, resp->status);
+  EXPECT_TRUE(resp->body.starts_with(prev->body + golden));
+
+  EXPECT_EQ(400, client->Get("/test/events.json?from=2021-01-01")->status);
+  EXPECT_EQ(400, client->Get("/test/events.json?from=2021-01-02&to=2021-01-01")->status);
+  EXPECT_EQ(400, client->Get("/test/events.json?from=2020-12-01&to=2021-01-01")->status);
+  EXPECT_EQ(404, client->Get("/test/events.json?from=2021-02-01&to=2021-02-02")->status);
+}
+
+TEST_F(ServerTest, GrepTxt) {
+  auto resp = client->Get("/test/grep.txt?re=shapez&from=2020-12-29&to=2021-01-03");
+  ASSERT_EQ(200, resp->status);
+  EXPECT_EQ(
+      "\n2020-12-29:\n\n"
+      "14:33:32 <fizzie> Sounds like the shapez thing.\n"
+      "[...]\n"
+      "14:34:42 <b_jonas> fizzie: yes, it's shapez.io, the free demo version\n",
+      resp->body);
+
+  // context lines around the matches (with overlapping ones merged), and a limit on the matches
+  resp = client->Get("/test/grep.txt?re=shapez&from=2020-12-29&to=2021-01-03&context=1");
+  ASSERT_EQ(200, resp->status);
+  std::vector<std::string> lines = ListedLines(resp->body);
+  ASSERT_EQ(5u, lines.size()) << resp->body;
+  EXPECT_TRUE(lines[0].starts_with("14:32:53 <b_jonas> let me give a hint.")) << lines[0];
+  EXPECT_EQ("14:33:32 <fizzie> Sounds like the shapez thing.", lines[1]);
+  EXPECT_EQ("14:34:42 <b_jonas> fizzie: yes, it's shapez.io, the free demo version", lines[3]);
+  EXPECT_TRUE(lines[4].starts_with("14:35:36 <fizzie> Steam's been")) << lines[4];
+  resp = client->Get("/test/grep.txt?re=shapez&from=2020-12-29&to=2021-01-03&limit=1");
+  ASSERT_EQ(200, resp->status);
+  EXPECT_EQ("\n2020-12-29:\n\n14:33:32 <fizzie> Sounds like the shapez thing.\n", resp->body);
+
+  // patterns are matched against the lines as the text format shows them, case-sensitively
+  resp = client->Get("/test/grep.txt?re=Shapez&from=2020-12-29&to=2021-01-03");
+  ASSERT_EQ(200, resp->status);
+  EXPECT_EQ("", resp->body);
+  std::string folded = client->Get("/test/grep.txt?re=shapez&from=2020-12-29&to=2021-01-03")->body;
+  resp = client->Get("/test/grep.txt?re=%28%3Fi%29Shapez&from=2020-12-29&to=2021-01-03");
+  ASSERT_EQ(200, resp->status);
+  EXPECT_EQ(folded, resp->body);
+
+  std::vector<std::string> expected;
+  std::regex fizzie_re("fizzie");
+  for (const std::string& line : TextLines(client.get())) {
+    if (std::regex_search(line, fizzie_re))
+      expected.push_back(line);
+  }
+  resp = client->Get("/test/grep.txt?re=fizzie&from=2020-12-29&to=2021-01-03&limit=1000");
+  ASSERT_EQ(200, resp->status);
+  lines = ListedLines(resp->body);
+  lines.erase(std::remove(lines.begin(), lines.end(), "[...]"), lines.end());
+  ASSERT_FALSE(expected.empty());
+  EXPECT_EQ(expected, lines);
+
+  EXPECT_EQ(400, client->Get("/test/grep.txt?re=%28&from=2020-12-29&to=2021-01-03")->status);
+  EXPECT_EQ(400, client->Get("/test/grep.txt?re=shapez")->status);
+  EXPECT_EQ(400, client->Get("/test/grep.txt?from=2020-12-29&to=2021-01-03")->status);
+  EXPECT_EQ(400, client->Get("/test/grep.txt?re=shapez&from=2021-01-03&to=2020-12-29")->status);
+}
+
+/**
+ * Like ServerTest, but with the indices enabled. As they're stored next to the logfiles, the server
+ * gets a copy of the test logs of its own.
+ */
+struct IndexedServerTest : public ::testing::Test {
+  IndexedServerTest() {
+    const char* tmp = std::getenv("TEST_TMPDIR");
+    log_path = std::filesystem::path(tmp ? tmp : "/tmp") / "esologs_server_test_logs";
+    std::filesystem::remove_all(log_path);
+    std::filesystem::copy("testdata/logs", log_path, std::filesystem::copy_options::recursive);
+
+    Config config;
+    config.set_listen_port("127.0.0.1:0");
+    config.set_search(true);
+    config.set_nick_index(true);
+    TargetConfig *target = config.add_target();
+    target->set_name("test");
+    target->set_log_path(log_path.string());
+    target->set_nick("esolangs");
+    target->set_title("test logs");
+    target->set_rescan_interval_ms(kRescanMs);
+    server = std::make_unique<Server>(config, &loop);
+    client = std::make_unique<httplib::Client>("127.0.0.1", server->port());
+  }
+
+  ~IndexedServerTest() {
+    client.reset();
+    server.reset();
+    std::filesystem::remove_all(log_path);
+  }
+
+  /** Gets \p url, retrying for as long as the indices are still being built. */
+  httplib::Result GetIndexed(const std::string& url) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+    while (true) {
+      auto resp = client->Get(url.c_str());
+      if (!resp || resp->status != 503 || std::chrono::steady_clock::now() > deadline)
+        return resp;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  }
+
+  /** How often the server looks for new days, in the copy of the logs. */
+  static constexpr int kRescanMs = 100;
+
+  std::filesystem::path log_path;
+  event::Loop loop;
+  std::unique_ptr<Server> server;
+  std::unique_ptr<httplib::Client> client;
+};
+
+TEST_F(IndexedServerTest, IndexETagChangesWithNewDay) {
+  auto before = client->Get("/test/");
+  ASSERT_EQ(200, before->status);
+  std::string etag = before->get_header_value("ETag");
+  ASSERT_FALSE(etag.empty());
+  EXPECT_EQ(std::string::npos, before->body.find("2021-01-04"));
+
+  std::filesystem::copy_file(log_path / "2021/1/3.pb", log_path / "2021/1/4.pb");
+  std::this_thread::sleep_for(std::chrono::milliseconds(2 * kRescanMs));
+
+  auto after = client->Get("/test/", httplib::Headers{{"If-None-Match", etag}});
+  ASSERT_EQ(200, after->status);
+  EXPECT_NE(std::string::npos, after->body.find("2021-01-04"));
+  std::string new_etag = after->get_header_value("ETag");
+  EXPECT_NE(etag, new_etag);
+  EXPECT_EQ(304, client->Get("/test/", httplib::Headers{{"If-None-Match", new_etag}})->status);
+}
+
+TEST_F(IndexedServerTest, SearchJson) {
+  auto resp = GetIndexed("/test/search.json?q=BBC+stream");
+  ASSERT_EQ(200, resp->status);
+  EXPECT_NE(std::string::npos, resp->body.find("\"total\":1,")) << resp->body;
+  EXPECT_NE(std::string::npos, resp->body.find("{\"date\":\"2021-01-01\",\"line\":0,\"time\":\"00:00:20\",\"nick\":\"fizzie\"")) << resp->body;
+  EXPECT_NE(std::string::npos, resp->body.find("\"text\":\"BBC stream is a bit late too.\"")) << resp->body;
+
+  // matches are the messages containing every term, ignoring case
+  std::vector<std::string> messages;
+  std::regex message_re("^\\d\\d:\\d\\d:\\d\\d (<[^>]*> |\\* \\S+ )(.*)$");
+  for (const std::string& line : TextLines(client.get())) {
+    std::smatch m;
+    if (std::regex_match(line, m, message_re)) {
+      std::string text = m[2];
+      std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+      messages.push_back(text);
+    }
+  }
+  static const std::vector<std::string> queries[] = {{"shapez"}, {"the", "game"}, {"sandstorm"}, {"bbc", "stream"}};
+  for (const auto& terms : queries) {
+    std::string query;
+    for (const std::string& term : terms)
+      query += (query.empty() ? "" : "+") + term;
+    auto expected = std::count_if(messages.begin(), messages.end(), [&terms](const std::string& text) {
+        return std::all_of(terms.begin(), terms.end(), [&text](const std::string& term) { return text.find(term) != std::string::npos; });
+      });
+    ASSERT_GT(expected, 0) << query;
+    resp = GetIndexed("/test/search.json?q=" + query);
+    ASSERT_EQ(200, resp->status) << query;
+    EXPECT_NE(std::string::npos, resp->body.find("\"total\":" + std::to_string(expected) + ",")) << query << ": " << resp->body;
+  }
+
+  resp = GetIndexed("/test/search.json?q=xyzzyplugh");
+  ASSERT_EQ(200, resp->status);
+  EXPECT_NE(std::string::npos, resp->body.find("\"total\":0,")) << resp->body;
+}
+
+TEST_F(IndexedServerTest, SearchNeedsTrigram) {
+  EXPECT_EQ(400, GetIndexed("/test/search.json?q=ab")->status);
+  EXPECT_EQ(400, GetIndexed("/test/search.json?q=ab+cd")->status);
+  EXPECT_EQ(400, GetIndexed("/test/search.json")->status);
+  EXPECT_EQ(400, GetIndexed("/test/search.html?q=ab")->status);
+  // but the HTML page without a query is the search form
+  EXPECT_EQ(200, GetIndexed("/test/search.html")->status);
+  // and short terms are fine next to a longer one
+  EXPECT_EQ(200, GetIndexed("/test/search.json?q=bbc+a")->status);
+}
+
+TEST_F(IndexedServerTest, SaidTxt) {
+  auto resp = GetIndexed("/test/said.txt?nick=fizzie");
+  ASSERT_EQ(200, resp->status);
+
+  // the lines are those of the nick in the day pages, under headings for their days
+  std::vector<std::string> said = ListedLines(resp->body);
+  std::vector<std::string> expected;
+  std::regex line_re("^\\d\\d:\\d\\d:\\d\\d (<fizzie> |\\* fizzie |-!- fizzie has ).*");
+  for (const std::string& line : TextLines(client.get())) {
+    if (std::regex_match(line, line_re))
+      expected.push_back(line);
+  }
+  ASSERT_FALSE(expected.empty());
+  EXPECT_EQ(expected, said);
+
+  // nicks are matched ignoring case, with the rfc1459 casemapping
+  EXPECT_EQ(resp->body, GetIndexed("/test/said.txt?nick=FiZZIE")->body);
+  resp = GetIndexed("/test/said.txt?nick=BWBellairs%5BNNRF%5D");
+  ASSERT_EQ(200, resp->status);
+  EXPECT_NE(std::string::npos, resp->body.find("02:37:04 -!- BWBellairs[NNRF] has joined.\n")) << resp->body;
+  EXPECT_EQ(resp->body, GetIndexed("/test/said.txt?nick=bwbellairs%7Bnnrf%7D")->body);
+
+  resp = GetIndexed("/test/said.txt?nick=fizzie&from=2021-01-01&to=2021-01-02");
+  ASSERT_EQ(200, resp->status);
+  EXPECT_NE(std::string::npos, resp->body.find("2021-01-01:\n")) << resp->body;
+  EXPECT_EQ(std::string::npos, resp->body.find("2020-12-29:\n")) << resp->body;
+
+  EXPECT_EQ(400, GetIndexed("/test/said.txt")->status);
+  EXPECT_EQ(400, GetIndexed("/test/said.txt?nick=fizzie&account=fizzie")->status);
+  EXPECT_EQ(400, GetIndexed("/test/said.txt?nick=fizzie&from=2021-1-1")->status);
+}
+
+/**
+ * Like ServerTest, but with month pages rendered on a pool of four threads. Their output must be
+ * byte-identical to the sequential rendering, and so to the pages exported by esologs_export.
+ */
+struct ParallelServerTest : public ::testing::Test {
+  ParallelServerTest() {
+    Config config;
+    config.set_listen_port("127.0.0.1:0");
+    config.set_render_threads(4);
+    TargetConfig *target = config.add_target();
+    target->set_name("test");
+    target->set_log_path("testdata/logs");
+    target->set_nick("esolangs");
+    target->set_title("test logs");
+    target->set_about("<p>These are test logs.</p>\n");
+    target->set_announce("<p>This is a test announcement.</p>\n");
+    target_config = *target;
+    server = std::make_unique<Server>(config, &loop);
+    client = std::make_unique<httplib::Client>("127.0.0.1", server->port());
+  }
+
+  /** Renders a page on the calling thread, the way the server does with `render_threads: 1`. */
+  std::string RenderSequential(const YMD& date, std::string_view format) {
+    LogIndex index(target_config.log_path());
+    std::optional<YMD> prev, next;
+    EXPECT_TRUE(index.Lookup(date, &prev, &next));
+    std::string rendered;
+    FormatLog(LogFormatter::Create(format, &rendered).get(), &index, target_config, date, prev, next);
+    return rendered;
+  }
+
+  TargetConfig target_config;
+  event::Loop loop;
+  std::unique_ptr<Server> server;
+  std::unique_ptr<httplib::Client> client;
+};
+
+TEST_F(ParallelServerTest, MonthsMatchSequentialRendering) {
+  for (const YMD& month : {YMD(2020, 12), YMD(2021, 1)}) {
+    for (const char* format : {".html", ".txt", "-raw.txt", ".json"}) {
+      char url[32];
+      std::snprintf(url, sizeof url, "/test/%04d-%02d%s", month.year, month.month, format);
+      SCOPED_TRACE(url);
+      auto resp = client->Get(url);
+      ASSERT_EQ(200, resp->status);
+      EXPECT_EQ(RenderSequential(month, format), resp->body);
+    }
+  }
+
+  std::string golden;
+  std::getline(std::ifstream("testdata/golden/esologs.2021-01.html"), golden, '\0');
+  ASSERT_GT(golden.size(), 0);
+  EXPECT_EQ(golden, client->Get("/test/2021-01.html")->body);
+}
+
+TEST_F(ParallelServerTest, ExportMatchesRendering) {
+  const char* tmp = std::getenv("TEST_TMPDIR");
+  std::filesystem::path dir = std::filesystem::path(tmp ? tmp : "/tmp") / "esologs_export_test";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  {
+    std::ofstream config(dir / "esologs.config");
+    config << "target { name: \"test\" log_path: \"testdata/logs\" nick: \"esolangs\" title: \"test logs\""
+           << " about: \"<p>These are test logs.</p>\\n\" announce: \"<p>This is a test announcement.</p>\\n\" }\n";
+  }
+  std::string command = "esologs/esologs_export --threads=4 " + (dir / "esologs.config").string() + " " + (dir / "out").string();
+  ASSERT_EQ(0, std::system(command.c_str()));
+
+  // Every exported page (with its compressed siblings) must be what the server would send.
+  unsigned pages = 0;
+  for (const auto& entry : std::filesystem::directory_iterator(dir / "out" / "test")) {
+    std::string name = entry.path().filename().string();
+    if (name.ends_with(".gz") || name.ends_with(".br"))
+      continue;
+    SCOPED_TRACE(name);
+    EXPECT_TRUE(std::filesystem::exists(dir / "out" / "test" / (name + ".gz")));
+    EXPECT_TRUE(std::filesystem::exists(dir / "out" / "test" / (name + ".br")));
+
+    std::string exported;
+    std::getline(std::ifstream(entry.path(), std::ios::binary), exported, '\0');
+    auto resp = client->Get(name == "index.html" ? "/test/" : "/test/" + name);
+    ASSERT_EQ(200, resp->status);
+    EXPECT_EQ(resp->body, exported);
+    ++pages;
+  }
+  // the frozen days that aren't the last one, their month, and the index pages
+  EXPECT_TRUE(std::filesystem::exists(dir / "out" / "test" / "2020-12-29.html"));
+  EXPECT_TRUE(std::filesystem::exists(dir / "out" / "test" / "2020-12.html"));
+  EXPECT_TRUE(std::filesystem::exists(dir / "out" / "test" / "all.html"));
+  EXPECT_GT(pages, 10u);
+
+  std::filesystem::remove_all(dir);
+}
+
+/** Like ServerTest, but with the event loop backend, and a raw socket for checking the framing. */
+struct LoopServerTest : public ::testing::Test {
+  LoopServerTest() {
+    config.set_listen_port("127.0.0.1:0");
+    config.set_event_loop_server(true);
+    TargetConfig *target = config.add_target();
+    target->set_name("test");
+    target->set_log_path("testdata/logs");
+    target->set_nick("esolangs");
+    target->set_title("test logs");
+    server = std::make_unique<Server>(config, &loop);
+  }
+
+  ~LoopServerTest() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  /** Opens a second connection, which gives up on reads after \p timeout_s seconds. */
+  int ConnectOther(int timeout_s) {
+    int other = socket(AF_INET, SOCK_STREAM, 0);
+    struct timeval timeout = { timeout_s, 0 };
+    setsockopt(other, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server->port());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (other >= 0 && connect(other, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) != 0) {
+      close(other);
+      return -1;
+    }
+    return other;
+  }
+
+  /** Runs \p client on a thread of its own, while running the loop on this one. */
+  template <typename F>
+  void WithClient(F client) {
+    auto done = std::async(std::launch::async, client);
+    while (done.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+      loop.Poll();
+    done.get();
+  }
+
+  bool Connect() {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server->port());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return fd >= 0 && connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) == 0;
+  }
+
+  bool Send(std::string_view request) {
+    return send(fd, request.data(), request.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.size());
+  }
+
+  /**
+   * Reads a response (which must have a Content-Length) from the socket, and returns its head.
+   * Returns an empty string if the connection was closed first.
+   */
+  std::string ReadResponse() {
+    std::size_t head_end;
+    while ((head_end = in.find("\r\n\r\n")) == std::string::npos) {
+      if (!Fill())
+        return "";
+    }
+    std::string head = in.substr(0, head_end + 2);
+    std::size_t length_pos = head.find("Content-Length: ");
+    if (length_pos == std::string::npos)
+      return "";
+    std::size_t size = head_end + 4 + std::strtoul(head.c_str() + length_pos + 16, nullptr, 10);
+    while (in.size() < size) {
+      if (!Fill())
+        return "";
+    }
+    in.erase(0, size);
+    return head;
+  }
+
+  /** Returns `true` if the server has closed the connection (with nothing more to read). */
+  bool Closed() {
+    return in.empty() && !Fill();
+  }
+
+  bool Fill() {
+    char buf[4096];
+    ssize_t got = recv(fd, buf, sizeof buf, 0);
+    if (got <= 0)
+      return false;
+    in.append(buf, got);
+    return true;
+  }
+
+  Config config;
+  event::Loop loop;
+  std::unique_ptr<Server> server;
+  int fd = -1;
+  std::string in;
+};
+
+TEST_F(LoopServerTest, KeepAlive) {
+  WithClient([this]() {
+    ASSERT_TRUE(Connect());
+
+    ASSERT_TRUE(Send("GET /test/ HTTP/1.1\r\nHost: localhost\r\n\r\n"));
+    std::string head = ReadResponse();
+    EXPECT_TRUE(head.starts_with("HTTP/1.1 200 ")) << head;
+    EXPECT_EQ(std::string::npos, head.find("Connection: close")) << head;
+
+    // pipelined, and on the same connection
+    ASSERT_TRUE(Send(
+        "GET /test/2021-01-01.txt HTTP/1.1\r\nHost: localhost\r\n\r\n"
+        "GET /test/nonexistent HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n"));
+    head = ReadResponse();
+    EXPECT_TRUE(head.starts_with("HTTP/1.1 200 ")) << head;
+    EXPECT_EQ(std::string::npos, head.find("Connection: close")) << head;
+    head = ReadResponse();
+    EXPECT_TRUE(head.starts_with("HTTP/1.1 404 ")) << head;
+    EXPECT_NE(std::string::npos, head.find("\r\nConnection: close\r\n")) << head;
+    EXPECT_TRUE(Closed());
+  });
+}
+
+TEST_F(LoopServerTest, Http10ClosesConnection) {
+  WithClient([this]() {
+    ASSERT_TRUE(Connect());
+    ASSERT_TRUE(Send("GET /test/ HTTP/1.0\r\n\r\n"));
+    std::string head = ReadResponse();
+    EXPECT_TRUE(head.starts_with("HTTP/1.1 200 ")) << head;
+    EXPECT_NE(std::string::npos, head.find("\r\nConnection: close\r\n")) << head;
+    EXPECT_TRUE(Closed());
+  });
+}
+
+// A client that doesn't read its responses must not hold up the worker threads: what the socket
+// doesn't take is left for the loop to send.
+TEST_F(LoopServerTest, SlowReader) {
+  server.reset();
+  config.set_num_threads(1);
+  server = std::make_unique<Server>(config, &loop);
+
+  WithClient([this]() {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    int small = 4096;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &small, sizeof small);
+    ASSERT_TRUE(Connect());
+    std::string requests;
+    for (int i = 0; i < 100; ++i)
+      requests += "GET /test/2021-01.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    ASSERT_TRUE(Send(requests));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    int other = ConnectOther(5);
+    ASSERT_GE(other, 0);
+    std::string request = "GET /test/ HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    ASSERT_EQ(static_cast<ssize_t>(request.size()), send(other, request.data(), request.size(), MSG_NOSIGNAL));
+    std::string response;
+    char buf[4096];
+    for (ssize_t got; (got = recv(other, buf, sizeof buf, 0)) > 0; )
+      response.append(buf, got);
+    close(other);
+    EXPECT_TRUE(response.starts_with("HTTP/1.1 200 ")) << response.substr(0, 100);
+
+    // and the slow client still gets all of its responses
+    for (int i = 0; i < 100; ++i) {
+      std::string head = ReadResponse();
+      ASSERT_TRUE(head.starts_with("HTTP/1.1 200 ")) << i << ": " << head;
+    }
+  });
+}
+
+TEST_F(LoopServerTest, MethodNotAllowed) {
+  WithClient([this]() {
+    ASSERT_TRUE(Connect());
+    // the body isn't read, so the connection can't be reused either
+    ASSERT_TRUE(Send("POST /test/ HTTP/1.1\r\nHost: localhost\r\nContent-Length: 2\r\n\r\nhi"));
+    std::string head = ReadResponse();
+    EXPECT_TRUE(head.starts_with("HTTP/1.1 405 ")) << head;
+    EXPECT_NE(std::string::npos, head.find("\r\nAllow: GET, HEAD\r\n")) << head;
+    EXPECT_NE(std::string::npos, head.find("\r\nConnection: close\r\n")) << head;
+    EXPECT_TRUE(Closed());
+  });
+}
+
 } // namespace esologs
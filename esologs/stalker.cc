@@ -1,21 +1,44 @@
+#include <chrono>
+#include <iterator>
+#include <limits>
+#include <vector>
+
 #include <date/date.h>
 #include <prometheus/gauge.h>
+#include <prometheus/histogram.h>
 
 #include "base/buffer.h"
 #include "esologs/config.pb.h"
+#include "esologs/search.h"
 #include "esologs/stalker.h"
+#include "esologs/timing.h"
+#include "web/encoding.h"
+#include "web/etag.h"
 #include "web/server.h"
+#include "web/writer.h"
 
 namespace esologs {
 
+namespace {
+
+void ObserveNs(prometheus::Histogram* metric, std::int64_t from_ns, std::int64_t to_ns) {
+  if (metric && from_ns && to_ns >= from_ns)
+    metric->Observe((to_ns - from_ns) * 1e-9);
+}
+
+} // unnamed namespace
+
 class Stalker::Client : public web::WebsocketClientHandler {
  public:
   Client(Stalker* stalker, Stalker::Target* target, TargetConfig config) : stalker_(stalker), target_(target), config_(config) {}
 
   bool Send(const LogEvent& event);
+  /** Sends an event already rendered (with any day header) by someone else, like a catch-up. */
+  bool SendRendered(std::int64_t day, std::uint64_t line, std::string_view text);
   void Close();
 
   bool registered() const noexcept { return socket_ && sent_day_; }
+  bool catching_up() const noexcept { return catch_up_ != nullptr; }
 
   bool has_event(const LogEvent& event) const noexcept {
     const LogEventId& id = event.event_id();
@@ -34,6 +57,7 @@ class Stalker::Client : public web::WebsocketClientHandler {
 
   std::int64_t sent_day_ = 0;
   std::uint64_t sent_line_ = 0;
+  std::shared_ptr<CatchUp> catch_up_;
 
   std::string buffer_;
   std::unique_ptr<LogFormatter> fmt_ = LogFormatter::CreateHTML(&buffer_);
@@ -41,11 +65,158 @@ class Stalker::Client : public web::WebsocketClientHandler {
   friend class Stalker;
 };
 
+class Stalker::Snapshot {
+ public:
+  Snapshot(const std::string& format, const TargetConfig& config)
+      : format_(format), config_(config), fmt_(LogFormatter::Create(format, &scratch_))
+  {}
+
+  void Append(const LogEvent& event, const LogEvent* prev);
+  void PopFront(const LogEvent* new_front);
+  std::size_t size() const noexcept { return sizes_.size(); }
+
+  void Render(int link_year, std::string* out);
+
+ private:
+  struct Fragment {
+    std::size_t size;
+    bool day_start;
+  };
+
+  const std::string format_;
+  const TargetConfig& config_;
+
+  std::string scratch_;
+  std::unique_ptr<LogFormatter> fmt_;
+
+  std::string body_;
+  std::size_t body_start_ = 0;
+  std::deque<Fragment> sizes_;
+
+  std::string lead_;
+  int header_year_ = -1;
+  std::string header_;
+  std::string footer_;
+
+  static constexpr std::size_t kCompactAt = 65536;
+};
+
+void Stalker::Snapshot::Append(const LogEvent& event, const LogEvent* prev) {
+  std::int64_t day = event.event_id().day();
+  bool day_start = !prev || day > prev->event_id().day();
+
+  if (day_start) {
+    YMD ymd(YMD::day_number, day);
+    fmt_->FormatDay(true, ymd.year, ymd.month, ymd.day);
+    if (event.event_id().line() > 0)
+      fmt_->FormatElision();
+  }
+  fmt_->FormatEvent(event, config_);
+
+  if (sizes_.empty())
+    lead_.clear();
+  body_ += scratch_;
+  sizes_.push_back({scratch_.size(), day_start});
+  scratch_.clear();
+
+  fmt_->FormatStalkerFooter();
+  footer_.swap(scratch_);
+  scratch_.clear();
+}
+
+void Stalker::Snapshot::PopFront(const LogEvent* new_front) {
+  body_start_ += sizes_.front().size;
+  sizes_.pop_front();
+
+  if (body_start_ >= kCompactAt && body_start_ >= body_.size() / 2) {
+    body_.erase(0, body_start_);
+    body_start_ = 0;
+  }
+
+  // If the new first event doesn't start a day of its own, it needs a day header and an elision
+  // marker, like the first event on an uncached page. The main formatter is not used for this, as
+  // the raw format keeps track of the current day.
+
+  lead_.clear();
+  if (new_front && !sizes_.front().day_start) {
+    YMD ymd(YMD::day_number, new_front->event_id().day());
+    auto lead_fmt = LogFormatter::Create(format_, &lead_);
+    lead_fmt->FormatDay(true, ymd.year, ymd.month, ymd.day);
+    if (new_front->event_id().line() > 0)
+      lead_fmt->FormatElision();
+  }
+}
+
+void Stalker::Snapshot::Render(int link_year, std::string* out) {
+  if (link_year != header_year_) {
+    fmt_->FormatStalkerHeader(link_year, config_.title());
+    header_.swap(scratch_);
+    scratch_.clear();
+    header_year_ = link_year;
+  }
+  if (footer_.empty() && sizes_.empty()) {
+    fmt_->FormatStalkerFooter();
+    footer_.swap(scratch_);
+    scratch_.clear();
+  }
+
+  std::string_view body = std::string_view(body_).substr(body_start_);
+  out->reserve(header_.size() + lead_.size() + body.size() + footer_.size());
+  out->append(header_);
+  out->append(lead_);
+  out->append(body);
+  out->append(footer_);
+}
+
+struct Stalker::CatchUp {
+  // only to be touched under the clients lock, and only if not cancelled
+  Client* const client;
+  // target of the client, which outlives it
+  Target* const target;
+  // position of the next event to read from the logfiles
+  std::int64_t day;
+  std::uint64_t line;
+  std::unique_ptr<proto::DelimReader> reader;
+  // set (under the clients lock) if the client has gone away
+  bool cancelled = false;
+
+  // The events of a chunk are rendered here before taking the clients lock, and the messages
+  // record where each of them ends. The day header is added when the day changes from the
+  // previous rendered event, and an elision marker if events had to be left out.
+  struct Message {
+    std::int64_t day;
+    std::uint64_t line;
+    std::size_t end;
+  };
+  std::string rendered;
+  std::vector<Message> messages;
+  std::unique_ptr<LogFormatter> fmt = LogFormatter::CreateHTML(&rendered);
+  std::int64_t rendered_day;
+  bool elided;
+
+  CatchUp(Client* c, Target* t, std::int64_t d, std::uint64_t l, std::int64_t sent_day, bool e)
+      : client(c), target(t), day(d), line(l), rendered_day(sent_day), elided(e) {}
+};
+
+Stalker::Target::Target(const TargetConfig& c) : name(c.name()), config(c) {}
+Stalker::Target::~Target() = default;
+
 bool Stalker::Client::Send(const LogEvent& event) {
   const LogEventId& id = event.event_id();
   std::int64_t day = id.day();
-  std::uint64_t line = id.line();
 
+  if (day > sent_day_) {
+    YMD ymd(YMD::day_number, day);
+    fmt_->FormatDay(true, ymd.year, ymd.month, ymd.day);
+  }
+  fmt_->FormatEvent(event, config_);
+
+  bool sent = SendRendered(day, id.line(), buffer_);
+  buffer_.clear();
+  return sent;
+}
+
+bool Stalker::Client::SendRendered(std::int64_t day, std::uint64_t line, std::string_view text) {
   std::optional<std::size_t> wrote;
 
   {
@@ -59,17 +230,8 @@ bool Stalker::Client::Send(const LogEvent& event) {
     }
   }
 
-  if (day > sent_day_) {
-    YMD ymd(YMD::day_number, day);
-    fmt_->FormatDay(true, ymd.year, ymd.month, ymd.day);
-  }
-  fmt_->FormatEvent(event, config_);
-
-  std::size_t body_size = buffer_.size();
-  wrote = socket_->Write(web::Websocket::Type::kText, buffer_.data(), body_size);
-  buffer_.clear();
-
-  if (!wrote || *wrote != body_size) {
+  wrote = socket_->Write(web::Websocket::Type::kText, text.data(), text.size());
+  if (!wrote || *wrote != text.size()) {
     LOG(WARNING) << "stalker websocket: body write failed";
     return false;
   }
@@ -107,11 +269,29 @@ web::Websocket::Result Stalker::Client::WebsocketData(web::Websocket* socket, we
 
   {
     std::lock_guard<std::mutex> lock(stalker_->clients_lock_);
+    if (catch_up_)
+      return web::Websocket::Result::kKeepOpen; // the catch-up keeps track of the position
     if (!sent_day_)
       LOG(INFO) << "stalker: new websocket (" << msg_day << ", " << msg_line << ")";
     sent_day_ = msg_day;
     sent_line_ = msg_line;
     stalker_->clients_active_ = true;
+
+    // If the client is further behind than the oldest event in memory (say, after a laptop has
+    // been sleeping), the missing events are streamed from the logfiles before going live.
+
+    bool gap = false;
+    {
+      std::lock_guard<std::mutex> lock_events(target_->events_lock);
+      if (!target_->events.empty() && msg_day > 0) {
+        const LogEventId& front = target_->events.front().event_id();
+        gap = front.day() > msg_day || (front.day() == msg_day && front.line() > msg_line + 1);
+      }
+    }
+    if (gap) {
+      stalker_->StartCatchUp(this, msg_day, msg_line);
+      return web::Websocket::Result::kKeepOpen;
+    }
   }
 
   stalker_->UpdateClients();
@@ -119,27 +299,31 @@ web::Websocket::Result Stalker::Client::WebsocketData(web::Websocket* socket, we
 }
 
 void Stalker::Client::WebsocketClose(web::Websocket* socket) {
-  std::lock_guard<std::mutex> lock(stalker_->clients_lock_);
+  Stalker* stalker = stalker_; // outlives the self-destruct below
+  std::lock_guard<std::mutex> lock(stalker->clients_lock_);
 
-  stalker_->clients_.erase(this);  // self-destruct
-  if (stalker_->metric_clients_)
-    stalker_->metric_clients_->Set(stalker_->clients_.size());
+  if (catch_up_)
+    catch_up_->cancelled = true;
+
+  stalker->clients_.erase(this);  // self-destruct
+  if (stalker->metric_clients_)
+    stalker->metric_clients_->Set(stalker->clients_.size());
 
   bool active = false;
-  for (Client* client : stalker_->clients_) {
+  for (Client* client : stalker->clients_) {
     if (client->registered()) {
       active = true;
       break;
     }
   }
-  stalker_->clients_active_ = active;
+  stalker->clients_active_ = active;
 }
 
 Stalker::Stalker(const Config& config, event::Loop* loop, IndexMapper* indices, prometheus::Registry* metric_registry)
     : loop_(loop), indices_(indices), pipe_path_(config.pipe_socket())
 {
   for (const auto& target_config : config.target())
-    targets_.emplace_back(std::make_unique<Target>(target_config.name()));
+    targets_.emplace_back(std::make_unique<Target>(target_config));
 
   if (metric_registry) {
     metric_clients_ = &prometheus::BuildGauge()
@@ -152,15 +336,45 @@ Stalker::Stalker(const Config& config, event::Loop* loop, IndexMapper* indices,
         .Help("When was the last log message received from the stalker feed?")
         .Register(*metric_registry)
         .Add({});
+    metric_backfill_seconds_ = &prometheus::BuildGauge()
+        .Name("esologs_stalker_backfill_duration_seconds")
+        .Help("How long did the initial stalker backfill from the logfiles take?")
+        .Register(*metric_registry)
+        .Add({});
+
+    auto& latency = prometheus::BuildHistogram()
+        .Name("esologs_stalker_latency_seconds")
+        .Help("Time spent by log events in each hop from the IRC bot to the stalker websockets.")
+        .Register(*metric_registry);
+    const prometheus::Histogram::BucketBoundaries buckets{
+      0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5};
+    metric_latency_write_ = &latency.Add({{"hop", "write"}}, buckets);
+    metric_latency_pipe_ = &latency.Add({{"hop", "pipe"}}, buckets);
+    metric_latency_queue_ = &latency.Add({{"hop", "stalker_queue"}}, buckets);
+    metric_latency_websocket_ = &latency.Add({{"hop", "websocket_write"}}, buckets);
+    metric_latency_fanout_ = &latency.Add({{"hop", "fanout"}}, buckets);
+    metric_latency_total_ = &latency.Add({{"hop", "total"}}, buckets);
   }
 
+  catch_up_thread_ = std::thread(&Stalker::CatchUpWorker, this);
+
   ConnectPipe();
 }
 
-Stalker::~Stalker() {}
+Stalker::~Stalker() {
+  if (backfill_thread_.joinable())
+    backfill_thread_.join();
 
-void Stalker::Format(const TargetConfig& cfg, LogFormatter* fmt) {
-  std::int64_t day = 0;
+  {
+    std::lock_guard<std::mutex> lock(catch_up_lock_);
+    catch_up_shutdown_ = true;
+  }
+  catch_up_cv_.notify_all();
+  catch_up_thread_.join();
+}
+
+int Stalker::Serve(const TargetConfig& cfg, const std::string& format, const web::Request& req, web::Response* resp) {
+  web::Encoding encoding = web::NegotiateEncoding(req.header("Accept-Encoding"));
 
   int link_year;
   {
@@ -168,27 +382,40 @@ void Stalker::Format(const TargetConfig& cfg, LogFormatter* fmt) {
     std::lock_guard<std::mutex> lock(*index->lock());
     link_year = index->default_year();
   }
-  fmt->FormatStalkerHeader(link_year, cfg.title());
 
   Target* tgt = target(cfg.name());
-  std::lock_guard<std::mutex> lock(tgt->events_lock);
-  for (const LogEvent& event : tgt->events) {
-    std::int64_t event_day = event.event_id().day();
-    std::uint64_t event_line = event.event_id().line();
-
-    if (event_day > day) {
-      day = event_day;
-      YMD ymd(YMD::day_number, day);
-      fmt->FormatDay(true, ymd.year, ymd.month, ymd.day);
+  std::string page, etag;
+  {
+    std::lock_guard<std::mutex> lock(tgt->events_lock);
 
-      if (event_line > 0)
-        fmt->FormatElision();
+    etag = "\"" + std::to_string(tgt->last_day) + '-' + std::to_string(tgt->last_line) + '-' + std::to_string(link_year);
+    if (encoding != web::Encoding::kIdentity) {
+      etag += '-';
+      etag += web::EncodingName(encoding);
+    }
+    etag += '"';
+    if (const char* cond = req.header("If-None-Match"); cond && web::MatchesETag(cond, etag)) {
+      FormatErrorWithHeaders(resp, 304, "ETag: " + etag + "\r\nVary: Accept-Encoding\r\n", "not modified");
+      return 304;
     }
 
-    fmt->FormatEvent(event, cfg);
+    auto& snapshot = tgt->snapshots[format];
+    if (!snapshot) {
+      snapshot = std::make_unique<Snapshot>(format, tgt->config);
+      const LogEvent* prev = nullptr;
+      for (const LogEvent& event : tgt->events) {
+        snapshot->Append(event, prev);
+        prev = &event;
+      }
+    }
+    if (!req.is_head())
+      snapshot->Render(link_year, &page);
   }
 
-  fmt->FormatStalkerFooter();
+  web::Writer web(resp, LogContentType(format), 200, "ETag: " + etag + "\r\nVary: Accept-Encoding\r\n", encoding);
+  web.BufferBody();
+  web.Write(web::Ref(page));
+  return 200;
 }
 
 web::WebsocketClientHandler* Stalker::AddClient(const TargetConfig& config) {
@@ -206,9 +433,9 @@ void Stalker::ConnectionOpen() {
   state_ = kConnected;
   pipe_->WantRead(true);
 
-  if (!events_loaded_) {
+  if (!backfill_started_) {
+    backfill_started_ = true;
     Backfill();
-    events_loaded_ = true;
   }
 }
 
@@ -241,6 +468,15 @@ void Stalker::CanRead() {
     return;
   }
 
+  Arrival arrival{0, MonotonicNs()};
+  if (event.has_timing()) {
+    const LogEventTiming& timing = event.timing();
+    arrival.received_ns = timing.received_ns();
+    ObserveNs(metric_latency_write_, timing.received_ns(), timing.written_ns());
+    ObserveNs(metric_latency_pipe_, timing.piped_ns(), arrival.arrived_ns);
+    event.clear_timing();
+  }
+
   Target* tgt = target(event.event_id().target());
   if (!tgt) {
     LOG(WARNING) << "stalker: pipe event for unknown target: " << event.event_id().target();
@@ -257,16 +493,25 @@ void Stalker::CanRead() {
     tgt->last_day = event_day;
     tgt->last_line = event_line;
 
+    const LogEvent* prev = tgt->events.empty() ? nullptr : &tgt->events.back();
+    for (auto& [format, snapshot] : tgt->snapshots)
+      snapshot->Append(event, prev);
+    if (SearchIndex* search = indices_->search(tgt->name))
+      search->Add(event);
+
     tgt->events.emplace_back(std::move(event));
-    if (tgt->events.size() > kQueueSize)
+    if (tgt->events.size() > kQueueSize) {
       tgt->events.pop_front();
+      for (auto& [format, snapshot] : tgt->snapshots)
+        snapshot->PopFront(&tgt->events.front());
+    }
   }
 
   if (metric_last_received_)
     metric_last_received_->SetToCurrentTime();
 
   if (clients_active_)
-    UpdateClients();
+    UpdateClients(&arrival);
 }
 
 void Stalker::ConnectPipe() {
@@ -294,11 +539,13 @@ void Stalker::ResetPipe() {
   loop_->Delay(kReconnectDelay, base::borrow(this));
 }
 
-void Stalker::UpdateClients() {
+void Stalker::UpdateClients(const Arrival* arrival) {
   std::lock_guard<std::mutex> lock_clients(clients_lock_);
+  if (arrival)
+    ObserveNs(metric_latency_queue_, arrival->arrived_ns, MonotonicNs());
 
   for (Client* client : clients_) {
-    if (!client->registered())
+    if (!client->registered() || client->catching_up())
       continue;
 
     std::lock_guard<std::mutex> lock_events(client->target_->events_lock);
@@ -307,54 +554,303 @@ void Stalker::UpdateClients() {
     while (event != events.begin() && !client->has_event(*(event-1)))
       --event;
     for (; event != events.end(); ++event) {
-      if (!client->Send(*event)) {
+      std::int64_t send_start = metric_latency_websocket_ ? MonotonicNs() : 0;
+      bool sent = client->Send(*event);
+      if (send_start)
+        ObserveNs(metric_latency_websocket_, send_start, MonotonicNs());
+      if (!sent) {
         client->Close();
         break;
       }
     }
   }
+
+  if (arrival) {
+    std::int64_t done = MonotonicNs();
+    ObserveNs(metric_latency_fanout_, arrival->arrived_ns, done);
+    ObserveNs(metric_latency_total_, arrival->received_ns, done);
+  }
 }
 
-// TODO: consider just doing an eager backfill
 void Stalker::Backfill() {
+  // The backfill runs on its own thread, so that reading the logfiles doesn't block the event loop.
+  // Events arriving from the pipe in the meanwhile are queued normally, and the backfilled events
+  // get spliced in front of them when done. The stalker pages stay unavailable until then.
+
+  backfill_thread_ = std::thread([this]() {
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (const auto& tgt : targets_)
+      workers.emplace_back(&Stalker::BackfillTarget, this, tgt.get());
+    for (auto& worker : workers)
+      worker.join();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    LOG(INFO) << "stalker: backfill done in " << elapsed.count() << "s";
+    if (metric_backfill_seconds_)
+      metric_backfill_seconds_->Set(elapsed.count());
+
+    events_loaded_ = true;
+    if (clients_active_)
+      UpdateClients();
+  });
+}
+
+void Stalker::BackfillTarget(Target* tgt) {
   auto today = date::floor<date::days>(std::chrono::system_clock::now());
 
-  for (const auto& tgt : targets_) {
-    std::lock_guard<std::mutex> lock_events(tgt->events_lock);
+  // Take a snapshot of the available days, so that the index lock isn't held while reading.
+  // LogIndex::Open only depends on the (immutable) root path, so it's safe to call unlocked.
 
-    LogIndex* index = indices_->index(tgt->name);
+  LogIndex* index = indices_->index(tgt->name);
+  std::vector<date::sys_days> days;
+  {
     std::lock_guard<std::mutex> lock(*index->lock());
+    for (auto day = today - kBackfillDays; day <= today; day += date::days{1})
+      if (index->Lookup(YMD{day}))
+        days.push_back(day);
+  }
 
-    for (auto backfill_day = today - kBackfillDays; backfill_day <= today; backfill_day += date::days{1}) {
-      YMD ymd{backfill_day};
-      if (!index->Lookup(ymd))
-        continue;
+  // Read the days backwards from the most recent one, until the queue is full. Each day is read
+  // just once, keeping a ring of its last events that still fit in front of the later days.
 
+  std::deque<LogEvent> events;
+  try {
+    for (auto day = days.rbegin(); day != days.rend() && events.size() < kQueueSize; ++day) {
+      YMD ymd{*day};
       auto reader = index->Open(ymd.year, ymd.month, ymd.day);
-      std::uint64_t line = 0;
-      while (true) {
-        LogEvent& event = tgt->events.emplace_back();
+      if (!reader)
+        break;
 
-        if (!reader->Read(&event)) {
-          tgt->events.pop_back();
+      std::size_t room = kQueueSize - events.size();
+      std::deque<LogEvent> tail;
+      for (std::uint64_t line = 0; ; ++line) {
+        LogEvent event;
+        if (!reader->Read(&event))
           break;
-        }
-
         LogEventId* event_id = event.mutable_event_id();
-        event_id->set_day(backfill_day.time_since_epoch().count());
+        event_id->set_day(day->time_since_epoch().count());
         event_id->set_line(line);
-        ++line;
+        tail.push_back(std::move(event));
+        if (tail.size() > room)
+          tail.pop_front();
+      }
+      events.insert(events.begin(), std::make_move_iterator(tail.begin()), std::make_move_iterator(tail.end()));
+    }
+  } catch (const base::Exception& e) {
+    LOG(WARNING) << "stalker: backfill failed for " << tgt->name << ": " << e.what();
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock_events(tgt->events_lock);
+
+  // Any live events already queued are at least as recent as the logfiles we read, but may overlap
+  // with the end of them. Keep the backfilled prefix up to the first live event.
+
+  if (!tgt->events.empty()) {
+    const LogEventId& first_live = tgt->events.front().event_id();
+    while (!events.empty()) {
+      const LogEventId& last = events.back().event_id();
+      if (last.day() < first_live.day() || (last.day() == first_live.day() && last.line() < first_live.line()))
+        break;
+      events.pop_back();
+    }
+  } else if (!events.empty()) {
+    tgt->last_day = events.back().event_id().day();
+    tgt->last_line = events.back().event_id().line();
+  }
+
+  tgt->events.insert(tgt->events.begin(), std::make_move_iterator(events.begin()), std::make_move_iterator(events.end()));
+  while (tgt->events.size() > kQueueSize)
+    tgt->events.pop_front();
+  tgt->snapshots.clear(); // rebuilt on demand
+}
+
+void Stalker::StartCatchUp(Client* client, std::int64_t day, std::uint64_t line) {
+  // called with clients_lock_ held
+
+  // A client that has been gone for longer than the logfiles are read back for gets an elision
+  // marker in front of the first event, so that the hole in its stream doesn't go unnoticed.
 
-        if (tgt->events.size() > kQueueSize)
-          tgt->events.pop_front();
+  std::int64_t sent_day = day;
+  bool elided = false;
+  auto today = date::floor<date::days>(std::chrono::system_clock::now()).time_since_epoch().count();
+  if (day < today - kCatchUpDays.count()) {
+    day = today - kCatchUpDays.count();
+    line = 0;
+    elided = true;
+  } else {
+    ++line;
+  }
+
+  LOG(INFO) << "stalker: catching up websocket from logfiles (" << day << ", " << line << ")" << (elided ? ", with a gap" : "");
+  client->catch_up_ = std::make_shared<CatchUp>(client, client->target_, day, line, sent_day, elided);
+  {
+    std::lock_guard<std::mutex> lock(catch_up_lock_);
+    catch_up_queue_.push_back(client->catch_up_);
+  }
+  catch_up_cv_.notify_one();
+}
+
+void Stalker::CatchUpWorker() {
+  while (true) {
+    std::shared_ptr<CatchUp> job;
+    {
+      std::unique_lock<std::mutex> lock(catch_up_lock_);
+      catch_up_cv_.wait(lock, [this]() { return catch_up_shutdown_ || !catch_up_queue_.empty(); });
+      if (catch_up_shutdown_)
+        return;
+      job = std::move(catch_up_queue_.front());
+      catch_up_queue_.pop_front();
+    }
+
+    bool done;
+    try {
+      done = CatchUpChunk(job.get());
+    } catch (const base::Exception& e) {
+      LOG(WARNING) << "stalker: catch-up failed: " << e.what();
+      std::lock_guard<std::mutex> lock(clients_lock_);
+      if (!job->cancelled) {
+        job->client->catch_up_.reset();
+        job->client->Close();
       }
+      done = true;
+    }
 
-      if (line > 0) {
-        tgt->last_day = backfill_day.time_since_epoch().count();
-        tgt->last_line = line - 1;
+    if (!done) {
+      // requeue at the back, so that concurrent catch-ups proceed in turns
+      std::lock_guard<std::mutex> lock(catch_up_lock_);
+      catch_up_queue_.push_back(std::move(job));
+    }
+  }
+}
+
+bool Stalker::CatchUpChunk(CatchUp* job) {
+  // The client may already be gone (and freed), so it's only looked at once under the lock below.
+  Target* tgt = job->target;
+  LogIndex* index = indices_->index(tgt->name);
+  auto today = date::floor<date::days>(std::chrono::system_clock::now()).time_since_epoch().count();
+
+  // Read up to a chunk of events from the logfiles, stopping at the oldest event still in memory.
+
+  std::int64_t front_day = std::numeric_limits<std::int64_t>::max();
+  std::uint64_t front_line = 0;
+  {
+    std::lock_guard<std::mutex> lock(tgt->events_lock);
+    if (!tgt->events.empty()) {
+      front_day = tgt->events.front().event_id().day();
+      front_line = tgt->events.front().event_id().line();
+    }
+  }
+
+  std::vector<LogEvent> events;
+  bool exhausted = false;
+  while (events.size() < kCatchUpChunk) {
+    if (job->day > front_day || (job->day == front_day && job->line >= front_line))
+      break;
+
+    if (!job->reader) {
+      bool found;
+      YMD ymd(YMD::day_number, job->day);
+      {
+        std::lock_guard<std::mutex> lock(*index->lock());
+        found = index->Lookup(ymd);
+      }
+      if (found)
+        job->reader = index->Open(ymd.year, ymd.month, ymd.day);
+      if (job->reader) {
+        for (std::uint64_t skip = 0; skip < job->line; ++skip) {
+          if (!job->reader->Skip())
+            break;
+        }
+      } else if (job->day < today) {
+        ++job->day;
+        job->line = 0;
+        continue;
+      } else {
+        exhausted = true;
+        break;
       }
     }
+
+    LogEvent& event = events.emplace_back();
+    if (!job->reader->Read(&event)) {
+      events.pop_back();
+      job->reader.reset();
+      if (job->day >= today) {
+        exhausted = true;
+        break;
+      }
+      ++job->day;
+      job->line = 0;
+      continue;
+    }
+    LogEventId* event_id = event.mutable_event_id();
+    event_id->set_target(tgt->name);
+    event_id->set_day(job->day);
+    event_id->set_line(job->line);
+    ++job->line;
+  }
+
+  // Render the chunk before taking the clients lock, which holds up all the other clients, and
+  // the pipe. Only the writes to the socket need it.
+
+  job->rendered.clear();
+  job->messages.clear();
+  for (const LogEvent& event : events) {
+    std::int64_t day = event.event_id().day();
+    if (job->elided) {
+      job->fmt->FormatElision();
+      job->elided = false;
+    }
+    if (day > job->rendered_day) {
+      YMD ymd(YMD::day_number, day);
+      job->fmt->FormatDay(true, ymd.year, ymd.month, ymd.day);
+      job->rendered_day = day;
+    }
+    job->fmt->FormatEvent(event, tgt->config);
+    job->messages.push_back({day, event.event_id().line(), job->rendered.size()});
+  }
+
+  // Send the chunk. If the client has caught up with the in-memory queue, switch it over.
+
+  std::lock_guard<std::mutex> lock_clients(clients_lock_);
+  if (job->cancelled)
+    return true;
+  Client* client = job->client;
+
+  std::size_t start = 0;
+  for (const CatchUp::Message& message : job->messages) {
+    if (!client->SendRendered(message.day, message.line, std::string_view(job->rendered).substr(start, message.end - start))) {
+      client->catch_up_.reset();
+      client->Close();
+      return true;
+    }
+    start = message.end;
+  }
+
+  std::lock_guard<std::mutex> lock_events(tgt->events_lock);
+  auto& queue = tgt->events;
+  if (!exhausted && !queue.empty()) {
+    const LogEventId& front = queue.front().event_id();
+    if (front.day() > job->day || (front.day() == job->day && front.line() > job->line))
+      return false;  // still behind
+  }
+
+  client->catch_up_.reset();
+  LOG(INFO) << "stalker: websocket caught up (" << client->sent_day_ << ", " << client->sent_line_ << ")";
+  if (job->elided)
+    client->fmt_->FormatElision(); // nothing was left in the logfiles: goes in front of the next event
+  for (const LogEvent& event : queue) {
+    if (client->has_event(event))
+      continue;
+    if (!client->Send(event)) {
+      client->Close();
+      break;
+    }
   }
+  return true;
 }
 
 Stalker::Target* Stalker::target(const std::string& name) {
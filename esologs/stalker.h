@@ -2,10 +2,15 @@
 #define ESOLOGS_STALKER_H_
 
 #include <atomic>
+#include <condition_variable>
 #include <deque>
 #include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
 
 #include <date/date.h>
+#include <prometheus/histogram.h>
 #include <prometheus/registry.h>
 
 #include "base/exc.h"
@@ -16,12 +21,18 @@
 #include "esologs/log.pb.h"
 #include "event/loop.h"
 #include "event/socket.h"
+#include "web/request.h"
+#include "web/response.h"
 #include "web/websocket.h"
 
 namespace esologs {
 
+class SearchIndex;
+
 struct IndexMapper {
   virtual LogIndex* index(const std::string& target) = 0;
+  /** Returns the search index of a target, if it has one, to be fed the events from the pipe. */
+  virtual SearchIndex* search(const std::string& target) { return nullptr; }
   virtual ~IndexMapper() = default;
 };
 
@@ -30,7 +41,13 @@ class Stalker : public event::Socket::Watcher, public event::Timed {
   Stalker(const Config& config, event::Loop* loop, IndexMapper* indices, prometheus::Registry* metric_registry = nullptr);
   ~Stalker();
 
-  void Format(const TargetConfig& cfg, LogFormatter* fmt);
+  /**
+   * Serves the current stalker page of a target in one of the log formats.
+   *
+   * The page is kept pre-rendered, and updated incrementally as events arrive, so serving it is
+   * just a copy. The response carries an ETag, and conditional requests are answered with 304.
+   */
+  int Serve(const TargetConfig& cfg, const std::string& format, const web::Request& req, web::Response* resp);
 
   web::WebsocketClientHandler* AddClient(const TargetConfig& config);
 
@@ -50,27 +67,44 @@ class Stalker : public event::Socket::Watcher, public event::Timed {
     kConnected,
     kWaiting,
   };
+  class Snapshot;
   struct Target {
-    Target(const std::string& n) : name(n) {}
-    const std::string name; // TODO: maybe put TargetConfig copy here instead of client; less passing around
+    Target(const TargetConfig& c);
+    ~Target();
+    const std::string name;
+    const TargetConfig config;
     std::int64_t last_day = 0;
     std::uint64_t last_line = 0;
     std::deque<LogEvent> events;
+    std::unordered_map<std::string, std::unique_ptr<Snapshot>> snapshots; // by format, created on demand
     std::mutex events_lock;
   };
   class Client;
+  struct CatchUp;
 
   void ConnectPipe();
   void ResetPipe();
 
-  void UpdateClients();
+  struct Arrival {
+    std::int64_t received_ns; // when the bot got the message (if known)
+    std::int64_t arrived_ns;  // when the event came out of the pipe
+  };
+
+  void UpdateClients(const Arrival* arrival = nullptr);
   void Backfill();
+  void BackfillTarget(Target* tgt);
+
+  void StartCatchUp(Client* client, std::int64_t day, std::uint64_t line);
+  void CatchUpWorker();
+  bool CatchUpChunk(CatchUp* job);
 
   Target* target(const std::string& name);
 
   static constexpr date::days kBackfillDays{3};
   static constexpr std::size_t kQueueSize = 1000;
   static constexpr auto kReconnectDelay = std::chrono::seconds(30);
+  static constexpr date::days kCatchUpDays{7};
+  static constexpr std::size_t kCatchUpChunk = 200;
 
   event::Loop* const loop_;
   IndexMapper* const indices_;
@@ -82,13 +116,28 @@ class Stalker : public event::Socket::Watcher, public event::Timed {
   std::array<char, 4096> read_buffer_;
 
   std::atomic<bool> events_loaded_ = false;
+  bool backfill_started_ = false;
+  std::thread backfill_thread_;
 
   base::unique_set<Client> clients_;
   std::mutex clients_lock_;
   std::atomic<bool> clients_active_ = false;
 
+  std::thread catch_up_thread_;
+  std::deque<std::shared_ptr<CatchUp>> catch_up_queue_;
+  std::mutex catch_up_lock_;
+  std::condition_variable catch_up_cv_;
+  bool catch_up_shutdown_ = false;
+
   prometheus::Gauge* metric_clients_ = nullptr;
   prometheus::Gauge* metric_last_received_ = nullptr;
+  prometheus::Gauge* metric_backfill_seconds_ = nullptr;
+  prometheus::Histogram* metric_latency_write_ = nullptr;
+  prometheus::Histogram* metric_latency_pipe_ = nullptr;
+  prometheus::Histogram* metric_latency_queue_ = nullptr;
+  prometheus::Histogram* metric_latency_websocket_ = nullptr;
+  prometheus::Histogram* metric_latency_fanout_ = nullptr;
+  prometheus::Histogram* metric_latency_total_ = nullptr;
 };
 
 } // namespace esologs
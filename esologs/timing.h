@@ -0,0 +1,20 @@
+#ifndef ESOLOGS_TIMING_H_
+#define ESOLOGS_TIMING_H_
+
+#include <chrono>
+#include <cstdint>
+
+namespace esologs {
+
+/** Returns the current monotonic time, in the units used by LogEventTiming. */
+inline std::int64_t MonotonicNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace esologs
+
+#endif // ESOLOGS_TIMING_H_
+
+// Local Variables:
+// mode: c++
+// End:
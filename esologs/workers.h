@@ -0,0 +1,48 @@
+#ifndef ESOLOGS_WORKERS_H_
+#define ESOLOGS_WORKERS_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "base/common.h"
+
+namespace esologs {
+
+/**
+ * Fixed-size pool of threads running tasks in the order they were posted.
+ *
+ * Used to spread the work of a single request (like decoding and formatting the days of a month)
+ * over several cores. Tasks must not block waiting for tasks posted after them.
+ */
+class WorkerPool {
+ public:
+  explicit WorkerPool(unsigned threads);
+  /** Runs any tasks still queued, then stops the threads. */
+  ~WorkerPool();
+  DISALLOW_COPY(WorkerPool);
+
+  void Post(std::function<void()> task);
+
+  unsigned size() const noexcept { return static_cast<unsigned>(threads_.size()); }
+
+ private:
+  std::vector<std::thread> threads_;
+  std::mutex lock_;
+  std::condition_variable work_cv_;
+  std::deque<std::function<void()>> work_;
+  bool shutdown_ = false;
+
+  void Worker();
+};
+
+} // namespace esologs
+
+#endif // ESOLOGS_WORKERS_H_
+
+// Local Variables:
+// mode: c++
+// End:
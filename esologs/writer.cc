@@ -59,6 +59,8 @@ void Writer::Write(LogEvent* event, PipeServer* pipe) {
     OpenLog(day);
   }
 
+  std::unique_ptr<LogEventTiming> timing(event->has_timing() ? event->release_timing() : nullptr);
+
   event->set_time_us(time_us);
   current_log_->Write(*event);
 
@@ -67,6 +69,10 @@ void Writer::Write(LogEvent* event, PipeServer* pipe) {
     event_id->set_target(target_);
     event_id->set_day(day.time_since_epoch().count());
     event_id->set_line(current_log_->line() - 1);
+    if (timing) {
+      timing->set_written_ns(MonotonicNs());
+      event->set_allocated_timing(timing.release());
+    }
     pipe->Write(event);
   }
 
@@ -129,6 +135,9 @@ void PipeServer::Write(LogEvent* event) {
 
   bool start_write = write_buffer_.empty();
 
+  if (event->has_timing())
+    event->mutable_timing()->set_piped_ns(MonotonicNs());
+
   std::size_t event_size = event->ByteSizeLong();
   if (write_buffer_.size() + event_size > kWriteBufferSize) {
     LOG(WARNING) << "pipeserver: send queue full, killing the client";
@@ -13,6 +13,7 @@
 #include "base/common.h"
 #include "esologs/config.pb.h"
 #include "esologs/log.pb.h"
+#include "esologs/timing.h"
 #include "event/loop.h"
 #include "event/socket.h"
 #include "proto/delim.h"
@@ -41,7 +42,8 @@ class Writer {
    *
    * Further, if tee'ing the event to a pipe is requested by passing in a non-null pipe server, the
    * event will be mutated to contain the correct event ID that the event received when it was
-   * written to the logfile.
+   * written to the logfile. Any `timing` field is not written to the logfile, but is passed along
+   * to the pipe with the write time filled in.
    */
   void Write(LogEvent* event, PipeServer* pipe = nullptr);
 
@@ -58,7 +60,7 @@ class Writer {
   date::sys_days current_day_;
   std::unique_ptr<FileWriter> current_log_;
 
-  prometheus::Gauge* metric_last_written_;
+  prometheus::Gauge* metric_last_written_ = nullptr;
 
   std::pair<date::sys_days, std::uint64_t> Now() {
     auto now = std::chrono::system_clock::now();
@@ -0,0 +1,74 @@
+#include <string>
+
+#include "web/asset.h"
+#include "web/encoding.h"
+#include "web/etag.h"
+#include "web/writer.h"
+
+namespace web {
+
+namespace {
+
+/**
+ * Assets don't have versioned URLs, so they can't be cached forever. A day bounds how long a
+ * browser keeps using a stale stylesheet after an upgrade; revalidating with the ETag is cheap.
+ */
+constexpr char kCacheControl[] = "Cache-Control: public, max-age=86400\r\n";
+
+} // unnamed namespace
+
+const Asset* FindAsset(std::span<const Asset> assets, std::string_view path) {
+  for (const Asset& asset : assets) {
+    if (asset.path == path)
+      return &asset;
+  }
+  return nullptr;
+}
+
+int ServeAsset(const Asset& asset, const Request& req, Response* resp) {
+  Encoding encoding = NegotiateEncoding(req.header("Accept-Encoding"));
+  std::string_view body = asset.identity;
+  if (encoding == Encoding::kBrotli && !asset.brotli.empty())
+    body = asset.brotli;
+  else if (encoding == Encoding::kGzip && !asset.gzip.empty())
+    body = asset.gzip;
+  else
+    encoding = Encoding::kIdentity;
+
+  std::string headers{"Vary: Accept-Encoding\r\n"};
+  headers += kCacheControl;
+  headers += "ETag: ";
+  std::size_t etag_start = headers.size();
+  if (encoding == Encoding::kIdentity) {
+    headers += asset.etag;
+  } else {
+    // the same content in different encodings must not share an entity tag
+    headers += asset.etag.substr(0, asset.etag.size() - 1);
+    headers += '-';
+    headers += EncodingName(encoding);
+    headers += '"';
+  }
+  std::string_view etag = std::string_view(headers).substr(etag_start);
+  bool not_modified = false;
+  if (const char* cond = req.header("If-None-Match"))
+    not_modified = MatchesETag(cond, etag);
+  headers += "\r\n";
+
+  if (not_modified) {
+    Writer web(resp, asset.content_type, 304, headers);
+    return 304;
+  }
+
+  if (encoding != Encoding::kIdentity) {
+    headers += "Content-Encoding: ";
+    headers += EncodingName(encoding);
+    headers += "\r\n";
+  }
+  Writer web(resp, asset.content_type, 200, headers);
+  web.BufferBody();
+  if (!req.is_head())
+    web.Write(Ref(body));
+  return 200;
+}
+
+} // namespace web
@@ -0,0 +1,48 @@
+#ifndef WEB_ASSET_H_
+#define WEB_ASSET_H_
+
+#include <span>
+#include <string_view>
+
+#include "web/request.h"
+#include "web/response.h"
+
+namespace web {
+
+/**
+ * A static file compiled into the binary, along with precompressed variants of it.
+ *
+ * Tables of these are generated at build time by the `//web:embed` tool. All the strings point to
+ * read-only data that lives as long as the program.
+ */
+struct Asset {
+  /** Request path the asset is served at, like `/log.css`. */
+  std::string_view path;
+  const char* content_type;
+  /** Entity tag (including the quotes) derived from a hash of the content. */
+  std::string_view etag;
+  std::string_view identity;
+  /** Gzip-compressed content, or empty if compressing didn't make it smaller. */
+  std::string_view gzip;
+  /** Brotli-compressed content, or empty if compressing didn't make it smaller. */
+  std::string_view brotli;
+};
+
+/** Returns the asset with the given path, or `nullptr` if there isn't one. */
+const Asset* FindAsset(std::span<const Asset> assets, std::string_view path);
+
+/**
+ * Responds to a request with an asset.
+ *
+ * Picks the smallest variant the client accepts, and handles `If-None-Match`. The body is sent
+ * straight from the embedded data without copying it.
+ */
+int ServeAsset(const Asset& asset, const Request& req, Response* resp);
+
+} // namespace web
+
+#endif // WEB_ASSET_H_
+
+// Local Variables:
+// mode: c++
+// End:
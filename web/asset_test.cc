@@ -0,0 +1,123 @@
+#include <map>
+#include <string>
+#include <string_view>
+
+#include "gtest/gtest.h"
+
+#include "web/asset.h"
+
+namespace web {
+
+namespace {
+
+struct FakeRequest : public Request {
+  bool is_head() const override { return head; }
+  const char* uri() const override { return "/a.css"; }
+  const char* query() const override { return nullptr; }
+  const char* header(const char* key) const override {
+    auto it = headers.find(key);
+    return it != headers.end() ? it->second.c_str() : nullptr;
+  }
+
+  bool head = false;
+  std::map<std::string, std::string> headers;
+};
+
+struct FakeResponse : public Response {
+  void Write(const void* data, std::size_t size) override { out.append(static_cast<const char*>(data), size); }
+  bool is_head() const override { return head; }
+
+  /** Returns the value of a response header, or an empty string if it's not there. */
+  std::string header(std::string_view key) const {
+    std::string prefix = "\r\n" + std::string(key) + ": ";
+    std::size_t start = out.find(prefix);
+    if (start == std::string::npos || start > out.find("\r\n\r\n"))
+      return "";
+    start += prefix.size();
+    return out.substr(start, out.find("\r\n", start) - start);
+  }
+
+  std::string body() const { return out.substr(out.find("\r\n\r\n") + 4); }
+
+  bool head = false;
+  std::string out;
+};
+
+const Asset kAssets[] = {
+  {"/a.css", "text/css", "\"a1\"", "identity of a", "gzip of a", "brotli of a"},
+  {"/b.css", "text/css", "\"b1\"", "identity of b", "gzip of b", ""},
+};
+
+} // unnamed namespace
+
+TEST(AssetTest, FindAsset) {
+  EXPECT_EQ(&kAssets[0], FindAsset(kAssets, "/a.css"));
+  EXPECT_EQ(&kAssets[1], FindAsset(kAssets, "/b.css"));
+  EXPECT_EQ(nullptr, FindAsset(kAssets, "/c.css"));
+  EXPECT_EQ(nullptr, FindAsset(kAssets, "/"));
+}
+
+TEST(AssetTest, PicksVariantByAcceptEncoding) {
+  static const struct {
+    const Asset* asset;
+    const char* accept_encoding; // or nullptr for none
+    const char* body;
+    const char* content_encoding;
+    const char* etag;
+  } tests[] = {
+    {&kAssets[0], nullptr, "identity of a", "", "\"a1\""},
+    {&kAssets[0], "gzip", "gzip of a", "gzip", "\"a1-gzip\""},
+    {&kAssets[0], "gzip, br", "brotli of a", "br", "\"a1-br\""},
+    {&kAssets[0], "br;q=0, gzip", "gzip of a", "gzip", "\"a1-gzip\""},
+    {&kAssets[0], "identity", "identity of a", "", "\"a1\""},
+    // no brotli variant (it wasn't any smaller): falls back to identity, not gzip
+    {&kAssets[1], "br", "identity of b", "", "\"b1\""},
+    {&kAssets[1], "gzip", "gzip of b", "gzip", "\"b1-gzip\""},
+  };
+
+  for (const auto& test : tests) {
+    FakeRequest req;
+    if (test.accept_encoding)
+      req.headers["Accept-Encoding"] = test.accept_encoding;
+    FakeResponse resp;
+    EXPECT_EQ(200, ServeAsset(*test.asset, req, &resp));
+    SCOPED_TRACE(resp.out);
+    EXPECT_TRUE(resp.out.starts_with("HTTP/1.1 200 "));
+    EXPECT_EQ(test.body, resp.body());
+    EXPECT_EQ(test.content_encoding, resp.header("Content-Encoding"));
+    EXPECT_EQ(test.etag, resp.header("ETag"));
+    EXPECT_EQ("Accept-Encoding", resp.header("Vary"));
+    EXPECT_EQ("text/css", resp.header("Content-Type"));
+  }
+}
+
+TEST(AssetTest, NotModified) {
+  FakeRequest req;
+  req.headers["Accept-Encoding"] = "br";
+  req.headers["If-None-Match"] = "\"a1-br\"";
+  FakeResponse resp;
+  EXPECT_EQ(304, ServeAsset(kAssets[0], req, &resp));
+  EXPECT_TRUE(resp.out.starts_with("HTTP/1.1 304 ")) << resp.out;
+  EXPECT_EQ("", resp.body());
+  EXPECT_EQ("\"a1-br\"", resp.header("ETag"));
+
+  // the tag of another variant doesn't match
+  req.headers["Accept-Encoding"] = "gzip";
+  resp.out.clear();
+  EXPECT_EQ(200, ServeAsset(kAssets[0], req, &resp));
+  EXPECT_EQ("gzip of a", resp.body());
+}
+
+TEST(AssetTest, Head) {
+  FakeRequest req;
+  req.head = true;
+  req.headers["Accept-Encoding"] = "gzip";
+  FakeResponse resp;
+  resp.head = true;
+  EXPECT_EQ(200, ServeAsset(kAssets[0], req, &resp));
+  EXPECT_EQ("", resp.body());
+  EXPECT_EQ("\"a1-gzip\"", resp.header("ETag"));
+  EXPECT_EQ("gzip", resp.header("Content-Encoding"));
+}
+
+} // namespace web
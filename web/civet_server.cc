@@ -0,0 +1,402 @@
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <strings.h> // strcasecmp
+
+#include "base/exc.h"
+#include "base/log.h"
+#include "web/civet_server.h"
+#include "web/response.h"
+
+namespace web {
+
+class CivetServer::CivetConnection : public Request, public Response {
+ public:
+  explicit CivetConnection(struct mg_connection* conn);
+  bool is_head() const override;
+  bool chunked_ok() const override;
+  const char* uri() const override;
+  const char* query() const override;
+  const char* header(const char* key) const override;
+  void Write(const void* data, std::size_t size) override;
+  void WriteV(const std::string_view* parts, std::size_t count) override;
+
+ private:
+  struct mg_connection* const conn_;
+  const struct mg_request_info* const info_;
+};
+
+CivetServer::CivetConnection::CivetConnection(struct mg_connection* conn)
+    : conn_(conn), info_(mg_get_request_info(conn))
+{}
+
+bool CivetServer::CivetConnection::is_head() const {
+  return std::string_view(info_->request_method) == "HEAD";
+}
+
+bool CivetServer::CivetConnection::chunked_ok() const {
+  return info_->http_version && std::string_view(info_->http_version) != "1.0";
+}
+
+const char* CivetServer::CivetConnection::uri() const {
+  return info_->local_uri;
+}
+
+const char* CivetServer::CivetConnection::query() const {
+  return info_->query_string;
+}
+
+const char* CivetServer::CivetConnection::header(const char* key) const {
+  for (int i = 0; i < info_->num_headers; i++) {
+    if (strcasecmp(info_->http_headers[i].name, key) == 0)
+      return info_->http_headers[i].value;
+  }
+  return NULL;
+}
+
+void CivetServer::CivetConnection::Write(const void* data, std::size_t size) {
+  mg_write(conn_, data, size);
+}
+
+void CivetServer::CivetConnection::WriteV(const std::string_view* parts, std::size_t count) {
+  // civetweb has no vectored write, and each mg_write is a send(2) of its own. Gathering the parts
+  // costs a copy, but keeps it to one system call per flush.
+  thread_local std::string gather;
+  gather.clear();
+  for (std::size_t i = 0; i < count; ++i)
+    gather += parts[i];
+  mg_write(conn_, gather.data(), gather.size());
+}
+
+class CivetServer::CivetWebsocket : public Websocket {
+ public:
+  CivetWebsocket(struct mg_connection* conn, WebsocketClientHandler* handler)
+      : conn_(conn), handler_(handler)
+  {}
+
+  DISALLOW_COPY(CivetWebsocket);
+
+  std::optional<std::size_t> Write(Type type, const void* buf, std::size_t size) override;
+  void Close(Status status) override;
+
+  WebsocketClientHandler* handler() const noexcept { return handler_; }
+
+  // updated on every incoming frame, so without taking CivetServer::websocket_lock_
+  std::atomic<std::chrono::steady_clock::time_point> last_seen = std::chrono::steady_clock::now();
+
+  // heartbeat state, guarded by CivetServer::websocket_lock_
+  std::chrono::steady_clock::time_point last_ping;
+  bool reaped = false;
+  // set by the close handler, which then waits for the heartbeat to unpin the websocket
+  bool closing = false;
+  unsigned pins = 0;
+
+  void Ping(std::chrono::steady_clock::time_point now);
+
+ private:
+  struct Lock {
+    Lock(struct mg_connection* conn) : conn_(conn) { mg_lock_connection(conn_); }
+    ~Lock() { mg_unlock_connection(conn_); }
+   private:
+    struct mg_connection* const conn_;
+  };
+
+  struct mg_connection* const conn_;
+  WebsocketClientHandler* const handler_;
+};
+
+std::optional<std::size_t> CivetServer::CivetWebsocket::Write(Type type, const void* buf, std::size_t size) {
+  int opcode = 0x80 | (type == Type::kBinary ? 2 : 1);
+  int wrote;
+
+  {
+    Lock lock(conn_);
+    wrote = mg_websocket_write(conn_, opcode, static_cast<const char*>(buf), size);
+  }
+
+  if (wrote < 0)
+    return std::optional<std::size_t>();
+  else
+    return std::optional<std::size_t>(wrote);
+}
+
+void CivetServer::CivetWebsocket::Ping(std::chrono::steady_clock::time_point now) {
+  char payload[kPingSize];
+  PingPayload(now, payload);
+
+  Lock lock(conn_);
+  mg_websocket_write(conn_, 0x89, payload, sizeof payload);
+}
+
+void CivetServer::CivetWebsocket::Close(Status status) {
+  unsigned char code[2];
+  code[0] = static_cast<unsigned>(status) >> 8;
+  code[1] = static_cast<unsigned>(status) & 0xff;
+
+  Lock lock(conn_);
+  mg_websocket_write(conn_, 0x88, reinterpret_cast<char*>(code), sizeof code);
+  // TODO: verify this bit
+}
+
+CivetServer::CivetServer(const Options& options) : Server(options) {
+  // civetweb closes websockets that have been silent for longer than its timeout. As pings are
+  // sent more frequently than that, only unresponsive clients hit it.
+  std::string websocket_timeout_ms = std::to_string(
+      std::chrono::duration_cast<std::chrono::milliseconds>(options_.websocket_idle_timeout).count());
+  // All responses are framed by web::Writer, so connections can be kept open between requests.
+  bool keep_alive = options_.keep_alive_timeout.count() > 0;
+  std::string keep_alive_timeout_ms = std::to_string(options_.keep_alive_timeout.count());
+  std::string num_threads = std::to_string(options_.num_threads);
+
+  const char* options_list[] = {
+    "listening_ports", options_.port.c_str(),
+    "num_threads", num_threads.c_str(),
+    "websocket_timeout_ms", websocket_timeout_ms.c_str(),
+    "enable_keep_alive", keep_alive ? "yes" : "no",
+    "keep_alive_timeout_ms", keep_alive_timeout_ms.c_str(),
+    nullptr
+  };
+
+  struct mg_callbacks cb = { nullptr };
+  cb.init_connection = CivetInitConnection;
+  cb.connection_close = CivetConnectionClose;
+
+  civet_ctx_ = mg_start(&cb, this, options_list);
+  if (!civet_ctx_)
+    throw base::Exception("civetweb server failed to start");
+
+  heartbeat_thread_ = std::thread(&CivetServer::Heartbeat, this);
+}
+
+CivetServer::~CivetServer() {
+  {
+    std::lock_guard<std::mutex> lock(websocket_lock_);
+    heartbeat_shutdown_ = true;
+  }
+  heartbeat_cv_.notify_all();
+  heartbeat_thread_.join();
+
+  mg_stop(civet_ctx_);
+}
+
+int CivetServer::port() const {
+  struct mg_server_port port_info;
+  if (mg_get_server_ports(civet_ctx_, 1, &port_info) != 1)
+    throw base::Exception("civetweb listen port unknown");
+  return port_info.port;
+}
+
+void CivetServer::AddHandler(const char* path, RequestHandler* handler) {
+  mg_set_request_handler(civet_ctx_, path, CivetRequestHandler, handler);
+}
+
+void CivetServer::AddWebsocketHandler(const char* path, const char* proto, WebsocketHandler* handler) {
+  auto* record = &websocket_handlers_.emplace_back(this, handler, proto);
+  mg_set_websocket_handler_with_subprotocols(
+      civet_ctx_, path, &record->proto.get()->proto_list,
+      CivetWebsocketConnectHandler,
+      CivetWebsocketReadyHandler,
+      CivetWebsocketDataHandler,
+      CivetWebsocketCloseHandler,
+      record);
+}
+
+namespace {
+
+// civetweb serves each connection from start to end on a single worker thread, so a thread-local
+// counter is enough to tell fresh connections from reused ones.
+thread_local unsigned connection_requests = 0;
+
+} // unnamed namespace
+
+int CivetServer::CivetInitConnection(const struct mg_connection* conn, void**) {
+  connection_requests = 0;
+  auto* server = static_cast<CivetServer*>(mg_get_user_data(mg_get_context(conn)));
+  if (server->metric_http_connections_) {
+    server->metric_http_connections_->Increment();
+    server->metric_http_connections_open_->Increment();
+  }
+  return 0;
+}
+
+void CivetServer::CivetConnectionClose(const struct mg_connection* conn) {
+  auto* server = static_cast<CivetServer*>(mg_get_user_data(mg_get_context(conn)));
+  if (server->metric_http_connections_open_)
+    server->metric_http_connections_open_->Decrement();
+}
+
+int CivetServer::CivetRequestHandler(struct mg_connection* conn, void* cb) {
+  std::string_view method = mg_get_request_info(conn)->request_method;
+  if (method != "HEAD" && method != "GET")
+    return 0; // TODO: return method not allowed?
+
+  auto* server = static_cast<CivetServer*>(mg_get_user_data(mg_get_context(conn)));
+  if (server->metric_http_requests_new_) {
+    if (connection_requests == 0)
+      server->metric_http_requests_new_->Increment();
+    else
+      server->metric_http_requests_reused_->Increment();
+  }
+  ++connection_requests;
+  auto* handler = static_cast<RequestHandler*>(cb);
+  CivetConnection c(conn);
+  return handler->HandleGet(c, &c);
+}
+
+int CivetServer::CivetWebsocketConnectHandler(const struct mg_connection* const_conn, void* cb) {
+  enum ReturnCode { kAccept = 0, kClose = 1 };
+
+  auto* record = static_cast<WebsocketHandlerRecord*>(cb);
+  auto* conn = const_cast<struct mg_connection*>(const_conn);  // this API is odd
+
+  CivetServer* server = record->server;
+
+  {
+    std::lock_guard<std::mutex> lock(server->websocket_lock_);
+    if (server->websocket_clients_.size() >= server->options_.max_websocket_clients) {
+      if (server->metric_websocket_refused_)
+        server->metric_websocket_refused_->Increment();
+      return kClose;
+    }
+  }
+
+  const struct mg_request_info* info = mg_get_request_info(conn);
+  WebsocketClientHandler* client_handler =
+      record->handler->HandleWebsocketClient(info->request_uri, info->acceptedWebSocketSubprotocol);
+
+  if (!client_handler)
+    return kClose;
+
+  std::lock_guard<std::mutex> lock(server->websocket_lock_);
+  CivetWebsocket* websocket = server->websocket_clients_.emplace(conn, client_handler);
+  mg_set_user_connection_data(conn, websocket);
+  if (server->metric_websocket_open_)
+    server->metric_websocket_open_->Set(server->websocket_clients_.size());
+  return kAccept;
+}
+
+void CivetServer::CivetWebsocketReadyHandler(struct mg_connection* conn, void*) {
+  auto* websocket = static_cast<CivetWebsocket*>(mg_get_user_connection_data(conn));
+  websocket->handler()->WebsocketReady(websocket);
+}
+
+int CivetServer::CivetWebsocketDataHandler(struct mg_connection* conn, int raw_opcode, char* raw_buf, std::size_t size, void* cb) {
+  auto* record = static_cast<WebsocketHandlerRecord*>(cb);
+  auto* buf = reinterpret_cast<unsigned char*>(raw_buf);
+  auto* websocket = static_cast<CivetWebsocket*>(mg_get_user_connection_data(conn));
+  auto* handler = websocket->handler();
+
+  auto now = std::chrono::steady_clock::now();
+  websocket->last_seen.store(now, std::memory_order_relaxed);
+
+  bool fin = raw_opcode & 0x80;
+  int opcode = raw_opcode & 0x0f;
+  Websocket::Result result;
+
+  if (opcode == 0 || opcode == 1 || opcode == 2) {
+    result = HandleDataFrame(websocket, handler, fin, opcode, buf, size);
+  } else if (!fin) {
+    // a fragmented non-data message
+    LOG(WARNING) << "websocket: unexpected opcode (fragmented): " << opcode;
+    result = Websocket::Result::kClose;
+  } else if (opcode == 8) {
+    // websocket close control frame: no action
+    result = Websocket::Result::kClose;
+  } else if (opcode == 9) {
+    // websocket ping control frame, try to reply
+    mg_websocket_write(conn, 0x89, raw_buf, size);
+    result = Websocket::Result::kKeepOpen;
+  } else if (opcode == 10) {
+    // websocket pong control frame: if it's a reply to our ping, record the round-trip time
+    record->server->ObservePong(now, raw_buf, size);
+    result = Websocket::Result::kKeepOpen;
+  } else {
+    // unexpected opcode type
+    LOG(WARNING) << "websocket: unexpected opcode: " << opcode;
+    websocket->Close(Websocket::Status::kProtocolError);
+    result = Websocket::Result::kClose;
+  }
+
+  return static_cast<int>(result);
+}
+
+void CivetServer::CivetWebsocketCloseHandler(const struct mg_connection* conn, void* cb) {
+  auto* record = static_cast<WebsocketHandlerRecord*>(cb);
+  auto* websocket = static_cast<CivetWebsocket*>(mg_get_user_connection_data(conn));
+  websocket->handler()->WebsocketClose(websocket);
+
+  CivetServer* server = record->server;
+  std::unique_lock<std::mutex> lock(server->websocket_lock_);
+  websocket->closing = true;
+  server->websocket_unpinned_cv_.wait(lock, [websocket]() { return websocket->pins == 0; });
+  server->websocket_clients_.erase(websocket);
+  if (server->metric_websocket_open_)
+    server->metric_websocket_open_->Set(server->websocket_clients_.size());
+}
+
+void CivetServer::Heartbeat() {
+  // Checking a few times per ping interval keeps the pings reasonably close to schedule.
+  auto period = options_.websocket_ping_interval / 4;
+  if (period < std::chrono::seconds(1))
+    period = std::chrono::seconds(1);
+
+  // Pings and closes are blocking writes, which can stall on a client with a full send buffer. So
+  // they're only picked under the lock, which handshakes and the close handler need, and made
+  // after releasing it. The websockets stay pinned (and not freed) until the writes are done.
+  std::vector<std::pair<CivetWebsocket*, bool>> due; // and whether to close it
+  std::unique_lock<std::mutex> lock(websocket_lock_);
+  while (!heartbeat_cv_.wait_for(lock, period, [this]() { return heartbeat_shutdown_; })) {
+    auto now = std::chrono::steady_clock::now();
+    std::size_t idle = 0;
+
+    due.clear();
+    for (CivetWebsocket* websocket : websocket_clients_) {
+      if (websocket->closing)
+        continue;
+      auto silent = now - websocket->last_seen.load(std::memory_order_relaxed);
+      if (silent < options_.websocket_ping_interval)
+        continue;
+      ++idle;
+
+      if (silent >= options_.websocket_idle_timeout) {
+        // civetweb will tear down the connection once its own timeout expires; just ask nicely.
+        if (!websocket->reaped) {
+          LOG(INFO) << "websocket: closing unresponsive client";
+          websocket->reaped = true;
+          due.emplace_back(websocket, true);
+          if (metric_websocket_reaped_)
+            metric_websocket_reaped_->Increment();
+        }
+      } else if (now - websocket->last_ping >= options_.websocket_ping_interval) {
+        websocket->last_ping = now;
+        due.emplace_back(websocket, false);
+      }
+    }
+
+    if (metric_websocket_idle_)
+      metric_websocket_idle_->Set(idle);
+    if (due.empty())
+      continue;
+
+    for (auto [websocket, close] : due)
+      ++websocket->pins;
+    lock.unlock();
+    for (auto [websocket, close] : due) {
+      if (close)
+        websocket->Close(Websocket::Status::kGoingAway);
+      else
+        websocket->Ping(now);
+    }
+    lock.lock();
+    for (auto [websocket, close] : due)
+      --websocket->pins;
+    websocket_unpinned_cv_.notify_all();
+  }
+}
+
+} // namespace web
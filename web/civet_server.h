@@ -0,0 +1,79 @@
+#ifndef WEB_CIVET_SERVER_H_
+#define WEB_CIVET_SERVER_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "civetweb.h"
+
+#include "base/common.h"
+#include "base/unique_set.h"
+#include "web/request.h"
+#include "web/response.h"
+#include "web/server.h"
+#include "web/websocket.h"
+
+namespace web {
+
+/** web::Server built on civetweb. Each open connection (including websockets) holds a thread. */
+class CivetServer : public Server {
+ public:
+  explicit CivetServer(const Options& options);
+  ~CivetServer();
+
+  int port() const override;
+
+  void AddHandler(const char* path, RequestHandler* handler) override;
+  void AddWebsocketHandler(const char* path, const char* proto, WebsocketHandler* handler) override;
+
+ private:
+  class CivetConnection;
+  class CivetWebsocket;
+
+  struct WebsocketHandlerProto {
+    WebsocketHandlerProto(const char *p) : proto(p) {
+      proto_list.nb_subprotocols = 1;
+      proto_list.subprotocols = &proto;
+    }
+    const char *proto;
+    struct mg_websocket_subprotocols proto_list;
+  };
+
+  struct WebsocketHandlerRecord {
+    CivetServer* server;
+    WebsocketHandler* handler;
+    std::unique_ptr<WebsocketHandlerProto> proto;
+    WebsocketHandlerRecord(CivetServer* s, WebsocketHandler* h, const char* p) : server(s), handler(h), proto(std::make_unique<WebsocketHandlerProto>(p)) {}
+  };
+
+  struct mg_context* civet_ctx_;
+  std::vector<WebsocketHandlerRecord> websocket_handlers_;
+  base::unique_set<CivetWebsocket> websocket_clients_;
+  std::mutex websocket_lock_;
+  std::condition_variable websocket_unpinned_cv_;
+
+  std::thread heartbeat_thread_;
+  std::condition_variable heartbeat_cv_;
+  bool heartbeat_shutdown_ = false;
+
+  void Heartbeat();
+
+  static int CivetInitConnection(const struct mg_connection* conn, void** conn_data);
+  static void CivetConnectionClose(const struct mg_connection* conn);
+  static int CivetRequestHandler(struct mg_connection* conn, void* cb);
+  static int CivetWebsocketConnectHandler(const struct mg_connection* conn, void* cb);
+  static void CivetWebsocketReadyHandler(struct mg_connection* conn, void*);
+  static int CivetWebsocketDataHandler(struct mg_connection* conn, int opcode, char* buf, std::size_t size, void*);
+  static void CivetWebsocketCloseHandler(const struct mg_connection* conn, void* cb);
+};
+
+} // namespace web
+
+#endif // WEB_CIVET_SERVER_H_
+
+// Local Variables:
+// mode: c++
+// End:
@@ -0,0 +1,169 @@
+// Generates a C++ source file embedding static files as a table of web::Asset entries.
+//
+// Usage: embed --namespace=NS --function=NAME --out=FILE.cc /path=file [/path=file ...]
+//
+// The output defines `std::span<const web::Asset> NS::NAME()`, to be declared in a hand-written
+// header. Each file is stored as is, and gzip/brotli-compressed (when that makes it smaller).
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "web/encoding.h"
+
+namespace {
+
+struct File {
+  std::string path;
+  std::string source;
+  std::string data;
+};
+
+const char* ContentType(std::string_view path) {
+  static constexpr struct {
+    std::string_view ext;
+    const char* type;
+  } kTypes[] = {
+    {".css", "text/css; charset=utf-8"},
+    {".html", "text/html; charset=utf-8"},
+    {".ico", "image/x-icon"},
+    {".js", "text/javascript; charset=utf-8"},
+    {".png", "image/png"},
+    {".svg", "image/svg+xml"},
+    {".txt", "text/plain; charset=utf-8"},
+  };
+  for (const auto& t : kTypes) {
+    if (path.ends_with(t.ext))
+      return t.type;
+  }
+  return "application/octet-stream";
+}
+
+std::string ETag(std::string_view data) {
+  // FNV-1a: not cryptographic, but entity tags only need to change when the content does
+  std::uint64_t hash = 0xcbf29ce484222325u;
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 0x100000001b3u;
+  }
+  char buf[24];
+  std::snprintf(buf, sizeof buf, "\"%016llx\"", static_cast<unsigned long long>(hash));
+  return buf;
+}
+
+/** Writes data as a (possibly multi-line) string_view literal. */
+void WriteLiteral(std::FILE* out, std::string_view data) {
+  constexpr std::size_t kLineWidth = 100;
+
+  if (data.empty()) {
+    std::fputs("std::string_view()", out);
+    return;
+  }
+
+  std::string line;
+  bool first = true;
+  auto flush = [&]() {
+    std::fprintf(out, "%s\"%s\"", first ? "" : "\n        ", line.c_str());
+    line.clear();
+    first = false;
+  };
+
+  for (unsigned char c : data) {
+    if (c == '\n') {
+      line += "\\n";
+      flush();
+      continue;
+    }
+    if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\' && c != '?') {
+      line += static_cast<char>(c);
+    } else {
+      // three-digit octal escapes can't run into the following characters
+      char esc[8];
+      std::snprintf(esc, sizeof esc, "\\%03o", c);
+      line += esc;
+    }
+    if (line.size() >= kLineWidth)
+      flush();
+  }
+  if (!line.empty())
+    flush();
+  std::fputs("sv", out);
+}
+
+/** Returns the compressed form of data, or an empty string if it's not any smaller. */
+std::string Compressed(web::Encoding encoding, const std::string& data) {
+  std::string compressed = web::Compress(encoding, data);
+  return compressed.size() < data.size() ? compressed : std::string();
+}
+
+} // unnamed namespace
+
+int main(int argc, char *argv[]) {
+  std::string ns, function, out_path;
+  std::vector<File> files;
+
+  for (int arg = 1; arg < argc; arg++) {
+    std::string_view opt(argv[arg]);
+    if (opt.starts_with("--namespace=")) {
+      ns = opt.substr(12);
+    } else if (opt.starts_with("--function=")) {
+      function = opt.substr(11);
+    } else if (opt.starts_with("--out=")) {
+      out_path = opt.substr(6);
+    } else if (std::size_t eq = opt.find('='); !opt.starts_with("--") && eq != std::string_view::npos) {
+      File f{std::string(opt.substr(0, eq)), std::string(opt.substr(eq + 1)), std::string()};
+      std::ifstream in(f.source, std::ios::binary);
+      if (!in) {
+        std::fprintf(stderr, "can't read: %s\n", f.source.c_str());
+        return 1;
+      }
+      f.data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+      files.push_back(std::move(f));
+    } else {
+      ns.clear(); // force usage message
+      break;
+    }
+  }
+  if (ns.empty() || function.empty() || out_path.empty()) {
+    std::fprintf(stderr, "usage: %s --namespace=NS --function=NAME --out=FILE.cc /path=file [/path=file ...]\n", argv[0]);
+    return 1;
+  }
+
+  std::FILE* out = std::fopen(out_path.c_str(), "w");
+  if (!out) {
+    std::perror(out_path.c_str());
+    return 1;
+  }
+
+  std::fprintf(out, "// Generated by //web:embed. Do not edit.\n\n");
+  std::fprintf(out, "#include <span>\n#include <string_view>\n\n#include \"web/asset.h\"\n\n");
+  std::fprintf(out, "namespace %s {\n\nnamespace {\n\nusing namespace std::literals::string_view_literals;\n\n", ns.c_str());
+  std::fprintf(out, "const web::Asset kAssets[] = {\n");
+  for (const File& f : files) {
+    std::fprintf(out, "  {\n    // %s\n", f.source.c_str());
+    std::fprintf(out, "    \"%s\"sv,\n", f.path.c_str());
+    std::fprintf(out, "    \"%s\",\n", ContentType(f.path));
+    std::fputs("    ", out);
+    WriteLiteral(out, ETag(f.data));
+    std::fputs(",\n    ", out);
+    WriteLiteral(out, f.data);
+    std::fputs(",\n    ", out);
+    WriteLiteral(out, Compressed(web::Encoding::kGzip, f.data));
+    std::fputs(",\n    ", out);
+    WriteLiteral(out, Compressed(web::Encoding::kBrotli, f.data));
+    std::fputs(",\n  },\n", out);
+  }
+  std::fprintf(out, "};\n\n} // unnamed namespace\n\n");
+  std::fprintf(out, "std::span<const web::Asset> %s() { return kAssets; }\n\n", function.c_str());
+  std::fprintf(out, "} // namespace %s\n", ns.c_str());
+
+  if (std::fclose(out) != 0) {
+    std::perror(out_path.c_str());
+    return 1;
+  }
+  return 0;
+}
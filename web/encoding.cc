@@ -0,0 +1,191 @@
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+
+#include <brotli/encode.h>
+#include <zlib.h>
+
+#include "base/exc.h"
+#include "web/encoding.h"
+
+namespace web {
+
+namespace {
+
+// Compression levels: responses cached in compressed form are compressed only once, so they can
+// afford to be slower than the streaming (per-request) case.
+constexpr int kBrotliQualityOnce = 9;
+constexpr int kBrotliQualityStream = 5;
+constexpr int kGzipLevelOnce = 9;
+constexpr int kGzipLevelStream = 6;
+
+constexpr std::size_t kChunk = 16384;
+
+std::string_view Trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+    s.remove_prefix(1);
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+    s.remove_suffix(1);
+  return s;
+}
+
+bool EqualsIgnoreCase(std::string_view a, std::string_view b) {
+  if (a.size() != b.size())
+    return false;
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    char ca = a[i], cb = b[i];
+    if (ca >= 'A' && ca <= 'Z') ca += 'a' - 'A';
+    if (cb >= 'A' && cb <= 'Z') cb += 'a' - 'A';
+    if (ca != cb)
+      return false;
+  }
+  return true;
+}
+
+/** Parses the `q` parameter of an `Accept-Encoding` list element, defaulting to 1. */
+double ParseQuality(std::string_view params) {
+  while (!params.empty()) {
+    std::size_t end = params.find(';');
+    std::string_view param = Trim(params.substr(0, end));
+    params = end == std::string_view::npos ? std::string_view() : params.substr(end + 1);
+    if (param.size() >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+      std::string value(param.substr(2));
+      return std::strtod(value.c_str(), nullptr);
+    }
+  }
+  return 1.0;
+}
+
+class BrotliCompressor : public Compressor {
+ public:
+  explicit BrotliCompressor(int quality) : state_(BrotliEncoderCreateInstance(nullptr, nullptr, nullptr)) {
+    if (!state_)
+      throw base::Exception("BrotliEncoderCreateInstance failed");
+    BrotliEncoderSetParameter(state_, BROTLI_PARAM_QUALITY, quality);
+  }
+
+  ~BrotliCompressor() { BrotliEncoderDestroyInstance(state_); }
+
+  void Compress(std::string_view data, bool finish, std::string* out) override {
+    const std::uint8_t* next_in = reinterpret_cast<const std::uint8_t*>(data.data());
+    std::size_t avail_in = data.size();
+    BrotliEncoderOperation op = finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+
+    while (true) {
+      std::size_t avail_out = 0;
+      if (!BrotliEncoderCompressStream(state_, op, &avail_in, &next_in, &avail_out, nullptr, nullptr))
+        throw base::Exception("BrotliEncoderCompressStream failed");
+      std::size_t size = 0;
+      const std::uint8_t* output = BrotliEncoderTakeOutput(state_, &size);
+      out->append(reinterpret_cast<const char*>(output), size);
+      if (avail_in == 0 && !BrotliEncoderHasMoreOutput(state_) && (!finish || BrotliEncoderIsFinished(state_)))
+        break;
+    }
+  }
+
+ private:
+  BrotliEncoderState* state_;
+};
+
+class GzipCompressor : public Compressor {
+ public:
+  explicit GzipCompressor(int level) {
+    std::memset(&stream_, 0, sizeof stream_);
+    // windowBits + 16 selects the gzip wrapper instead of the zlib one
+    if (deflateInit2(&stream_, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      throw base::Exception("deflateInit2 failed");
+  }
+
+  ~GzipCompressor() { deflateEnd(&stream_); }
+
+  void Compress(std::string_view data, bool finish, std::string* out) override {
+    stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream_.avail_in = data.size();
+    int flush = finish ? Z_FINISH : Z_NO_FLUSH;
+
+    while (true) {
+      std::size_t old_size = out->size();
+      out->resize(old_size + kChunk);
+      stream_.next_out = reinterpret_cast<Bytef*>(out->data() + old_size);
+      stream_.avail_out = kChunk;
+      int ret = deflate(&stream_, flush);
+      out->resize(old_size + kChunk - stream_.avail_out);
+      if (ret == Z_STREAM_END)
+        break;
+      if (ret != Z_OK && ret != Z_BUF_ERROR)
+        throw base::Exception("deflate failed");
+      if (stream_.avail_out != 0 && stream_.avail_in == 0 && !finish)
+        break;
+    }
+  }
+
+ private:
+  z_stream stream_;
+};
+
+std::unique_ptr<Compressor> CreateCompressor(Encoding encoding, bool once) {
+  switch (encoding) {
+    case Encoding::kBrotli:
+      return std::make_unique<BrotliCompressor>(once ? kBrotliQualityOnce : kBrotliQualityStream);
+    case Encoding::kGzip:
+      return std::make_unique<GzipCompressor>(once ? kGzipLevelOnce : kGzipLevelStream);
+    case Encoding::kIdentity:
+      break;
+  }
+  throw base::Exception("no compressor for identity encoding");
+}
+
+} // unnamed namespace
+
+Encoding NegotiateEncoding(const char* accept_encoding) {
+  if (!accept_encoding)
+    return Encoding::kIdentity;
+
+  double q_br = -1, q_gzip = -1, q_any = -1;
+  std::string_view list(accept_encoding);
+  while (!list.empty()) {
+    std::size_t end = list.find(',');
+    std::string_view item = list.substr(0, end);
+    list = end == std::string_view::npos ? std::string_view() : list.substr(end + 1);
+
+    std::size_t params = item.find(';');
+    std::string_view coding = Trim(item.substr(0, params));
+    double q = params == std::string_view::npos ? 1.0 : ParseQuality(item.substr(params + 1));
+
+    if (EqualsIgnoreCase(coding, "br"))
+      q_br = q;
+    else if (EqualsIgnoreCase(coding, "gzip") || EqualsIgnoreCase(coding, "x-gzip"))
+      q_gzip = q;
+    else if (coding == "*")
+      q_any = q;
+  }
+  if (q_br < 0) q_br = q_any;
+  if (q_gzip < 0) q_gzip = q_any;
+
+  if (q_br > 0 && q_br >= q_gzip)
+    return Encoding::kBrotli;
+  if (q_gzip > 0)
+    return Encoding::kGzip;
+  return Encoding::kIdentity;
+}
+
+const char* EncodingName(Encoding encoding) {
+  switch (encoding) {
+    case Encoding::kBrotli: return "br";
+    case Encoding::kGzip: return "gzip";
+    case Encoding::kIdentity: break;
+  }
+  return "";
+}
+
+std::string Compress(Encoding encoding, std::string_view data) {
+  std::string out;
+  CreateCompressor(encoding, /* once: */ true)->Compress(data, /* finish: */ true, &out);
+  return out;
+}
+
+std::unique_ptr<Compressor> Compressor::Create(Encoding encoding) {
+  return CreateCompressor(encoding, /* once: */ false);
+}
+
+} // namespace web
@@ -0,0 +1,53 @@
+#ifndef WEB_ENCODING_H_
+#define WEB_ENCODING_H_
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace web {
+
+/** HTTP content codings supported for responses. */
+enum class Encoding {
+  kIdentity,
+  kGzip,
+  kBrotli,
+};
+
+/**
+ * Picks the content coding to use for a response, based on the `Accept-Encoding` header.
+ *
+ * Brotli is preferred over gzip when the client accepts both equally. A null header (or one that
+ * doesn't accept either) results in Encoding::kIdentity.
+ */
+Encoding NegotiateEncoding(const char* accept_encoding);
+
+/** Returns the `Content-Encoding` token for an encoding (empty for Encoding::kIdentity). */
+const char* EncodingName(Encoding encoding);
+
+/** Compresses a complete body in one go, at a high compression level. */
+std::string Compress(Encoding encoding, std::string_view data);
+
+/** Streaming compressor, for responses generated incrementally. */
+class Compressor {
+ public:
+  /** Creates a compressor for \p encoding, which must not be Encoding::kIdentity. */
+  static std::unique_ptr<Compressor> Create(Encoding encoding);
+
+  /**
+   * Compresses \p data, appending any available output to \p out.
+   *
+   * If \p finish is set, the stream is terminated, and the compressor can no longer be used.
+   */
+  virtual void Compress(std::string_view data, bool finish, std::string* out) = 0;
+
+  virtual ~Compressor() = default;
+};
+
+} // namespace web
+
+#endif // WEB_ENCODING_H_
+
+// Local Variables:
+// mode: c++
+// End:
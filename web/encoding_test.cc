@@ -0,0 +1,96 @@
+#include <string>
+#include <string_view>
+
+#include <zlib.h>
+
+#include "gtest/gtest.h"
+
+#include "web/encoding.h"
+
+namespace web {
+
+namespace {
+
+std::string Gunzip(std::string_view data) {
+  z_stream stream{};
+  EXPECT_EQ(Z_OK, inflateInit2(&stream, 15 + 16));
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = data.size();
+  std::string out;
+  int ret = Z_OK;
+  while (ret == Z_OK) {
+    char buf[4096];
+    stream.next_out = reinterpret_cast<Bytef*>(buf);
+    stream.avail_out = sizeof buf;
+    ret = inflate(&stream, Z_NO_FLUSH);
+    out.append(buf, sizeof buf - stream.avail_out);
+  }
+  EXPECT_EQ(Z_STREAM_END, ret);
+  inflateEnd(&stream);
+  return out;
+}
+
+} // unnamed namespace
+
+TEST(EncodingTest, NegotiateEncoding) {
+  static const struct {
+    const char* accept_encoding;
+    Encoding encoding;
+  } tests[] = {
+    {nullptr, Encoding::kIdentity},
+    {"", Encoding::kIdentity},
+    {"identity", Encoding::kIdentity},
+    {"deflate", Encoding::kIdentity},
+    {"gzip", Encoding::kGzip},
+    {"x-gzip", Encoding::kGzip},
+    {"GZip", Encoding::kGzip},
+    {"br", Encoding::kBrotli},
+    // brotli wins a tie, wherever it is in the list
+    {"gzip, deflate, br", Encoding::kBrotli},
+    {"br, gzip", Encoding::kBrotli},
+    // otherwise the higher quality does
+    {"br;q=0.5, gzip", Encoding::kGzip},
+    {"br;q=0.8, gzip;q=0.5", Encoding::kBrotli},
+    {"gzip;q=1.0, br;q=0.9", Encoding::kGzip},
+    {"gzip ; q=0.5 , br ; Q=0.6", Encoding::kBrotli},
+    // q=0 means "not acceptable"
+    {"br;q=0", Encoding::kIdentity},
+    {"br;q=0, gzip;q=0", Encoding::kIdentity},
+    {"br;q=0.000, gzip", Encoding::kGzip},
+    // a wildcard stands for the codings not listed on their own
+    {"*", Encoding::kBrotli},
+    {"*;q=0.5, br;q=0", Encoding::kGzip},
+    {"gzip, *;q=0", Encoding::kGzip},
+    {"*;q=0", Encoding::kIdentity},
+    {"br;q=0.2, *;q=0.5", Encoding::kGzip},
+  };
+
+  for (const auto& test : tests)
+    EXPECT_EQ(test.encoding, NegotiateEncoding(test.accept_encoding)) << (test.accept_encoding ? test.accept_encoding : "(none)");
+}
+
+TEST(EncodingTest, EncodingName) {
+  EXPECT_STREQ("", EncodingName(Encoding::kIdentity));
+  EXPECT_STREQ("gzip", EncodingName(Encoding::kGzip));
+  EXPECT_STREQ("br", EncodingName(Encoding::kBrotli));
+}
+
+TEST(EncodingTest, Gzip) {
+  std::string data;
+  for (int i = 0; i < 10000; ++i)
+    data += "line " + std::to_string(i) + "\n";
+
+  std::string once = Compress(Encoding::kGzip, data);
+  EXPECT_LT(once.size(), data.size());
+  EXPECT_EQ(data, Gunzip(once));
+
+  // the streaming compressor gives the same content, however the input is split up
+  std::string streamed;
+  auto compressor = Compressor::Create(Encoding::kGzip);
+  for (std::size_t at = 0; at < data.size(); at += 1000)
+    compressor->Compress(std::string_view(data).substr(at, 1000), /* finish: */ false, &streamed);
+  compressor->Compress(std::string_view(), /* finish: */ true, &streamed);
+  EXPECT_EQ(data, Gunzip(streamed));
+}
+
+} // namespace web
@@ -0,0 +1,29 @@
+#include <string_view>
+
+#include "web/etag.h"
+
+namespace web {
+
+bool MatchesETag(std::string_view cond, std::string_view etag) {
+  while (!cond.empty()) {
+    while (!cond.empty() && (cond.front() == ' ' || cond.front() == '\t' || cond.front() == ','))
+      cond.remove_prefix(1);
+    if (cond.empty())
+      return false;
+    if (cond.starts_with('*'))
+      return true;
+    if (cond.starts_with("W/"))
+      cond.remove_prefix(2);
+    if (!cond.starts_with('"'))
+      return false;
+    std::size_t end = cond.find('"', 1);
+    if (end == std::string_view::npos)
+      return false;
+    if (cond.substr(0, end + 1) == etag)
+      return true;
+    cond.remove_prefix(end + 1);
+  }
+  return false;
+}
+
+} // namespace web
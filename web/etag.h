@@ -0,0 +1,22 @@
+#ifndef WEB_ETAG_H_
+#define WEB_ETAG_H_
+
+#include <string_view>
+
+namespace web {
+
+/**
+ * Tests whether an `If-None-Match` header matches the entity tag \p etag (including the quotes).
+ *
+ * The header can be `*` or a comma-separated list of tags. As per RFC 9110, the weak comparison
+ * is used, so `W/"x"` matches `"x"`. A malformed list matches nothing from the point it goes wrong.
+ */
+bool MatchesETag(std::string_view cond, std::string_view etag);
+
+} // namespace web
+
+#endif // WEB_ETAG_H_
+
+// Local Variables:
+// mode: c++
+// End:
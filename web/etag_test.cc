@@ -0,0 +1,30 @@
+#include "gtest/gtest.h"
+
+#include "web/etag.h"
+
+namespace web {
+
+TEST(ETagTest, MatchesETag) {
+  static const struct {
+    const char* cond;
+    bool matches;
+  } tests[] = {
+    {"\"abc\"", true},
+    {"\"abd\"", false},
+    {"W/\"abc\"", true},
+    {"*", true},
+    {"\"x\", \"abc\"", true},
+    {"\"x\",W/\"abc\"", true},
+    {", \"abc\"", true},
+    {"\"x\" , \"y\"", false},
+    {"\"abc", false},
+    {"abc", false},
+    {"", false},
+    {" , ", false},
+  };
+
+  for (const auto& test : tests)
+    EXPECT_EQ(test.matches, MatchesETag(test.cond, "\"abc\"")) << test.cond;
+}
+
+} // namespace web
@@ -0,0 +1,297 @@
+// HTTP load generator, for comparing the web::Server backends.
+//
+// Opens a number of connections that repeatedly GET a path (optionally over keep-alive), while also
+// holding open a number of idle websockets, and reports the request rate and latency percentiles.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <strings.h> // strncasecmp
+
+extern "C" {
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  std::string host = "localhost";
+  std::string port;
+  std::string path = "/";
+  std::string websocket_path = "/";
+  std::string websocket_protocol;
+  int connections = 16;
+  int websockets = 0;
+  bool keep_alive = true;
+  std::chrono::seconds duration{10};
+};
+
+struct Client {
+  int fd = -1;
+  bool websocket = false;
+  bool upgraded = false;
+  std::string in;
+  Clock::time_point sent;
+  unsigned requests = 0;
+};
+
+struct Stats {
+  std::vector<double> latencies_ms;
+  std::uint64_t bytes = 0;
+  std::uint64_t errors = 0;
+  std::uint64_t connects = 0;
+  int websockets_open = 0;
+};
+
+struct addrinfo* Resolve(const Options& opt) {
+  struct addrinfo hints;
+  std::memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* addrs;
+  if (int ret = getaddrinfo(opt.host.c_str(), opt.port.c_str(), &hints, &addrs); ret != 0) {
+    std::fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+    std::exit(1);
+  }
+  return addrs;
+}
+
+int Connect(const struct addrinfo* addr) {
+  int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+  if (fd == -1 || connect(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+    std::perror("connect");
+    std::exit(1);
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  return fd;
+}
+
+void SendAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t sent = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+    if (sent <= 0)
+      return; // noticed on the next read
+    data.remove_prefix(sent);
+  }
+}
+
+/** Returns the length of the response at the start of \p in, or 0 if it's not complete yet. */
+std::size_t ResponseSize(const std::string& in, bool* close) {
+  std::size_t end = in.find("\r\n\r\n");
+  if (end == std::string::npos)
+    return 0;
+  std::string_view head(in.data(), end + 2);
+  auto header = [&head](std::string_view name) -> std::string_view {
+    for (std::size_t pos = head.find("\r\n"); pos != std::string_view::npos; ) {
+      std::size_t next = head.find("\r\n", pos + 2);
+      if (next == std::string_view::npos)
+        break;
+      std::string_view line = head.substr(pos + 2, next - pos - 2);
+      if (line.size() > name.size() && line[name.size()] == ':' && strncasecmp(line.data(), name.data(), name.size()) == 0) {
+        line.remove_prefix(name.size() + 1);
+        while (!line.empty() && line.front() == ' ') line.remove_prefix(1);
+        return line;
+      }
+      pos = next;
+    }
+    return std::string_view();
+  };
+
+  *close = header("Connection") == "close";
+  std::size_t body = end + 4;
+  if (std::string_view length = header("Content-Length"); !length.empty())
+    return in.size() >= body + std::atoll(std::string(length).c_str()) ? body + std::atoll(std::string(length).c_str()) : 0;
+
+  if (header("Transfer-Encoding") == "chunked") {
+    std::size_t pos = body;
+    while (true) {
+      std::size_t eol = in.find("\r\n", pos);
+      if (eol == std::string::npos)
+        return 0;
+      std::size_t size = std::strtoull(in.c_str() + pos, nullptr, 16);
+      pos = eol + 2 + size + 2;
+      if (pos > in.size())
+        return 0;
+      if (size == 0)
+        return pos;
+    }
+  }
+
+  *close = true; // body runs until the connection closes
+  return 0;
+}
+
+} // unnamed namespace
+
+int main(int argc, char *argv[]) {
+  Options opt;
+
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    std::string_view o(argv[arg]);
+    if (o.starts_with("--connections="))
+      opt.connections = std::atoi(argv[arg] + 14);
+    else if (o.starts_with("--websockets="))
+      opt.websockets = std::atoi(argv[arg] + 13);
+    else if (o.starts_with("--websocket-path="))
+      opt.websocket_path = o.substr(17);
+    else if (o.starts_with("--websocket-protocol="))
+      opt.websocket_protocol = o.substr(21);
+    else if (o.starts_with("--duration="))
+      opt.duration = std::chrono::seconds(std::atoi(argv[arg] + 11));
+    else if (o == "--no-keep-alive")
+      opt.keep_alive = false;
+    else
+      arg = argc; // force usage message
+  }
+  if (arg >= argc || arg + 2 < argc || opt.connections < 1 || opt.websockets < 0) {
+    std::fprintf(
+        stderr,
+        "usage: %s [--connections=N] [--websockets=N] [--websocket-path=P] [--websocket-protocol=P] [--duration=S] [--no-keep-alive] [host:]port [path]\n",
+        argv[0]);
+    return 1;
+  }
+  std::string_view target(argv[arg]);
+  if (std::size_t colon = target.rfind(':'); colon != std::string_view::npos) {
+    opt.host = target.substr(0, colon);
+    opt.port = target.substr(colon + 1);
+  } else {
+    opt.port = target;
+  }
+  if (arg + 1 < argc)
+    opt.path = argv[arg + 1];
+
+  struct addrinfo* addr = Resolve(opt);
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
+  Stats stats;
+
+  std::string request = "GET " + opt.path + " HTTP/1.1\r\nHost: " + opt.host + "\r\nAccept-Encoding: br, gzip\r\n";
+  if (!opt.keep_alive)
+    request += "Connection: close\r\n";
+  request += "\r\n";
+  std::string upgrade =
+      "GET " + opt.websocket_path + " HTTP/1.1\r\nHost: " + opt.host + "\r\n"
+      "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+      "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n";
+  if (!opt.websocket_protocol.empty())
+    upgrade += "Sec-WebSocket-Protocol: " + opt.websocket_protocol + "\r\n";
+  upgrade += "\r\n";
+
+  std::vector<Client> clients(opt.connections + opt.websockets);
+  auto start = [&](Client* c) {
+    if (c->fd == -1) {
+      c->fd = Connect(addr);
+      ++stats.connects;
+      struct epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.ptr = c;
+      epoll_ctl(epoll, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+    c->in.clear();
+    c->sent = Clock::now();
+    SendAll(c->fd, c->websocket ? upgrade : request);
+  };
+  auto reconnect = [&](Client* c) {
+    close(c->fd); // also removes it from the epoll set
+    c->fd = -1;
+    start(c);
+  };
+
+  for (int i = 0; i < opt.websockets; ++i) {
+    clients[opt.connections + i].websocket = true;
+    start(&clients[opt.connections + i]);
+  }
+  auto begin = Clock::now();
+  for (int i = 0; i < opt.connections; ++i)
+    start(&clients[i]);
+
+  auto deadline = begin + opt.duration;
+  struct epoll_event events[256];
+  char buf[65536];
+  while (Clock::now() < deadline) {
+    int n = epoll_wait(epoll, events, 256, 100);
+    for (int i = 0; i < n; ++i) {
+      Client* c = static_cast<Client*>(events[i].data.ptr);
+      if (c->fd == -1)
+        continue;
+      ssize_t got = recv(c->fd, buf, sizeof buf, 0);
+      if (got <= 0) {
+        if (c->websocket && c->upgraded)
+          --stats.websockets_open;
+        ++stats.errors;
+        c->upgraded = false;
+        reconnect(c);
+        continue;
+      }
+      stats.bytes += got;
+      if (c->upgraded)
+        continue; // ignore whatever the websocket sends
+      c->in.append(buf, got);
+
+      if (c->websocket) {
+        if (c->in.find("\r\n\r\n") == std::string::npos)
+          continue;
+        if (c->in.starts_with("HTTP/1.1 101")) {
+          c->upgraded = true;
+          ++stats.websockets_open;
+        } else {
+          ++stats.errors; // refused: don't retry
+          close(c->fd);
+          c->fd = -1;
+        }
+        continue;
+      }
+
+      bool close_after = false;
+      std::size_t size = ResponseSize(c->in, &close_after);
+      if (size == 0)
+        continue;
+
+      if (!c->in.starts_with("HTTP/1.1 200") && !c->in.starts_with("HTTP/1.0 200"))
+        ++stats.errors;
+      stats.latencies_ms.push_back(std::chrono::duration<double, std::milli>(Clock::now() - c->sent).count());
+      ++c->requests;
+      if (close_after || !opt.keep_alive)
+        reconnect(c);
+      else
+        start(c);
+    }
+  }
+
+  std::chrono::duration<double> elapsed = Clock::now() - begin;
+  std::sort(stats.latencies_ms.begin(), stats.latencies_ms.end());
+  auto percentile = [&stats](double p) {
+    if (stats.latencies_ms.empty())
+      return 0.0;
+    return stats.latencies_ms[std::min(stats.latencies_ms.size() - 1, std::size_t(p * stats.latencies_ms.size()))];
+  };
+
+  std::printf(
+      "%zu requests in %.1f s over %d connections (%llu connects, %llu errors), %d/%d websockets open\n"
+      "  %.0f requests/s, %.1f MB/s\n"
+      "  latency ms: p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n",
+      stats.latencies_ms.size(), elapsed.count(), opt.connections,
+      static_cast<unsigned long long>(stats.connects), static_cast<unsigned long long>(stats.errors),
+      stats.websockets_open, opt.websockets,
+      stats.latencies_ms.size() / elapsed.count(), stats.bytes / elapsed.count() / 1e6,
+      percentile(0.5), percentile(0.9), percentile(0.99), percentile(1.0));
+
+  freeaddrinfo(addr);
+  close(epoll);
+  return 0;
+}
@@ -0,0 +1,1132 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <strings.h> // strcasecmp
+
+#include "base/exc.h"
+#include "base/log.h"
+#include "web/loop_server.h"
+#include "web/writer.h"
+
+extern "C" {
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+}
+
+namespace web {
+
+namespace {
+
+constexpr std::size_t kMaxRequestHeader = 16384;
+constexpr std::size_t kMaxFramePayload = 65536;
+/** Websocket output queued beyond this gets the client disconnected. */
+constexpr std::size_t kMaxWebsocketBacklog = 8 << 20;
+/**
+ * Response output a worker can queue for the loop thread to send, when the client is slow to take
+ * it. A worker that gets this far ahead waits for the client, up to kResponseTimeout in total.
+ */
+constexpr std::size_t kMaxResponseBacklog = 4 << 20;
+constexpr auto kResponseTimeout = std::chrono::seconds(30);
+/** Queued response output is dropped (with the connection) if the client takes none for this long. */
+constexpr auto kWriteTimeout = std::chrono::seconds(30);
+/** Connections that haven't sent a complete request in this long are dropped (without keep-alive). */
+constexpr auto kRequestTimeout = std::chrono::seconds(10);
+/** How long to wait for the client's reply to a websocket close frame. */
+constexpr auto kCloseTimeout = std::chrono::seconds(5);
+constexpr auto kHeartbeatPeriod = std::chrono::seconds(1);
+
+constexpr char kWebsocketGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+
+using Clock = std::chrono::steady_clock;
+
+std::string Sha1(std::string_view data) {
+  auto rol = [](std::uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+
+  std::uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+  std::string msg(data);
+  std::uint64_t bits = std::uint64_t{data.size()} * 8;
+  msg += '\x80';
+  while (msg.size() % 64 != 56)
+    msg += '\0';
+  for (int i = 7; i >= 0; --i)
+    msg += static_cast<char>(bits >> (8 * i));
+
+  for (std::size_t block = 0; block < msg.size(); block += 64) {
+    std::uint32_t w[80];
+    for (int i = 0; i < 16; ++i) {
+      const unsigned char* p = reinterpret_cast<const unsigned char*>(msg.data() + block + 4 * i);
+      w[i] = std::uint32_t{p[0]} << 24 | std::uint32_t{p[1]} << 16 | std::uint32_t{p[2]} << 8 | p[3];
+    }
+    for (int i = 16; i < 80; ++i)
+      w[i] = rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+    std::uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; ++i) {
+      std::uint32_t f, k;
+      if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+      else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+      else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+      else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+      std::uint32_t t = rol(a, 5) + f + e + k + w[i];
+      e = d; d = c; c = rol(b, 30); b = a; a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+  }
+
+  std::string digest;
+  for (std::uint32_t x : h) {
+    for (int i = 3; i >= 0; --i)
+      digest += static_cast<char>(x >> (8 * i));
+  }
+  return digest;
+}
+
+std::string Base64(std::string_view data) {
+  static constexpr char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  for (std::size_t i = 0; i < data.size(); i += 3) {
+    std::uint32_t v = std::uint32_t{static_cast<unsigned char>(data[i])} << 16;
+    if (i + 1 < data.size()) v |= std::uint32_t{static_cast<unsigned char>(data[i+1])} << 8;
+    if (i + 2 < data.size()) v |= static_cast<unsigned char>(data[i+2]);
+    out += alphabet[(v >> 18) & 63];
+    out += alphabet[(v >> 12) & 63];
+    out += i + 1 < data.size() ? alphabet[(v >> 6) & 63] : '=';
+    out += i + 2 < data.size() ? alphabet[v & 63] : '=';
+  }
+  return out;
+}
+
+/** Tests whether a comma-separated header value contains \p token (case-insensitively). */
+bool HasToken(const char* header, std::string_view token) {
+  if (!header)
+    return false;
+  std::string_view list(header);
+  while (!list.empty()) {
+    std::size_t end = list.find(',');
+    std::string_view item = list.substr(0, end);
+    list = end == std::string_view::npos ? std::string_view() : list.substr(end + 1);
+    while (!item.empty() && item.front() == ' ') item.remove_prefix(1);
+    while (!item.empty() && item.back() == ' ') item.remove_suffix(1);
+    if (item.size() == token.size() && strncasecmp(item.data(), token.data(), token.size()) == 0)
+      return true;
+  }
+  return false;
+}
+
+/** Matches a request path against a handler path the way civetweb does: the path, or anything under it. */
+bool PathMatches(std::string_view path, std::string_view uri) {
+  if (!uri.starts_with(path))
+    return false;
+  return uri.size() == path.size() || path.ends_with('/') || uri[path.size()] == '/';
+}
+
+int HexDigit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+void AppendFrame(std::string* out, int opcode, const void* data, std::size_t size) {
+  out->push_back(static_cast<char>(0x80 | opcode));
+  if (size < 126) {
+    out->push_back(static_cast<char>(size));
+  } else if (size < 65536) {
+    out->push_back(126);
+    out->push_back(static_cast<char>(size >> 8));
+    out->push_back(static_cast<char>(size));
+  } else {
+    out->push_back(127);
+    for (int i = 7; i >= 0; --i)
+      out->push_back(static_cast<char>(std::uint64_t{size} >> (8 * i)));
+  }
+  out->append(static_cast<const char*>(data), size);
+}
+
+} // unnamed namespace
+
+class LoopServer::Connection : public Request, public Response, public Websocket {
+ public:
+  enum class State {
+    kReading, // waiting for (the rest of) a request, owned by the loop
+    kHandling, // request passed to a worker, which owns the connection
+    kSending, // request handled, the loop is sending the rest of the response
+    kWebsocket, // upgraded, owned by the loop
+  };
+
+  Connection(LoopServer* server, int fd)
+      : server_(server), fd_(fd), reader_(this), writer_(this)
+  {}
+
+  ~Connection() { close(fd_); }
+
+  // Request
+  bool is_head() const override { return head_; }
+  const char* uri() const override { return uri_.c_str(); }
+  const char* query() const override { return has_query_ ? query_.c_str() : nullptr; }
+  const char* header(const char* key) const override;
+
+  // Response
+  void Write(const void* data, std::size_t size) override;
+  void WriteV(const std::string_view* parts, std::size_t count) override;
+  void WriteFile(int fd, off_t offset, std::size_t size) override;
+  bool chunked_ok() const override { return http11_; }
+  bool keep_alive() const override { return keep_alive_; }
+
+  // Websocket
+  std::optional<std::size_t> Write(Type type, const void* buf, std::size_t size) override;
+  void Close(Status status) override;
+
+  LoopServer* const server_;
+  const int fd_;
+  State state_ = State::kReading;
+  Clock::time_point last_active_ = Clock::now();
+  unsigned requests_ = 0;
+
+  // current request, parsed in place in in_ (valid while kHandling)
+  std::string in_;
+  std::size_t request_size_ = 0;
+  const char* method_ = nullptr;
+  std::string uri_;
+  std::string query_;
+  bool has_query_ = false;
+  std::vector<std::pair<const char*, const char*>> headers_;
+  bool head_ = false;
+  bool http11_ = false;
+  bool keep_alive_ = false;
+
+  // response state, owned by the worker
+  bool wrote_ = false;
+  bool write_failed_ = false;
+  Clock::time_point deadline_;
+
+  // websocket state; the handler is only called on the loop thread
+  WebsocketClientHandler* handler_ = nullptr;
+  Clock::time_point last_ping_;
+  bool reaped_ = false;
+
+  // websocket output, from any thread; or the part of a response the socket didn't take at once
+  std::mutex out_lock_;
+  std::condition_variable drained_cv_;
+  std::string out_;
+  std::size_t out_sent_ = 0;
+  bool write_wanted_ = false; // loop has been (or will be) asked to watch for writability
+  bool write_registered_ = false; // loop thread only
+  bool read_registered_ = false; // loop thread only
+  bool closed_ = false;
+  bool overflowed_ = false;
+  std::optional<Clock::time_point> close_sent_;
+
+  void CanRead(int);
+  void CanWrite(int);
+  void WatchRead(bool watch);
+
+  /** Parses a request from in_, if a complete one has arrived. Returns false on a malformed request. */
+  bool ParseRequest();
+  /** Handles any complete websocket frames in in_. Returns false if the connection should close. */
+  bool ProcessFrames();
+  bool Upgrade();
+  void Ping(Clock::time_point now);
+
+  /** Sends a small response directly from the loop thread, and marks the connection for closing. */
+  void SendError(int code, const char* reason);
+
+  /** Writes (or queues) part of a response, on a worker thread. */
+  bool SendAll(const struct iovec* iov, std::size_t iovcnt);
+  /** Waits for the queued response output to go below kMaxResponseBacklog. Called with out_lock_ held. */
+  bool WaitBacklog(std::unique_lock<std::mutex>& lock);
+  /** Sends as much of out_ as the socket takes. Called with out_lock_ held. */
+  bool FlushOut();
+
+  event::FdReaderM<Connection, &Connection::CanRead> reader_;
+  event::FdWriterM<Connection, &Connection::CanWrite> writer_;
+};
+
+const char* LoopServer::Connection::header(const char* key) const {
+  for (const auto& [name, value] : headers_) {
+    if (strcasecmp(name, key) == 0)
+      return value;
+  }
+  return nullptr;
+}
+
+void LoopServer::Connection::Write(const void* data, std::size_t size) {
+  struct iovec iov = { const_cast<void*>(data), size };
+  SendAll(&iov, 1);
+}
+
+void LoopServer::Connection::WriteV(const std::string_view* parts, std::size_t count) {
+  constexpr std::size_t kMaxParts = 64;
+  struct iovec iov[kMaxParts];
+  std::size_t n = 0;
+  for (std::size_t i = 0; i < count; ++i) {
+    if (parts[i].empty())
+      continue;
+    iov[n++] = { const_cast<char*>(parts[i].data()), parts[i].size() };
+    if (n == kMaxParts) {
+      SendAll(iov, n);
+      n = 0;
+    }
+  }
+  if (n > 0)
+    SendAll(iov, n);
+}
+
+void LoopServer::Connection::WriteFile(int fd, off_t offset, std::size_t size) {
+  if (write_failed_)
+    return;
+  wrote_ = true;
+
+  std::unique_lock<std::mutex> lock(out_lock_);
+  while (size > 0 && out_sent_ == out_.size()) {
+    ssize_t sent = sendfile(fd_, fd, &offset, size);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      write_failed_ = true;
+      return;
+    }
+    if (sent == 0) {
+      write_failed_ = true; // the file is shorter than promised; the body can't be completed
+      return;
+    }
+    size -= sent;
+  }
+
+  // The socket is full, so the rest of the file is queued for the loop thread, a piece at a time.
+  // The file can't be sent from later, as it belongs to the handler.
+  std::string piece;
+  while (size > 0) {
+    if (!WaitBacklog(lock))
+      return;
+    lock.unlock();
+    piece.resize(std::min(size, kMaxResponseBacklog));
+    ssize_t got = pread(fd, piece.data(), piece.size(), offset);
+    lock.lock();
+    if (got <= 0) {
+      write_failed_ = true;
+      return;
+    }
+    out_.append(piece.data(), got);
+    offset += got;
+    size -= got;
+    if (!FlushOut()) {
+      write_failed_ = true;
+      return;
+    }
+  }
+}
+
+bool LoopServer::Connection::SendAll(const struct iovec* iov_in, std::size_t iovcnt) {
+  if (write_failed_)
+    return false;
+
+  wrote_ = true;
+  struct iovec iov[64];
+  std::copy(iov_in, iov_in + iovcnt, iov);
+  struct iovec* next = iov;
+
+  std::unique_lock<std::mutex> lock(out_lock_);
+  while (iovcnt > 0 && out_sent_ == out_.size()) {
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof msg);
+    msg.msg_iov = next;
+    msg.msg_iovlen = iovcnt;
+    ssize_t sent = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      write_failed_ = true;
+      return false;
+    }
+
+    std::size_t left = sent;
+    while (iovcnt > 0 && left >= next->iov_len) {
+      left -= next->iov_len;
+      ++next;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      next->iov_base = static_cast<char*>(next->iov_base) + left;
+      next->iov_len -= left;
+    }
+  }
+  if (iovcnt == 0)
+    return true;
+
+  // The socket is full. The rest is queued for the loop thread to send when it can, so that the
+  // worker can move on: the last write of a response never waits, whatever its size.
+  if (!WaitBacklog(lock))
+    return false;
+  for (; iovcnt > 0; ++next, --iovcnt)
+    out_.append(static_cast<const char*>(next->iov_base), next->iov_len);
+  if (!FlushOut()) {
+    write_failed_ = true;
+    return false;
+  }
+  return true;
+}
+
+bool LoopServer::Connection::WaitBacklog(std::unique_lock<std::mutex>& lock) {
+  bool room = drained_cv_.wait_until(lock, deadline_, [this]() {
+    return out_.size() - out_sent_ < kMaxResponseBacklog || overflowed_;
+  });
+  if (!room || overflowed_) {
+    write_failed_ = true;
+    return false;
+  }
+  return true;
+}
+
+std::optional<std::size_t> LoopServer::Connection::Write(Type type, const void* buf, std::size_t size) {
+  std::lock_guard<std::mutex> lock(out_lock_);
+  if (closed_ || close_sent_ || overflowed_)
+    return std::nullopt;
+
+  AppendFrame(&out_, type == Type::kBinary ? 2 : 1, buf, size);
+  if (!FlushOut())
+    return std::nullopt;
+  if (out_.size() - out_sent_ > kMaxWebsocketBacklog) {
+    LOG(WARNING) << "websocket: client too slow, dropping";
+    overflowed_ = true; // the heartbeat will tear it down
+    return std::nullopt;
+  }
+  return size;
+}
+
+void LoopServer::Connection::Close(Status status) {
+  unsigned char code[2];
+  code[0] = static_cast<unsigned>(status) >> 8;
+  code[1] = static_cast<unsigned>(status) & 0xff;
+
+  std::lock_guard<std::mutex> lock(out_lock_);
+  if (closed_ || close_sent_)
+    return;
+  AppendFrame(&out_, 8, code, sizeof code);
+  close_sent_ = Clock::now();
+  FlushOut();
+}
+
+bool LoopServer::Connection::FlushOut() {
+  while (out_sent_ < out_.size()) {
+    ssize_t sent = send(fd_, out_.data() + out_sent_, out_.size() - out_sent_, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      overflowed_ = true; // not quite, but it's as dead
+      return false;
+    }
+    out_sent_ += sent;
+  }
+
+  if (out_sent_ == out_.size()) {
+    out_.clear();
+    out_sent_ = 0;
+  } else if (!write_wanted_) {
+    write_wanted_ = true;
+    server_->WantWrite(this);
+  }
+  return true;
+}
+
+void LoopServer::Connection::WatchRead(bool watch) {
+  if (watch == read_registered_)
+    return;
+  if (watch)
+    server_->loop_->ReadFd(fd_, base::borrow(&reader_));
+  else
+    server_->loop_->ReadFd(fd_);
+  read_registered_ = watch;
+}
+
+void LoopServer::Connection::CanWrite(int) {
+  bool sent, failed;
+  {
+    std::lock_guard<std::mutex> lock(out_lock_);
+    std::size_t before = out_.size() - out_sent_;
+    FlushOut();
+    if (out_.size() - out_sent_ < before)
+      last_active_ = Clock::now();
+    drained_cv_.notify_all();
+    if (out_.empty()) {
+      server_->loop_->WriteFd(fd_);
+      write_registered_ = false;
+      write_wanted_ = false;
+    }
+    sent = out_.empty();
+    failed = overflowed_;
+  }
+
+  if (state_ != State::kSending)
+    return;
+  if (failed)
+    server_->Teardown(this);
+  else if (sent)
+    server_->NextRequest(this);
+}
+
+void LoopServer::Connection::Ping(Clock::time_point now) {
+  char payload[kPingSize];
+  PingPayload(now, payload);
+
+  std::lock_guard<std::mutex> lock(out_lock_);
+  if (closed_ || close_sent_)
+    return;
+  AppendFrame(&out_, 9, payload, sizeof payload);
+  FlushOut();
+  last_ping_ = now;
+}
+
+void LoopServer::Connection::SendError(int code, const char* reason) {
+  std::string resp = "HTTP/1.1 " + std::to_string(code) + ' ' + reason + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+  send(fd_, resp.data(), resp.size(), MSG_NOSIGNAL);  // best effort
+}
+
+void LoopServer::Connection::CanRead(int) {
+  char buf[16384];
+  while (true) {
+    ssize_t got = recv(fd_, buf, sizeof buf, 0);
+    if (got < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      server_->Teardown(this);
+      return;
+    }
+    if (got == 0) {
+      server_->Teardown(this);
+      return;
+    }
+    in_.append(buf, got);
+    if (static_cast<std::size_t>(got) < sizeof buf)
+      break;
+  }
+  last_active_ = Clock::now();
+
+  if (state_ == State::kWebsocket) {
+    if (!ProcessFrames())
+      server_->Teardown(this);
+    return;
+  }
+
+  if (!ParseRequest()) {
+    server_->Teardown(this);
+    return;
+  }
+  if (request_size_ > 0)
+    server_->Dispatch(this);
+}
+
+bool LoopServer::Connection::ParseRequest() {
+  request_size_ = 0;
+
+  std::size_t end = in_.find("\r\n\r\n");
+  if (end == std::string::npos) {
+    if (in_.size() > kMaxRequestHeader) {
+      SendError(431, "Request Header Fields Too Large");
+      return false;
+    }
+    return true; // wait for more
+  }
+  if (end + 4 > kMaxRequestHeader) {
+    SendError(431, "Request Header Fields Too Large");
+    return false;
+  }
+
+  // Everything is parsed in place: strings are terminated by overwriting separators with NULs.
+  char* p = in_.data();
+  char* const head_end = p + end;
+  *head_end = '\0';
+
+  // request line: METHOD SP target SP version
+  char* sp1 = std::strchr(p, ' ');
+  char* line_end = std::strstr(p, "\r\n");
+  if (!line_end)
+    line_end = head_end;
+  char* sp2 = sp1 ? static_cast<char*>(std::memchr(sp1 + 1, ' ', line_end - sp1 - 1)) : nullptr;
+  if (!sp1 || !sp2) {
+    SendError(400, "Bad Request");
+    return false;
+  }
+  *sp1 = '\0';
+  *sp2 = '\0';
+  *line_end = '\0';
+  method_ = p;
+  std::string_view target(sp1 + 1);
+  std::string_view version(sp2 + 1);
+  if (!version.starts_with("HTTP/1.")) {
+    SendError(400, "Bad Request");
+    return false;
+  }
+  http11_ = version != "HTTP/1.0";
+  head_ = std::strcmp(method_, "HEAD") == 0;
+
+  // the local path, percent-decoded and without the query string
+  uri_.clear();
+  std::size_t query = target.find('?');
+  has_query_ = query != std::string_view::npos;
+  if (has_query_)
+    query_.assign(target.substr(query + 1));
+  target = target.substr(0, query);
+  for (std::size_t i = 0; i < target.size(); ++i) {
+    int hi, lo;
+    if (target[i] == '%' && i + 2 < target.size() && (hi = HexDigit(target[i+1])) >= 0 && (lo = HexDigit(target[i+2])) >= 0) {
+      uri_ += static_cast<char>(hi << 4 | lo);
+      i += 2;
+    } else {
+      uri_ += target[i];
+    }
+  }
+
+  headers_.clear();
+  for (char* line = line_end < head_end ? line_end + 2 : head_end; line < head_end; ) {
+    char* eol = std::strstr(line, "\r\n");
+    if (!eol)
+      eol = head_end;
+    *eol = '\0';
+    char* colon = std::strchr(line, ':');
+    if (colon) {
+      *colon = '\0';
+      char* value = colon + 1;
+      while (*value == ' ' || *value == '\t')
+        ++value;
+      char* value_end = eol;
+      while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+        *--value_end = '\0';
+      headers_.emplace_back(line, value);
+    }
+    line = eol + 2;
+  }
+
+  // Request bodies aren't read, so a request that has one can't be followed by another.
+  const char* length = header("Content-Length");
+  bool has_body = (length && std::strcmp(length, "0") != 0) || header("Transfer-Encoding");
+  keep_alive_ =
+      http11_ && !has_body
+      && server_->options_.keep_alive_timeout.count() > 0
+      && !HasToken(header("Connection"), "close");
+
+  request_size_ = end + 4;
+  return true;
+}
+
+bool LoopServer::Connection::Upgrade() {
+  const WebsocketHandlerRecord* record = server_->FindWebsocketHandler(uri_);
+  const char* key = header("Sec-WebSocket-Key");
+  const char* version = header("Sec-WebSocket-Version");
+  if (!record || !key || !version || std::strcmp(version, "13") != 0 || std::strcmp(method_, "GET") != 0) {
+    SendError(400, "Bad Request");
+    return false;
+  }
+
+  if (server_->websocket_count_ >= server_->options_.max_websocket_clients) {
+    if (server_->metric_websocket_refused_)
+      server_->metric_websocket_refused_->Increment();
+    SendError(503, "Service Unavailable");
+    return false;
+  }
+
+  const char* protocol = HasToken(header("Sec-WebSocket-Protocol"), record->proto) ? record->proto.c_str() : nullptr;
+  handler_ = record->handler->HandleWebsocketClient(uri_.c_str(), protocol);
+  if (!handler_) {
+    SendError(403, "Forbidden");
+    return false;
+  }
+
+  std::string accept = Base64(Sha1(std::string(key) + kWebsocketGuid));
+  std::string resp =
+      "HTTP/1.1 101 Switching Protocols\r\n"
+      "Upgrade: websocket\r\n"
+      "Connection: Upgrade\r\n"
+      "Sec-WebSocket-Accept: " + accept + "\r\n";
+  if (protocol) {
+    resp += "Sec-WebSocket-Protocol: ";
+    resp += protocol;
+    resp += "\r\n";
+  }
+  resp += "\r\n";
+
+  in_.erase(0, request_size_);
+  request_size_ = 0;
+  headers_.clear();
+  state_ = State::kWebsocket;
+  WatchRead(true);
+  ++server_->websocket_count_;
+  if (server_->metric_websocket_open_)
+    server_->metric_websocket_open_->Set(server_->websocket_count_);
+
+  {
+    std::lock_guard<std::mutex> lock(out_lock_);
+    out_ += resp;
+    FlushOut();
+  }
+  handler_->WebsocketReady(this);
+  return ProcessFrames();
+}
+
+bool LoopServer::Connection::ProcessFrames() {
+  std::size_t pos = 0;
+  bool keep_open = true;
+
+  while (keep_open) {
+    auto* buf = reinterpret_cast<unsigned char*>(in_.data() + pos);
+    std::size_t avail = in_.size() - pos;
+    if (avail < 2)
+      break;
+
+    bool fin = buf[0] & 0x80;
+    int opcode = buf[0] & 0x0f;
+    bool masked = buf[1] & 0x80;
+    std::uint64_t size = buf[1] & 0x7f;
+    std::size_t header = 2;
+    if (size == 126) {
+      if (avail < 4)
+        break;
+      size = std::uint64_t{buf[2]} << 8 | buf[3];
+      header = 4;
+    } else if (size == 127) {
+      if (avail < 10)
+        break;
+      size = 0;
+      for (int i = 0; i < 8; ++i)
+        size = size << 8 | buf[2 + i];
+      header = 10;
+    }
+
+    if (!masked) {
+      LOG(WARNING) << "websocket: unmasked client frame";
+      Close(Status::kProtocolError);
+      return false;
+    }
+    if (size > kMaxFramePayload) {
+      LOG(WARNING) << "websocket: frame too big: " << size;
+      Close(Status::kTooBig);
+      return false;
+    }
+    if (avail < header + 4 + size)
+      break;
+
+    unsigned char* mask = buf + header;
+    unsigned char* payload = mask + 4;
+    for (std::size_t i = 0; i < size; ++i)
+      payload[i] ^= mask[i & 3];
+    pos += header + 4 + size;
+
+    Result result;
+    if (opcode == 0 || opcode == 1 || opcode == 2) {
+      result = HandleDataFrame(this, handler_, fin, opcode, payload, size);
+    } else if (!fin) {
+      // a fragmented non-data message
+      LOG(WARNING) << "websocket: unexpected opcode (fragmented): " << opcode;
+      result = Result::kClose;
+    } else if (opcode == 8) {
+      // websocket close control frame: echo it (unless we started the closing), then done
+      Close(Status::kOk);
+      result = Result::kClose;
+    } else if (opcode == 9) {
+      // websocket ping control frame, reply with a pong
+      std::lock_guard<std::mutex> lock(out_lock_);
+      AppendFrame(&out_, 10, payload, size);
+      FlushOut();
+      result = Result::kKeepOpen;
+    } else if (opcode == 10) {
+      // websocket pong control frame: if it's a reply to our ping, record the round-trip time
+      server_->ObservePong(last_active_, payload, size);
+      result = Result::kKeepOpen;
+    } else {
+      // unexpected opcode type
+      LOG(WARNING) << "websocket: unexpected opcode: " << opcode;
+      Close(Status::kProtocolError);
+      result = Result::kClose;
+    }
+
+    keep_open = result == Result::kKeepOpen;
+  }
+
+  in_.erase(0, pos);
+  if (!keep_open)
+    Close(Status::kOk);
+  return keep_open;
+}
+
+LoopServer::LoopServer(const Options& options, event::Loop* loop)
+    : Server(options),
+      loop_(loop),
+      loop_thread_(std::this_thread::get_id()),
+      accept_reader_(this),
+      wake_reader_(this)
+{
+  std::string host, port = options_.port;
+  if (std::size_t colon = port.rfind(':'); colon != std::string::npos) {
+    host = port.substr(0, colon);
+    port = port.substr(colon + 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+      host = host.substr(1, host.size() - 2);
+  }
+
+  struct addrinfo hints;
+  std::memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  struct addrinfo* addrs;
+  if (int ret = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &addrs); ret != 0) {
+    std::string error = "getaddrinfo: ";
+    error += gai_strerror(ret);
+    throw base::Exception(error);
+  }
+  struct AddrinfoDeleter {
+    void operator()(struct addrinfo* addrs) { freeaddrinfo(addrs); }
+  };
+  std::unique_ptr<struct addrinfo, AddrinfoDeleter> addrs_owner(addrs);
+
+  listen_fd_ = socket(addrs->ai_family, addrs->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addrs->ai_protocol);
+  if (listen_fd_ == -1)
+    throw base::Exception("socket", errno);
+  int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  if (bind(listen_fd_, addrs->ai_addr, addrs->ai_addrlen) == -1)
+    throw base::Exception("bind", errno);
+  if (listen(listen_fd_, SOMAXCONN) == -1)
+    throw base::Exception("listen", errno);
+
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd_ == -1)
+    throw base::Exception("eventfd", errno);
+
+  loop_->ReadFd(listen_fd_, base::borrow(&accept_reader_));
+  loop_->ReadFd(wake_fd_, base::borrow(&wake_reader_));
+  heartbeat_timer_ = loop_->Delay(kHeartbeatPeriod, base::borrow(this));
+
+  for (unsigned i = 0; i < std::max(options_.num_threads, 1u); ++i)
+    workers_.emplace_back(&LoopServer::Worker, this);
+}
+
+LoopServer::~LoopServer() {
+  {
+    std::lock_guard<std::mutex> lock(work_lock_);
+    shutdown_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto& worker : workers_)
+    worker.join();
+
+  loop_->Cancel(heartbeat_timer_);
+  loop_->ReadFd(listen_fd_);
+  loop_->ReadFd(wake_fd_);
+
+  std::vector<Connection*> conns;
+  for (Connection* conn : connections_)
+    conns.push_back(conn);
+  for (Connection* conn : conns)
+    Teardown(conn);
+
+  close(listen_fd_);
+  close(wake_fd_);
+}
+
+int LoopServer::port() const {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof addr;
+  if (getsockname(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), &len) == -1)
+    throw base::Exception("getsockname", errno);
+  if (addr.ss_family == AF_INET6)
+    return ntohs(reinterpret_cast<struct sockaddr_in6*>(&addr)->sin6_port);
+  return ntohs(reinterpret_cast<struct sockaddr_in*>(&addr)->sin_port);
+}
+
+void LoopServer::AddHandler(const char* path, RequestHandler* handler) {
+  handlers_.push_back(HandlerRecord{path, handler});
+}
+
+void LoopServer::AddWebsocketHandler(const char* path, const char* proto, WebsocketHandler* handler) {
+  websocket_handlers_.push_back(WebsocketHandlerRecord{path, proto, handler});
+}
+
+RequestHandler* LoopServer::FindHandler(std::string_view uri) const {
+  const HandlerRecord* best = nullptr;
+  for (const auto& record : handlers_) {
+    if (PathMatches(record.path, uri) && (!best || record.path.size() > best->path.size()))
+      best = &record;
+  }
+  return best ? best->handler : nullptr;
+}
+
+const LoopServer::WebsocketHandlerRecord* LoopServer::FindWebsocketHandler(std::string_view uri) const {
+  const WebsocketHandlerRecord* best = nullptr;
+  for (const auto& record : websocket_handlers_) {
+    if (PathMatches(record.path, uri) && (!best || record.path.size() > best->path.size()))
+      best = &record;
+  }
+  return best;
+}
+
+void LoopServer::Accept(int) {
+  while (true) {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        LOG(WARNING) << "accept: " << std::strerror(errno);
+      return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    Connection* conn = connections_.emplace(this, fd);
+    conn->WatchRead(true);
+    if (metric_http_connections_) {
+      metric_http_connections_->Increment();
+      metric_http_connections_open_->Increment();
+    }
+  }
+}
+
+void LoopServer::Dispatch(Connection* conn) {
+  // loop thread, with a complete request parsed in conn->in_
+  if (metric_http_requests_new_)
+    (conn->requests_ == 0 ? metric_http_requests_new_ : metric_http_requests_reused_)->Increment();
+  ++conn->requests_;
+
+  if (HasToken(conn->header("Upgrade"), "websocket") && HasToken(conn->header("Connection"), "upgrade")) {
+    if (!conn->Upgrade())
+      Teardown(conn);
+    return;
+  }
+
+  conn->state_ = Connection::State::kHandling;
+  conn->wrote_ = false;
+  conn->deadline_ = Clock::now() + kResponseTimeout;
+  conn->WatchRead(false);
+  {
+    std::lock_guard<std::mutex> lock(work_lock_);
+    work_.push_back(conn);
+  }
+  work_cv_.notify_one();
+}
+
+void LoopServer::Worker() {
+  while (true) {
+    Connection* conn;
+    {
+      std::unique_lock<std::mutex> lock(work_lock_);
+      work_cv_.wait(lock, [this]() { return shutdown_ || !work_.empty(); });
+      if (shutdown_)
+        return;
+      conn = work_.front();
+      work_.pop_front();
+    }
+
+    std::string_view method(conn->method_);
+    if (method != "GET" && method != "HEAD") {
+      Writer web(conn, "text/plain", 405, "Allow: GET, HEAD\r\n");
+    } else if (RequestHandler* handler = FindHandler(conn->uri_); handler) {
+      int code = handler->HandleGet(*conn, conn);
+      if (code == 0 && !conn->wrote_)
+        Writer web(conn, "text/plain", 404);
+    } else {
+      Writer web(conn, "text/plain", 404);
+    }
+
+    Finished(conn);
+  }
+}
+
+void LoopServer::Finished(Connection* conn) {
+  {
+    std::lock_guard<std::mutex> lock(wake_lock_);
+    done_.push_back(conn);
+  }
+  std::uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof one) < 0 && errno != EAGAIN)
+    LOG(WARNING) << "eventfd write: " << std::strerror(errno);
+}
+
+void LoopServer::WantWrite(Connection* conn) {
+  // called with conn->out_lock_ held
+  if (std::this_thread::get_id() == loop_thread_) {
+    if (!conn->write_registered_) {
+      loop_->WriteFd(conn->fd_, base::borrow(&conn->writer_));
+      conn->write_registered_ = true;
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(wake_lock_);
+    want_write_.push_back(conn);
+  }
+  std::uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof one) < 0 && errno != EAGAIN)
+    LOG(WARNING) << "eventfd write: " << std::strerror(errno);
+}
+
+void LoopServer::Wake(int) {
+  std::uint64_t count;
+  while (read(wake_fd_, &count, sizeof count) > 0) {}
+
+  std::vector<Connection*> done, want_write;
+  {
+    std::lock_guard<std::mutex> lock(wake_lock_);
+    done.swap(done_);
+    want_write.swap(want_write_);
+  }
+
+  for (Connection* conn : want_write) {
+    std::lock_guard<std::mutex> lock(conn->out_lock_);
+    if (!conn->closed_ && !conn->write_registered_ && conn->write_wanted_) {
+      loop_->WriteFd(conn->fd_, base::borrow(&conn->writer_));
+      conn->write_registered_ = true;
+    }
+  }
+
+  for (Connection* conn : done) {
+    if (conn->write_failed_) {
+      Teardown(conn);
+      continue;
+    }
+    bool sending;
+    {
+      std::lock_guard<std::mutex> lock(conn->out_lock_);
+      sending = conn->out_sent_ < conn->out_.size();
+    }
+    if (sending) {
+      // the rest of the response is sent by Connection::CanWrite, which then moves on
+      conn->state_ = Connection::State::kSending;
+      conn->last_active_ = Clock::now();
+      continue;
+    }
+    NextRequest(conn);
+  }
+}
+
+void LoopServer::NextRequest(Connection* conn) {
+  // loop thread, once a response has been sent in full
+  if (!conn->keep_alive_) {
+    Teardown(conn);
+    return;
+  }
+  conn->in_.erase(0, conn->request_size_);
+  conn->request_size_ = 0;
+  conn->state_ = Connection::State::kReading;
+  conn->last_active_ = Clock::now();
+
+  if (!conn->ParseRequest()) {
+    Teardown(conn);
+  } else if (conn->request_size_ > 0) {
+    Dispatch(conn); // pipelined
+  } else {
+    conn->WatchRead(true);
+  }
+}
+
+void LoopServer::Teardown(Connection* conn) {
+  // loop thread, never while a worker owns the connection
+  if (conn->state_ == Connection::State::kWebsocket) {
+    conn->handler_->WebsocketClose(conn);
+    --websocket_count_;
+    if (metric_websocket_open_)
+      metric_websocket_open_->Set(websocket_count_);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(conn->out_lock_);
+    conn->closed_ = true;
+    if (conn->write_registered_)
+      loop_->WriteFd(conn->fd_);
+  }
+  {
+    std::lock_guard<std::mutex> lock(wake_lock_);
+    std::erase(want_write_, conn);
+  }
+  conn->WatchRead(false);
+
+  connections_.erase(conn);
+  if (metric_http_connections_open_)
+    metric_http_connections_open_->Decrement();
+}
+
+void LoopServer::TimerExpired(bool) {
+  auto now = Clock::now();
+  std::size_t idle = 0;
+  std::vector<Connection*> dead;
+
+  for (Connection* conn : connections_) {
+    auto silent = now - conn->last_active_;
+
+    if (conn->state_ == Connection::State::kReading) {
+      auto timeout = conn->requests_ > 0 ? std::chrono::duration_cast<Clock::duration>(options_.keep_alive_timeout) : Clock::duration(kRequestTimeout);
+      if (silent >= timeout)
+        dead.push_back(conn);
+      continue;
+    }
+    if (conn->state_ == Connection::State::kSending) {
+      if (silent >= kWriteTimeout)
+        dead.push_back(conn);
+      continue;
+    }
+    if (conn->state_ != Connection::State::kWebsocket)
+      continue;
+
+    bool overflowed, close_expired;
+    {
+      std::lock_guard<std::mutex> lock(conn->out_lock_);
+      overflowed = conn->overflowed_;
+      close_expired = conn->close_sent_ && now - *conn->close_sent_ >= kCloseTimeout;
+    }
+    if (overflowed || close_expired) {
+      dead.push_back(conn);
+      continue;
+    }
+
+    if (silent < options_.websocket_ping_interval)
+      continue;
+    ++idle;
+
+    if (silent >= options_.websocket_idle_timeout) {
+      if (!conn->reaped_) {
+        LOG(INFO) << "websocket: closing unresponsive client";
+        conn->Close(Websocket::Status::kGoingAway);
+        conn->reaped_ = true;
+        if (metric_websocket_reaped_)
+          metric_websocket_reaped_->Increment();
+      }
+    } else if (now - conn->last_ping_ >= options_.websocket_ping_interval) {
+      conn->Ping(now);
+    }
+  }
+
+  for (Connection* conn : dead)
+    Teardown(conn);
+  if (metric_websocket_idle_)
+    metric_websocket_idle_->Set(idle);
+
+  heartbeat_timer_ = loop_->Delay(kHeartbeatPeriod, base::borrow(this));
+}
+
+} // namespace web
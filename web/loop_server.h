@@ -0,0 +1,108 @@
+#ifndef WEB_LOOP_SERVER_H_
+#define WEB_LOOP_SERVER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/common.h"
+#include "base/unique_set.h"
+#include "event/loop.h"
+#include "web/request.h"
+#include "web/server.h"
+#include "web/websocket.h"
+
+namespace web {
+
+/**
+ * web::Server built on an event::Loop.
+ *
+ * All socket I/O is non-blocking and happens on the loop thread: accepting, reading and parsing
+ * requests, websocket frames and heartbeats. Only the RequestHandler::HandleGet calls are passed to
+ * a small pool of worker threads (since rendering a page can take a while), which then write the
+ * response directly to the socket. Idle keep-alive connections and websockets don't hold a thread.
+ *
+ * Output that doesn't fit in the socket buffer is queued, and sent by the loop thread once the
+ * socket becomes writable. This goes for websockets (which may be written to from any thread), and
+ * for responses, so that a slow client doesn't keep a worker from serving others.
+ *
+ * The server must be created (and destroyed) on the thread that runs the loop.
+ */
+class LoopServer : public Server, public event::Timed {
+ public:
+  LoopServer(const Options& options, event::Loop* loop);
+  ~LoopServer();
+
+  int port() const override;
+
+  void AddHandler(const char* path, RequestHandler* handler) override;
+  void AddWebsocketHandler(const char* path, const char* proto, WebsocketHandler* handler) override;
+
+  // event::Timed
+  void TimerExpired(bool) override;
+
+ private:
+  class Connection;
+
+  struct HandlerRecord {
+    std::string path;
+    RequestHandler* handler;
+  };
+
+  struct WebsocketHandlerRecord {
+    std::string path;
+    std::string proto;
+    WebsocketHandler* handler;
+  };
+
+  event::Loop* const loop_;
+  const std::thread::id loop_thread_;
+  int listen_fd_ = -1;
+  int wake_fd_ = -1;
+  event::TimerId heartbeat_timer_;
+
+  std::vector<HandlerRecord> handlers_;
+  std::vector<WebsocketHandlerRecord> websocket_handlers_;
+
+  // only touched on the loop thread
+  base::unique_set<Connection> connections_;
+  std::size_t websocket_count_ = 0;
+
+  std::vector<std::thread> workers_;
+  std::mutex work_lock_;
+  std::condition_variable work_cv_;
+  std::deque<Connection*> work_;
+  bool shutdown_ = false;
+
+  // hand-offs from other threads to the loop thread, signalled through wake_fd_
+  std::mutex wake_lock_;
+  std::vector<Connection*> done_; // connections whose request has been handled
+  std::vector<Connection*> want_write_; // connections with queued output
+
+  void Accept(int);
+  void Wake(int);
+  void Worker();
+
+  void Dispatch(Connection* conn);
+  void Finished(Connection* conn);
+  void NextRequest(Connection* conn);
+  void WantWrite(Connection* conn);
+  void Teardown(Connection* conn);
+
+  RequestHandler* FindHandler(std::string_view uri) const;
+  const WebsocketHandlerRecord* FindWebsocketHandler(std::string_view uri) const;
+
+  event::FdReaderM<LoopServer, &LoopServer::Accept> accept_reader_;
+  event::FdReaderM<LoopServer, &LoopServer::Wake> wake_reader_;
+};
+
+} // namespace web
+
+#endif // WEB_LOOP_SERVER_H_
+
+// Local Variables:
+// mode: c++
+// End:
@@ -0,0 +1,99 @@
+#include <algorithm>
+#include <charconv>
+#include <string_view>
+
+#include "web/range.h"
+
+namespace web {
+
+namespace {
+
+std::string_view Trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+    s.remove_prefix(1);
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+    s.remove_suffix(1);
+  return s;
+}
+
+/** Parses a nonempty string of digits. */
+std::optional<std::size_t> ParsePosition(std::string_view s) {
+  std::size_t pos;
+  auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), pos);
+  if (s.empty() || ec != std::errc() || end != s.data() + s.size())
+    return std::nullopt;
+  return pos;
+}
+
+void AppendNumber(std::size_t n, std::string* out) {
+  char buf[24];
+  out->append(buf, std::to_chars(buf, buf + sizeof buf, n).ptr);
+}
+
+} // unnamed namespace
+
+std::optional<RangeSpec> ParseRange(const char* header) {
+  if (!header)
+    return std::nullopt;
+
+  std::string_view spec = Trim(header);
+  if (!spec.starts_with("bytes="))
+    return std::nullopt;
+  spec = Trim(spec.substr(6));
+  if (spec.find(',') != std::string_view::npos)
+    return std::nullopt; // multipart/byteranges responses are not worth the trouble
+
+  std::size_t dash = spec.find('-');
+  if (dash == std::string_view::npos)
+    return std::nullopt;
+  std::string_view first = Trim(spec.substr(0, dash)), last = Trim(spec.substr(dash + 1));
+
+  RangeSpec range;
+  if (!first.empty()) {
+    if (!(range.first = ParsePosition(first)))
+      return std::nullopt;
+  }
+  if (!last.empty()) {
+    if (!(range.last = ParsePosition(last)))
+      return std::nullopt;
+  }
+
+  if (!range.first && !range.last)
+    return std::nullopt;
+  if (range.first && range.last && *range.last < *range.first)
+    return std::nullopt; // invalid, so ignored
+  return range;
+}
+
+std::optional<ByteRange> ResolveRange(const RangeSpec& spec, std::size_t size) {
+  if (!spec.first) {
+    // suffix range: the last N bytes
+    if (*spec.last == 0 || size == 0)
+      return std::nullopt;
+    std::size_t length = std::min(*spec.last, size);
+    return ByteRange{size - length, size - 1};
+  }
+
+  if (*spec.first >= size)
+    return std::nullopt;
+  std::size_t last = spec.last ? std::min(*spec.last, size - 1) : size - 1;
+  return ByteRange{*spec.first, last};
+}
+
+void AppendContentRange(const ByteRange& range, std::size_t size, std::string* headers) {
+  headers->append("Content-Range: bytes ");
+  AppendNumber(range.first, headers);
+  headers->push_back('-');
+  AppendNumber(range.last, headers);
+  headers->push_back('/');
+  AppendNumber(size, headers);
+  headers->append("\r\n");
+}
+
+void AppendUnsatisfiedRange(std::size_t size, std::string* headers) {
+  headers->append("Content-Range: bytes */");
+  AppendNumber(size, headers);
+  headers->append("\r\n");
+}
+
+} // namespace web
@@ -0,0 +1,53 @@
+#ifndef WEB_RANGE_H_
+#define WEB_RANGE_H_
+
+#include <cstddef>
+#include <optional>
+#include <string>
+
+namespace web {
+
+/** A single byte range from a `Range` header, not yet resolved against a representation. */
+struct RangeSpec {
+  /** First byte position, or (if not set) a suffix range of the last `last` bytes. */
+  std::optional<std::size_t> first;
+  /** Last byte position (inclusive), if set; or the suffix length. */
+  std::optional<std::size_t> last;
+};
+
+/** A satisfiable byte range, with inclusive bounds. */
+struct ByteRange {
+  std::size_t first;
+  std::size_t last;
+
+  std::size_t size() const { return last - first + 1; }
+};
+
+/**
+ * Parses a `Range` request header.
+ *
+ * Only a single range in `bytes` units is supported. Anything else (including multiple ranges)
+ * results in std::nullopt, which per RFC 9110 means the header should be ignored, and the full
+ * representation sent.
+ */
+std::optional<RangeSpec> ParseRange(const char* header);
+
+/**
+ * Resolves a range against a representation of \p size bytes.
+ *
+ * Returns std::nullopt if the range is not satisfiable (a 416 response).
+ */
+std::optional<ByteRange> ResolveRange(const RangeSpec& spec, std::size_t size);
+
+/** Appends a `Content-Range` header for a 206 response. */
+void AppendContentRange(const ByteRange& range, std::size_t size, std::string* headers);
+/** Appends a `Content-Range` header for a 416 response. */
+void AppendUnsatisfiedRange(std::size_t size, std::string* headers);
+
+} // namespace web
+
+#endif // WEB_RANGE_H_
+
+// Local Variables:
+// mode: c++
+// End:
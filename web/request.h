@@ -9,6 +9,8 @@ namespace web {
 struct Request {
   virtual bool is_head() const = 0;
   virtual const char* uri() const = 0;
+  /** Returns the query string (after the `?`, not decoded), or `nullptr` if there wasn't one. */
+  virtual const char* query() const = 0;
   virtual const char* header(const char* key) const = 0;
 
   Request() = default;
@@ -2,11 +2,52 @@
 #define WEB_RESPONSE_H_
 
 #include <cstdlib>
+#include <string_view>
+
+extern "C" {
+#include <sys/types.h>
+#include <unistd.h>
+}
 
 namespace web {
 
 struct Response {
   virtual void Write(const void* data, std::size_t size) = 0;
+  /** Writes several pieces of data (skipping any empty ones) as if concatenated. */
+  virtual void WriteV(const std::string_view* parts, std::size_t count) {
+    for (std::size_t i = 0; i < count; ++i) {
+      if (!parts[i].empty())
+        Write(parts[i].data(), parts[i].size());
+    }
+  }
+
+  /**
+   * Writes \p size bytes of the open file \p fd, starting from \p offset.
+   *
+   * The default reads the file in pieces and writes them out. Backends that can send it straight
+   * from the page cache to the socket (with `sendfile(2)`) do that instead.
+   */
+  virtual void WriteFile(int fd, off_t offset, std::size_t size) {
+    char buf[65536];
+    while (size > 0) {
+      ssize_t got = pread(fd, buf, size < sizeof buf ? size : sizeof buf, offset);
+      if (got <= 0)
+        return; // the file shrunk or broke; the client will see a short body
+      Write(buf, got);
+      offset += got;
+      size -= got;
+    }
+  }
+
+  /** True if this is the response to a HEAD request, and must not have a body. */
+  virtual bool is_head() const { return false; }
+  /** True if the client understands `Transfer-Encoding: chunked` (i.e., speaks HTTP/1.1). */
+  virtual bool chunked_ok() const { return true; }
+  /**
+   * False if the connection will be closed after this response, which must then say so in a
+   * `Connection: close` header. Backends that manage the header themselves leave this as is.
+   */
+  virtual bool keep_alive() const { return true; }
 };
 
 } // namespace web
@@ -1,267 +1,139 @@
-#include <strings.h> // strcasecmp
+#include <cstring>
 
 #include "base/exc.h"
 #include "base/log.h"
-#include "web/response.h"
+#include "web/civet_server.h"
+#include "web/loop_server.h"
 #include "web/server.h"
 
 namespace web {
 
-class Server::CivetConnection : public Request, public Response {
- public:
-  explicit CivetConnection(struct mg_connection* conn);
-  bool is_head() const override; 
-  const char* uri() const override;
-  const char* header(const char* key) const override;
-  void Write(const void* data, std::size_t size) override;
-
- private:
-  struct mg_connection* const conn_;
-  const struct mg_request_info* const info_;
-};
-
-Server::CivetConnection::CivetConnection(struct mg_connection* conn)
-    : conn_(conn), info_(mg_get_request_info(conn))
-{}
-
-bool Server::CivetConnection::is_head() const {
-  return std::string_view(info_->request_method) == "HEAD";
-}
-
-const char* Server::CivetConnection::uri() const {
-  return info_->local_uri;
-}
-
-const char* Server::CivetConnection::header(const char* key) const {
-  for (int i = 0; i < info_->num_headers; i++) {
-    if (strcasecmp(info_->http_headers[i].name, key) == 0)
-      return info_->http_headers[i].value;
-  }
-  return NULL;
-}
-
-void Server::CivetConnection::Write(const void* data, std::size_t size) {
-  mg_write(conn_, data, size);
-}
-
-class Server::CivetWebsocket : public Websocket {
- public:
-  CivetWebsocket(struct mg_connection* conn, WebsocketClientHandler* handler)
-      : conn_(conn), handler_(handler)
-  {}
-
-  DISALLOW_COPY(CivetWebsocket);
-
-  std::optional<std::size_t> Write(Type type, const void* buf, std::size_t size) override;
-  void Close(Status status) override;
-
-  WebsocketClientHandler* handler() const noexcept { return handler_; }
-
- private:
-  struct Lock {
-    Lock(struct mg_connection* conn) : conn_(conn) { mg_lock_connection(conn_); }
-    ~Lock() { mg_unlock_connection(conn_); }
-   private:
-    struct mg_connection* const conn_;
-  };
-
-  struct mg_connection* const conn_;
-  WebsocketClientHandler* const handler_;
-};
-
-std::optional<std::size_t> Server::CivetWebsocket::Write(Type type, const void* buf, std::size_t size) {
-  int opcode = 0x80 | (type == Type::kBinary ? 2 : 1);
-  int wrote;
-
-  {
-    Lock lock(conn_);
-    wrote = mg_websocket_write(conn_, opcode, static_cast<const char*>(buf), size);
+std::unique_ptr<Server> Server::Create(const Options& options, event::Loop* loop) {
+  switch (options.backend) {
+    case Backend::kCivetweb:
+      return std::make_unique<CivetServer>(options);
+    case Backend::kLoop:
+      if (!loop)
+        throw base::Exception("event loop web server needs a loop");
+      return std::make_unique<LoopServer>(options, loop);
   }
-
-  if (wrote < 0)
-    return std::optional<std::size_t>();
-  else
-    return std::optional<std::size_t>(wrote);
-}
-
-void Server::CivetWebsocket::Close(Status status) {
-  unsigned char code[2];
-  code[0] = static_cast<unsigned>(status) >> 8;
-  code[1] = static_cast<unsigned>(status) >> 8;
-
-  Lock lock(conn_);
-  mg_websocket_write(conn_, 0x88, reinterpret_cast<char*>(code), sizeof code);
-  // TODO: verify this bit
-}
-
-Server::Server(const std::string& port) {
-  const char* options[] = {
-    "listening_ports", port.c_str(),
-    "num_threads", "2",
-    "websocket_timeout_ms", "300000",
-    // TODO: enable_websocket_ping_pong? needs newer civetweb
-    nullptr
-  };
-
-  struct mg_callbacks cb = { nullptr };
-
-  civet_ctx_ = mg_start(&cb, this, options);
-  if (!civet_ctx_)
-    throw base::Exception("civetweb server failed to start");
-}
-
-Server::~Server() {
-  mg_stop(civet_ctx_);
-}
-
-int Server::port() const {
-  struct mg_server_port port_info;
-  if (mg_get_server_ports(civet_ctx_, 1, &port_info) != 1)
-    throw base::Exception("civetweb listen port unknown");
-  return port_info.port;
-}
-
-void Server::AddHandler(const char* path, RequestHandler* handler) {
-  mg_set_request_handler(civet_ctx_, path, CivetRequestHandler, handler);
-}
-
-void Server::AddWebsocketHandler(const char* path, const char* proto, WebsocketHandler* handler) {
-  auto* record = &websocket_handlers_.emplace_back(this, handler, proto);
-  mg_set_websocket_handler_with_subprotocols(
-      civet_ctx_, path, &record->proto.get()->proto_list,
-      CivetWebsocketConnectHandler,
-      CivetWebsocketReadyHandler,
-      CivetWebsocketDataHandler,
-      CivetWebsocketCloseHandler,
-      record);
-}
-
-int Server::CivetRequestHandler(struct mg_connection* conn, void* cb) {
-  std::string_view method = mg_get_request_info(conn)->request_method;
-  if (method != "HEAD" && method != "GET")
-    return 0; // TODO: return method not allowed?
-  auto* handler = static_cast<RequestHandler*>(cb);
-  CivetConnection c(conn);
-  return handler->HandleGet(c, &c);
-}
-
-int Server::CivetWebsocketConnectHandler(const struct mg_connection* const_conn, void* cb) {
-  enum ReturnCode { kAccept = 0, kClose = 1 };
-
-  auto* record = static_cast<WebsocketHandlerRecord*>(cb);
-  auto* conn = const_cast<struct mg_connection*>(const_conn);  // this API is odd
-
-  if (record->server->websocket_clients_.size() >= kMaxWebsocketClients)
-    return kClose;
-
-  const struct mg_request_info* info = mg_get_request_info(conn);
-  WebsocketClientHandler* client_handler =
-      record->handler->HandleWebsocketClient(info->request_uri, info->acceptedWebSocketSubprotocol);
-
-  if (!client_handler)
-    return kClose;
-
-  CivetWebsocket* websocket = record->server->websocket_clients_.emplace(conn, client_handler);
-  mg_set_user_connection_data(conn, websocket);
-  return kAccept;
-}
-
-void Server::CivetWebsocketReadyHandler(struct mg_connection* conn, void*) {
-  auto* websocket = static_cast<CivetWebsocket*>(mg_get_user_connection_data(conn));
-  websocket->handler()->WebsocketReady(websocket);
-}
-
-int Server::CivetWebsocketDataHandler(struct mg_connection* conn, int raw_opcode, char* raw_buf, std::size_t size, void*) {
-  auto* buf = reinterpret_cast<unsigned char*>(raw_buf);
-  auto* websocket = static_cast<CivetWebsocket*>(mg_get_user_connection_data(conn));
-  auto* handler = websocket->handler();
-
-  bool fin = raw_opcode & 0x80;
-  int opcode = raw_opcode & 0x0f;
-  Websocket::Result result;
-
+  throw base::Exception("unknown web server backend");
+}
+
+Server::Server(const Options& options) : options_(options) {
+  if (!options_.metric_registry)
+    return;
+
+  auto& registry = *options_.metric_registry;
+  metric_websocket_open_ = &prometheus::BuildGauge()
+      .Name("web_websocket_open")
+      .Help("How many websockets are currently open?")
+      .Register(registry)
+      .Add({});
+  metric_websocket_idle_ = &prometheus::BuildGauge()
+      .Name("web_websocket_idle")
+      .Help("How many open websockets have been silent for longer than the ping interval?")
+      .Register(registry)
+      .Add({});
+  metric_websocket_reaped_ = &prometheus::BuildCounter()
+      .Name("web_websocket_reaped_total")
+      .Help("How many websockets have been closed for not responding to pings?")
+      .Register(registry)
+      .Add({});
+  metric_websocket_refused_ = &prometheus::BuildCounter()
+      .Name("web_websocket_refused_total")
+      .Help("How many websocket clients have been refused for being over capacity?")
+      .Register(registry)
+      .Add({});
+  metric_websocket_rtt_ = &prometheus::BuildHistogram()
+      .Name("web_websocket_rtt_seconds")
+      .Help("Round-trip times of websocket pings.")
+      .Register(registry)
+      .Add({}, prometheus::Histogram::BucketBoundaries{0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10});
+  metric_http_connections_ = &prometheus::BuildCounter()
+      .Name("web_http_connections_total")
+      .Help("How many client connections have been accepted?")
+      .Register(registry)
+      .Add({});
+  metric_http_connections_open_ = &prometheus::BuildGauge()
+      .Name("web_http_connections_open")
+      .Help("How many client connections (including websockets) are currently open?")
+      .Register(registry)
+      .Add({});
+  auto& requests = prometheus::BuildCounter()
+      .Name("web_http_requests_total")
+      .Help("How many requests have been handled, by whether they arrived on a fresh or reused connection?")
+      .Register(registry);
+  metric_http_requests_new_ = &requests.Add({{"connection", "new"}});
+  metric_http_requests_reused_ = &requests.Add({{"connection", "reused"}});
+}
+
+Websocket::Result Server::HandleDataFrame(Websocket* websocket, WebsocketClientHandler* handler, bool fin, int opcode, const unsigned char* buf, std::size_t size) {
   if (opcode == 0) {
     // continuation of a previously started fragmented message
     if (handler->fragment_opcode_ == 0) {
       // no data message currently under reassembly
       LOG(WARNING) << "websocket: unexpected continuation frame";
-      result = Websocket::Result::kClose;
-    } else if (handler->fragment_buffer_.size() + size > handler->fragment_reassembly_limit_) {
+      return Websocket::Result::kClose;
+    }
+    if (handler->fragment_buffer_.size() + size > handler->fragment_reassembly_limit_) {
       // new message would become too big
       LOG(WARNING)
           << "websocket: fragment reassembly limit exceeded: "
           << handler->fragment_buffer_.size() << " + " << size << " > " << handler->fragment_reassembly_limit_;
       handler->fragment_opcode_ = 0;
       handler->fragment_buffer_.clear();
-      result = Websocket::Result::kClose;
-    } else {
-      // append to buffer, pass to handler if complete
-      handler->fragment_buffer_.insert(
-          handler->fragment_buffer_.end(),
-          buf, buf + size);
-      if (fin) {
-        result = handler->WebsocketData(
-            websocket,
-            handler->fragment_opcode_ == 2 ? Websocket::Type::kBinary : Websocket::Type::kText,
-            &handler->fragment_buffer_[0], handler->fragment_buffer_.size());
-        handler->fragment_opcode_ = 0;
-        handler->fragment_buffer_.clear();
-      } else {
-        result = Websocket::Result::kKeepOpen;
-      }
+      return Websocket::Result::kClose;
     }
-  } else if (!fin) {
+    // append to buffer, pass to handler if complete
+    handler->fragment_buffer_.insert(handler->fragment_buffer_.end(), buf, buf + size);
+    if (!fin)
+      return Websocket::Result::kKeepOpen;
+    Websocket::Result result = handler->WebsocketData(
+        websocket,
+        handler->fragment_opcode_ == 2 ? Websocket::Type::kBinary : Websocket::Type::kText,
+        &handler->fragment_buffer_[0], handler->fragment_buffer_.size());
+    handler->fragment_opcode_ = 0;
+    handler->fragment_buffer_.clear();
+    return result;
+  }
+
+  if (!fin) {
     // first frame of a fragmented message
     if (handler->fragment_opcode_ != 0) {
       // existing message under reassembly already
       LOG(WARNING) << "websocket: incomplete fragmented message";
       handler->fragment_opcode_ = 0;
       handler->fragment_buffer_.clear();
-      result = Websocket::Result::kClose;
-    } else if (opcode != 1 && opcode != 2) {
-      // a fragmented non-data message
-      LOG(WARNING) << "websocket: unexpected opcode (fragmented): " << opcode;
-      result = Websocket::Result::kClose;
-    } else {
-      // start a new reassembly
-      handler->fragment_opcode_ = opcode;
-      handler->fragment_buffer_.assign(buf, buf + size);
-      result = Websocket::Result::kKeepOpen;
-    }
-  } else {
-    // unfragmented message delivered in a single frame
-    if (opcode == 1 || opcode == 2) {
-      // regular data frame, just pass to actual handler
-      result = handler->WebsocketData(
-          websocket,
-          opcode == 2 ? Websocket::Type::kBinary : Websocket::Type::kText,
-          buf, size);
-    } else if (opcode == 8) {
-      // websocket close control frame: no action
-      result = Websocket::Result::kClose;
-    } else if (opcode == 9) {
-      // websocket ping control frame, try to reply
-      mg_websocket_write(conn, 0x89, raw_buf, size);
-      result = Websocket::Result::kKeepOpen;
-    } else if (opcode == 10) {
-      // websocket pong control frame, regular or unsolicited; ignore
-      result = Websocket::Result::kKeepOpen;
-    } else {
-      // unexpected opcode type
-      LOG(WARNING) << "websocket: unexpected opcode: " << opcode;
-      websocket->Close(Websocket::Status::kProtocolError);
-      result = Websocket::Result::kClose;
+      return Websocket::Result::kClose;
     }
+    // start a new reassembly
+    handler->fragment_opcode_ = opcode;
+    handler->fragment_buffer_.assign(buf, buf + size);
+    return Websocket::Result::kKeepOpen;
   }
 
-  return static_cast<int>(result);
+  // unfragmented message delivered in a single frame
+  return handler->WebsocketData(
+      websocket,
+      opcode == 2 ? Websocket::Type::kBinary : Websocket::Type::kText,
+      buf, size);
+}
+
+void Server::PingPayload(std::chrono::steady_clock::time_point now, char (&payload)[kPingSize]) {
+  // The payload is the send time, to measure the round-trip time when the pong arrives.
+  std::int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+  std::memcpy(payload, &ns, sizeof ns);
 }
 
-void Server::CivetWebsocketCloseHandler(const struct mg_connection* conn, void* cb) {
-  auto* record = static_cast<WebsocketHandlerRecord*>(cb);
-  auto* websocket = static_cast<CivetWebsocket*>(mg_get_user_connection_data(conn));
-  websocket->handler()->WebsocketClose(websocket);
-  record->server->websocket_clients_.erase(websocket);
+void Server::ObservePong(std::chrono::steady_clock::time_point now, const void* payload, std::size_t size) {
+  std::int64_t sent_ns;
+  if (size != sizeof sent_ns || !metric_websocket_rtt_)
+    return;
+  std::memcpy(&sent_ns, payload, sizeof sent_ns);
+  std::chrono::duration<double> rtt = now.time_since_epoch() - std::chrono::nanoseconds(sent_ns);
+  if (rtt.count() >= 0)
+    metric_websocket_rtt_->Observe(rtt.count());
 }
 
 } // namespace web
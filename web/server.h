@@ -1,64 +1,99 @@
 #ifndef WEB_SERVER_H_
 #define WEB_SERVER_H_
 
+#include <chrono>
 #include <cstdint>
 #include <memory>
-#include <optional>
 #include <string>
-#include <vector>
 
-#include "civetweb.h"
+#include <prometheus/counter.h>
+#include <prometheus/gauge.h>
+#include <prometheus/histogram.h>
+#include <prometheus/registry.h>
 
 #include "base/common.h"
-#include "base/unique_set.h"
+#include "event/loop.h"
 #include "web/request.h"
 #include "web/response.h"
 #include "web/websocket.h"
 
 namespace web {
 
+/** HTTP and websocket server. See CivetServer and LoopServer for the implementations. */
 class Server {
  public:
-  Server(const std::string& port);
-  ~Server();
-  DISALLOW_COPY(Server);
-
-  int port() const;
-
-  void AddHandler(const char* path, RequestHandler* handler);
-  void AddWebsocketHandler(const char* path, const char* proto, WebsocketHandler* handler);
-
- private:
-  class CivetConnection;
-  class CivetWebsocket;
-
-  struct WebsocketHandlerProto {
-    WebsocketHandlerProto(const char *p) : proto(p) {
-      proto_list.nb_subprotocols = 1;
-      proto_list.subprotocols = &proto;
-    }
-    const char *proto;
-    struct mg_websocket_subprotocols proto_list;
+  enum class Backend {
+    /** civetweb, with a thread per connection (CivetServer). */
+    kCivetweb,
+    /** Non-blocking sockets on an event::Loop, with a small pool for request handlers (LoopServer). */
+    kLoop,
   };
 
-  struct WebsocketHandlerRecord {
-    Server* server;
-    WebsocketHandler* handler;
-    std::unique_ptr<WebsocketHandlerProto> proto;
-    WebsocketHandlerRecord(Server* s, WebsocketHandler* h, const char* p) : server(s), handler(h), proto(std::make_unique<WebsocketHandlerProto>(p)) {}
+  struct Options {
+    /** Listening port, in civetweb `listening_ports` syntax (`[host:]port`). */
+    std::string port;
+    /** Which implementation to use. */
+    Backend backend = Backend::kCivetweb;
+    /**
+     * Number of threads running request handlers.
+     *
+     * For civetweb, this also bounds the number of open connections (including websockets).
+     */
+    unsigned num_threads = 2;
+    /** Maximum number of concurrently open websockets. Further clients are refused. */
+    std::size_t max_websocket_clients = 4096;
+    /** How long a websocket can be silent before it gets sent a ping. */
+    std::chrono::seconds websocket_ping_interval{30};
+    /** How long a websocket can be silent (not even answering pings) before it gets closed. */
+    std::chrono::seconds websocket_idle_timeout{90};
+    /** How long an idle HTTP connection is kept open for further requests. Zero disables keep-alive. */
+    std::chrono::milliseconds keep_alive_timeout{2000};
+    /** If set, metrics about connections and open websockets are registered here. */
+    prometheus::Registry* metric_registry = nullptr;
   };
 
-  static constexpr std::size_t kMaxWebsocketClients = 256;
+  /**
+   * Creates and starts a server.
+   *
+   * The Backend::kLoop server needs \p loop, and must be created on the thread that runs it.
+   */
+  static std::unique_ptr<Server> Create(const Options& options, event::Loop* loop = nullptr);
 
-  struct mg_context* civet_ctx_;
-  std::vector<WebsocketHandlerRecord> websocket_handlers_;
-  base::unique_set<CivetWebsocket> websocket_clients_;
+  virtual ~Server() = default;
+  DISALLOW_COPY(Server);
 
-  static int CivetRequestHandler(struct mg_connection* conn, void* cb);
-  static int CivetWebsocketConnectHandler(const struct mg_connection* conn, void* cb);
-  static void CivetWebsocketReadyHandler(struct mg_connection* conn, void*);
-  static int CivetWebsocketDataHandler(struct mg_connection* conn, int opcode, char* buf, std::size_t size, void*);
-  static void CivetWebsocketCloseHandler(const struct mg_connection* conn, void* cb);
+  virtual int port() const = 0;
+
+  virtual void AddHandler(const char* path, RequestHandler* handler) = 0;
+  virtual void AddWebsocketHandler(const char* path, const char* proto, WebsocketHandler* handler) = 0;
+
+ protected:
+  explicit Server(const Options& options);
+
+  const Options options_;
+
+  prometheus::Gauge* metric_websocket_open_ = nullptr;
+  prometheus::Gauge* metric_websocket_idle_ = nullptr;
+  prometheus::Counter* metric_websocket_reaped_ = nullptr;
+  prometheus::Counter* metric_websocket_refused_ = nullptr;
+  prometheus::Histogram* metric_websocket_rtt_ = nullptr;
+  prometheus::Counter* metric_http_connections_ = nullptr;
+  prometheus::Gauge* metric_http_connections_open_ = nullptr;
+  prometheus::Counter* metric_http_requests_new_ = nullptr;
+  prometheus::Counter* metric_http_requests_reused_ = nullptr;
+
+  /**
+   * Handles a websocket data frame (text, binary or continuation), reassembling fragmented messages.
+   *
+   * Calls WebsocketClientHandler::WebsocketData once a complete message is available.
+   */
+  static Websocket::Result HandleDataFrame(Websocket* websocket, WebsocketClientHandler* handler, bool fin, int opcode, const unsigned char* buf, std::size_t size);
+
+  /** Records the round-trip time of a pong, if its payload is one made by PingPayload. */
+  void ObservePong(std::chrono::steady_clock::time_point now, const void* payload, std::size_t size);
+  /** Fills in the payload of a heartbeat ping, for ObservePong. */
+  static constexpr std::size_t kPingSize = sizeof(std::int64_t);
+  static void PingPayload(std::chrono::steady_clock::time_point now, char (&payload)[kPingSize]);
 };
 
 } // namespace web
@@ -1,25 +1,177 @@
+#include <charconv>
+
 #include "web/writer.h"
 
 namespace web {
 
-Writer::Writer(Response* resp, const char* content_type, int response_code, std::string_view extra_headers)
+namespace {
+
+const char* ReasonPhrase(int code) {
+  switch (code) {
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 416: return "Range Not Satisfiable";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+  }
+  switch (code / 100) {
+    case 1: return "Informational";
+    case 2: return "Success";
+    case 3: return "Redirection";
+    case 4: return "Client Error";
+  }
+  return "Server Error";
+}
+
+} // unnamed namespace
+
+Writer::Writer(Response* resp, const char* content_type, int response_code, std::string_view extra_headers, Encoding encoding)
     : resp_(resp),
       owned_buffer_(new std::string),
-      buffer_(owned_buffer_.get())
+      buffer_(owned_buffer_.get()),
+      encoding_(encoding)
 {
-  Write(
-      "HTTP/1.1 ", response_code, " OK\r\n"
-      "Content-Type: ", content_type, "\r\n",
-      extra_headers, "\r\n");
+  char code[16];
+  headers_ += "HTTP/1.1 ";
+  headers_.append(code, std::to_chars(code, code + sizeof code, response_code).ptr);
+  headers_ += ' ';
+  headers_ += ReasonPhrase(response_code);
+  headers_ += "\r\nContent-Type: ";
+  headers_ += content_type;
+  headers_ += "\r\n";
+  if (!resp_->keep_alive())
+    headers_ += "Connection: close\r\n";
+  headers_ += extra_headers;
+  if (encoding != Encoding::kIdentity) {
+    headers_ += "Content-Encoding: ";
+    headers_ += EncodingName(encoding);
+    headers_ += "\r\n";
+  }
+
+  no_body_ = resp_->is_head() || response_code / 100 == 1 || response_code == 204 || response_code == 304;
+  // without chunked framing, the only other way to delimit the body would be to close the connection
+  buffered_ = !resp_->chunked_ok();
+}
+
+Writer::~Writer() {
+  if (resp_ && !body_sent_)
+    Flush(/* finish: */ true);
+}
+
+void Writer::SendFile(int fd, std::size_t size) {
+  if (no_body_)
+    return; // the destructor sends the headers
+  FinishHeaders(size);
+  resp_->Write(headers_.data(), headers_.size());
+  resp_->WriteFile(fd, 0, size);
+  headers_.clear();
+  body_sent_ = true;
+}
+
+void Writer::Append(Ref s) {
+  if (!resp_ || s.str.size() < kMinReference) {
+    *buffer_ += s.str;
+    return;
+  }
+  if (buffer_->size() > segment_start_) {
+    segments_.push_back(Segment{nullptr, segment_start_, buffer_->size() - segment_start_});
+    segment_start_ = buffer_->size();
+  }
+  segments_.push_back(Segment{s.str.data(), 0, s.str.size()});
+  pending_ += s.str.size();
 }
 
-void Writer::Flush(bool force) {
-  if (!resp_)
-    return;  // nowhere to flush to
-  if (force ? !buffer_->empty() : buffer_->size() >= kFlushAt) {
-    resp_->Write(buffer_->data(), buffer_->size());
+void Writer::Flush(bool finish) {
+  if (no_body_) {
     buffer_->clear();
+    segments_.clear();
+    segment_start_ = pending_ = 0;
+    if (finish) {
+      FinishHeaders(std::nullopt);
+      resp_->Write(headers_.data(), headers_.size());
+    }
+    return;
+  }
+  if (buffered_ && !finish)
+    return;
+
+  // parts_[0] and parts_[1] are reserved for the headers and the chunk header
+  CollectParts();
+
+  if (encoding_ != Encoding::kIdentity) {
+    if (!compressor_)
+      compressor_ = Compressor::Create(encoding_);
+    compressed_.clear();
+    for (std::size_t i = 2; i < parts_.size(); ++i)
+      compressor_->Compress(parts_[i], /* finish: */ false, &compressed_);
+    if (finish)
+      compressor_->Compress(std::string_view(), /* finish: */ true, &compressed_);
+    parts_.resize(2);
+    parts_.push_back(compressed_);
+  }
+
+  std::size_t size = 0;
+  for (std::size_t i = 2; i < parts_.size(); ++i)
+    size += parts_[i].size();
+
+  if (!headers_sent_) {
+    FinishHeaders(finish ? std::optional<std::size_t>(size) : std::nullopt);
+    parts_[0] = headers_;
+  }
+  if (chunked_) {
+    if (size > 0) {  // an empty chunk would terminate the body
+      char* end = std::to_chars(chunk_header_, chunk_header_ + sizeof chunk_header_ - 2, size, 16).ptr;
+      *end++ = '\r';
+      *end++ = '\n';
+      parts_[1] = std::string_view(chunk_header_, end - chunk_header_);
+      parts_.push_back("\r\n");
+    }
+    if (finish)
+      parts_.push_back("0\r\n\r\n");
+  }
+
+  resp_->WriteV(parts_.data(), parts_.size());
+
+  headers_.clear();
+  buffer_->clear();
+  segments_.clear();
+  segment_start_ = pending_ = 0;
+}
+
+void Writer::CollectParts() {
+  parts_.clear();
+  parts_.resize(2);
+  for (const Segment& segment : segments_) {
+    if (segment.data)
+      parts_.emplace_back(segment.data, segment.size);
+    else
+      parts_.emplace_back(buffer_->data() + segment.offset, segment.size);
+  }
+  if (buffer_->size() > segment_start_)
+    parts_.emplace_back(buffer_->data() + segment_start_, buffer_->size() - segment_start_);
+}
+
+void Writer::FinishHeaders(std::optional<std::size_t> content_length) {
+  if (content_length) {
+    char buf[24];
+    headers_ += "Content-Length: ";
+    headers_.append(buf, std::to_chars(buf, buf + sizeof buf, *content_length).ptr);
+    headers_ += "\r\n";
+  } else if (!no_body_) {
+    headers_ += "Transfer-Encoding: chunked\r\n";
+    chunked_ = true;
   }
+  headers_ += "\r\n";
+  headers_sent_ = true;
 }
 
 } // namespace web
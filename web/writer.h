@@ -1,39 +1,107 @@
 #ifndef WEB_WRITER_H_
 #define WEB_WRITER_H_
 
+#include <charconv>
 #include <cstdlib>
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <utility>
+#include <vector>
 
+#include "web/encoding.h"
 #include "web/response.h"
 
 namespace web {
 
+/**
+ * Text that outlives the writer it's written to: string literals, or bodies the caller keeps alive.
+ *
+ * Writing one of these lets web::Writer reference the text instead of copying it into its buffer.
+ */
+struct Ref {
+  constexpr explicit Ref(std::string_view s) : str(s) {}
+  std::string_view str;
+};
+
 class Writer {
  public:
-  /** Writer for a web response. */
-  Writer(Response* resp, const char* content_type, int response_code=200, std::string_view extra_headers=std::string_view());
+  /**
+   * Writer for a web response.
+   *
+   * If \p encoding is not Encoding::kIdentity, a `Content-Encoding` header is added, and the body
+   * is compressed as it is written. Callers sending an already compressed body should instead pass
+   * the header in \p extra_headers.
+   *
+   * The headers are held back until the first part of the body is ready. A body that fits in the
+   * first flush is sent with a `Content-Length` header; anything longer uses chunked framing. For
+   * responses that have no body (HEAD requests, 304 and such), whatever is written is discarded.
+   */
+  Writer(Response* resp, const char* content_type, int response_code=200, std::string_view extra_headers=std::string_view(), Encoding encoding=Encoding::kIdentity);
   /** Writer to an external buffer. */
   Writer(std::string* buffer) : buffer_(buffer) {}
 
-  ~Writer() { Flush(true); }
+  ~Writer();
+
+  /**
+   * Holds the entire body until the writer is destroyed, so that it's always sent with a
+   * `Content-Length` header. Useful when the body already exists in memory anyway.
+   */
+  void BufferBody() { buffered_ = true; }
+
+  /**
+   * Sends \p size bytes of the open file \p fd as the whole body, with a `Content-Length` header.
+   *
+   * The file is sent as is (see Response::WriteFile), so this can't be mixed with other writes,
+   * and the writer must have been created with Encoding::kIdentity (a precompressed file's
+   * `Content-Encoding` header goes in the extra headers).
+   */
+  void SendFile(int fd, std::size_t size);
 
   template <typename... Args>
   void Write(Args&&... args) {
     DoWrite(std::forward<Args>(args)...);
-    Flush();
+    if (resp_ && pending_ + buffer_->size() >= kFlushAt)
+      Flush();
   }
 
  private:
   static constexpr std::size_t kFlushAt = 8192;
+  /** Referenced strings shorter than this are copied anyway: that's cheaper than another segment. */
+  static constexpr std::size_t kMinReference = 128;
+
+  /** Part of the body: either referenced text, or (if `data` is null) a slice of `*buffer_`. */
+  struct Segment {
+    const char* data;
+    std::size_t offset;
+    std::size_t size;
+  };
 
   Response* resp_ = nullptr;
 
+  std::string headers_; // pending until the first flush
+  bool headers_sent_ = false;
+  bool no_body_ = false;
+  bool buffered_ = false;
+  bool chunked_ = false;
+  bool body_sent_ = false;
+
   std::unique_ptr<std::string> owned_buffer_;
   std::string* buffer_;
 
+  // Segments are only used for responses; when writing to an external buffer, everything is copied.
+  // The buffer, segment and part lists keep their capacity across flushes.
+  std::vector<Segment> segments_;
+  std::size_t segment_start_ = 0; // start of the not yet segmented tail of *buffer_
+  std::size_t pending_ = 0; // bytes in referenced segments
+  std::vector<std::string_view> parts_;
+  char chunk_header_[24];
+
+  Encoding encoding_ = Encoding::kIdentity;
+  std::unique_ptr<Compressor> compressor_; // created lazily, never needed for bodiless responses
+  std::string compressed_;
+
   template <typename Arg1, typename... Args>
   void DoWrite(Arg1&& arg1, Args&&... args) {
     Append(arg1);
@@ -44,10 +112,12 @@ class Writer {
   void Append(const char* s) { *buffer_ += s; }
   void Append(const std::string& s) { *buffer_ += s; }
   void Append(std::string_view s) { *buffer_ += s; }
+  void Append(Ref s);
 
   template <typename Number>
-  auto Append(Number n) -> decltype((void)std::to_string(n), void()) {
-    *buffer_ += std::to_string(n);
+  auto Append(Number n) -> decltype((void)std::to_chars(std::declval<char*>(), std::declval<char*>(), n), void()) {
+    char buf[32];
+    buffer_->append(buf, std::to_chars(buf, buf + sizeof buf, n).ptr);
   }
 
   template <typename T>
@@ -55,7 +125,10 @@ class Writer {
     WebWrite(this, t);
   }
 
-  void Flush(bool force=false);
+  void Flush(bool finish = false);
+  void CollectParts();
+  /** Completes the header block, which the caller then sends along with the first part of the body. */
+  void FinishHeaders(std::optional<std::size_t> content_length);
 };
 
 } // namespace web